@@ -2,6 +2,11 @@
 #include "Main.h"
 #include "Resource.h"
 #include "SmsConvert.h"
+#include "SmsPipeline.h"
+#include "SmsPhone.h"
+#include "SmsCheckpoint.h"
+#include "SmsBench.h"
+#include "SmsTrace.h"
 #include <functional>
 
 
@@ -9,9 +14,54 @@ HINSTANCE g_hInst = NULL;
 ULONG g_iInputType = 0;	
 
 
+//+ FILE_SUMMARY
+/// Posted to the dialog by the summary thread (WM_FILE_SUMMARY)
+struct FILE_SUMMARY {
+	TCHAR szFile[MAX_PATH];				/// The summarized file
+	BOOL bFinal;						/// FALSE=Sniffed format only, TRUE=Full summary
+	ULONG err;
+	ULONG iType;
+	ULONG iMessageCount;
+	utf8string sComments;
+};
+
+//+ SUMMARY_TASK
+/// Background summary request. Shared between the UI thread and the worker thread (reference counted)
+struct SUMMARY_TASK {
+	volatile LONG iRefCount;
+	volatile LONG bCancel;
+	ULONG iRequestId;
+	HWND hDlg;
+	TCHAR szFile[MAX_PATH];
+	WIN32_FILE_ATTRIBUTE_DATA FileInfo;	/// File identity, captured before reading
+};
+
+//+ SUMMARY_CACHE_ENTRY
+/// Persistent summary cache entry, stored as REG_BINARY under REGKEY_SUMMARY_CACHE. The value name is the file path
+/// The entry is followed by the (UTF-8) comments
+#define REGKEY_SUMMARY_CACHE			REGKEY _T( "\\SummaryCache" )
+#define SUMMARY_CACHE_VERSION			1
+#define SUMMARY_CACHE_MAX_ENTRIES		32
+struct SUMMARY_CACHE_ENTRY {
+	ULONG iVersion;
+	ULONG iType;
+	ULONG iMessageCount;
+	ULARGE_INTEGER iFileSize;			/// File identity
+	FILETIME ftFileWrite;				/// File identity
+	FILETIME ftLastUsed;				/// Eviction order
+};
+
+SUMMARY_TASK *g_pSummaryTask = NULL;		/// The pending request (UI thread only)
+ULONG g_iSummaryRequestId = 0;				/// The most recent request ID (UI thread only)
+TCHAR g_szSummaryFile[MAX_PATH] = {0};		/// The most recent request file (UI thread only)
+WIN32_FILE_ATTRIBUTE_DATA g_SummaryFileInfo = {0};	/// The most recent request file identity (UI thread only)
+
+
 //+ Definitions
 #define PROP_HACCEL _T( "m_hAccel" )
 
+void OnFileSummary( _In_ HWND hDlg, _In_ FILE_SUMMARY *pSummary );
+void SetInputType( _In_ HWND hDlg, _In_ LPCTSTR pszInput, _In_ ULONG iType );
 void OnButtonAbout( _In_ HWND hDlg );
 void OnButtonBrowse( _In_ HWND hDlg );
 void OnButtonConvert( _In_ HWND hDlg );
@@ -72,18 +122,285 @@ void GetInputFile( _In_ HWND hDlg, _Out_ TCHAR szFile[MAX_PATH] )
 }
 
 
+//++ SummaryCacheLookup
+/// Returns TRUE if the file's summary is cached and the file hasn't changed since
+BOOL SummaryCacheLookup( _In_ LPCTSTR pszFile, _In_ const WIN32_FILE_ATTRIBUTE_DATA &FileInfo, _Out_ FILE_SUMMARY &Summary )
+{
+	BOOL bFound = FALSE;
+
+	HKEY hKey;
+	if (RegOpenKeyEx( HKEY_CURRENT_USER, REGKEY_SUMMARY_CACHE, 0, KEY_READ | KEY_WRITE, &hKey ) == ERROR_SUCCESS) {
+
+		DWORD dwType, dwSize = 0;
+		if (RegQueryValueEx( hKey, pszFile, NULL, &dwType, NULL, &dwSize ) == ERROR_SUCCESS && dwType == REG_BINARY && dwSize >= sizeof( SUMMARY_CACHE_ENTRY )) {
+
+			std::vector<BYTE> Data( dwSize );
+			if (RegQueryValueEx( hKey, pszFile, NULL, &dwType, Data.data(), &dwSize ) == ERROR_SUCCESS) {
+
+				SUMMARY_CACHE_ENTRY *pEntry = (SUMMARY_CACHE_ENTRY*)Data.data();
+				if (pEntry->iVersion == SUMMARY_CACHE_VERSION &&
+					pEntry->iFileSize.HighPart == FileInfo.nFileSizeHigh &&
+					pEntry->iFileSize.LowPart == FileInfo.nFileSizeLow &&
+					CompareFileTime( &pEntry->ftFileWrite, &FileInfo.ftLastWriteTime ) == 0)
+				{
+					Summary.bFinal = TRUE;
+					Summary.err = ERROR_SUCCESS;
+					Summary.iType = pEntry->iType;
+					Summary.iMessageCount = pEntry->iMessageCount;
+					Summary.sComments.assign( (LPCSTR)(pEntry + 1), (LPCSTR)Data.data() + dwSize );
+					bFound = TRUE;
+
+					/// Touch
+					GetSystemTimeAsFileTime( &pEntry->ftLastUsed );
+					RegSetValueEx( hKey, pszFile, 0, REG_BINARY, Data.data(), dwSize );
+				}
+			}
+		}
+		RegCloseKey( hKey );
+	}
+
+	return bFound;
+}
+
+
+//++ SummaryCacheStore
+void SummaryCacheStore( _In_ LPCTSTR pszFile, _In_ const WIN32_FILE_ATTRIBUTE_DATA &FileInfo, _In_ const FILE_SUMMARY &Summary )
+{
+	HKEY hKey;
+	if (RegCreateKeyEx( HKEY_CURRENT_USER, REGKEY_SUMMARY_CACHE, 0, NULL, 0, KEY_READ | KEY_WRITE, NULL, &hKey, NULL ) == ERROR_SUCCESS) {
+
+		// Evict the least recently used entries
+		for (;;) {
+			DWORD iValues = 0;
+			if (RegQueryInfoKey( hKey, NULL, NULL, NULL, NULL, NULL, NULL, &iValues, NULL, NULL, NULL, NULL ) != ERROR_SUCCESS || iValues < SUMMARY_CACHE_MAX_ENTRIES)
+				break;
+
+			TCHAR szName[MAX_PATH], szOldest[MAX_PATH] = {0};
+			FILETIME ftOldest = {0xffffffff, 0xffffffff};
+			SUMMARY_CACHE_ENTRY Entry;
+			for (DWORD i = 0; i < iValues; i++) {
+				DWORD iNameLen = ARRAYSIZE( szName ), dwType, dwSize = sizeof( Entry );
+				LONG e = RegEnumValue( hKey, i, szName, &iNameLen, NULL, &dwType, (LPBYTE)&Entry, &dwSize );
+				if (e == ERROR_MORE_DATA || e == ERROR_SUCCESS) {
+					/// ERROR_MORE_DATA is expected. Only the fixed size header has been read
+					if (dwType != REG_BINARY || dwSize < sizeof( Entry )) {
+						StringCchCopy( szOldest, ARRAYSIZE( szOldest ), szName );		/// Garbage
+						break;
+					}
+					if (CompareFileTime( &Entry.ftLastUsed, &ftOldest ) < 0) {
+						ftOldest = Entry.ftLastUsed;
+						StringCchCopy( szOldest, ARRAYSIZE( szOldest ), szName );
+					}
+				}
+			}
+			if (!*szOldest || RegDeleteValue( hKey, szOldest ) != ERROR_SUCCESS)
+				break;
+		}
+
+		// Store
+		std::vector<BYTE> Data( sizeof( SUMMARY_CACHE_ENTRY ) + Summary.sComments.size() );
+		SUMMARY_CACHE_ENTRY *pEntry = (SUMMARY_CACHE_ENTRY*)Data.data();
+		pEntry->iVersion = SUMMARY_CACHE_VERSION;
+		pEntry->iType = Summary.iType;
+		pEntry->iMessageCount = Summary.iMessageCount;
+		pEntry->iFileSize.HighPart = FileInfo.nFileSizeHigh;
+		pEntry->iFileSize.LowPart = FileInfo.nFileSizeLow;
+		pEntry->ftFileWrite = FileInfo.ftLastWriteTime;
+		GetSystemTimeAsFileTime( &pEntry->ftLastUsed );
+		CopyMemory( pEntry + 1, Summary.sComments.data(), Summary.sComments.size() );
+		RegSetValueEx( hKey, pszFile, 0, REG_BINARY, Data.data(), (DWORD)Data.size() );
+
+		RegCloseKey( hKey );
+	}
+}
+
+
+//++ ReleaseSummaryTask
+void ReleaseSummaryTask( _In_ SUMMARY_TASK *pTask )
+{
+	if (InterlockedDecrement( &pTask->iRefCount ) == 0)
+		delete pTask;
+}
+
+
+//++ CancelSummaryTask
+void CancelSummaryTask()
+{
+	if (g_pSummaryTask) {
+		InterlockedExchange( &g_pSummaryTask->bCancel, TRUE );
+		ReleaseSummaryTask( g_pSummaryTask );
+		g_pSummaryTask = NULL;
+	}
+}
+
+
+//++ PostSummary
+BOOL PostSummary( _In_ SUMMARY_TASK *pTask, _In_ FILE_SUMMARY *pSummary )
+{
+	if (!pTask->bCancel && PostMessage( pTask->hDlg, WM_FILE_SUMMARY, pTask->iRequestId, (LPARAM)pSummary ))
+		return TRUE;
+	delete pSummary;		/// Nobody will receive it
+	return FALSE;
+}
+
+
+//++ SummaryThread
+DWORD WINAPI SummaryThread( _In_ LPVOID pParam )
+{
+	SUMMARY_TASK *pTask = (SUMMARY_TASK*)pParam;
+
+	// Sniff the format (fast)
+	FILE_SUMMARY *pSummary = new FILE_SUMMARY;
+	StringCchCopy( pSummary->szFile, ARRAYSIZE( pSummary->szFile ), pTask->szFile );
+	pSummary->bFinal = FALSE;
+	pSummary->iType = 0;
+	pSummary->iMessageCount = 0;
+	pSummary->err = SmsSniffFileType( pTask->szFile, pSummary->iType );
+	if (pSummary->err == ERROR_SUCCESS && pSummary->iType != 0) {
+		PostSummary( pTask, pSummary );
+	} else {
+		delete pSummary;
+	}
+
+	// Refine the summary (slow)
+	if (!pTask->bCancel) {
+		pSummary = new FILE_SUMMARY;
+		StringCchCopy( pSummary->szFile, ARRAYSIZE( pSummary->szFile ), pTask->szFile );
+		pSummary->bFinal = TRUE;
+		pSummary->err = SmsGetFileSummary( pTask->szFile, pSummary->iType, pSummary->iMessageCount, pSummary->sComments, &pTask->bCancel, TRUE );
+		if (pSummary->err == ERROR_SUCCESS && pSummary->iType != 0)
+			SummaryCacheStore( pTask->szFile, pTask->FileInfo, *pSummary );
+		PostSummary( pTask, pSummary );
+	}
+
+	ReleaseSummaryTask( pTask );
+	return 0;
+}
+
+
 //++ SetOutputFile
+/// Start computing the input file summary in background. The dialog receives the results as WM_FILE_SUMMARY
 void SetOutputFile( _In_ HWND hDlg )
 {
-	TCHAR szInput[MAX_PATH], szOutput[MAX_PATH];
+	TCHAR szInput[MAX_PATH];
+	GetInputFile( hDlg, szInput );
+
+	WIN32_FILE_ATTRIBUTE_DATA FileInfo = {0};
+	BOOL bFileInfo = *szInput && GetFileAttributesEx( szInput, GetFileExInfoStandard, &FileInfo );
+
+	// Same file as the most recent request? (pending or complete)
+	if (bFileInfo &&
+		lstrcmpi( g_szSummaryFile, szInput ) == 0 &&
+		g_SummaryFileInfo.nFileSizeHigh == FileInfo.nFileSizeHigh &&
+		g_SummaryFileInfo.nFileSizeLow == FileInfo.nFileSizeLow &&
+		CompareFileTime( &g_SummaryFileInfo.ftLastWriteTime, &FileInfo.ftLastWriteTime ) == 0)
+	{
+		return;
+	}
+
+	// Cancel the stale request
+	CancelSummaryTask();
+	g_iSummaryRequestId++;
+	g_iInputType = 0;
+	StringCchCopy( g_szSummaryFile, ARRAYSIZE( g_szSummaryFile ), szInput );
+	g_SummaryFileInfo = FileInfo;
+
+	/// The Convert button stays enabled: this runs on EN_KILLFOCUS, when a click on Convert moves the focus. See OnButtonConvert
+	if (bFileInfo) {
+
+		// Known file?
+		FILE_SUMMARY Summary;
+		if (SummaryCacheLookup( szInput, FileInfo, Summary )) {
+			StringCchCopy( Summary.szFile, ARRAYSIZE( Summary.szFile ), szInput );
+			OnFileSummary( hDlg, &Summary );
+			return;
+		}
+
+		SUMMARY_TASK *pTask = new SUMMARY_TASK;
+		pTask->iRefCount = 2;			/// UI thread + worker thread
+		pTask->bCancel = FALSE;
+		pTask->iRequestId = g_iSummaryRequestId;
+		pTask->hDlg = hDlg;
+		pTask->FileInfo = FileInfo;
+		StringCchCopy( pTask->szFile, ARRAYSIZE( pTask->szFile ), szInput );
+
+		HANDLE hThread = CreateThread( NULL, 0, SummaryThread, pTask, 0, NULL );
+		if (hThread) {
+			CloseHandle( hThread );
+			g_pSummaryTask = pTask;
+			SetDlgItemText( hDlg, IDC_EDIT_INFO, _T( "Reading..." ) );
+			return;
+		}
+		delete pTask;
+	}
+
+	// Nothing to wait for
+	FILE_SUMMARY Summary;
+	StringCchCopy( Summary.szFile, ARRAYSIZE( Summary.szFile ), szInput );
+	Summary.bFinal = TRUE;
+	Summary.err = ERROR_INVALID_PARAMETER;
+	Summary.iType = 0;
+	Summary.iMessageCount = 0;
+	OnFileSummary( hDlg, &Summary );
+}
+
+
+//++ GetSortMemoryBudget
+/// Memory allowed for sorting, in bytes. Larger inputs are sorted externally (in temporary files)
+/// Configurable as REGKEY\SortMemoryMB (REG_DWORD). Default is half the available memory, minus what the reader holds (see SmsReaderFootprint)
+/// The reader doesn't stream: a conversion needs the reader's footprint plus this budget
+#define SORT_MIN_BUDGET		(16 * 1024 * 1024)
+ULONG64 GetSortMemoryBudget( _In_ ULONG iType, _In_ ULONG64 iInputSize )
+{
+	HKEY hKey;
+	DWORD iMB = 0, dwType, dwSize = sizeof( iMB );
+	if (RegOpenKeyEx( HKEY_CURRENT_USER, REGKEY, 0, KEY_READ, &hKey ) == ERROR_SUCCESS) {
+		if (RegQueryValueEx( hKey, _T( "SortMemoryMB" ), NULL, &dwType, (LPBYTE)&iMB, &dwSize ) != ERROR_SUCCESS || dwType != REG_DWORD)
+			iMB = 0;
+		RegCloseKey( hKey );
+	}
+	if (iMB)
+		return (ULONG64)iMB * 1024 * 1024;
+
+	MEMORYSTATUSEX ms = {sizeof( ms )};
+	if (!GlobalMemoryStatusEx( &ms ))
+		return SORT_MIN_BUDGET;
+	ULONG64 iAvail = __min( ms.ullAvailPhys, ms.ullAvailVirtual ) / 2;		/// Virtual address space matters to 32-bit builds
+	ULONG64 iReader = SmsReaderFootprint( iType, iInputSize );
+	return iAvail > iReader + SORT_MIN_BUDGET ? iAvail - iReader : SORT_MIN_BUDGET;		/// Never 0 (unlimited)
+}
+
+
+//++ OnFileSummary
+/// Input file summary -> Info text, Output filename
+/// Summaries of a file other than the one in the input box are stale (the box changed since the request) and ignored
+void OnFileSummary( _In_ HWND hDlg, _In_ FILE_SUMMARY *pSummary )
+{
+	TCHAR szInput[MAX_PATH];
+	LPCTSTR pszInput = pSummary->szFile;
 
-	szOutput[0] = 0;
 	GetInputFile( hDlg, szInput );
-	
-	ULONG iCount;
-	utf8string sComments;
-	SmsGetFileSummary( szInput, g_iInputType, iCount, sComments );
-	if (g_iInputType != 1 && g_iInputType != 2 && g_iInputType != 3) {
+	if (lstrcmpi( szInput, pszInput ) != 0)
+		return;
+
+	if (!pSummary->bFinal) {
+
+		/// Sniffed format. Still counting messages...
+		CHAR szInfo[255];
+		StringCchPrintfA( szInfo, ARRAYSIZE( szInfo ), "Format: \"%hs\"\r\nMessages: counting...", SmsFormatStr( pSummary->iType ) );
+		SetDlgItemTextA( hDlg, IDC_EDIT_INFO, szInfo );
+		return;
+	}
+
+	if (g_pSummaryTask) {
+		ReleaseSummaryTask( g_pSummaryTask );		/// Request complete
+		g_pSummaryTask = NULL;
+	}
+
+	g_iInputType = pSummary->iType;
+	ULONG iCount = pSummary->iMessageCount;
+	utf8string &sComments = pSummary->sComments;
+	if (g_iInputType < 1 || g_iInputType > 4) {
 
 		SetDlgItemText( hDlg, IDC_EDIT_INFO, _T( "Unknown file format" ) );
 		SetDlgItemText( hDlg, IDC_EDIT_OUTPUT, _T( "" ) );
@@ -93,29 +410,44 @@ void SetOutputFile( _In_ HWND hDlg )
 
 	} else {
 
-		CHAR szFormat[128], szMsgCount[50];
+		CHAR szFormat[128], szMsgCount[50], szMemory[100];
 		StringCchPrintfA( szFormat, ARRAYSIZE( szFormat ), "Format: \"%hs\"\r\n", SmsFormatStr( g_iInputType ) );
 		StringCchPrintfA( szMsgCount, ARRAYSIZE( szMsgCount ), "Messages: %u\r\n", iCount );
+		ULONG64 iInputSize = ((ULONG64)g_SummaryFileInfo.nFileSizeHigh << 32) | g_SummaryFileInfo.nFileSizeLow;
+		StringCchPrintfA( szMemory, ARRAYSIZE( szMemory ), "Memory: %I64u MB to read, %I64u MB to sort\r\n",
+			SmsReaderFootprint( g_iInputType, iInputSize ) >> 20, GetSortMemoryBudget( g_iInputType, iInputSize ) >> 20 );
+		sComments.insert( 0, szMemory );
 		sComments.insert( 0, szMsgCount );
 		sComments.insert( 0, szFormat );
 		SetDlgItemTextA( hDlg, IDC_EDIT_INFO, sComments );
 
-		StringCchCopy( szOutput, ARRAYSIZE( szOutput ), szInput );
-		PathRemoveExtension( szOutput );
+		SetInputType( hDlg, pszInput, g_iInputType );
+	}
+}
+
 
-		SYSTEMTIME st;
-		GetLocalTime( &st );
+//++ SetInputType
+/// Input format -> Output filename, Convert button
+void SetInputType( _In_ HWND hDlg, _In_ LPCTSTR pszInput, _In_ ULONG iType )
+{
+	TCHAR szOutput[MAX_PATH];
+	g_iInputType = iType;
 
-		TCHAR szSuffix[30];
-		StringCchPrintf( szSuffix, ARRAYSIZE( szSuffix ), _T( "-%hu%02hu%02hu" ), st.wYear, st.wMonth, st.wDay );
-		StringCchCat( szOutput, ARRAYSIZE( szOutput ), szSuffix );
+	StringCchCopy( szOutput, ARRAYSIZE( szOutput ), pszInput );
+	PathRemoveExtension( szOutput );
 
-		PathAddExtension( szOutput, g_iInputType != 2 ? _T( ".xml" ) : _T( ".msg" ) );
-		SetDlgItemText( hDlg, IDC_EDIT_OUTPUT, szOutput );
+	SYSTEMTIME st;
+	GetLocalTime( &st );
 
-		SetDlgItemText( hDlg, IDC_BUTTON_CONVERT, g_iInputType != 2 ? _T( "Convert to Android" ) : _T( "Convert to Windows" ) );
-		EnableWindow( GetDlgItem( hDlg, IDC_BUTTON_CONVERT ), TRUE );
-	}
+	TCHAR szSuffix[30];
+	StringCchPrintf( szSuffix, ARRAYSIZE( szSuffix ), _T( "-%hu%02hu%02hu" ), st.wYear, st.wMonth, st.wDay );
+	StringCchCat( szOutput, ARRAYSIZE( szOutput ), szSuffix );
+
+	PathAddExtension( szOutput, g_iInputType != 2 ? _T( ".xml" ) : _T( ".msg" ) );
+	SetDlgItemText( hDlg, IDC_EDIT_OUTPUT, szOutput );
+
+	SetDlgItemText( hDlg, IDC_BUTTON_CONVERT, g_iInputType != 2 ? _T( "Convert to Android" ) : _T( "Convert to Windows" ) );
+	EnableWindow( GetDlgItem( hDlg, IDC_BUTTON_CONVERT ), TRUE );
 }
 
 
@@ -196,8 +528,20 @@ INT_PTR CALLBACK DialogProc( __in HWND hDlg, __in UINT iMsg, __in WPARAM wParam,
 			return (INT_PTR)TRUE;
 		}
 
+		case WM_FILE_SUMMARY:
+		{
+			FILE_SUMMARY *pSummary = (FILE_SUMMARY*)lParam;
+			if ((ULONG)wParam == g_iSummaryRequestId)
+				OnFileSummary( hDlg, pSummary );
+			delete pSummary;
+			return (INT_PTR)TRUE;
+		}
+
 		case WM_DESTROY:
 		{
+			// Background tasks
+			CancelSummaryTask();
+
 			// Accelerators
 			HACCEL hAccel = (HACCEL)RemoveProp( hDlg, PROP_HACCEL );
 			if (hAccel)
@@ -353,10 +697,61 @@ void OnButtonBrowse( _In_ HWND hDlg )
 }
 
 
+//++ GetDefaultCountryCode
+/// Country code of national phone numbers (e.g. 40 turns 0740... into +40740...)
+/// Configurable as REGKEY\DefaultCountryCode (REG_DWORD). Default is 0 (national numbers are left alone)
+ULONG GetDefaultCountryCode()
+{
+	HKEY hKey;
+	DWORD iCC = 0, dwType, dwSize = sizeof( iCC );
+	if (RegOpenKeyEx( HKEY_CURRENT_USER, REGKEY, 0, KEY_READ, &hKey ) == ERROR_SUCCESS) {
+		if (RegQueryValueEx( hKey, _T( "DefaultCountryCode" ), NULL, &dwType, (LPBYTE)&iCC, &dwSize ) != ERROR_SUCCESS || dwType != REG_DWORD)
+			iCC = 0;
+		RegCloseKey( hKey );
+	}
+	return iCC;
+}
+
+
+//++ GetNormalizePhones
+/// Rewrite phone numbers in their canonical form (see SmsNormalizeStage)
+/// Configurable as REGKEY\NormalizePhones (REG_DWORD). Default is 0 (numbers are written as they are read)
+BOOL GetNormalizePhones()
+{
+	HKEY hKey;
+	DWORD iNormalize = 0, dwType, dwSize = sizeof( iNormalize );
+	if (RegOpenKeyEx( HKEY_CURRENT_USER, REGKEY, 0, KEY_READ, &hKey ) == ERROR_SUCCESS) {
+		if (RegQueryValueEx( hKey, _T( "NormalizePhones" ), NULL, &dwType, (LPBYTE)&iNormalize, &dwSize ) != ERROR_SUCCESS || dwType != REG_DWORD)
+			iNormalize = 0;
+		RegCloseKey( hKey );
+	}
+	return iNormalize != 0;
+}
+
+
+//++ SetNokiaTimeZone
+/// Time zone of the Nokia timestamps (see SmsSetNokiaTimeZone)
+/// Configurable as REGKEY\NokiaTimeZone (REG_SZ): a tz database file, or a POSIX TZ string. Default is the system's time zone
+ULONG SetNokiaTimeZone()
+{
+	HKEY hKey;
+	TCHAR szZone[MAX_PATH] = _T( "" );
+	DWORD dwType, dwSize = sizeof( szZone ) - sizeof( TCHAR );
+	if (RegOpenKeyEx( HKEY_CURRENT_USER, REGKEY, 0, KEY_READ, &hKey ) == ERROR_SUCCESS) {
+		if (RegQueryValueEx( hKey, _T( "NokiaTimeZone" ), NULL, &dwType, (LPBYTE)szZone, &dwSize ) == ERROR_SUCCESS && dwType == REG_SZ)
+			szZone[dwSize / sizeof( TCHAR )] = 0;
+		else
+			szZone[0] = 0;
+		RegCloseKey( hKey );
+	}
+	return SmsSetNokiaTimeZone( szZone );
+}
+
+
 //++ OnButtonConvert
 void OnButtonConvert( _In_ HWND hDlg )
 {
-	HRESULT hr;
+	ULONG err;
 
 	TCHAR szInput[MAX_PATH], szOutput[MAX_PATH];
 	szOutput[0] = 0;
@@ -369,46 +764,147 @@ void OnButtonConvert( _In_ HWND hDlg )
 		return;
 	}
 
-	if (!PathFileExists( szOutput ) ||
-		UtlMessageBox( hDlg, MB_YESNO | MB_ICONQUESTION, NULL, DialogTitle( hDlg ), _T( "\"%s\" already exists\nOverwrite?" ), PathFindFileName( szOutput ) ) == IDYES)
+	/// The summary of a path typed just before the click may still be pending. The conversion only needs the format: sniff it now
+	/// The summary keeps running, its result arrives later (WM_FILE_SUMMARY)
+	SetOutputFile( hDlg );		/// No-op if the summary of this file was already requested
+	if (g_iInputType == 0) {
+		ULONG iType = 0;
+		if (SmsSniffFileType( szInput, iType ) != ERROR_SUCCESS || iType < 1 || iType > 4) {
+			UtlMessageBox( hDlg, MB_OK | MB_ICONSTOP, NULL, DialogTitle( hDlg ), _T( "\"%s\"\nUnknown file format" ), PathFindFileName( szInput ) );
+			return;
+		}
+		SetInputType( hDlg, szInput, iType );
+		GetDlgItemText( hDlg, IDC_EDIT_OUTPUT, szOutput, ARRAYSIZE( szOutput ) );
+	}
+
+	/// An output with a checkpoint can be continued with the new messages (see SmsCheckpoint.h)
+	SmsCheckpoint Checkpoint;
+	int iAnswer = IDYES;
+	BOOL bAppend = FALSE;
+	if (PathFileExists( szOutput )) {
+		if (Checkpoint.Load( szOutput ) == ERROR_SUCCESS && Checkpoint.GetInputType() == g_iInputType) {
+			iAnswer = UtlMessageBox( hDlg, MB_YESNOCANCEL | MB_ICONQUESTION, NULL, DialogTitle( hDlg ), _T( "\"%s\" already exists\nAppend the messages that are new since the last conversion?\n\nYes: Append\nNo: Overwrite" ), PathFindFileName( szOutput ) );
+			bAppend = (iAnswer == IDYES);
+			if (iAnswer == IDNO)
+				iAnswer = IDYES;		/// Overwrite
+		} else {
+			iAnswer = UtlMessageBox( hDlg, MB_YESNO | MB_ICONQUESTION, NULL, DialogTitle( hDlg ), _T( "\"%s\" already exists\nOverwrite?" ), PathFindFileName( szOutput ) );
+		}
+		if (!bAppend)
+			Checkpoint.Clear();
+	}
+
+	if (iAnswer == IDYES)
 	{
-		SMS_LIST SmsList;
+		/// Reading, normalizing, sorting and writing run concurrently
+		SmsPipeline Pipeline;
+		SmsWriter *pWriter = NULL;
+		SmsSortStage *pSort = NULL;
+		WIN32_FILE_ATTRIBUTE_DATA fad;
+		ULONG64 iInputSize = GetFileAttributesEx( szInput, GetFileExInfoStandard, &fad ) ? ((ULONG64)fad.nFileSizeHigh << 32) | fad.nFileSizeLow : 0;
+		ULONG64 iSortBudget = GetSortMemoryBudget( g_iInputType, iInputSize );
 		if (g_iInputType == 1) {
 			// CMBK -> SMSBR
-			hr = Read_CMBK( szInput, SmsList );
-			if (SUCCEEDED( hr )) {
-				SmsList.sort( std::less<SMS>() );			/// Oldest messages first (SMSBR)
-				hr = Write_SMSBR( szOutput, SmsList );
-			}
+			pSort = new SmsSortStage( FALSE, iSortBudget );	/// Oldest messages first (SMSBR)
+			pWriter = SmsCreateWriter( 2, szOutput );
 		} else if (g_iInputType == 2) {
 			// SMSBR -> CMBK
-			hr = Read_SMSBR( szInput, SmsList );
-			if (SUCCEEDED( hr )) {
-				SmsList.sort( std::greater<SMS>() );		/// Newest messages first (CMBK)
-				hr = Write_CMBK( szOutput, SmsList );
-			}
+			pSort = new SmsSortStage( TRUE, iSortBudget );	/// Newest messages first (CMBK)
+			pWriter = SmsCreateWriter( 1, szOutput );
 		} else if (g_iInputType == 3) {
 			// NOKIA -> SMSBR
-			hr = Read_NOKIA( szInput, SmsList );
-			if (SUCCEEDED( hr )) {
-				SmsList.sort( std::greater<SMS>() );		/// Newer messages first (NOKIA)
-				hr = Write_SMSBR( szOutput, SmsList );
-			}
+			pSort = new SmsSortStage( TRUE, iSortBudget );	/// Newer messages first (NOKIA)
+			pWriter = SmsCreateWriter( 2, szOutput );
+		} else if (g_iInputType == 4) {
+			// SMSB -> SMSBR
+			pSort = new SmsSortStage( FALSE, iSortBudget );	/// Oldest messages first (SMSBR)
+			pWriter = SmsCreateWriter( 2, szOutput );
+		}
+
+		SmsNormalizeStage Normalize( GetDefaultCountryCode() );
+
+		err = (g_iInputType == 3) ? SetNokiaTimeZone() : ERROR_SUCCESS;
+		if (err != ERROR_SUCCESS) {
+			/// Invalid time zone
+		} else if (pSort && pWriter) {
+			Pipeline.SetReader( g_iInputType, szInput );
+			if (GetNormalizePhones())
+				Pipeline.AddStage( &Normalize );
+			Pipeline.AddStage( pSort );
+			Pipeline.SetWriter( pWriter );
+			Pipeline.SetCheckpoint( &Checkpoint );
+			err = Pipeline.Run();
+			if (err == ERROR_SUCCESS)
+				Checkpoint.Save( szOutput );		/// Best effort. Without a checkpoint, the next conversion starts over
 		} else {
-			hr = E_INVALIDARG;
+			err = ERROR_INVALID_PARAMETER;
 		}
+		delete pWriter;
+		delete pSort;
 
 		// Message
-		if (SUCCEEDED( hr )) {
-			UtlMessageBox( hDlg, MB_OK, MAKEINTRESOURCE( IDI_MAIN ), DialogTitle( hDlg ), _T( "Successfully converted %u messages\nEnjoy!" ), g_hInst, SmsCount( SmsList ) );	// SmsCount() is aware of multiple contacts
+		if (err == ERROR_SUCCESS) {
+			UtlMessageBox( hDlg, MB_OK, MAKEINTRESOURCE( IDI_MAIN ), DialogTitle( hDlg ), bAppend ? _T( "Successfully appended %u new messages\nEnjoy!" ) : _T( "Successfully converted %u messages\nEnjoy!" ), g_hInst, Pipeline.GetCount() );	// SmsCount() is aware of multiple contacts
 		} else {
 			TCHAR szErr[128];
-			UtlMessageBox( hDlg, MB_OK | MB_ICONSTOP, NULL, DialogTitle( hDlg ), _T( "%s\nError 0x%x" ), UtlFormatError( hr, szErr, ARRAYSIZE( szErr ) ), hr );
+			UtlMessageBox( hDlg, MB_OK | MB_ICONSTOP, NULL, DialogTitle( hDlg ), _T( "%s\nError 0x%x" ), UtlFormatError( err, szErr, ARRAYSIZE( szErr ) ), err );
 		}
 	}
 }
 
 
+//++ RunBenchmark
+/// Command line: /bench <directory> [message count] [repetitions] [/trace <file.json>]
+/// Returns FALSE if the command line doesn't ask for a benchmark
+BOOL RunBenchmark( _Out_ DWORD &err )
+{
+	int argc = 0;
+	LPWSTR *argv = CommandLineToArgvW( GetCommandLineW(), &argc );
+	if (!argv)
+		return FALSE;
+
+	BOOL bBench = (argc >= 3 && EqualStr( argv[1], _T( "/bench" ) ));
+	if (bBench) {
+
+		SMS_GENERATOR Gen;
+		SmsGeneratorDefaults( Gen );
+		if (argc > 3)
+			Gen.iCount = (ULONG)StrToInt( argv[3] );
+		ULONG iRepeat = (argc > 4 ? (ULONG)StrToInt( argv[4] ) : 5);
+
+		TCHAR szResults[MAX_PATH];
+		PathCombine( szResults, argv[2], _T( "bench.jsonl" ) );
+		err = SmsBenchmark( argv[2], Gen, iRepeat, szResults );
+	}
+
+	LocalFree( argv );
+	return bBench;
+}
+
+
+//++ GetTraceFile
+/// Command line: [...] /trace <file.json>
+/// Returns FALSE if the command line doesn't ask for a trace
+BOOL GetTraceFile( _Out_ LPTSTR pszFile, _In_ ULONG iLen )
+{
+	int argc = 0;
+	LPWSTR *argv = CommandLineToArgvW( GetCommandLineW(), &argc );
+	if (!argv)
+		return FALSE;
+
+	BOOL bTrace = FALSE;
+	for (int i = 1; i + 1 < argc && !bTrace; i++) {
+		if (EqualStr( argv[i], _T( "/trace" ) )) {
+			StringCchCopy( pszFile, iLen, argv[i + 1] );
+			bTrace = TRUE;
+		}
+	}
+
+	LocalFree( argv );
+	return bTrace;
+}
+
+
 //++ WinMain
 int APIENTRY _tWinMain( __in HINSTANCE hInstance, __in HINSTANCE hPrevInstance, __in LPTSTR lpCmdLine, __in int nCmdShow )
 {
@@ -421,6 +917,18 @@ int APIENTRY _tWinMain( __in HINSTANCE hInstance, __in HINSTANCE hPrevInstance,
 	/// Instance
 	g_hInst = GetModuleHandle( NULL );
 
+	/// Instrumentation
+	TCHAR szTraceFile[MAX_PATH];
+	if (GetTraceFile( szTraceFile, ARRAYSIZE( szTraceFile ) ))
+		SmsTraceEnable( TRUE );
+
+	/// Benchmark (no UI)
+	if (RunBenchmark( err )) {
+		if (SmsTracing())
+			SmsTraceSave( szTraceFile );
+		return (int)err;
+	}
+
 	/// Common controls
 	InitCommonControls();
 
@@ -451,5 +959,8 @@ int APIENTRY _tWinMain( __in HINSTANCE hInstance, __in HINSTANCE hPrevInstance,
 		err = GetLastError();
 	}
 
+	if (SmsTracing())
+		SmsTraceSave( szTraceFile );
+
 	return (int)err;
 }
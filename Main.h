@@ -6,6 +6,7 @@
 #define REGKEY							_T( "Software\\Marius Negrutiu\\sms_w2a" )
 #define WM_TRANSLATE_ACCELERATOR_KEY	0xFF01	/// (WM_APP + 0x7F01) wParam==Unused, lParam==(LPMSG)msg
 #define WM_TRANSLATE_DIALOG_KEY			0xFF02	/// (WM_APP + 0x7F02) wParam==Unused, lParam==(LPMSG)msg
+#define WM_FILE_SUMMARY					0xFF03	/// (WM_APP + 0x7F03) wParam==(ULONG)RequestID, lParam==(FILE_SUMMARY*)pSummary. The receiver must delete pSummary
 
 //+ Global variables
 extern HINSTANCE g_hInst;
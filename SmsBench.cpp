@@ -0,0 +1,446 @@
+#include "StdAfx.h"
+#include "SmsBench.h"
+#include "SmsParse.h"
+#include "SmsPhone.h"
+#include <algorithm>
+#include <psapi.h>
+#include <new>
+
+
+//!++ Generator
+
+//+ Random
+/// xorshift32. Deterministic and fast, good enough for synthetic data
+static ULONG Random( _Inout_ ULONG &iState )
+{
+	iState ^= iState << 13;
+	iState ^= iState >> 17;
+	iState ^= iState << 5;
+	return iState;
+}
+
+/// Text fragments (UTF-8). Plain words, XML special characters, Romanian diacritics, CJK, emoji and line breaks
+static LPCSTR g_Words[] = {
+	"hello", "salut", "ok", "see you", "tomorrow", "at", "the", "meeting", "call me", "thanks",
+	"a&b", "x<y", "y>x", "\"quoted\"", "it's",
+	"\xC8\x99i", "m\xC3\xA2ine", "\xC3\xAEn", "ora\xC8\x99", "\xC8\x9B" "ar\xC4\x83",				/// și, mâine, în, oraș, țară
+	"\xE4\xBD\xA0\xE5\xA5\xBD", "\xE8\xB0\xA2\xE8\xB0\xA2",									/// CJK
+	"\xF0\x9F\x98\x80", "\xF0\x9F\x91\x8D", "\xF0\x9F\x8E\x89", "\xE2\x98\x85",				/// Emoji (4-byte UTF-8) and BMP symbols
+	"\r\n",
+};
+
+//++ SmsGeneratorDefaults
+void SmsGeneratorDefaults( _Out_ SMS_GENERATOR &Gen )
+{
+	Gen.iCount = 100000;
+	Gen.iSeed = 2017;
+	Gen.iContacts = 500;
+	Gen.iMultiPercent = 5;
+	Gen.iMaxWords = 40;
+}
+
+//++ SmsGenerate
+ULONG SmsGenerate( _In_ const SMS_GENERATOR &Gen, _Out_ SMS_LIST &SmsList )
+{
+	SmsList.clear();
+	if (Gen.iContacts == 0 || Gen.iMaxWords == 0)
+		return ERROR_INVALID_PARAMETER;
+
+	ULONG iState = Gen.iSeed ? Gen.iSeed : 1;		/// xorshift state can't be zero
+
+	// Contacts
+	std::vector<SMS_PHONE_ID> Contacts( Gen.iContacts );
+	for (ULONG i = 0; i < Gen.iContacts; i++) {
+		CHAR szPhone[20];
+		StringCchPrintfA( szPhone, ARRAYSIZE( szPhone ), "+40%09u", Random( iState ) % 1000000000 );
+		Contacts[i] = SmsPhones().Intern( szPhone );
+	}
+
+	// Messages
+	SMS_TIME iTime = SmsTimeFromCivil( 2015, 1, 1, 0, 0, 0 );
+
+	SMS sms;
+	for (ULONG i = 0; i < Gen.iCount; i++) {
+
+		sms.clear();
+		iTime += (ULONG64)(3600000 + Random( iState ) % 7200000) * 10000;		/// 1..3h, millisecond precision
+		sms.Timestamp = iTime;
+		sms.IsIncoming = (Random( iState ) & 1) != 0;
+		sms.IsRead = !sms.IsIncoming || (Random( iState ) % 10) != 0;
+
+		ULONG iPhones = 1;
+		if (!sms.IsIncoming && Random( iState ) % 100 < Gen.iMultiPercent)
+			iPhones = 2 + Random( iState ) % 4;
+		while (sms.PhoneId.size() < iPhones && sms.PhoneId.size() < Gen.iContacts) {
+			SMS_PHONE_ID id = Contacts[Random( iState ) % Gen.iContacts];
+			if (std::find( sms.PhoneId.begin(), sms.PhoneId.end(), id ) == sms.PhoneId.end())
+				sms.PhoneId.push_back( id );
+		}
+
+		for (ULONG iWords = 1 + Random( iState ) % Gen.iMaxWords; iWords > 0; iWords--) {
+			if (!sms.Text.empty())
+				sms.Text += ' ';
+			sms.Text += g_Words[Random( iState ) % ARRAYSIZE( g_Words )];
+		}
+
+		SmsList.push_back( std::move( sms ) );
+	}
+
+	return ERROR_SUCCESS;
+}
+
+//++ SmsGenerateFile
+ULONG SmsGenerateFile( _In_ ULONG iType, _In_ LPCTSTR pszFile, _In_ const SMS_GENERATOR &Gen )
+{
+	SMS_LIST SmsList;
+	ULONG err = SmsGenerate( Gen, SmsList );
+	if (err == ERROR_SUCCESS) {
+		switch (iType) {
+			case 1: err = Write_CMBK( pszFile, SmsList ); break;
+			case 2: err = Write_SMSBR( pszFile, SmsList ); break;
+			case 3: err = Write_NOKIA( pszFile, SmsList ); break;
+			case 4: err = Write_SMSB( pszFile, SmsList ); break;
+			default: err = ERROR_NOT_SUPPORTED;
+		}
+	}
+	return err;
+}
+
+
+//!++ Benchmark
+
+//+ MemorySampler
+/// Samples the working set every millisecond, on a separate thread
+/// The result is relative to the working set at the start: what the operation added to what the process already held
+class MemorySampler {
+public:
+	MemorySampler(): m_iBase( 0 ), m_iBasePeak( 0 ), m_iPeak( 0 ), m_hThread( NULL )
+	{
+		PROCESS_MEMORY_COUNTERS pmc;
+		if (GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) )) {
+			m_iBase = m_iPeak = pmc.WorkingSetSize;
+			m_iBasePeak = pmc.PeakWorkingSetSize;
+		}
+		m_hStop = CreateEvent( NULL, TRUE, FALSE, NULL );
+		if (m_hStop)
+			m_hThread = CreateThread( NULL, 0, Thread, this, 0, NULL );
+	}
+
+	~MemorySampler() { Stop(); if (m_hStop) CloseHandle( m_hStop ); }
+
+	/// Working set growth (bytes)
+	SIZE_T Stop()
+	{
+		if (m_hThread) {
+			SetEvent( m_hStop );
+			WaitForSingleObject( m_hThread, INFINITE );
+			CloseHandle( m_hThread );
+			m_hThread = NULL;
+		}
+		Sample();
+		return m_iPeak - m_iBase;
+	}
+
+private:
+	void Sample()
+	{
+		PROCESS_MEMORY_COUNTERS pmc;
+		if (GetProcessMemoryInfo( GetCurrentProcess(), &pmc, sizeof( pmc ) )) {
+			m_iPeak = __max( m_iPeak, pmc.WorkingSetSize );
+			if (pmc.PeakWorkingSetSize > m_iBasePeak)
+				m_iPeak = __max( m_iPeak, pmc.PeakWorkingSetSize );		/// A new process peak, set during the operation. Exact, even between samples
+		}
+	}
+
+	static DWORD WINAPI Thread( _In_ LPVOID pParam )
+	{
+		MemorySampler *pThis = (MemorySampler*)pParam;
+		while (WaitForSingleObject( pThis->m_hStop, 1 ) == WAIT_TIMEOUT)
+			pThis->Sample();
+		return 0;
+	}
+
+private:
+	SIZE_T m_iBase;			/// Working set at the start
+	SIZE_T m_iBasePeak;		/// Process peak at the start
+	SIZE_T m_iPeak;			/// Written by the sampler thread only, until stopped
+	HANDLE m_hStop;
+	HANDLE m_hThread;
+};
+
+
+//+ Allocation counter
+/// The global operator new counts C++ allocations (all threads) while g_bCountAllocs is set. Debug and Release builds alike
+/// Otherwise it's the CRT's: malloc, and the new handler on failure. C allocations (malloc, e.g. libcsv) aren't counted
+static volatile LONG g_bCountAllocs = FALSE;
+static volatile LONG g_iAllocs = 0;
+
+void* operator new( size_t iSize )
+{
+	if (g_bCountAllocs)
+		InterlockedIncrement( &g_iAllocs );
+	for (;;) {
+		void *p = malloc( iSize ? iSize : 1 );
+		if (p)
+			return p;
+		std::new_handler pfnHandler = std::get_new_handler();
+		if (!pfnHandler)
+			throw std::bad_alloc();
+		pfnHandler();
+	}
+}
+
+void operator delete( void *p ) noexcept
+{
+	free( p );
+}
+
+
+enum { OP_WRITE_CMBK, OP_WRITE_SMSBR, OP_READ_CMBK, OP_READ_SMSBR, OP_READ_NOKIA, OP_HASH_CMBK, OP_PARSE_FAST, OP_PARSE_SHLWAPI, OP_NORMALIZE, OP_READ_CMBK_BATCH, OP_READ_SMSBR_BATCH, OP_COUNT };
+static LPCSTR g_OpNames[OP_COUNT] = { "Write_CMBK", "Write_SMSBR", "Read_CMBK", "Read_SMSBR", "Read_NOKIA", "Compute_CMBK_Hash", "Parse_Fields", "Parse_Fields_Shlwapi", "Normalize_Phones", "Read_CMBK_Batch", "Read_SMSBR_Batch" };
+
+//+ BENCH_FILES
+struct BENCH_FILES {
+	TCHAR szCMBK[MAX_PATH];
+	TCHAR szSMSBR[MAX_PATH];
+	TCHAR szNOKIA[MAX_PATH];
+};
+
+//+ BENCH_FIELDS
+/// The numeric and boolean fields of every message, as the readers see them: CMBK LocalTimestamp and IsIncoming, SMSBR date and type
+/// Fields are zero-terminated (shlwapi needs it), four per message
+struct BENCH_FIELDS {
+	std::string Text;
+	std::vector<size_t> Starts;
+	ULONG64 iChecksum;					/// Expected parse result
+};
+
+//+ BENCH_PHONES
+/// The messages' addresses, without text. The synthetic numbers ("+40...") are spelled three ways: as they are, "0040..." and "0..." (national)
+#define BENCH_COUNTRY_CODE 40
+struct BENCH_PHONES {
+	SMS_BATCH Batch;
+};
+
+//+ RespellPhones
+static void RespellPhones( _In_ const SMS_LIST &SmsList, _Out_ BENCH_PHONES &Phones )
+{
+	std::unordered_map<SMS_PHONE_ID, SMS_PHONE_ID> Spellings[2];		/// "0040...", "0..."
+	Phones.Batch.clear();
+	Phones.Batch.reserve( SmsList.size() );
+
+	ULONG i = 0;
+	for (auto it = SmsList.begin(); it != SmsList.end(); ++it) {
+		SMS sms;
+		sms.clear();
+		sms.Timestamp = it->Timestamp;
+		sms.IsIncoming = it->IsIncoming;
+		sms.IsRead = it->IsRead;
+		for (auto itId = it->PhoneId.begin(); itId != it->PhoneId.end(); ++itId) {
+			ULONG iSpelling = i++ % 3;
+			if (iSpelling == 0) {
+				sms.PhoneId.push_back( *itId );
+				continue;
+			}
+			auto &Spelling = Spellings[iSpelling - 1];
+			auto itSpelling = Spelling.find( *itId );
+			if (itSpelling == Spelling.end()) {
+				std::string sPhone = SmsPhones().Resolve( *itId ).c_str();
+				BOOL bNational = (iSpelling == 2 && sPhone[3] != '0');		/// "+400..." has no national form ("00" is the international prefix)
+				sPhone.replace( 0, 3, bNational ? "0" : "0040" );		/// "+40..."
+				itSpelling = Spelling.insert( std::make_pair( *itId, SmsPhones().Intern( sPhone.c_str() ) ) ).first;
+			}
+			sms.PhoneId.push_back( itSpelling->second );
+		}
+		Phones.Batch.push_back( std::move( sms ) );
+	}
+}
+
+//+ NormalizePhones
+/// The pipeline stage, over a copy of the addresses (the copy is timed too)
+/// Numbers are canonicalized once per process. The first run pays for it, the others only look them up
+static ULONG NormalizePhones( _In_ const BENCH_PHONES &Phones, _Out_ ULONG &iMessages )
+{
+	SMS_BATCH Batch( Phones.Batch );
+	SmsNormalizeStage Normalize( BENCH_COUNTRY_CODE );
+	ULONG err = Normalize.Process( Batch );
+	iMessages = (ULONG)Batch.size();
+	return err;
+}
+
+//+ FormatFields
+static void FormatFields( _In_ const SMS_LIST &SmsList, _Out_ BENCH_FIELDS &Fields )
+{
+	CHAR szTicks[30], szMillis[30];
+	Fields.Text.clear();
+	Fields.Starts.clear();
+	Fields.iChecksum = 0;
+
+	for (auto it = SmsList.begin(); it != SmsList.end(); ++it) {
+		ULONG64 iTicks = it->Timestamp;
+		ULONG64 iMillis = (ULONG64)SmsTimeToPosixMs( it->Timestamp );		/// Since 1970/01/01
+		StringCchPrintfA( szTicks, ARRAYSIZE( szTicks ), "%I64u", iTicks );
+		StringCchPrintfA( szMillis, ARRAYSIZE( szMillis ), "%I64u", iMillis );
+		LPCSTR Values[4] = { szTicks, it->IsIncoming ? "true" : "false", szMillis, it->IsIncoming ? "1" : "2" };
+		for (int i = 0; i < 4; i++) {
+			Fields.Starts.push_back( Fields.Text.size() );
+			Fields.Text += Values[i];
+			Fields.Text += '\0';
+		}
+		Fields.iChecksum += iTicks + iMillis + (it->IsIncoming ? 2 : 0);
+	}
+}
+
+//+ ParseFields
+/// Parse the fields with SmsParse.h (bFast) or shlwapi and CompareString, the way the readers used to
+static ULONG ParseFields( _In_ const BENCH_FIELDS &Fields, _In_ BOOL bFast, _Out_ ULONG &iMessages )
+{
+	ULONG64 iChecksum = 0;
+	LPCSTR psz = Fields.Text.c_str();
+	iMessages = (ULONG)(Fields.Starts.size() / 4);
+	for (size_t i = 0; i + 4 <= Fields.Starts.size(); i += 4) {
+		LPCSTR pszTicks = psz + Fields.Starts[i], pszIn = psz + Fields.Starts[i + 1], pszMillis = psz + Fields.Starts[i + 2], pszType = psz + Fields.Starts[i + 3];
+		if (bFast) {
+			int64_t n;
+			if (!SmsParseInt( pszTicks, Fields.Starts[i + 1] - Fields.Starts[i] - 1, n ))
+				return ERROR_INVALID_DATA;
+			iChecksum += n;
+			if (!SmsParseInt( pszMillis, Fields.Starts[i + 3] - Fields.Starts[i + 2] - 1, n ))
+				return ERROR_INVALID_DATA;
+			iChecksum += n;
+			iChecksum += SmsSpanIs( pszIn, Fields.Starts[i + 2] - Fields.Starts[i + 1] - 1, "true" ) ? 1 : 0;
+			iChecksum += SmsSpanIs( pszType, strlen( pszType ), "1" ) ? 1 : 0;
+		} else {
+			LONGLONG n;
+			StrToInt64ExA( pszTicks, STIF_DEFAULT, &n );
+			iChecksum += n;
+			StrToInt64ExA( pszMillis, STIF_DEFAULT, &n );
+			iChecksum += n;
+			iChecksum += EqualStrA( pszIn, "true" ) ? 1 : 0;
+			iChecksum += EqualStrA( pszType, "1" ) ? 1 : 0;
+		}
+	}
+	return iChecksum == Fields.iChecksum ? ERROR_SUCCESS : ERROR_INVALID_DATA;
+}
+
+//+ RunOp
+/// iMessages receives the number of messages read or written
+static ULONG RunOp( _In_ ULONG iOp, _In_ const BENCH_FILES &Files, _In_ const SMS_LIST &SmsList, _In_ const BENCH_FIELDS &Fields, _In_ const BENCH_PHONES &Phones, _Out_ ULONG &iMessages )
+{
+	ULONG err;
+	SMS_LIST Messages;
+	utf8string Hash;
+
+	iMessages = 0;
+	switch (iOp) {
+		case OP_WRITE_CMBK:		err = Write_CMBK( Files.szCMBK, SmsList ); iMessages = (ULONG)SmsList.size(); break;
+		case OP_WRITE_SMSBR:	err = Write_SMSBR( Files.szSMSBR, SmsList ); iMessages = (ULONG)SmsList.size(); break;
+		case OP_READ_CMBK:
+		case OP_READ_CMBK_BATCH:	err = Read_CMBK( Files.szCMBK, Messages ); iMessages = (ULONG)Messages.size(); break;
+		case OP_READ_SMSBR:
+		case OP_READ_SMSBR_BATCH:	err = Read_SMSBR( Files.szSMSBR, Messages ); iMessages = (ULONG)Messages.size(); break;
+		case OP_READ_NOKIA:		err = Read_NOKIA( Files.szNOKIA, Messages ); iMessages = (ULONG)Messages.size(); break;
+		case OP_HASH_CMBK:		err = Compute_CMBK_Hash( Files.szCMBK, Hash ); iMessages = (ULONG)SmsList.size(); break;
+		case OP_PARSE_FAST:		err = ParseFields( Fields, TRUE, iMessages ); break;
+		case OP_PARSE_SHLWAPI:	err = ParseFields( Fields, FALSE, iMessages ); break;
+		case OP_NORMALIZE:		err = NormalizePhones( Phones, iMessages ); break;
+		default:				err = ERROR_INVALID_PARAMETER;
+	}
+	return err;
+}
+
+//+ FileSize
+static ULONG64 FileSize( _In_ LPCTSTR pszFile )
+{
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if (GetFileAttributesEx( pszFile, GetFileExInfoStandard, &fad ))
+		return ((ULONG64)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+	return 0;
+}
+
+//++ SmsBenchmark
+ULONG SmsBenchmark( _In_ LPCTSTR pszDir, _In_ const SMS_GENERATOR &Gen, _In_ ULONG iRepeat, _In_ LPCTSTR pszResults )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	if (!pszDir || !*pszDir || !pszResults || !*pszResults || iRepeat == 0)
+		return ERROR_INVALID_PARAMETER;
+
+	BENCH_FILES Files;
+	PathCombine( Files.szCMBK, pszDir, _T( "bench.msg" ) );
+	PathCombine( Files.szSMSBR, pszDir, _T( "bench.xml" ) );
+	PathCombine( Files.szNOKIA, pszDir, _T( "bench.csv" ) );
+
+	// Synthetic data
+	SMS_LIST SmsList;
+	if ((err = SmsGenerate( Gen, SmsList )) != ERROR_SUCCESS)
+		return err;
+	if ((err = Write_NOKIA( Files.szNOKIA, SmsList )) != ERROR_SUCCESS)		/// Not benchmarked. The other files are created by their writers
+		return err;
+	BENCH_FIELDS Fields;
+	FormatFields( SmsList, Fields );
+	BENCH_PHONES Phones;
+	RespellPhones( SmsList, Phones );
+
+	LARGE_INTEGER iFreq;
+	QueryPerformanceFrequency( &iFreq );
+
+	utf8string Results;
+	for (ULONG iOp = 0; iOp < OP_COUNT && err == ERROR_SUCCESS; iOp++) {
+
+		std::vector<double> Times;
+		ULONG iMessages = 0;
+		SIZE_T iPeak = 0;
+		LONG iAllocs = 0;
+
+		/// The readers run as in the app, each with a new parser document. The batch variants keep the document (and its memory pool) from one run to the next
+		BOOL bBatch = (iOp == OP_READ_CMBK_BATCH || iOp == OP_READ_SMSBR_BATCH);
+		if (bBatch)
+			SmsXmlRetain( TRUE );
+
+		for (ULONG iRun = 0; iRun < iRepeat && err == ERROR_SUCCESS; iRun++) {
+
+			LARGE_INTEGER t0, t1;
+			g_iAllocs = 0;
+			InterlockedExchange( &g_bCountAllocs, TRUE );
+			MemorySampler Memory;
+			QueryPerformanceCounter( &t0 );
+
+			err = RunOp( iOp, Files, SmsList, Fields, Phones, iMessages );
+
+			QueryPerformanceCounter( &t1 );
+			iPeak = __max( iPeak, Memory.Stop() );
+			InterlockedExchange( &g_bCountAllocs, FALSE );
+			iAllocs = g_iAllocs;		/// Last run
+			Times.push_back( (double)(t1.QuadPart - t0.QuadPart) * 1000.0 / (double)iFreq.QuadPart );
+		}
+		if (bBatch)
+			SmsXmlRetain( FALSE );
+
+		if (err == ERROR_SUCCESS) {
+
+			std::sort( Times.begin(), Times.end() );
+			double fBest = Times.front(), fMedian = Times[Times.size() / 2];
+			double fSeconds = __max( fBest, 0.001 ) / 1000.0;
+			ULONG64 iBytes = FileSize( iOp == OP_WRITE_SMSBR || iOp == OP_READ_SMSBR || iOp == OP_READ_SMSBR_BATCH ? Files.szSMSBR : (iOp == OP_READ_NOKIA ? Files.szNOKIA : Files.szCMBK) );
+			if (iOp == OP_PARSE_FAST || iOp == OP_PARSE_SHLWAPI)
+				iBytes = Fields.Text.size();
+			if (iOp == OP_NORMALIZE)
+				iBytes = 0;		/// Not a file operation
+
+			CHAR szLine[512];
+			StringCchPrintfA( szLine, ARRAYSIZE( szLine ),
+				"{\"op\":\"%s\",\"messages\":%u,\"bytes\":%I64u,\"runs\":%u,\"best_ms\":%.3f,\"median_ms\":%.3f,\"mb_per_s\":%.2f,\"msg_per_s\":%.0f,\"peak_rss_delta\":%I64u,\"allocs\":%d}\n",
+				g_OpNames[iOp], iMessages, iBytes, iRepeat, fBest, fMedian,
+				(double)iBytes / (1024.0 * 1024.0) / fSeconds, (double)iMessages / fSeconds,
+				(ULONG64)iPeak, iAllocs
+			);
+			Results += szLine;
+		}
+	}
+
+	if (err == ERROR_SUCCESS)
+		err = Results.SaveToFile( pszResults );
+
+	return err;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "SmsConvert.h"
+
+//? Synthetic backups and reader/writer benchmarks
+//? The generator produces deterministic message lists (same parameters, same messages): Unicode and emoji texts, XML special characters, CRLF line breaks and messages sent to multiple contacts
+//? The benchmark writes the synthetic list to CMBK, SMSBR and Nokia files, then times the readers, the writers and the CMBK hash
+//? The readers are timed as the app runs them, and again in batch mode (see SmsXmlRetain)
+//? It also times the readers' field parsers (timestamps and flags, see SmsParse.h) against the shlwapi functions they replaced, and the phone number normalization stage (see SmsPhone.h)
+//? Run it from the command line: sms_w2a.exe /bench <directory> [message count] [repetitions]
+//? The portable core (parsers, formatters, time conversions) has its own benchmark, sms_bench (SmsCoreBench.cpp), that builds on any platform
+
+
+//+ SMS_GENERATOR
+struct SMS_GENERATOR {
+	ULONG iCount;				/// Messages (SMS records)
+	ULONG iSeed;
+	ULONG iContacts;			/// Distinct phone numbers
+	ULONG iMultiPercent;		/// Messages sent to 2..5 contacts
+	ULONG iMaxWords;			/// Text length
+};
+
+//+ SmsGeneratorDefaults
+void SmsGeneratorDefaults( _Out_ SMS_GENERATOR &Gen );
+
+//+ SmsGenerate
+/// Messages are in chronological order, one to three hours apart, starting 2015/01/01
+ULONG SmsGenerate( _In_ const SMS_GENERATOR &Gen, _Out_ SMS_LIST &SmsList );
+
+//+ SmsGenerateFile
+/// Synthetic backup of any writable type (1=CMBK, 2=SMSBR, 3=NOKIA, 4=SMSB)
+ULONG SmsGenerateFile( _In_ ULONG iType, _In_ LPCTSTR pszFile, _In_ const SMS_GENERATOR &Gen );
+
+
+//+ SmsBenchmark
+/// Every operation runs iRepeat times. The results are written to pszResults as JSON lines, one line per operation:
+///   {"op":"Read_SMSBR","messages":100000,"bytes":52428800,"runs":5,"best_ms":412.5,"median_ms":420.1,"mb_per_s":121.2,"msg_per_s":242424,"peak_rss_delta":123456789,"allocs":1234567}
+/// Throughput is computed from the best run. peak_rss_delta is the largest working set during the operation, minus the working set before it (bytes, largest of all runs)
+/// allocs is the number of C++ heap allocations (operator new) during the last run, on all threads
+ULONG SmsBenchmark(
+	_In_ LPCTSTR pszDir,				/// Work directory. Synthetic files are created here
+	_In_ const SMS_GENERATOR &Gen,
+	_In_ ULONG iRepeat,
+	_In_ LPCTSTR pszResults
+);
@@ -0,0 +1,428 @@
+#include "StdAfx.h"
+#include "SmsBinary.h"
+#include "SmsFilter.h"
+#include "SmsTrace.h"
+
+
+//++ SmsEncodeRecord
+void SmsEncodeRecord( _Inout_ std::string &Buf, _In_ const SMS &sms, _Inout_ ULONG64 &iPrevTimestamp, _In_opt_ const std::vector<ULONG> *pPhoneMap )
+{
+	SmsPutVarint( Buf, SmsZigZag( (LONG64)(sms.Timestamp - iPrevTimestamp) ) );
+	iPrevTimestamp = sms.Timestamp;
+
+	Buf.push_back( (char)((sms.IsIncoming ? SMS_RECORD_FLAG_INCOMING : 0) | (sms.IsRead ? SMS_RECORD_FLAG_READ : 0)) );
+
+	SmsPutVarint( Buf, sms.PhoneId.size() );
+	for (auto it = sms.PhoneId.begin(); it != sms.PhoneId.end(); ++it)
+		SmsPutVarint( Buf, pPhoneMap ? (*pPhoneMap)[*it] : *it );
+
+	SmsPutVarint( Buf, sms.Text.size() );
+	Buf.append( sms.Text );
+}
+
+
+//++ SmsDecodeRecord
+BOOL SmsDecodeRecord( _Inout_ const BYTE *&p, _In_ const BYTE *pEnd, _Out_ SMS &sms, _Inout_ ULONG64 &iPrevTimestamp )
+{
+	ULONG64 v, iLen;
+
+	if (!SmsGetVarint( p, pEnd, v ))
+		return FALSE;
+	sms.Timestamp = iPrevTimestamp + (ULONG64)SmsUnZigZag( v );
+	iPrevTimestamp = sms.Timestamp;
+
+	if (p >= pEnd)
+		return FALSE;
+	BYTE iFlags = *p++;
+	sms.IsIncoming = (iFlags & SMS_RECORD_FLAG_INCOMING) != 0;
+	sms.IsRead = (iFlags & SMS_RECORD_FLAG_READ) != 0;
+
+	if (!SmsGetVarint( p, pEnd, v ) || v > (ULONG64)(pEnd - p))		/// Every phone id takes at least one byte
+		return FALSE;
+	sms.PhoneId.resize( (size_t)v );
+	for (auto it = sms.PhoneId.begin(); it != sms.PhoneId.end(); ++it) {
+		if (!SmsGetVarint( p, pEnd, v ) || v > 0xffffffff)
+			return FALSE;
+		*it = (SMS_PHONE_ID)v;
+	}
+
+	if (!SmsGetVarint( p, pEnd, iLen ) || iLen > (ULONG64)(pEnd - p))
+		return FALSE;
+	sms.Text.assign( (const char*)p, (size_t)iLen );
+	p += iLen;
+
+	return TRUE;
+}
+
+
+//!++ SMSB container
+
+//++ SmsBinaryReader
+SmsBinaryReader::SmsBinaryReader():
+	m_hFile( INVALID_HANDLE_VALUE ),
+	m_hMap( NULL ),
+	m_pView( NULL ),
+	m_pHeader( NULL ),
+	m_pRecord( NULL ),
+	m_pRecordsEnd( NULL ),
+	m_iPrevTimestamp( 0 )
+{
+}
+
+SmsBinaryReader::~SmsBinaryReader()
+{
+	Close();
+}
+
+ULONG SmsBinaryReader::Open( _In_ LPCTSTR pszFile )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	Close();
+	if (!pszFile || !*pszFile)
+		return ERROR_INVALID_PARAMETER;
+
+	m_hFile = CreateFile( pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return GetLastError();
+
+	LARGE_INTEGER iFileSize;
+	if (!GetFileSizeEx( m_hFile, &iFileSize )) {
+		err = GetLastError();
+	} else if ((ULONG64)iFileSize.QuadPart < sizeof( SMSB_HEADER ) || (ULONG64)iFileSize.QuadPart > (SIZE_T)-1) {
+		err = ERROR_INVALID_DATA;
+	} else {
+		/// The whole file is mapped. 32-bit processes may run out of address space for very large files
+		if ((m_hMap = CreateFileMapping( m_hFile, NULL, PAGE_READONLY, 0, 0, NULL )) == NULL) {
+			err = GetLastError();
+		} else if ((m_pView = (const BYTE*)MapViewOfFile( m_hMap, FILE_MAP_READ, 0, 0, 0 )) == NULL) {
+			err = GetLastError();
+		}
+	}
+
+	if (err == ERROR_SUCCESS) {
+
+		const BYTE *pEnd = m_pView + iFileSize.QuadPart;
+		m_pHeader = (const SMSB_HEADER*)m_pView;
+		if (memcmp( m_pHeader->Magic, SMSB_MAGIC, SMSB_MAGIC_SIZE ) != 0 ||
+			m_pHeader->iVersion != SMSB_VERSION ||
+			m_pHeader->iDictionaryOffset < sizeof( SMSB_HEADER ) ||
+			m_pHeader->iDictionaryOffset > (ULONG64)iFileSize.QuadPart)
+		{
+			err = ERROR_INVALID_DATA;
+		}
+
+		// Dictionary
+		if (err == ERROR_SUCCESS) {
+			const BYTE *p = m_pView + m_pHeader->iDictionaryOffset;
+			ULONG64 iCount, iLen;
+			if (SmsGetVarint( p, pEnd, iCount ) && iCount <= (ULONG64)(pEnd - p)) {
+				m_Phones.reserve( (size_t)iCount );
+				for (ULONG64 i = 0; i < iCount && err == ERROR_SUCCESS; i++) {
+					if (SmsGetVarint( p, pEnd, iLen ) && iLen <= (ULONG64)(pEnd - p)) {
+						m_Phones.push_back( std::make_pair( (const char*)p, (ULONG)iLen ) );
+						p += iLen;
+					} else {
+						err = ERROR_INVALID_DATA;
+					}
+				}
+			} else {
+				err = ERROR_INVALID_DATA;
+			}
+		}
+
+		m_pRecordsEnd = m_pView + m_pHeader->iDictionaryOffset;
+		Rewind();
+	}
+
+	if (err != ERROR_SUCCESS)
+		Close();
+	return err;
+}
+
+void SmsBinaryReader::Close()
+{
+	if (m_pView)
+		UnmapViewOfFile( m_pView );
+	if (m_hMap)
+		CloseHandle( m_hMap );
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		CloseHandle( m_hFile );
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMap = NULL;
+	m_pView = NULL;
+	m_pHeader = NULL;
+	m_pRecord = m_pRecordsEnd = NULL;
+	m_iPrevTimestamp = 0;
+	m_Phones.clear();
+}
+
+const char* SmsBinaryReader::GetPhone( _In_ ULONG iId, _Out_ ULONG &iLen ) const
+{
+	if (iId >= m_Phones.size()) {
+		iLen = 0;
+		return NULL;
+	}
+	iLen = m_Phones[iId].second;
+	return m_Phones[iId].first;
+}
+
+void SmsBinaryReader::Rewind()
+{
+	m_pRecord = m_pView ? m_pView + sizeof( SMSB_HEADER ) : NULL;
+	m_iPrevTimestamp = 0;
+}
+
+ULONG SmsBinaryReader::Next( _Out_ SMSB_RECORD &Rec )
+{
+	if (!m_pView)
+		return ERROR_INVALID_HANDLE;
+	if (m_pRecord >= m_pRecordsEnd)
+		return ERROR_HANDLE_EOF;
+
+	const BYTE *p = m_pRecord, *pEnd = m_pRecordsEnd;
+	ULONG64 v, iLen;
+
+	if (!SmsGetVarint( p, pEnd, v ) || p >= pEnd)
+		return ERROR_INVALID_DATA;
+	Rec.Timestamp = m_iPrevTimestamp + (ULONG64)SmsUnZigZag( v );
+
+	BYTE iFlags = *p++;
+	Rec.IsIncoming = (iFlags & SMS_RECORD_FLAG_INCOMING) != 0;
+	Rec.IsRead = (iFlags & SMS_RECORD_FLAG_READ) != 0;
+
+	if (!SmsGetVarint( p, pEnd, v ) || v > (ULONG64)(pEnd - p))
+		return ERROR_INVALID_DATA;
+	Rec.PhoneId.resize( (size_t)v );
+	for (auto it = Rec.PhoneId.begin(); it != Rec.PhoneId.end(); ++it) {
+		if (!SmsGetVarint( p, pEnd, v ) || v >= m_Phones.size())
+			return ERROR_INVALID_DATA;
+		*it = (ULONG)v;
+	}
+
+	if (!SmsGetVarint( p, pEnd, iLen ) || iLen > (ULONG64)(pEnd - p))
+		return ERROR_INVALID_DATA;
+	Rec.pText = (const char*)p;
+	Rec.iTextLen = (ULONG)iLen;
+	p += iLen;
+
+	m_pRecord = p;
+	m_iPrevTimestamp = Rec.Timestamp;
+	return ERROR_SUCCESS;
+}
+
+
+//++ SmsBinaryWriter
+#define SMSB_MAP_GROWTH		(4 * 1024 * 1024)		/// Minimum mapping growth
+#define SMSB_NO_ID			((ULONG)-1)
+
+SmsBinaryWriter::SmsBinaryWriter( _In_ LPCTSTR pszFile ):
+	m_Output( pszFile ),
+	m_hFile( INVALID_HANDLE_VALUE ),
+	m_hMap( NULL ),
+	m_pView( NULL ),
+	m_iCapacity( 0 ),
+	m_iSize( 0 ),
+	m_iPrevTimestamp( 0 )
+{
+	ZeroMemory( &m_Header, sizeof( m_Header ) );
+}
+
+SmsBinaryWriter::~SmsBinaryWriter()
+{
+	Unmap();
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		CloseHandle( m_hFile );
+	m_Output.Discard();		/// Unless End() succeeded
+}
+
+void SmsBinaryWriter::Unmap()
+{
+	if (m_pView)
+		UnmapViewOfFile( m_pView );
+	if (m_hMap)
+		CloseHandle( m_hMap );
+	m_pView = NULL;
+	m_hMap = NULL;
+	m_iCapacity = 0;
+}
+
+ULONG SmsBinaryWriter::Remap( _In_ ULONG64 iCapacity )
+{
+	Unmap();
+	if (iCapacity > (SIZE_T)-1)
+		return ERROR_NOT_ENOUGH_MEMORY;
+	/// Mapping more than the file size extends the file
+	if ((m_hMap = CreateFileMapping( m_hFile, NULL, PAGE_READWRITE, (DWORD)(iCapacity >> 32), (DWORD)iCapacity, NULL )) == NULL)
+		return GetLastError();
+	if ((m_pView = (BYTE*)MapViewOfFile( m_hMap, FILE_MAP_WRITE, 0, 0, (SIZE_T)iCapacity )) == NULL) {
+		ULONG err = GetLastError();
+		Unmap();
+		return err;
+	}
+	m_iCapacity = iCapacity;
+	return ERROR_SUCCESS;
+}
+
+ULONG SmsBinaryWriter::Append( _In_ const void *pData, _In_ size_t iSize )
+{
+	if (m_iSize + iSize > m_iCapacity) {
+		ULONG64 iCapacity = __max( m_iCapacity * 2, m_iSize + iSize + SMSB_MAP_GROWTH );
+		ULONG err = Remap( iCapacity );
+		if (err != ERROR_SUCCESS)
+			return err;
+	}
+	CopyMemory( m_pView + m_iSize, pData, iSize );
+	m_iSize += iSize;
+	return ERROR_SUCCESS;
+}
+
+ULONG SmsBinaryWriter::Begin( _In_ ULONG iCount )
+{
+	UNREFERENCED_PARAMETER( iCount );
+	SmsTraceScope Trace( SMS_STAGE_WRITE_SMSB );
+
+	ULONG err = m_Output.Create();
+	if (err != ERROR_SUCCESS)
+		return err;
+	m_hFile = CreateFile( m_Output.GetTempFile(), GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return GetLastError();
+
+	CopyMemory( m_Header.Magic, SMSB_MAGIC, SMSB_MAGIC_SIZE );
+	m_Header.iVersion = SMSB_VERSION;
+	return Append( &m_Header, sizeof( m_Header ) );		/// Finalized in End()
+}
+
+ULONG SmsBinaryWriter::Write( _In_ const SMS &sms )
+{
+	SmsTraceScope Trace( SMS_STAGE_WRITE_SMSB );
+	SmsTraceCount( SMS_COUNTER_MESSAGES_WRITTEN, 1 );
+
+	/// Process-wide id -> Dictionary id
+	for (auto it = sms.PhoneId.begin(); it != sms.PhoneId.end(); ++it) {
+		if (*it >= m_DictionaryIds.size())
+			m_DictionaryIds.resize( *it + 1, SMSB_NO_ID );
+		if (m_DictionaryIds[*it] == SMSB_NO_ID) {
+			m_DictionaryIds[*it] = (ULONG)m_Phones.size();
+			m_Phones.push_back( *it );
+		}
+	}
+
+	m_Buf.clear();
+	SmsEncodeRecord( m_Buf, sms, m_iPrevTimestamp, &m_DictionaryIds );
+
+	m_Header.iRecordCount++;
+	m_Header.iMessageCount += (ULONG)sms.PhoneId.size();
+	return Append( m_Buf.data(), m_Buf.size() );
+}
+
+ULONG SmsBinaryWriter::End()
+{
+	ULONG err = ERROR_SUCCESS;
+	SmsTraceScope Trace( SMS_STAGE_WRITE_SMSB );
+
+	// Dictionary
+	m_Header.iDictionaryOffset = m_iSize;
+	m_Buf.clear();
+	SmsPutVarint( m_Buf, m_Phones.size() );
+	for (auto it = m_Phones.begin(); it != m_Phones.end() && err == ERROR_SUCCESS; ++it) {
+		const utf8string &sPhone = SmsPhones().Resolve( *it );
+		SmsPutVarint( m_Buf, sPhone.size() );
+		m_Buf.append( sPhone );
+		if (m_Buf.size() >= SMSB_MAP_GROWTH) {
+			err = Append( m_Buf.data(), m_Buf.size() );
+			m_Buf.clear();
+		}
+	}
+	if (err == ERROR_SUCCESS)
+		err = Append( m_Buf.data(), m_Buf.size() );
+
+	// Header
+	if (err == ERROR_SUCCESS) {
+		CopyMemory( m_pView, &m_Header, sizeof( m_Header ) );
+		if (!FlushViewOfFile( m_pView, 0 ))
+			err = GetLastError();
+	}
+
+	// Truncate the file to its actual size
+	Unmap();
+	if (err == ERROR_SUCCESS) {
+		LARGE_INTEGER iPos;
+		iPos.QuadPart = (LONGLONG)m_iSize;
+		if (!SetFilePointerEx( m_hFile, iPos, NULL, FILE_BEGIN ) || !SetEndOfFile( m_hFile ))
+			err = GetLastError();
+	}
+	CloseHandle( m_hFile );
+	m_hFile = INVALID_HANDLE_VALUE;
+
+	if (err == ERROR_SUCCESS)
+		err = m_Output.Commit();
+
+	SmsTraceCount( SMS_COUNTER_BYTES_WRITTEN, m_iSize );
+	return err;
+}
+
+
+//++ Read_SMSB
+ULONG Read_SMSB( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
+{
+	SmsListSink Sink( SmsList );
+	return Read_SMSB( pszFile, Sink );
+}
+
+ULONG Read_SMSB( _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter )
+{
+	SmsTraceScope Trace( SMS_STAGE_READ_SMSB );
+	ULONG iRecords = 0, iMessages = 0;		/// Trace counters
+
+	SmsBinaryReader Reader;
+	ULONG err = Reader.Open( pszFile );
+	if (err == ERROR_SUCCESS) {
+
+		/// Dictionary id -> Process-wide id
+		std::vector<SMS_PHONE_ID> PhoneIds( Reader.GetPhoneCount() );
+		for (ULONG i = 0; i < Reader.GetPhoneCount(); i++) {
+			ULONG iLen;
+			LPCSTR pszPhone = Reader.GetPhone( i, iLen );
+			PhoneIds[i] = SmsPhones().Intern( pszPhone, iLen );
+		}
+
+		SMSB_RECORD Rec;
+		SMS sms;
+		while ((err = Reader.Next( Rec )) == ERROR_SUCCESS) {
+			iRecords++;
+			if (pFilter && (!pFilter->TestTime( Rec.Timestamp ) || !pFilter->TestFlags( Rec.IsIncoming, Rec.IsRead )))
+				continue;
+			sms.PhoneId.clear();
+			for (size_t i = 0; i < Rec.PhoneId.size(); i++)
+				if (!pFilter || pFilter->TestPhone( PhoneIds[Rec.PhoneId[i]] ))
+					sms.PhoneId.push_back( PhoneIds[Rec.PhoneId[i]] );
+			if (pFilter && ((pFilter->HasContacts() && sms.PhoneId.empty()) || !pFilter->TestText( Rec.pText, Rec.iTextLen )))
+				continue;
+			sms.Timestamp = Rec.Timestamp;
+			sms.IsIncoming = Rec.IsIncoming;
+			sms.IsRead = Rec.IsRead;
+			sms.Text.assign( Rec.pText, Rec.iTextLen );
+			iMessages++;
+			if (!Sink.Put( sms )) {
+				err = ERROR_CANCELLED;
+				break;
+			}
+		}
+		if (err == ERROR_HANDLE_EOF)
+			err = ERROR_SUCCESS;
+	}
+
+	SmsTraceCount( SMS_COUNTER_NODES_PARSED, iRecords );
+	SmsTraceCount( SMS_COUNTER_MESSAGES_READ, iMessages );
+	return err;
+}
+
+
+//++ Write_SMSB
+ULONG Write_SMSB( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList )
+{
+	SmsBinaryWriter Writer( pszFile );
+	return SmsWriteList( Writer, SmsList );
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "SmsConvert.h"
+
+//? Compact binary encoding of SMS records
+//? Used for temporary sort runs and the SMSB container. Integers are stored as varints (LEB128), signed integers are zigzag encoded first
+
+
+//+ Varint
+inline void SmsPutVarint( _Inout_ std::string &Buf, _In_ ULONG64 v )
+{
+	while (v >= 0x80) {
+		Buf.push_back( (char)(BYTE)(v | 0x80) );
+		v >>= 7;
+	}
+	Buf.push_back( (char)(BYTE)v );
+}
+
+/// Returns FALSE if the input is truncated or malformed
+inline BOOL SmsGetVarint( _Inout_ const BYTE *&p, _In_ const BYTE *pEnd, _Out_ ULONG64 &v )
+{
+	v = 0;
+	for (int iShift = 0; p < pEnd && iShift < 64; iShift += 7) {
+		BYTE b = *p++;
+		v |= (ULONG64)(b & 0x7f) << iShift;
+		if ((b & 0x80) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+inline ULONG64 SmsZigZag( _In_ LONG64 v )		{ return ((ULONG64)v << 1) ^ (ULONG64)(v >> 63); }
+inline LONG64 SmsUnZigZag( _In_ ULONG64 v )		{ return (LONG64)(v >> 1) ^ -(LONG64)(v & 1); }
+
+
+//+ SMS record
+/// [timestamp delta][flags][phone count]{[phone id]}[length][text]
+/// Phone ids are process-wide (see SmsPhones). The record can't be read by another process
+/// The timestamp is stored as a (zigzag) delta from the previous record. Start with iPrevTimestamp = 0
+/// pPhoneMap translates the phone ids (e.g. to SMSB dictionary ids). All ids of the message must be mapped
+#define SMS_RECORD_FLAG_INCOMING	0x01
+#define SMS_RECORD_FLAG_READ		0x02
+
+void SmsEncodeRecord( _Inout_ std::string &Buf, _In_ const SMS &sms, _Inout_ ULONG64 &iPrevTimestamp, _In_opt_ const std::vector<ULONG> *pPhoneMap = NULL );
+
+/// Returns FALSE if the record is truncated or malformed
+BOOL SmsDecodeRecord( _Inout_ const BYTE *&p, _In_ const BYTE *pEnd, _Out_ SMS &sms, _Inout_ ULONG64 &iPrevTimestamp );
+
+
+//!++ SMSB container
+
+//? Layout:
+//?   SMSB_HEADER
+//?   Records    {[timestamp delta][flags][phone count]{[phone id]}[length][text]}...
+//?   Dictionary [phone count]{[length][phone]}...
+//? Phone numbers are stored once, in the dictionary. Records refer to them by index
+//? The file is accessed through a memory mapping. Text and phone numbers are read in place (zero-copy)
+
+#define SMSB_MAGIC			"SMSB"
+#define SMSB_MAGIC_SIZE		4
+#define SMSB_VERSION		1
+
+//+ SMSB_HEADER
+struct SMSB_HEADER {
+	CHAR Magic[SMSB_MAGIC_SIZE];		/// SMSB_MAGIC
+	ULONG iVersion;						/// SMSB_VERSION
+	ULONG iRecordCount;
+	ULONG iMessageCount;				/// SmsCount() of all records
+	ULONG64 iDictionaryOffset;
+	ULONG64 iReserved;
+};
+
+//+ SMSB_RECORD
+/// Zero-copy view of a record. Pointers are valid while the reader is open
+struct SMSB_RECORD {
+	SMS_TIME Timestamp;
+	bool IsIncoming;
+	bool IsRead;
+	const char *pText;					/// Not null terminated!
+	ULONG iTextLen;
+	std::vector<ULONG> PhoneId;			/// See SmsBinaryReader::GetPhone
+};
+
+
+//+ SmsBinaryReader
+class SmsBinaryReader {
+public:
+	SmsBinaryReader();
+	~SmsBinaryReader();
+
+	ULONG Open( _In_ LPCTSTR pszFile );
+	void Close();
+
+	ULONG GetRecordCount() const	{ return m_pHeader ? m_pHeader->iRecordCount : 0; }
+	ULONG GetMessageCount() const	{ return m_pHeader ? m_pHeader->iMessageCount : 0; }
+	ULONG GetPhoneCount() const		{ return (ULONG)m_Phones.size(); }
+
+	/// Zero-copy phone number. Returns NULL if the id is invalid
+	const char* GetPhone( _In_ ULONG iId, _Out_ ULONG &iLen ) const;
+
+	/// Sequential access. Returns ERROR_HANDLE_EOF after the last record
+	ULONG Next( _Out_ SMSB_RECORD &Rec );
+	void Rewind();
+
+private:
+	HANDLE m_hFile;
+	HANDLE m_hMap;
+	const BYTE *m_pView;
+	const SMSB_HEADER *m_pHeader;
+	const BYTE *m_pRecord;				/// Next record
+	const BYTE *m_pRecordsEnd;
+	ULONG64 m_iPrevTimestamp;
+	std::vector<std::pair<const char*, ULONG>> m_Phones;
+};
+
+
+//+ SmsBinaryWriter
+/// The output file is written through a memory mapping that grows as needed
+class SmsBinaryWriter: public SmsWriter {
+public:
+	SmsBinaryWriter( _In_ LPCTSTR pszFile );
+	~SmsBinaryWriter();
+
+	ULONG Begin( _In_ ULONG iCount );
+	ULONG Write( _In_ const SMS &sms );
+	ULONG End();
+
+private:
+	ULONG Append( _In_ const void *pData, _In_ size_t iSize );
+	ULONG Remap( _In_ ULONG64 iCapacity );
+	void Unmap();
+
+private:
+	SmsOutputFile m_Output;
+	HANDLE m_hFile;
+	HANDLE m_hMap;
+	BYTE *m_pView;
+	ULONG64 m_iCapacity;				/// Mapped size
+	ULONG64 m_iSize;					/// Used size
+	ULONG64 m_iPrevTimestamp;
+	SMSB_HEADER m_Header;
+	std::vector<ULONG> m_DictionaryIds;				/// Indexed by process-wide phone id
+	std::vector<SMS_PHONE_ID> m_Phones;				/// Indexed by dictionary id
+	std::string m_Buf;
+};
@@ -0,0 +1,449 @@
+#include "StdAfx.h"
+#include "SmsCheckpoint.h"
+#include "SmsFilter.h"
+#include "SmsTrace.h"
+#include <algorithm>
+
+
+//!++ SHA-256
+/// FIPS 180-4
+
+static const ULONG g_Sha256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline ULONG Ror( _In_ ULONG x, _In_ int n )		{ return (x >> n) | (x << (32 - n)); }
+
+//++ SmsSha256
+void SmsSha256::Reset()
+{
+	static const ULONG Init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	memcpy( m_State, Init, sizeof( m_State ) );
+	m_iSize = 0;
+	ZeroMemory( m_Block, sizeof( m_Block ) );
+}
+
+void SmsSha256::Transform( _In_ const BYTE *pBlock )
+{
+	ULONG w[64];
+	for (int i = 0; i < 16; i++)
+		w[i] = ((ULONG)pBlock[i * 4] << 24) | ((ULONG)pBlock[i * 4 + 1] << 16) | ((ULONG)pBlock[i * 4 + 2] << 8) | pBlock[i * 4 + 3];
+	for (int i = 16; i < 64; i++) {
+		ULONG s0 = Ror( w[i - 15], 7 ) ^ Ror( w[i - 15], 18 ) ^ (w[i - 15] >> 3);
+		ULONG s1 = Ror( w[i - 2], 17 ) ^ Ror( w[i - 2], 19 ) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	ULONG a = m_State[0], b = m_State[1], c = m_State[2], d = m_State[3], e = m_State[4], f = m_State[5], g = m_State[6], h = m_State[7];
+	for (int i = 0; i < 64; i++) {
+		ULONG t1 = h + (Ror( e, 6 ) ^ Ror( e, 11 ) ^ Ror( e, 25 )) + ((e & f) ^ (~e & g)) + g_Sha256K[i] + w[i];
+		ULONG t2 = (Ror( a, 2 ) ^ Ror( a, 13 ) ^ Ror( a, 22 )) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	m_State[0] += a; m_State[1] += b; m_State[2] += c; m_State[3] += d;
+	m_State[4] += e; m_State[5] += f; m_State[6] += g; m_State[7] += h;
+}
+
+void SmsSha256::Update( _In_ const void *pData, _In_ size_t iSize )
+{
+	const BYTE *p = (const BYTE*)pData;
+	size_t iPending = (size_t)(m_iSize % 64);
+	m_iSize += iSize;
+
+	if (iPending > 0) {
+		size_t n = __min( iSize, 64 - iPending );
+		memcpy( m_Block + iPending, p, n );
+		p += n, iSize -= n;
+		if (iPending + n < 64)
+			return;
+		Transform( m_Block );
+	}
+	for (; iSize >= 64; p += 64, iSize -= 64)
+		Transform( p );
+	memcpy( m_Block, p, iSize );
+}
+
+void SmsSha256::Final( _Out_ BYTE Digest[32] ) const
+{
+	SmsSha256 Sha( *this );
+	ULONG64 iBits = m_iSize * 8;
+
+	BYTE Pad[72] = { 0x80 };
+	size_t iPad = (size_t)((m_iSize % 64) < 56 ? 56 - (m_iSize % 64) : 120 - (m_iSize % 64));
+	for (int i = 0; i < 8; i++)
+		Pad[iPad + i] = (BYTE)(iBits >> (56 - i * 8));
+	Sha.Update( Pad, iPad + 8 );
+
+	for (int i = 0; i < 8; i++) {
+		Digest[i * 4] = (BYTE)(Sha.m_State[i] >> 24);
+		Digest[i * 4 + 1] = (BYTE)(Sha.m_State[i] >> 16);
+		Digest[i * 4 + 2] = (BYTE)(Sha.m_State[i] >> 8);
+		Digest[i * 4 + 3] = (BYTE)Sha.m_State[i];
+	}
+}
+
+
+//!++ Input
+
+#define SMSK_SCAN_SIZE		(64 * 1024)		/// Bytes examined at each end of the input, looking for the root element
+
+//+ ReadAt
+static ULONG ReadAt( _In_ HANDLE hFile, _In_ ULONG64 iOffset, _Out_ void *pBuf, _In_ ULONG iSize )
+{
+	LARGE_INTEGER iPos;
+	DWORD dwBytes;
+	iPos.QuadPart = (LONGLONG)iOffset;
+	if (!SetFilePointerEx( hFile, iPos, NULL, FILE_BEGIN ) || !ReadFile( hFile, pBuf, iSize, &dwBytes, NULL ))
+		return GetLastError();
+	return dwBytes == iSize ? ERROR_SUCCESS : ERROR_HANDLE_EOF;
+}
+
+//+ FindContent_SMSBR
+/// Locate the content of the root element: [iStart, iEnd)
+static ULONG FindContent_SMSBR( _In_ HANDLE hFile, _Out_ ULONG64 &iStart, _Out_ ULONG64 &iEnd )
+{
+	ULONG err;
+	iStart = iEnd = 0;
+
+	LARGE_INTEGER iFileSize;
+	if (!GetFileSizeEx( hFile, &iFileSize ))
+		return GetLastError();
+	ULONG64 iSize = (ULONG64)iFileSize.QuadPart;
+	ULONG iScan = (ULONG)__min( iSize, SMSK_SCAN_SIZE );
+	std::string Buf( iScan, '\0' );
+
+	/// <smses ...>
+	if ((err = ReadAt( hFile, 0, &Buf[0], iScan )) != ERROR_SUCCESS)
+		return err;
+	size_t i;
+	for (i = Buf.find( "<smses" ); i != std::string::npos; i = Buf.find( "<smses", i + 1 ))
+		if (i + 6 < Buf.size() && strchr( " \t\r\n>", Buf[i + 6] ))
+			break;
+	if (i == std::string::npos || (i = Buf.find( '>', i )) == std::string::npos || Buf[i - 1] == '/')
+		return ERROR_INVALID_DATA;
+	iStart = i + 1;
+
+	/// </smses>
+	if ((err = ReadAt( hFile, iSize - iScan, &Buf[0], iScan )) != ERROR_SUCCESS)
+		return err;
+	if ((i = Buf.rfind( "</smses" )) == std::string::npos || iSize - iScan + i < iStart)
+		return ERROR_INVALID_DATA;
+	iEnd = iSize - iScan + i;
+
+	return ERROR_SUCCESS;
+}
+
+//+ HashContent
+/// Continue hashing with the bytes [iFrom, iTo) of the file
+static ULONG HashContent( _In_ HANDLE hFile, _In_ ULONG64 iFrom, _In_ ULONG64 iTo, _Inout_ SmsSha256 &Sha )
+{
+	ULONG err = ERROR_SUCCESS;
+	std::vector<BYTE> Buf( SMSK_SCAN_SIZE );
+	for (ULONG64 i = iFrom; i < iTo && err == ERROR_SUCCESS; ) {
+		ULONG iSize = (ULONG)__min( iTo - i, Buf.size() );
+		if ((err = ReadAt( hFile, i, Buf.data(), iSize )) == ERROR_SUCCESS) {
+			Sha.Update( Buf.data(), iSize );
+			i += iSize;
+		}
+	}
+	return err;
+}
+
+//+ DigestContent
+/// SHA-256 of the first and last SMSK_SCAN_SIZE bytes of [iFrom, iTo), or of all of them if there are fewer. The middle isn't read
+static ULONG DigestContent( _In_ HANDLE hFile, _In_ ULONG64 iFrom, _In_ ULONG64 iTo, _Out_ BYTE Digest[32] )
+{
+	ULONG err;
+	SmsSha256 Sha;
+	if (iTo - iFrom <= 2 * SMSK_SCAN_SIZE) {
+		err = HashContent( hFile, iFrom, iTo, Sha );
+	} else if ((err = HashContent( hFile, iFrom, iFrom + SMSK_SCAN_SIZE, Sha )) == ERROR_SUCCESS) {
+		err = HashContent( hFile, iTo - SMSK_SCAN_SIZE, iTo, Sha );
+	}
+	if (err == ERROR_SUCCESS)
+		Sha.Final( Digest );
+	return err;
+}
+
+//+ ReadTail_SMSBR
+/// Parse the elements following iOffset, as children of an empty <smses> root
+static ULONG ReadTail_SMSBR( _In_ HANDLE hFile, _In_ ULONG64 iOffset, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter )
+{
+	const char szRoot[] = "<smses>";
+	SmsTraceScope Trace( SMS_STAGE_READ_SMSBR );
+
+	LARGE_INTEGER iFileSize;
+	if (!GetFileSizeEx( hFile, &iFileSize ))
+		return GetLastError();
+	if ((ULONG64)iFileSize.QuadPart - iOffset >= MAXDWORD - sizeof( szRoot ))
+		return ERROR_FILE_TOO_LARGE;
+
+	ULONG iSize = (ULONG)((ULONG64)iFileSize.QuadPart - iOffset);
+	std::vector<char> Xml;
+	try {
+		Xml.resize( sizeof( szRoot ) - 1 + iSize + 1 );
+	} catch (const std::bad_alloc&) {
+		return ERROR_NOT_ENOUGH_MEMORY;
+	}
+	memcpy( Xml.data(), szRoot, sizeof( szRoot ) - 1 );
+	ULONG err = ReadAt( hFile, iOffset, Xml.data() + sizeof( szRoot ) - 1, iSize );
+	if (err == ERROR_SUCCESS) {
+		SmsTraceCount( SMS_COUNTER_BYTES_READ, iSize );
+		Xml.back() = '\0';
+		err = Parse_SMSBR( Xml.data(), Sink, pFilter, Xml.size() );
+	}
+	return err;
+}
+
+//+ NewestSink
+/// Forwards messages, remembering the newest timestamp and the digests of the messages that have it
+/// Messages found in Skip (converted before, with the previous newest timestamp) are dropped
+class NewestSink: public SmsSink {
+public:
+	NewestSink( _In_ SmsSink &Sink, _In_ SMS_TIME iNewest, _In_ const std::vector<SMSK_DIGEST> &Newest, _In_ const std::vector<SMSK_DIGEST> &Skip ):
+		m_Sink( Sink ), m_iNewest( iNewest ), m_Newest( Newest ), m_iSkip( iNewest ), m_Skip( Skip ) {}
+	BOOL Put( _Inout_ SMS &sms )
+	{
+		if (sms.Timestamp >= m_iNewest || (sms.Timestamp == m_iSkip && !m_Skip.empty())) {
+			SMSK_DIGEST Digest;
+			SmsMessageDigest( sms, Digest );
+			if (sms.Timestamp == m_iSkip && std::binary_search( m_Skip.begin(), m_Skip.end(), Digest ))
+				return TRUE;		/// Converted already
+			if (sms.Timestamp > m_iNewest) {
+				m_iNewest = sms.Timestamp;
+				m_Newest.clear();
+			}
+			if (sms.Timestamp == m_iNewest) {
+				auto it = std::lower_bound( m_Newest.begin(), m_Newest.end(), Digest );
+				if (it == m_Newest.end() || Digest < *it)
+					m_Newest.insert( it, Digest );
+			}
+		}
+		return m_Sink.Put( sms );
+	}
+	SMS_TIME GetNewest() const { return m_iNewest; }
+	const std::vector<SMSK_DIGEST>& GetNewestDigests() const { return m_Newest; }
+private:
+	SmsSink &m_Sink;
+	SMS_TIME m_iNewest;
+	std::vector<SMSK_DIGEST> m_Newest;		/// Sorted
+	SMS_TIME m_iSkip;
+	const std::vector<SMSK_DIGEST> &m_Skip;	/// Sorted
+};
+
+
+//++ SmsMessageDigest
+void SmsMessageDigest( _In_ const SMS &sms, _Out_ SMSK_DIGEST &Digest )
+{
+	SmsSha256 Sha;
+	BYTE Flags[2] = { (BYTE)sms.IsIncoming, (BYTE)sms.IsRead };
+	ULONG64 iLen = sms.Text.size();
+	Sha.Update( &sms.Timestamp, sizeof( sms.Timestamp ) );
+	Sha.Update( Flags, sizeof( Flags ) );
+	Sha.Update( &iLen, sizeof( iLen ) );
+	Sha.Update( sms.Text.data(), sms.Text.size() );
+	for (auto it = sms.PhoneId.begin(); it != sms.PhoneId.end(); ++it) {
+		const utf8string &Phone = SmsPhones().Resolve( *it );
+		Sha.Update( Phone.c_str(), Phone.size() + 1 );		/// NULL separated
+	}
+	Sha.Final( Digest.Bytes );
+}
+
+
+//!++ SmsCheckpoint
+
+//++ SmsCheckpointFile
+void SmsCheckpointFile( _In_ LPCTSTR pszOutput, _Out_ LPTSTR pszCheckpoint, _In_ ULONG iLen )
+{
+	StringCchPrintf( pszCheckpoint, iLen, _T( "%s%s" ), pszOutput, SMSK_EXTENSION );
+}
+
+//++ SmsCheckpoint
+SmsCheckpoint::SmsCheckpoint()
+{
+	Clear();
+}
+
+void SmsCheckpoint::Clear()
+{
+	ZeroMemory( &m_Data, sizeof( m_Data ) );
+	m_Newest.clear();
+	m_bInput = m_bOutput = FALSE;
+}
+
+ULONG SmsCheckpoint::Load( _In_ LPCTSTR pszOutput )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	Clear();
+	if (!pszOutput || !*pszOutput)
+		return ERROR_INVALID_PARAMETER;
+
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if (!GetFileAttributesEx( pszOutput, GetFileExInfoStandard, &fad ))
+		return GetLastError();
+
+	TCHAR szCheckpoint[MAX_PATH];
+	SmsCheckpointFile( pszOutput, szCheckpoint, ARRAYSIZE( szCheckpoint ) );
+	HANDLE hFile = CreateFile( szCheckpoint, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
+	if (hFile == INVALID_HANDLE_VALUE)
+		return GetLastError();
+
+	DWORD dwBytes;
+	if (!ReadFile( hFile, &m_Data, sizeof( m_Data ), &dwBytes, NULL )) {
+		err = GetLastError();
+	} else if (dwBytes != sizeof( m_Data ) ||
+		memcmp( m_Data.Magic, SMSK_MAGIC, SMSK_MAGIC_SIZE ) != 0 ||
+		m_Data.iVersion != SMSK_VERSION ||
+		m_Data.iOutputContent > m_Data.iOutputResume ||
+		m_Data.iOutputResume >= m_Data.iOutputSize ||
+		m_Data.iInputNewestCount > SMSK_MAX_DIGESTS ||
+		m_Data.iOutputSize != (((ULONG64)fad.nFileSizeHigh << 32) | fad.nFileSizeLow) ||
+		CompareFileTime( &m_Data.OutputTime, &fad.ftLastWriteTime ) != 0)		/// The output was modified
+	{
+		err = ERROR_INVALID_DATA;
+	} else {
+		m_Newest.resize( m_Data.iInputNewestCount );
+		DWORD dwSize = (DWORD)(m_Newest.size() * sizeof( SMSK_DIGEST ));
+		if (dwSize > 0 && !ReadFile( hFile, m_Newest.data(), dwSize, &dwBytes, NULL )) {
+			err = GetLastError();
+		} else if (dwSize > 0 && dwBytes != dwSize) {
+			err = ERROR_INVALID_DATA;
+		} else if (!std::is_sorted( m_Newest.begin(), m_Newest.end() )) {
+			err = ERROR_INVALID_DATA;
+		}
+	}
+	CloseHandle( hFile );
+
+	if (err == ERROR_SUCCESS) {
+		m_bInput = m_bOutput = TRUE;
+	} else {
+		Clear();
+	}
+	return err;
+}
+
+ULONG SmsCheckpoint::Save( _In_ LPCTSTR pszOutput )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	if (!pszOutput || !*pszOutput)
+		return ERROR_INVALID_PARAMETER;
+
+	TCHAR szCheckpoint[MAX_PATH];
+	SmsCheckpointFile( pszOutput, szCheckpoint, ARRAYSIZE( szCheckpoint ) );
+
+	if (!m_bInput || !m_bOutput) {
+		DeleteFile( szCheckpoint );		/// It would describe an older output
+		return ERROR_NOT_SUPPORTED;
+	}
+
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if (!GetFileAttributesEx( pszOutput, GetFileExInfoStandard, &fad ))
+		return GetLastError();
+
+	memcpy( m_Data.Magic, SMSK_MAGIC, SMSK_MAGIC_SIZE );
+	m_Data.iVersion = SMSK_VERSION;
+	m_Data.iOutputSize = ((ULONG64)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+	m_Data.OutputTime = fad.ftLastWriteTime;
+	m_Data.iInputNewestCount = (ULONG)m_Newest.size();
+
+	HANDLE hFile = CreateFile( szCheckpoint, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (hFile == INVALID_HANDLE_VALUE)
+		return GetLastError();
+	DWORD dwBytes;
+	if (!WriteFile( hFile, &m_Data, sizeof( m_Data ), &dwBytes, NULL ) ||
+		(!m_Newest.empty() && !WriteFile( hFile, m_Newest.data(), (DWORD)(m_Newest.size() * sizeof( SMSK_DIGEST )), &dwBytes, NULL )))
+		err = GetLastError();
+	CloseHandle( hFile );
+
+	if (err != ERROR_SUCCESS)
+		DeleteFile( szCheckpoint );
+	return err;
+}
+
+void SmsCheckpoint::SetOutput( _In_ ULONG iType, _In_ ULONG64 iContent, _In_ ULONG64 iResume )
+{
+	m_Data.iOutputType = iType;
+	m_Data.iOutputContent = iContent;
+	m_Data.iOutputResume = iResume;
+	m_bOutput = TRUE;
+}
+
+ULONG SmsCheckpoint::Read( _In_ ULONG iType, _In_ LPCTSTR pszInput, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	if (!pszInput || !*pszInput)
+		return ERROR_INVALID_PARAMETER;
+
+	static const std::vector<SMSK_DIGEST> None;
+	BOOL bResume = m_bInput && m_Data.iInputType == iType;
+
+	/// Root content of the new input
+	HANDLE hFile = INVALID_HANDLE_VALUE;
+	ULONG64 iStart = 0, iEnd = 0;
+	BOOL bContent = FALSE;
+	if (iType == 2) {
+		hFile = CreateFile( pszInput, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
+		if (hFile == INVALID_HANDLE_VALUE)
+			return GetLastError();
+		bContent = (FindContent_SMSBR( hFile, iStart, iEnd ) == ERROR_SUCCESS);
+	}
+
+	/// Does the new content start with the converted content? Both ends of it are compared, the cost doesn't grow with the history (see SMSK_FILE::InputDigest)
+	/// Then the digest of the new content, for the next checkpoint
+	BYTE Digest[32];
+	BOOL bPrefix = FALSE;
+	if (bContent) {
+		if (bResume && m_Data.iInputContent > 0 && m_Data.iInputContent <= iEnd - iStart)
+			bPrefix = (DigestContent( hFile, iStart, iStart + m_Data.iInputContent, Digest ) == ERROR_SUCCESS && memcmp( Digest, m_Data.InputDigest, sizeof( Digest ) ) == 0);
+		if (DigestContent( hFile, iStart, iEnd, Digest ) != ERROR_SUCCESS)
+			bContent = FALSE;
+	}
+
+	/// Messages with the checkpoint's timestamp are read again, unless the input continues after the converted content
+	NewestSink Newest( Sink, bResume ? m_Data.iInputNewest : SMS_TIME_MIN, bResume ? m_Newest : None, (bResume && !bPrefix) ? m_Newest : None );
+	if (!bResume) {
+
+		// Everything
+		err = SmsRead( iType, pszInput, Newest, pFilter );
+
+	} else if (bPrefix) {
+
+		// The content that follows the converted content
+		err = ReadTail_SMSBR( hFile, iStart + m_Data.iInputContent, Newest, pFilter );
+
+	} else {
+
+		// Messages as new as the checkpoint, or newer. The ones converted already are skipped
+		SmsFilter Newer( pFilter ? *pFilter : SmsFilter() );
+		Newer.NarrowTimeRange( m_Data.iInputNewest, SMS_TIME_MAX );
+		err = SmsRead( iType, pszInput, Newest, &Newer );
+	}
+
+	/// The new input position
+	if (err == ERROR_SUCCESS) {
+		m_Data.iInputType = iType;
+		m_Data.iInputNewest = Newest.GetNewest();
+		m_Newest = Newest.GetNewestDigests();
+		m_Data.iInputContent = 0;
+		if (bContent && iEnd > iStart) {
+			m_Data.iInputContent = iEnd - iStart;
+			memcpy( m_Data.InputDigest, Digest, sizeof( Digest ) );
+		}
+		m_bInput = TRUE;
+	}
+
+	if (hFile != INVALID_HANDLE_VALUE)
+		CloseHandle( hFile );
+	return err;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "SmsConvert.h"
+
+//? Incremental conversion of growing backups
+//? A checkpoint remembers how far the input was converted and where the output can be continued. The next conversion reads only the new messages and merges them into the output
+//? Input: SMSBR backups are expected to grow at the tail. The checkpoint stores the length of the converted content (the root element's children) and a digest of its ends
+//?   If the new backup starts with the same content, only the bytes that follow are parsed. Otherwise (and for the other formats) the whole backup is read, keeping the messages
+//?   newer than the newest converted one, and the ones as old as it that weren't converted (the checkpoint keeps a digest of each message with the newest timestamp)
+//? Output: the writer rewrites the document in a temporary file, merging the existing messages with the new ones (see SmsWriter::Resume). The order of the output is preserved
+//?   Not incremental: CMBK messages are stored newest first, so the new ones go before the existing ones, and the .hsh hash covers the whole file. Writer_CMBK hashes
+//?   the document as it writes it, the output isn't read back
+
+//+ SmsSha256
+/// Plain SHA-256. The state can be saved at any point (it's a flat structure) and resumed later
+class SmsSha256 {
+public:
+	SmsSha256() { Reset(); }
+	void Reset();
+	void Update( _In_ const void *pData, _In_ size_t iSize );
+	void Final( _Out_ BYTE Digest[32] ) const;		/// The state isn't altered. More data can follow
+	ULONG64 GetSize() const { return m_iSize; }		/// Bytes hashed so far
+private:
+	void Transform( _In_ const BYTE *pBlock );
+private:
+	ULONG m_State[8];
+	ULONG64 m_iSize;
+	BYTE m_Block[64];		/// Pending bytes (m_iSize % 64)
+};
+
+
+//!++ SMSK checkpoint file
+//? Stored next to the output, as "<output>.smsk"
+//? The checkpoint remembers the size and time of the output it describes. If the output was modified since, the checkpoint refuses to load
+
+#define SMSK_MAGIC			"SMSK"
+#define SMSK_MAGIC_SIZE		4
+#define SMSK_VERSION		3
+#define SMSK_EXTENSION		_T( ".smsk" )
+#define SMSK_MAX_DIGESTS	(1024 * 1024)		/// Sanity limit of iInputNewestCount
+
+//+ SMSK_DIGEST
+/// SHA-256 of a message (see SmsMessageDigest)
+struct SMSK_DIGEST {
+	BYTE Bytes[32];
+	bool operator<( const SMSK_DIGEST &second ) const { return memcmp( Bytes, second.Bytes, sizeof( Bytes ) ) < 0; }
+};
+
+//+ SMSK_FILE
+/// Followed by iInputNewestCount SMSK_DIGEST-s
+struct SMSK_FILE {
+	CHAR Magic[SMSK_MAGIC_SIZE];		/// SMSK_MAGIC
+	ULONG iVersion;						/// SMSK_VERSION
+	ULONG iInputType;
+	ULONG64 iInputContent;				/// Bytes of the root element's content converted so far. 0 if the input can't be resumed (not SMSBR)
+	BYTE InputDigest[32];				/// SHA-256 of the first and last 64 KiB of those bytes (all of them, if shorter). An edit in between, that keeps the length, goes unnoticed
+	SMS_TIME iInputNewest;				/// Newest converted message
+	ULONG iInputNewestCount;			/// Converted messages with the iInputNewest timestamp
+	ULONG iOutputType;
+	ULONG64 iOutputSize;				/// Size of the output
+	FILETIME OutputTime;				/// Last write time of the output
+	ULONG64 iOutputContent;				/// Where the output's messages start
+	ULONG64 iOutputResume;				/// Where they end (the trailer starts here)
+};
+
+//+ SmsMessageDigest
+/// SHA-256 of a message's timestamp, flags, text and phone numbers. Phone ids are resolved, the digest doesn't depend on the process
+void SmsMessageDigest( _In_ const SMS &sms, _Out_ SMSK_DIGEST &Digest );
+
+//+ SmsCheckpointFile
+/// Output file -> Checkpoint file
+void SmsCheckpointFile( _In_ LPCTSTR pszOutput, _Out_ LPTSTR pszCheckpoint, _In_ ULONG iLen );
+
+
+//+ SmsCheckpoint
+/// Usage: Load() the checkpoint of an existing output (optional), read with Read(), write with SmsWriter::Resume() or Begin(), then SmsWriter::Record() and Save()
+/// SmsPipeline does the reading and writing part (see SmsPipeline::SetCheckpoint)
+/// Save only after a successful conversion. Read() and Record() update the checkpoint as they go
+class SmsCheckpoint {
+public:
+	SmsCheckpoint();
+
+	/// Returns ERROR_INVALID_DATA if the checkpoint is damaged, or the output was modified since
+	ULONG Load( _In_ LPCTSTR pszOutput );
+	/// Returns ERROR_NOT_SUPPORTED if the output can't be resumed (a stale checkpoint file is deleted)
+	ULONG Save( _In_ LPCTSTR pszOutput );
+	void Clear();
+
+	BOOL HasOutput() const { return m_bOutput; }		/// Loaded, or recorded by the writer. The output can be resumed
+	ULONG GetInputType() const { return m_Data.iInputType; }
+
+	/// Read the messages that are new since the checkpoint (all messages, if it wasn't loaded). Then record the new input position
+	ULONG Read( _In_ ULONG iType, _In_ LPCTSTR pszInput, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter = NULL );
+
+	//+ Output, used by the writers
+	ULONG GetOutputType() const { return m_Data.iOutputType; }
+	ULONG64 GetOutputContent() const { return m_Data.iOutputContent; }
+	ULONG64 GetOutputResume() const { return m_Data.iOutputResume; }
+	void SetOutput( _In_ ULONG iType, _In_ ULONG64 iContent, _In_ ULONG64 iResume );
+
+private:
+	SMSK_FILE m_Data;
+	std::vector<SMSK_DIGEST> m_Newest;		/// Digests of the converted messages with the iInputNewest timestamp, sorted
+	BOOL m_bInput, m_bOutput;
+};
@@ -4,6 +4,13 @@
 
 #include "StdAfx.h"
 #include "SmsConvert.h"
+#include "SmsBinary.h"
+#include "SmsFilter.h"
+#include "SmsCheckpoint.h"
+#include "SmsTrace.h"
+#include "SmsParse.h"
+#include "SmsFormat.h"
+#include "SmsTimeZone.h"
 #include <algorithm>
 #include "rapidxml\rapidxml.hpp"
 #include "rapidxml\rapidxml_utils.hpp"
@@ -28,22 +35,380 @@ VOID SmsSetAppName( _In_ LPCSTR pszName )
 }
 
 
+//++ SmsPhoneTable
+SmsPhoneTable::SmsPhoneTable()
+{
+	InitializeSRWLock( &m_Lock );
+}
+
+SMS_PHONE_ID SmsPhoneTable::Intern( _In_ LPCSTR pszPhone, _In_ size_t iLen )
+{
+	std::string sPhone( pszPhone, iLen );
+	SMS_PHONE_ID iId;
+
+	/// Most numbers are already known
+	AcquireSRWLockShared( &m_Lock );
+	auto it = m_Ids.find( sPhone );
+	BOOL bFound = (it != m_Ids.end());
+	if (bFound)
+		iId = it->second;
+	ReleaseSRWLockShared( &m_Lock );
+
+	if (!bFound) {
+		AcquireSRWLockExclusive( &m_Lock );
+		auto ins = m_Ids.insert( std::make_pair( sPhone, (SMS_PHONE_ID)m_Phones.size() ) );
+		if (ins.second) {
+			m_Phones.push_back( utf8string() );
+			m_Phones.back().assign( pszPhone, iLen );
+		}
+		iId = ins.first->second;
+		ReleaseSRWLockExclusive( &m_Lock );
+	}
+	return iId;
+}
+
+const utf8string& SmsPhoneTable::Resolve( _In_ SMS_PHONE_ID iId )
+{
+	AcquireSRWLockShared( &m_Lock );
+	assert( iId < m_Phones.size() );
+	const utf8string &sPhone = m_Phones[iId];
+	ReleaseSRWLockShared( &m_Lock );
+	return sPhone;
+}
+
+ULONG SmsPhoneTable::GetCount()
+{
+	AcquireSRWLockShared( &m_Lock );
+	ULONG n = (ULONG)m_Phones.size();
+	ReleaseSRWLockShared( &m_Lock );
+	return n;
+}
+
+SmsPhoneTable& SmsPhones()
+{
+	static SmsPhoneTable Table;		/// Thread safe initialization (C++11)
+	return Table;
+}
+
+
 //++ SmsCount
 ULONG SmsCount( const SMS_LIST &SmsList )
 {
 	ULONG n = 0;
 	for (auto it = SmsList.begin(); it != SmsList.end(); ++it)
-		n += (ULONG)it->PhoneNo.size();
+		n += (ULONG)it->PhoneId.size();
 	return n;
 }
 
 
+//!++ XML documents
+/// Parsed documents need 2-4 times the size of the file in rapidxml nodes and attributes (CMBK is the denser type)
+/// The pool is pre-sized with a conservative estimate, up to XML_POOL_RESERVE_MAX. Any shortfall is allocated in geometrically growing blocks (up to RAPIDXML_MAX_DYNAMIC_POOL_SIZE each)
+/// A large contiguous block may not be available (e.g. in 32-bit processes). If the reservation fails, the pool just grows block by block
+
+#define XML_POOL_RESERVE_MAX			((size_t)256 * 1024 * 1024)
+#define XML_POOL_ESTIMATE(iFileSize)	((size_t)__min( (ULONG64)(iFileSize) * 2, XML_POOL_RESERVE_MAX ))
+
+static SRWLOCK g_XmlLock = SRWLOCK_INIT;
+static LONG g_iXmlRetain = 0;
+static std::vector<rapidxml::xml_document<>*> g_XmlDocs;		/// Idle documents, kept in batch mode
+
+//+ XmlDocument
+/// Parser document borrowed from the cache (or created) for the lifetime of the object
+/// In batch mode the document is reset and returned to the cache, keeping its memory pool for the next file
+class XmlDocument {
+public:
+	XmlDocument( _In_ size_t iReserve ) {
+		m_pDoc = NULL;
+		AcquireSRWLockExclusive( &g_XmlLock );
+		if (!g_XmlDocs.empty()) {
+			m_pDoc = g_XmlDocs.back();
+			g_XmlDocs.pop_back();
+		}
+		ReleaseSRWLockExclusive( &g_XmlLock );
+		if (!m_pDoc) {
+			m_pDoc = new rapidxml::xml_document<>;
+			if (SmsTracing())
+				m_pDoc->set_allocator( SmsTracePoolAlloc, SmsTracePoolFree );
+		}
+		try {
+			m_pDoc->reserve( iReserve );
+		} catch (const std::bad_alloc&) {
+			/// No single block that large. Parsing allocates smaller ones
+		}
+	}
+	~XmlDocument() {
+		m_pDoc->reset();
+		AcquireSRWLockExclusive( &g_XmlLock );
+		if (g_iXmlRetain > 0) {
+			g_XmlDocs.push_back( m_pDoc );
+			m_pDoc = NULL;
+		}
+		ReleaseSRWLockExclusive( &g_XmlLock );
+		delete m_pDoc;
+	}
+	rapidxml::xml_document<>& operator*() { return *m_pDoc; }
+private:
+	rapidxml::xml_document<> *m_pDoc;
+};
+
+
+//++ SmsXmlRetain
+void SmsXmlRetain( _In_ BOOL bRetain )
+{
+	std::vector<rapidxml::xml_document<>*> Docs;
+	AcquireSRWLockExclusive( &g_XmlLock );
+	if (bRetain) {
+		g_iXmlRetain++;
+	} else if (g_iXmlRetain > 0 && --g_iXmlRetain == 0) {
+		Docs.swap( g_XmlDocs );
+	}
+	ReleaseSRWLockExclusive( &g_XmlLock );
+	for (auto it = Docs.begin(); it != Docs.end(); ++it)
+		delete *it;
+}
+
+
+//!++ CSV detection
+
+#define CSV_SNIFF_RECORDS		8					/// Records validated by IsNokiaCsv
+#define SNIFF_PREFIX_SIZE		(64 * 1024)			/// File prefix examined by SmsSniffFileType and NokiaCsvSummary. Also the buffer of the streaming count
+
+//++ ReadPrefix
+/// Reads the first SNIFF_PREFIX_SIZE bytes of the file (fewer if the file is shorter) into Buf, followed by a null terminator
+/// bEof is TRUE if the prefix is the whole file
+static ULONG ReadPrefix( _In_ HANDLE h, _Out_ std::vector<char> &Buf, _Out_ DWORD &iBytes, _Out_ BOOL &bEof )
+{
+	Buf.resize( SNIFF_PREFIX_SIZE + 1 );
+	iBytes = 0;
+	bEof = FALSE;
+	if (!ReadFile( h, Buf.data(), SNIFF_PREFIX_SIZE, &iBytes, NULL ))
+		return GetLastError();
+	Buf[iBytes] = ANSI_NULL;
+	bEof = (iBytes < SNIFF_PREFIX_SIZE);
+	return ERROR_SUCCESS;
+}
+
+//++ IsNokiaCsv
+/// Validates the records of a file prefix with a minimal CSV state machine (quoted fields, doubled quotes, CR/LF line breaks)
+/// Nokia Suite records have 8 fields, and the first one is "sms". Records before the first one (headers, other item types) are skipped
+/// From there on, up to CSV_SNIFF_RECORDS records are examined. A record cut by the end of the prefix is not (unless bEof)
+/// Nothing is copied or allocated
+static BOOL IsNokiaCsv( _In_ const char *p, _In_ size_t iLen, _In_ BOOL bEof )
+{
+	const char *pEnd = p + iLen;
+	if (iLen >= 3 && (BYTE)p[0] == 0xEF && (BYTE)p[1] == 0xBB && (BYTE)p[2] == 0xBF)
+		p += 3;		/// UTF-8 BOM
+
+	ULONG iRecords = 0;
+	while (iRecords < CSV_SNIFF_RECORDS) {
+
+		while (p < pEnd && (*p == '\r' || *p == '\n'))
+			p++;		/// Empty lines
+		if (p == pEnd)
+			break;
+
+		ULONG iFields = 0;
+		BOOL bSms = FALSE, bEndOfRecord = FALSE;
+		while (!bEndOfRecord) {
+
+			while (p < pEnd && (*p == ' ' || *p == '\t'))
+				p++;
+			const char *pField = p;
+			size_t iFieldLen;
+			if (p < pEnd && *p == '"') {
+				/// Quoted field. It ends at a quote that isn't doubled
+				for (pField = ++p; p < pEnd; p++) {
+					if (*p == '"') {
+						if (p + 1 < pEnd && p[1] == '"')
+							p++;
+						else
+							break;
+					}
+				}
+				if (p == pEnd || (p + 1 == pEnd && !bEof))
+					return iRecords > 0;		/// Cut by the end of the prefix
+				iFieldLen = p++ - pField;
+				while (p < pEnd && *p != ',' && *p != '\r' && *p != '\n')
+					p++;						/// Garbage after the closing quote is tolerated, like libcsv does
+			} else {
+				while (p < pEnd && *p != ',' && *p != '\r' && *p != '\n')
+					p++;
+				for (iFieldLen = p - pField; iFieldLen > 0 && (pField[iFieldLen - 1] == ' ' || pField[iFieldLen - 1] == '\t'); iFieldLen--) {}
+			}
+
+			if (iFields++ == 0)
+				bSms = (iFieldLen == 3 && EqualStrNA( pField, "sms", 3 ));
+
+			if (p == pEnd) {
+				if (!bEof)
+					return iRecords > 0;		/// Cut by the end of the prefix
+				bEndOfRecord = TRUE;
+			} else if (*p == ',') {
+				p++;
+			} else {
+				bEndOfRecord = TRUE;
+			}
+		}
+
+		if (iRecords == 0 && (iFields != 8 || !bSms))
+			continue;		/// Not an sms record yet. Keep looking
+		if (iFields != 8)
+			return FALSE;
+		iRecords++;
+	}
+
+	return iRecords > 0;
+}
+
+//++ NokiaCsvSummary
+/// Nokia Suite CSV files are recognized from their first records, without loading the file. iType remains 0 for other files
+/// Messages are counted only if bCount, in a streaming pass over the prefix buffer (SNIFF_PREFIX_SIZE). Otherwise iMessageCount is SMS_COUNT_UNKNOWN
+static ULONG NokiaCsvSummary( _In_ LPCTSTR pszFile, _In_ BOOL bCount, _Out_ ULONG &iType, _Out_ ULONG &iMessageCount, _In_opt_ const volatile LONG *pbCancel )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	HANDLE h = CreateFile( pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if (h == INVALID_HANDLE_VALUE)
+		return GetLastError();
+
+	std::vector<char> Buf;
+	DWORD iBytes = 0;
+	BOOL bEof = FALSE;
+	if ((err = ReadPrefix( h, Buf, iBytes, bEof )) != ERROR_SUCCESS) {
+
+		/// ReadFile failed
+
+	} else if (IsNokiaCsv( Buf.data(), iBytes, bEof )) {
+
+		iType = 3;		/// Nokia Suite CSV
+		iMessageCount = SMS_COUNT_UNKNOWN;
+
+		if (bCount) {
+
+			typedef struct {
+				int iCurFields;
+				ULONG iRecords;
+				const volatile LONG *pbCancel;
+			} CTX;
+			CTX ctx = {0};
+			ctx.pbCancel = pbCancel;
+
+			auto OnField = []( void *s, size_t len, void *pParam )
+			{
+				CTX *pctx = (CTX*)pParam;
+				if (pctx->pbCancel && *pctx->pbCancel)
+					return;		/// Cancelled. Let libcsv run dry
+				if (pctx->iCurFields == 0) {
+					if (len == 3 && EqualStrNA( (LPCSTR)s, "sms", 3 )) {
+						/// First field OK ("sms")
+					} else {
+						pctx->iCurFields = -1;			/// Invalidate current record
+					}
+				}
+				if (pctx->iCurFields >= 0)
+					pctx->iCurFields++;
+			};
+			auto OnRecord = []( int ch, void *pParam )
+			{
+				CTX *pctx = (CTX*)pParam;
+				if (pctx->iCurFields == 8)			/// Valid records only
+					pctx->iRecords++;
+				pctx->iCurFields = 0;
+			};
+
+			/// Records may span chunks. libcsv keeps the state between calls
+			struct csv_parser csv;
+			csv_init( &csv, 0 );
+			while (iBytes > 0) {
+				SmsTraceCount( SMS_COUNTER_BYTES_READ, iBytes );
+				if (csv_parse( &csv, Buf.data(), iBytes, OnField, OnRecord, &ctx ) != iBytes) {
+					csv_strerror( csv_error( &csv ) );
+					err = ERROR_INVALID_DATA;
+					break;
+				}
+				if (pbCancel && *pbCancel) {
+					err = ERROR_CANCELLED;
+					break;
+				}
+				if (!ReadFile( h, Buf.data(), SNIFF_PREFIX_SIZE, &iBytes, NULL )) {
+					err = GetLastError();
+					break;
+				}
+			}
+			csv_fini( &csv, NULL, NULL, NULL );
+			csv_free( &csv );
+
+			if (err == ERROR_SUCCESS) {
+				iMessageCount = ctx.iRecords;
+			} else {
+				iType = 0;
+				iMessageCount = 0;
+			}
+		}
+	}
+
+	CloseHandle( h );
+	return err;
+}
+
+
+//++ SmsSniffFileType
+ULONG SmsSniffFileType( _In_ LPCTSTR pszFile, _Out_ ULONG &iType )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	if (!pszFile || !*pszFile)
+		return ERROR_INVALID_PARAMETER;
+
+	iType = 0;
+
+	HANDLE h = CreateFile( pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if (h != INVALID_HANDLE_VALUE) {
+
+		/// The same prefix as NokiaCsvSummary, so that both recognize the same CSV files
+		std::vector<char> Buf;
+		DWORD iBytes = 0;
+		BOOL bEof = FALSE;
+		if ((err = ReadPrefix( h, Buf, iBytes, bEof )) == ERROR_SUCCESS) {
+
+			LPCSTR psz = Buf.data();
+			if (iBytes >= 3 && (BYTE)psz[0] == 0xEF && (BYTE)psz[1] == 0xBB && (BYTE)psz[2] == 0xBF)
+				psz += 3;		/// UTF-8 BOM
+			while (*psz == ' ' || *psz == '\t' || *psz == '\r' || *psz == '\n')
+				psz++;
+
+			if (iBytes >= SMSB_MAGIC_SIZE && memcmp( Buf.data(), SMSB_MAGIC, SMSB_MAGIC_SIZE ) == 0) {
+				iType = 4;		/// sms_w2a binary
+			} else if (*psz == '<') {
+				/// XML. The root element follows the declaration, comments and processing instructions
+				if (StrStrA( psz, "<ArrayOfMessage" )) {
+					iType = 1;
+				} else if (StrStrA( psz, "<smses" )) {
+					iType = 2;
+				}
+			} else if (IsNokiaCsv( Buf.data(), iBytes, bEof )) {
+				iType = 3;
+			}
+		}
+		CloseHandle( h );
+
+	} else {
+		err = GetLastError();		/// CreateFile
+	}
+
+	return err;
+}
+
+
 //++ SmsGetFileSummary
 ULONG SmsGetFileSummary(
 	_In_ LPCTSTR pszFile,
-	_Out_ ULONG &iType,					/// 0=Unknown, 1=CMBK, 2=SMSBR, 3=NOKIA
+	_Out_ ULONG &iType,					/// 0=Unknown, 1=CMBK, 2=SMSBR, 3=NOKIA, 4=SMSB
 	_Out_ ULONG &iMessageCount,
-	_Out_ std::string &sComments
+	_Out_ std::string &sComments,
+	_In_opt_ const volatile LONG *pbCancel,
+	_In_ BOOL bCount
 )
 {
 	ULONG err = ERROR_SUCCESS;
@@ -55,15 +420,41 @@ ULONG SmsGetFileSummary(
 	iMessageCount = 0;
 	sComments.clear();
 
+	SmsTraceScope Trace( SMS_STAGE_SUMMARY );
+
+	#define SUMMARY_CANCELLED() (pbCancel && *pbCancel)
+	if (SUMMARY_CANCELLED())
+		return ERROR_CANCELLED;
+
+	// Binary type
+	SmsBinaryReader Binary;
+	if (Binary.Open( pszFile ) == ERROR_SUCCESS) {
+		iType = 4;
+		iMessageCount = Binary.GetMessageCount();
+		return ERROR_SUCCESS;
+	}
+
+	// CSV types. Recognized before the XML types: the DOM would load the whole file only to fail on the first character
+	if ((err = NokiaCsvSummary( pszFile, bCount, iType, iMessageCount, pbCancel )) != ERROR_SUCCESS || iType != 0)
+		return err;
+	if (SUMMARY_CANCELLED())
+		return ERROR_CANCELLED;
+
 	// XML types
 	try {
 
 		CHAR szFileA[MAX_PATH];
 		WideCharToMultiByte( CP_ACP, 0, pszFile, -1, szFileA, ARRAYSIZE( szFileA ), NULL, NULL );
 		rapidxml::file<> FileObj( szFileA );
+		SmsTraceCount( SMS_COUNTER_BYTES_READ, FileObj.size() );
+		if (SUMMARY_CANCELLED())
+			return ERROR_CANCELLED;
 
-		rapidxml::xml_document<> Doc;
+		XmlDocument CachedDoc( 0 );		/// No reservation. The summary parses the file once, in the background
+		rapidxml::xml_document<> &Doc = *CachedDoc;
 		Doc.parse<rapidxml::parse_comment_nodes>( FileObj.data() );
+		if (SUMMARY_CANCELLED())
+			return ERROR_CANCELLED;
 
 		rapidxml::xml_node<> *Root;
 		if ((Root = Doc.first_node( "ArrayOfMessage" ))) {
@@ -101,61 +492,13 @@ ULONG SmsGetFileSummary(
 		UNREFERENCED_PARAMETER( e );
 		///e.what();
 		err = ERROR_INVALID_DATA;
+	} catch (const std::bad_alloc&) {
+		err = ERROR_NOT_ENOUGH_MEMORY;
 	} catch (...) {
 		err = ERROR_INVALID_DATA;
 	}
 
-	// CSV types
-	if (iType == 0) {
-
-		utf8string s;
-		if (s.LoadFromFile( pszFile ) == ERROR_SUCCESS) {
-
-			typedef struct {
-				int iCurFields;
-				ULONG iRecords;
-			} CTX;
-			CTX ctx = {0};
-
-			struct csv_parser csv;
-			csv_init( &csv, 0 );
-			if (csv_parse(
-				&csv,
-				s.c_str(), s.size(),
-				[]( void *s, size_t len, void *pParam )
-				{
-					CTX *pctx = (CTX*)pParam;
-					if (pctx->iCurFields == 0) {
-						if (len == 3 && EqualStrNA( (LPCSTR)s, "sms", 3 )) {
-							/// First field OK ("sms")
-						} else {
-							pctx->iCurFields = -1;			/// Invalidate current record
-						}
-					}
-					if (pctx->iCurFields >= 0)
-						pctx->iCurFields++;
-				},
-				[]( int ch, void *pParam )
-				{
-					CTX *pctx = (CTX*)pParam;
-					if (pctx->iCurFields == 8)			/// Valid records only
-						pctx->iRecords++;
-					pctx->iCurFields = 0;
-				},
-				&ctx ) == s.size())
-			{
-				if (ctx.iRecords > 0) {
-					iType = 3;		/// Nokia Suite CSV
-					iMessageCount = ctx.iRecords;
-				}
-
-			} else {
-				csv_strerror( csv_error( &csv ) );
-			}
-			csv_fini( &csv, NULL, NULL, NULL );
-		}
-	}
-
+	#undef SUMMARY_CANCELLED
 	return err;
 }
 
@@ -167,44 +510,93 @@ LPCSTR SmsFormatStr( _In_ ULONG iType )
 		case 1: return "contact+messages backup";
 		case 2: return "SMS Backup & Restore";
 		case 3: return "Nokia Suite (exported messages)";
+		case 4: return "sms_w2a binary";
 	}
 	return NULL;
 }
 
 
-//!++ FILETIME <-> POSIX
-
-//? NOTES:
-//? * FILETIME is represented as 100ns intervals from 1 Jan 1601 (Windows epoch)
-//? * POSIX time is usually represented as *microseconds* (see struct timeval {} in BSD headers) from 1 Jan 1970 (Unix epoch)
-//? * Android messages are stored as *milliseconds* from 1 Jan 1970
-//? (Marius)
-
-//? LEGEND:
-//? * Seconds       1
-//? * Milliseconds  1000
-//? * Microseconds  1000000
-//? * Nanoseconds   1000000000
+//++ ExpandEntities
+/// Documents are parsed without entity translation, so that messages rejected by a filter are never decoded
+/// This is the deferred translation of a single value, done in place. It matches rapidxml's own (&amp; &apos; &quot; &gt; &lt; &#...;)
+/// Returns the new length. The value is null terminated
+static size_t ExpandEntities( _Inout_ char *pszValue, _In_ size_t iLen )
+{
+	const unsigned char *digits = rapidxml::internal::lookup_tables<0>::lookup_digits;
+	char *src = pszValue, *end = pszValue + iLen;
 
-//? LINKS:
-//? * https://en.wikipedia.org/wiki/Unix_time
-//? * http://stackoverflow.com/questions/6161776/convert-windows-filetime-to-second-in-unix-linux
-//? * http://stackoverflow.com/questions/3585583/convert-unix-linux-time-to-windows-filetime
+	/// Nothing to do, usually
+	while (src < end && *src != '&')
+		src++;
 
-#define EPOCH_DIFFms (11644473600LL * 1000LL)		/// Milliseconds(1/1/1970 - 1/1/1601)
+	char *dest = src;
 
-time_t FILETIME_to_POSIXms( FILETIME ft )
-{
-	time_t tm = *(time_t*)&ft / 10000;				/// 100ns -> ms
-	tm -= EPOCH_DIFFms;								/// Win epoch -> Unix epoch
-	return tm;
-}
+	while (src < end) {
+		if (*src == '&') {
+			switch (src[1]) {
+				case 'a':
+					if (src[2] == 'm' && src[3] == 'p' && src[4] == ';') {
+						*dest++ = '&', src += 5;
+						continue;
+					}
+					if (src[2] == 'p' && src[3] == 'o' && src[4] == 's' && src[5] == ';') {
+						*dest++ = '\'', src += 6;
+						continue;
+					}
+					break;
+				case 'q':
+					if (src[2] == 'u' && src[3] == 'o' && src[4] == 't' && src[5] == ';') {
+						*dest++ = '"', src += 6;
+						continue;
+					}
+					break;
+				case 'g':
+					if (src[2] == 't' && src[3] == ';') {
+						*dest++ = '>', src += 4;
+						continue;
+					}
+					break;
+				case 'l':
+					if (src[2] == 't' && src[3] == ';') {
+						*dest++ = '<', src += 4;
+						continue;
+					}
+					break;
+				case '#':
+				{
+					ULONG iCode = 0, iBase = (src[2] == 'x' ? 16 : 10);
+					for (src += (iBase == 16 ? 3 : 2); digits[(BYTE)*src] != 0xFF; src++)
+						iCode = iCode * iBase + digits[(BYTE)*src];
+					/// UTF-8. Surrogates are encoded individually, same as rapidxml
+					if (iCode < 0x80) {
+						*dest++ = (char)iCode;
+					} else if (iCode < 0x800) {
+						*dest++ = (char)(0xC0 | (iCode >> 6));
+						*dest++ = (char)(0x80 | (iCode & 0x3F));
+					} else if (iCode < 0x10000) {
+						*dest++ = (char)(0xE0 | (iCode >> 12));
+						*dest++ = (char)(0x80 | ((iCode >> 6) & 0x3F));
+						*dest++ = (char)(0x80 | (iCode & 0x3F));
+					} else if (iCode < 0x110000) {
+						*dest++ = (char)(0xF0 | (iCode >> 18));
+						*dest++ = (char)(0x80 | ((iCode >> 12) & 0x3F));
+						*dest++ = (char)(0x80 | ((iCode >> 6) & 0x3F));
+						*dest++ = (char)(0x80 | (iCode & 0x3F));
+					} else {
+						throw rapidxml::parse_error( "invalid numeric character entity", src );
+					}
+					if (*src != ';')
+						throw rapidxml::parse_error( "expected ;", src );
+					src++;
+					continue;
+				}
+			}
+		}
+		*dest++ = *src++;
+	}
 
-FILETIME POSIXms_to_FILETIME( time_t tm )
-{
-	tm += EPOCH_DIFFms;								/// Unix epoch -> Win epoch
-	tm *= 10000;									/// ms -> 100ns
-	return *(FILETIME*)&tm;
+	*dest = 0;
+	return dest - pszValue;
 }
 
 
@@ -234,72 +626,169 @@ FILETIME POSIXms_to_FILETIME( time_t tm )
 ///		</Message>
 ///	</ArrayOfMessage>
 
+//+ CMBK_FIELD
+/// <Message> children used by the reader
+enum CMBK_FIELD {
+	CMBK_FIELD_BODY,
+	CMBK_FIELD_INCOMING,
+	CMBK_FIELD_READ,
+	CMBK_FIELD_TIME,
+	CMBK_FIELD_SENDER,
+	CMBK_FIELD_RECIPIENTS,
+	CMBK_FIELD_COUNT
+};
+
+//++ XmlNameIs
+/// Case insensitive, same as rapidxml's first_node( name, 0, false ). The length of the literal is known at compile time
+template<size_t N>
+static inline bool XmlNameIs( _In_ const char *pszName, _In_ size_t iLen, _In_ const char (&szLiteral)[N] )
+{
+	return iLen == N - 1 && rapidxml::internal::compare( pszName, iLen, szLiteral, N - 1, false );
+}
+
+//++ CmbkField
+/// Node name -> CMBK_FIELD, or -1 if not used
+/// The name length and first letter select a single candidate, confirmed by one comparison
+/// The app writes the misspelled "Recepients". The correct spelling is accepted too
+static int CmbkField( _In_ const char *pszName, _In_ size_t iLen )
+{
+	switch (iLen) {
+		case 4:
+			return XmlNameIs( pszName, iLen, "Body" ) ? CMBK_FIELD_BODY : -1;
+		case 6:
+			switch (pszName[0] | 0x20) {
+				case 'i': return XmlNameIs( pszName, iLen, "IsRead" ) ? CMBK_FIELD_READ : -1;
+				case 's': return XmlNameIs( pszName, iLen, "Sender" ) ? CMBK_FIELD_SENDER : -1;
+			}
+			break;
+		case 10:
+			switch (pszName[0] | 0x20) {
+				case 'i': return XmlNameIs( pszName, iLen, "IsIncoming" ) ? CMBK_FIELD_INCOMING : -1;
+				case 'r': return (XmlNameIs( pszName, iLen, "Recepients" ) || XmlNameIs( pszName, iLen, "Recipients" )) ? CMBK_FIELD_RECIPIENTS : -1;
+			}
+			break;
+		case 14:
+			return XmlNameIs( pszName, iLen, "LocalTimestamp" ) ? CMBK_FIELD_TIME : -1;
+	}
+	return -1;
+}
+
 //++ Read_CMBK
 ULONG Read_CMBK( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
+{
+	SmsListSink Sink( SmsList );
+	return Read_CMBK( pszFile, Sink );
+}
+
+ULONG Read_CMBK( _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter )
 {
 	ULONG err = ERROR_SUCCESS;
+	ULONG iNodes = 0, iMessages = 0;		/// Trace counters
 
 	if (!pszFile || !*pszFile)
 		return ERROR_INVALID_PARAMETER;
 
+	SmsTraceScope Trace( SMS_STAGE_READ_CMBK );
+
 	try {
 
 		CHAR szFileA[MAX_PATH];
 		WideCharToMultiByte( CP_ACP, 0, pszFile, -1, szFileA, ARRAYSIZE( szFileA ), NULL, NULL );
 		rapidxml::file<> FileObj( szFileA );
+		SmsTraceCount( SMS_COUNTER_BYTES_READ, FileObj.size() );
 
-		rapidxml::xml_document<> Doc;
-		Doc.parse<0>( FileObj.data() );
+		XmlDocument CachedDoc( XML_POOL_ESTIMATE( FileObj.size() ) );
+		rapidxml::xml_document<> &Doc = *CachedDoc;
+		Doc.parse<rapidxml::parse_no_entity_translation>( FileObj.data() );		/// See ExpandEntities
 
 		rapidxml::xml_node<> *Root = Doc.first_node( "ArrayOfMessage" );
 		if (Root) {
 
+			SMS prev;			/// The previous message, to remove duplicates
+			BOOL bPrev = FALSE;
+
 			for (auto n = Root->first_node( "Message", 0, false ); n; n = n->next_sibling( "Message", 0, false )) {
 
-				rapidxml::xml_node<> *NodeBody = n->first_node( "Body", 0, false );
-				rapidxml::xml_node<> *NodeIn = n->first_node( "IsIncoming", 0, false );
-				rapidxml::xml_node<> *NodeRead = n->first_node( "IsRead", 0, false );
-				rapidxml::xml_node<> *NodeTime = n->first_node( "LocalTimestamp", 0, false );
-				rapidxml::xml_node<> *NodeFrom = n->first_node( "Sender", 0, false );
-				rapidxml::xml_node<> *NodeTo = n->first_node( "Recepients", 0, false );
+				iNodes++;
+
+				/// Single walk of the children. The first occurrence of each name wins (same as first_node)
+				rapidxml::xml_node<> *Fields[CMBK_FIELD_COUNT] = {NULL};
+				int iFound = 0;
+				for (auto c = n->first_node(); c && iFound < CMBK_FIELD_COUNT; c = c->next_sibling()) {
+					int i = CmbkField( c->name(), c->name_size() );
+					if (i >= 0 && !Fields[i]) {
+						Fields[i] = c;
+						iFound++;
+					}
+				}
+				rapidxml::xml_node<> *NodeBody = Fields[CMBK_FIELD_BODY];
+				rapidxml::xml_node<> *NodeIn = Fields[CMBK_FIELD_INCOMING];
+				rapidxml::xml_node<> *NodeRead = Fields[CMBK_FIELD_READ];
+				rapidxml::xml_node<> *NodeTime = Fields[CMBK_FIELD_TIME];
+				rapidxml::xml_node<> *NodeFrom = Fields[CMBK_FIELD_SENDER];
+				rapidxml::xml_node<> *NodeTo = Fields[CMBK_FIELD_RECIPIENTS];
 
 				if (NodeIn && NodeBody) {
 					
 					SMS sms;
 
-					sms.IsIncoming = EqualStrA( NodeIn->value(), "true" );
-					sms.Text = NodeBody->value();
-					sms.Text.StripLF();
-					sms.IsRead = NodeRead ? EqualStrA( NodeRead->value(), "true" ) : true;
+					sms.IsIncoming = SmsSpanIs( NodeIn->value(), NodeIn->value_size(), "true" );
+					sms.IsRead = NodeRead ? SmsSpanIs( NodeRead->value(), NodeRead->value_size(), "true" ) : true;
 					
-					if (NodeTime) {
-						StrToInt64ExA( NodeTime->value(), STIF_DEFAULT, (PLONGLONG)&sms.Timestamp );
-					} else {
-						sms.Timestamp.dwHighDateTime = sms.Timestamp.dwLowDateTime = 0;
+					int64_t iTicks = 0;
+					if (NodeTime && !SmsParseInt( NodeTime->value(), NodeTime->value_size(), iTicks )) {
+						SmsTraceCount( SMS_COUNTER_RECORDS_SKIPPED, 1 );		/// Out of range. Skip the message, keep converting
+						continue;
 					}
+					sms.Timestamp = (SMS_TIME)iTicks;
+
+					if (pFilter && (!pFilter->TestTime( sms.Timestamp ) || !pFilter->TestFlags( sms.IsIncoming, sms.IsRead )))
+						continue;
 
 					if (sms.IsIncoming && NodeFrom) {
 
-						sms.PhoneNo.push_back( NodeFrom->value() );
+						SMS_PHONE_ID iPhone = SmsPhones().Intern( NodeFrom->value(), ExpandEntities( NodeFrom->value(), NodeFrom->value_size() ) );
+						if (!pFilter || pFilter->TestPhone( iPhone ))
+							sms.PhoneId.push_back( iPhone );
 
 					} else if (!sms.IsIncoming && NodeTo) {
 
 						/// Multiple recepients
-						for (auto to = NodeTo->first_node( "string", 0, false ); to; to = to->next_sibling( "string", 0, false ))
-							sms.PhoneNo.push_back( to->value() );
+						for (auto to = NodeTo->first_node( "string", 0, false ); to; to = to->next_sibling( "string", 0, false )) {
+							SMS_PHONE_ID iPhone = SmsPhones().Intern( to->value(), ExpandEntities( to->value(), to->value_size() ) );
+							if (!pFilter || pFilter->TestPhone( iPhone ))
+								sms.PhoneId.push_back( iPhone );
+						}
 
 					} else {
 						/// Malformed/Incomplete node
 						continue;
 					}
 
-					SmsList.push_back( sms );
+					if (pFilter && pFilter->HasContacts() && sms.PhoneId.empty())
+						continue;
+
+					size_t iBodyLen = ExpandEntities( NodeBody->value(), NodeBody->value_size() );
+					if (pFilter && !pFilter->TestText( NodeBody->value(), iBodyLen ))
+						continue;
+
+					sms.Text = NodeBody->value();
+					sms.Text.StripLF();
+
+					// Remove duplicates
+					if (bPrev && sms == prev)
+						continue;
+					prev = sms;
+					bPrev = TRUE;
+
+					iMessages++;
+					if (!Sink.Put( sms )) {
+						err = ERROR_CANCELLED;
+						break;
+					}
 				}
 			}
 
-			// Remove duplicates
-			SmsList.erase( std::unique( SmsList.begin(), SmsList.end() ), SmsList.end() );
-
 		} else {
 			err = ERROR_INVALID_DATA;
 		}
@@ -308,179 +797,546 @@ ULONG Read_CMBK( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 		UNREFERENCED_PARAMETER( e );
 		///e.what();
 		err = ERROR_INVALID_DATA;
+	} catch (const std::bad_alloc&) {
+		err = ERROR_NOT_ENOUGH_MEMORY;
 	} catch (...) {
 		err = ERROR_INVALID_DATA;
 	}
 
+	SmsTraceCount( SMS_COUNTER_NODES_PARSED, iNodes );
+	SmsTraceCount( SMS_COUNTER_MESSAGES_READ, iMessages );
 	return err;
 }
 
 
-//++ Write_CMBK
-ULONG Write_CMBK( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList )
+//++ SmsOutputFile
+SmsOutputFile::SmsOutputFile( _In_ LPCTSTR pszFile )
 {
-	ULONG err = ERROR_SUCCESS;
-
-	if (!pszFile || !*pszFile)
-		return ERROR_INVALID_PARAMETER;
+	StringCchCopy( m_szFile, ARRAYSIZE( m_szFile ), pszFile ? pszFile : _T( "" ) );
+	m_szTempFile[0] = 0;
+}
 
-	try {
+ULONG SmsOutputFile::Create()
+{
+	Discard();
+
+	/// Same directory, same volume: the final move is a rename
+	TCHAR szDir[MAX_PATH];
+	StringCchCopy( szDir, ARRAYSIZE( szDir ), m_szFile );
+	PathRemoveFileSpec( szDir );
+	if (!*szDir)
+		StringCchCopy( szDir, ARRAYSIZE( szDir ), _T( "." ) );
+
+	if (!GetTempFileName( szDir, _T( "sms" ), 0, m_szTempFile )) {
+		m_szTempFile[0] = 0;
+		return GetLastError();
+	}
+	return ERROR_SUCCESS;
+}
 
-		rapidxml::xml_document<> Doc;
-		rapidxml::xml_node<> *Root, *Node, *SubNode;
-		CHAR szBuf[255];
+ULONG SmsOutputFile::Commit()
+{
+	if (!*m_szTempFile)
+		return ERROR_INVALID_HANDLE;
+	if (!MoveFileEx( m_szTempFile, m_szFile, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH ))
+		return GetLastError();
+	m_szTempFile[0] = 0;
+	return ERROR_SUCCESS;
+}
 
-		Node = Doc.allocate_node( rapidxml::node_declaration );
-		Node->append_attribute( Doc.allocate_attribute( "version", "1.0" ) );
-		Node->append_attribute( Doc.allocate_attribute( "encoding", "UTF-8" ) );
-		Node->append_attribute( Doc.allocate_attribute( "standalone", "yes" ) );
-		Doc.append_node( Node );
+void SmsOutputFile::Discard()
+{
+	if (*m_szTempFile)
+		DeleteFile( m_szTempFile );
+	m_szTempFile[0] = 0;
+}
 
-		SYSTEMTIME st;
-		GetLocalTime( &st );
-		StringCchPrintfA(
-			szBuf, ARRAYSIZE( szBuf ),
-			" File created by %s on %hu/%02hu/%02hu %02hu:%02hu:%02hu ",
-			g_szAppName,
-			st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond
-		);
-		Doc.append_node( Doc.allocate_node( rapidxml::node_comment, "", Doc.allocate_string( szBuf ) ) );
-		Doc.append_node( Doc.allocate_node( rapidxml::node_comment, "", " " SMS_APP_LINK " " ) );
 
-		// Root node
-		Root = Doc.allocate_node( rapidxml::node_element, "ArrayOfMessage" );
-		Doc.append_node( Root );
+//++ SmsWriteList
+ULONG SmsWriteList( _In_ SmsWriter &Writer, _In_ const SMS_LIST &SmsList )
+{
+	ULONG err = Writer.Begin( SmsCount( SmsList ) );
+	for (auto it = SmsList.begin(); it != SmsList.end() && err == ERROR_SUCCESS; ++it)
+		err = Writer.Write( *it );
+	if (err == ERROR_SUCCESS)
+		err = Writer.End();
+	return err;
+}
 
-		// SMS nodes
-		for (auto it = SmsList.begin(); it != SmsList.end(); ++it) {
 
-			Root->append_node( (Node = Doc.allocate_node( rapidxml::node_element, "Message" )) );
+static ULONG Encode_CMBK_Hash( _In_ const BYTE Digest[32], _Out_ utf8string &Hash );
 
-			Node->append_node( (SubNode = Doc.allocate_node( rapidxml::node_element, "Recepients" )) );
-			if (!it->IsIncoming) {
-				for (auto to = it->PhoneNo.begin(); to != it->PhoneNo.end(); to++)
-					SubNode->append_node( Doc.allocate_node( rapidxml::node_element, "string", *to ) );
-			}
+#define CMBK_ROOT_BEGIN "<ArrayOfMessage>\n"
+#define CMBK_ROOT_END "</ArrayOfMessage>"
 
-			Node->append_node( Doc.allocate_node( rapidxml::node_element, "Body", it->Text ) );
-			Node->append_node( Doc.allocate_node( rapidxml::node_element, "IsIncoming", it->IsIncoming ? "true" : "false" ) );
-			Node->append_node( Doc.allocate_node( rapidxml::node_element, "IsRead", it->IsRead ? "true" : "false" ) );
-			Node->append_node( Doc.allocate_node( rapidxml::node_element, "Attachments" ) );
+//++ CmbkMessageReader
+/// Reads the <Message> elements printed by Writer_CMBK, one at a time, as they are. Their timestamps are parsed, nothing else
+/// Text can't contain a literal "</Message>" (it's escaped), so the elements are found without parsing the document
+class CmbkMessageReader {
+public:
+	CmbkMessageReader(): m_iLeft( 0 ), m_iPos( 0 ), m_Timestamp( 0 ) {}
 
-			StringCchPrintfA( szBuf, ARRAYSIZE( szBuf ), "%I64u", it->Timestamp );
-			Node->append_node( Doc.allocate_node( rapidxml::node_element, "LocalTimestamp", Doc.allocate_string( szBuf ) ) );
+	/// The messages are in [iFrom, iTo) of the file. The text before iFrom is copied to Prolog
+	ULONG Open( _In_ LPCTSTR pszFile, _In_ ULONG64 iFrom, _In_ ULONG64 iTo, _Out_ std::string &Prolog )
+	{
+		CHAR szFileA[MAX_PATH];
+		WideCharToMultiByte( CP_UTF8, 0, pszFile, -1, szFileA, ARRAYSIZE( szFileA ), NULL, NULL );
+		m_fin.open( szFileA, std::ios::in | std::ios::binary );
+		if (!m_fin.is_open())
+			return ERROR_OPEN_FAILED;
+		Prolog.resize( (size_t)iFrom );
+		if (!m_fin.read( &Prolog[0], Prolog.size() ))
+			return ERROR_INVALID_DATA;
+		StripCR( Prolog );
+		m_iLeft = iTo - iFrom;
+		m_Buf.clear(), m_iPos = 0;
+		return Next();
+	}
 
-			Node->append_node( Doc.allocate_node( rapidxml::node_element, "Sender", it->IsIncoming ? (it->PhoneNo.empty() ? "" : it->PhoneNo.front()) : "" ) );
+	void Close() { if (m_fin.is_open()) m_fin.close(); m_iLeft = 0; m_Buf.clear(); m_iPos = 0; m_Message.clear(); }
+
+	BOOL HasMessage() const { return !m_Message.empty(); }
+	const std::string& GetElement() const { return m_Message; }		/// The whole element, including its indentation and line break
+	SMS_TIME GetTimestamp() const { return m_Timestamp; }
+
+	/// Advance to the next message. HasMessage() is FALSE at the end
+	ULONG Next()
+	{
+		static const char szEnd[] = "</Message>";
+		static const char szTime[] = "<LocalTimestamp>";
+		m_Message.clear();
+
+		size_t i;
+		while ((i = m_Buf.find( szEnd, m_iPos )) == std::string::npos || (i = m_Buf.find( '\n', i )) == std::string::npos) {
+			if (m_iLeft == 0)
+				return m_iPos < m_Buf.size() ? ERROR_INVALID_DATA : ERROR_SUCCESS;		/// Trailing garbage
+			m_Buf.erase( 0, m_iPos ), m_iPos = 0;
+			size_t iSize = m_Buf.size(), iMore = (size_t)__min( m_iLeft, 64 * 1024 );
+			m_Buf.resize( iSize + iMore );
+			if (!m_fin.read( &m_Buf[iSize], iMore ))
+				return ERROR_INVALID_DATA;
+			m_iLeft -= iMore;
 		}
+		m_Message.assign( m_Buf, m_iPos, i + 1 - m_iPos );
+		m_iPos = i + 1;
+		StripCR( m_Message );
+
+		size_t t = m_Message.find( szTime );
+		if (t == std::string::npos)
+			return ERROR_INVALID_DATA;
+		t += sizeof( szTime ) - 1;
+		int64_t iTicks;
+		if (!SmsParseInt( m_Message.c_str() + t, m_Message.find( '<', t ) - t, iTicks ))
+			return ERROR_INVALID_DATA;
+		m_Timestamp = (SMS_TIME)iTicks;
+		return ERROR_SUCCESS;
+	}
 
-		// xml -> File
+	/// The file has "\r\n" line breaks. "\r\n" -> "\n", CmbkOutputBuf puts the '\r' back
+	static void StripCR( _Inout_ std::string &Str )
+	{
+		size_t j = 0;
+		for (size_t i = 0; i < Str.size(); i++)
+			if (Str[i] != '\r' || i + 1 == Str.size() || Str[i + 1] != '\n')
+				Str[j++] = Str[i];
+		Str.resize( j );
+	}
+
+private:
+	std::ifstream m_fin;
+	ULONG64 m_iLeft;			/// Bytes not read yet
+	std::string m_Buf;
+	size_t m_iPos;				/// Unused data starts here
+	std::string m_Message;
+	SMS_TIME m_Timestamp;
+};
+
+//++ CmbkOutputBuf
+/// Stream buffer of Writer_CMBK. Line breaks are written as "\r\n", like a Windows text stream does
+/// The bytes are hashed on their way to the file, the .hsh hash is ready when the file is closed
+class CmbkOutputBuf: public std::streambuf {
+public:
+	CmbkOutputBuf(): m_iPos( 0 ) { setp( m_Put, m_Put + ARRAYSIZE( m_Put ) ); }
+	~CmbkOutputBuf() { Close(); }
+
+	BOOL Open( _In_ LPCTSTR pszFile )
+	{
 		CHAR szFileA[MAX_PATH];
 		WideCharToMultiByte( CP_UTF8, 0, pszFile, -1, szFileA, ARRAYSIZE( szFileA ), NULL, NULL );
-		std::ofstream fout( szFileA );
-		if (!fout.bad()) {
+		m_Sha.Reset();
+		m_iPos = 0;
+		setp( m_Put, m_Put + ARRAYSIZE( m_Put ) );
+		return m_File.open( szFileA, std::ios::out | std::ios::binary | std::ios::trunc ) != NULL;
+	}
+
+	/// Returns FALSE if a write failed
+	BOOL Close()
+	{
+		if (!m_File.is_open())
+			return TRUE;
+		BOOL bOk = Drain();
+		return (m_File.close() != NULL) && bOk;
+	}
 
-			rapidxml::print( std::ostream_iterator<char>( fout ), Doc, rapidxml::print_no_surrogate_expansion );
-			fout.close();
+	const SmsSha256& GetHash() const { return m_Sha; }		/// The bytes written to the file so far
 
-			// Generate the hash file (.hsh) required by "contacts+message backup"
+protected:
+	int_type overflow( int_type c )
+	{
+		if (!Drain())
+			return traits_type::eof();
+		if (!traits_type::eq_int_type( c, traits_type::eof() )) {
+			*pptr() = traits_type::to_char_type( c );
+			pbump( 1 );
+		}
+		return traits_type::not_eof( c );
+	}
+
+	int sync() { return Drain() ? 0 : -1; }
+
+	/// tellp() only. The position is in file bytes, line breaks included
+	pos_type seekoff( off_type iOffset, std::ios_base::seekdir Dir, std::ios_base::openmode Which )
+	{
+		if (iOffset != 0 || Dir != std::ios_base::cur || !(Which & std::ios_base::out) || !Drain())
+			return pos_type( off_type( -1 ) );
+		return pos_type( (off_type)m_iPos );
+	}
+
+private:
+	/// Put area -> file
+	BOOL Drain()
+	{
+		m_Out.clear();
+		for (const char *p = pbase(); p < pptr(); p++) {
+			if (*p == '\n')
+				m_Out.push_back( '\r' );
+			m_Out.push_back( *p );
+		}
+		setp( m_Put, m_Put + ARRAYSIZE( m_Put ) );
+		m_Sha.Update( m_Out.data(), m_Out.size() );
+		m_iPos += m_Out.size();
+		return m_File.is_open() && m_File.sputn( m_Out.data(), (std::streamsize)m_Out.size() ) == (std::streamsize)m_Out.size();
+	}
+
+private:
+	std::filebuf m_File;
+	char m_Put[64 * 1024];		/// Put area, as printed
+	std::string m_Out;			/// As written
+	ULONG64 m_iPos;				/// Bytes written to the file
+	SmsSha256 m_Sha;
+};
+
+//++ Writer_CMBK
+/// Streaming "contacts+message backup" writer
+/// Messages are printed one by one, the output is identical to printing the whole document at once
+/// A previous output can be continued (see Resume). Its messages are merged with the new ones, newest first (the order of CMBK backups)
+/// The whole document is rewritten then, since the new messages go first. The .hsh hash is computed as the document is written (see CmbkOutputBuf)
+class Writer_CMBK: public SmsWriter {
+public:
+
+	Writer_CMBK( _In_ LPCTSTR pszFile ): m_Output( pszFile ), m_fout( &m_Buf ), m_bRootOpen( FALSE ), m_bDone( FALSE ), m_iContent( 0 ), m_iResume( 0 )
+	{
+	}
+
+	~Writer_CMBK()
+	{
+		m_Buf.Close();
+		m_Output.Discard();		/// Unless End() succeeded
+	}
+
+	ULONG Begin( _In_ ULONG iCount )
+	{
+		ULONG err = ERROR_SUCCESS;
+		UNREFERENCED_PARAMETER( iCount );		/// Not needed
+		SmsTraceScope Trace( SMS_STAGE_WRITE_CMBK );
+
+		if ((err = m_Output.Create()) != ERROR_SUCCESS)
+			return err;
+
+		try {
+
+			if (m_Buf.Open( m_Output.GetTempFile() )) {
+
+				rapidxml::xml_document<> Doc;
+				rapidxml::xml_node<> *Node;
+				CHAR szBuf[255];
+
+				Node = Doc.allocate_node( rapidxml::node_declaration );
+				Node->append_attribute( Doc.allocate_attribute( "version", "1.0" ) );
+				Node->append_attribute( Doc.allocate_attribute( "encoding", "UTF-8" ) );
+				Node->append_attribute( Doc.allocate_attribute( "standalone", "yes" ) );
+				Doc.append_node( Node );
+
+				SYSTEMTIME st;
+				GetLocalTime( &st );
+				StringCchPrintfA(
+					szBuf, ARRAYSIZE( szBuf ),
+					" File created by %s on %hu/%02hu/%02hu %02hu:%02hu:%02hu ",
+					g_szAppName,
+					st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond
+				);
+				Doc.append_node( Doc.allocate_node( rapidxml::node_comment, "", Doc.allocate_string( szBuf ) ) );
+				Doc.append_node( Doc.allocate_node( rapidxml::node_comment, "", " " SMS_APP_LINK " " ) );
+
+				/// Print the prolog without the document's trailing line break. It follows the root element (see End)
+				rapidxml::internal::print_children( std::ostream_iterator<char>( m_fout ), &Doc, rapidxml::print_no_surrogate_expansion, 0 );
+
+			} else {
+				err = ERROR_OPEN_FAILED;
+			}
+
+		} catch (...) {
+			err = ERROR_INVALID_DATA;
+		}
+
+		return err;
+	}
+
+	ULONG Resume( _In_ const SmsCheckpoint &Checkpoint )
+	{
+		ULONG err = ERROR_SUCCESS;
+
+		if (Checkpoint.GetOutputType() != 1)
+			return ERROR_NOT_SUPPORTED;
+
+		SmsTraceScope Trace( SMS_STAGE_WRITE_CMBK );
+
+		/// The existing messages must be where the checkpoint says. They are merged with the new ones as they're written
+		/// The document is rewritten in the temporary file. The existing output is replaced in End()
+		std::string Prolog;
+		if ((err = m_Output.Create()) != ERROR_SUCCESS)
+			return err;
+		if ((err = m_Existing.Open( m_Output.GetFile(), Checkpoint.GetOutputContent(), Checkpoint.GetOutputResume(), Prolog )) != ERROR_SUCCESS)
+			return err;
+		if (Prolog.size() < sizeof( CMBK_ROOT_BEGIN ) - 1 || Prolog.compare( Prolog.size() - (sizeof( CMBK_ROOT_BEGIN ) - 1), std::string::npos, CMBK_ROOT_BEGIN ) != 0)
+			return ERROR_INVALID_DATA;
+
+		if (m_Buf.Open( m_Output.GetTempFile() )) {
+			m_fout << Prolog;
+			m_bRootOpen = TRUE;
+			m_iContent = Prolog.size();
+		} else {
+			err = ERROR_OPEN_FAILED;
+		}
+
+		return err;
+	}
+
+	/// Existing messages as new as iTimestamp, or newer, go first
+	ULONG WriteExisting( _In_ SMS_TIME iTimestamp )
+	{
+		ULONG err = ERROR_SUCCESS;
+		while (m_Existing.HasMessage() && m_Existing.GetTimestamp() >= iTimestamp && err == ERROR_SUCCESS) {
+			m_fout << m_Existing.GetElement();
+			err = m_Existing.Next();
+		}
+		return err;
+	}
+
+	ULONG Write( _In_ const SMS &sms )
+	{
+		ULONG err = ERROR_SUCCESS;
+		SmsTraceScope Trace( SMS_STAGE_WRITE_CMBK );
+		SmsTraceCount( SMS_COUNTER_MESSAGES_WRITTEN, 1 );
+
+		try {
+
+			rapidxml::xml_node<> *Node, *SubNode;
+			CHAR szBuf[50];
+
+			// Root node
+			if (!m_bRootOpen) {
+				m_fout << CMBK_ROOT_BEGIN;
+				m_bRootOpen = TRUE;
+				m_iContent = (ULONG64)m_fout.tellp();
+			}
+
+			if ((err = WriteExisting( sms.Timestamp )) != ERROR_SUCCESS)
+				return err;
+
+			// SMS node
+			m_Doc.reset();		/// Recycle the memory pool
+
+			Node = m_Doc.allocate_node( rapidxml::node_element, "Message" );
+
+			Node->append_node( (SubNode = m_Doc.allocate_node( rapidxml::node_element, "Recepients" )) );
+			if (!sms.IsIncoming) {
+				for (auto to = sms.PhoneId.begin(); to != sms.PhoneId.end(); to++)
+					SubNode->append_node( m_Doc.allocate_node( rapidxml::node_element, "string", SmsPhones().Resolve( *to ) ) );
+			}
+
+			Node->append_node( m_Doc.allocate_node( rapidxml::node_element, "Body", sms.Text ) );
+			Node->append_node( m_Doc.allocate_node( rapidxml::node_element, "IsIncoming", sms.IsIncoming ? "true" : "false" ) );
+			Node->append_node( m_Doc.allocate_node( rapidxml::node_element, "IsRead", sms.IsRead ? "true" : "false" ) );
+			Node->append_node( m_Doc.allocate_node( rapidxml::node_element, "Attachments" ) );
+
+			size_t iLen = SmsFormatUInt( szBuf, sms.Timestamp );
+			szBuf[iLen] = '\0';
+			Node->append_node( m_Doc.allocate_node( rapidxml::node_element, "LocalTimestamp", szBuf, 0, iLen ) );
+
+			Node->append_node( m_Doc.allocate_node( rapidxml::node_element, "Sender", sms.IsIncoming ? (sms.PhoneId.empty() ? "" : (LPCSTR)SmsPhones().Resolve( sms.PhoneId.front() )) : "" ) );
+
+			rapidxml::internal::print_node( std::ostream_iterator<char>( m_fout ), Node, rapidxml::print_no_surrogate_expansion, 1 );
+
+		} catch (...) {
+			err = ERROR_INVALID_DATA;
+		}
+
+		return err;
+	}
+
+	ULONG End()
+	{
+		ULONG err = ERROR_SUCCESS;
+		SmsTraceScope Trace( SMS_STAGE_WRITE_CMBK );
+
+		err = WriteExisting( SMS_TIME_MIN );		/// The rest of them
+		m_Existing.Close();
+		if (err != ERROR_SUCCESS)
+			return err;
+
+		if (m_bRootOpen)
+			m_iResume = (ULONG64)m_fout.tellp();		/// The next conversion continues from here
+		m_fout << (m_bRootOpen ? CMBK_ROOT_END "\n\n" : "<ArrayOfMessage/>\n\n");		/// Document's trailing line break
+		m_fout.flush();
+		BOOL bClosed = m_Buf.Close();
+
+		if (bClosed && !m_fout.fail()) {
+
+			// Generate the hash file (.hsh) required by "contacts+message backup". The document was hashed as it was written
 			utf8string sHsh;
-			err = Compute_CMBK_Hash( pszFile, sHsh );
+			BYTE Digest[32];
+			m_Buf.GetHash().Final( Digest );
+			SmsTraceCount( SMS_COUNTER_BYTES_WRITTEN, m_Buf.GetHash().GetSize() );
+			SmsTraceCount( SMS_COUNTER_BYTES_HASHED, m_Buf.GetHash().GetSize() );
+			err = Encode_CMBK_Hash( Digest, sHsh );
+			if (err == ERROR_SUCCESS)
+				err = m_Output.Commit();
 			if (err == ERROR_SUCCESS) {
 				TCHAR szHshFile[MAX_PATH];
-				StringCchCopy( szHshFile, ARRAYSIZE( szHshFile ), pszFile );
+				StringCchCopy( szHshFile, ARRAYSIZE( szHshFile ), m_Output.GetFile() );
 				PathRenameExtension( szHshFile, _T( ".hsh" ) );
 				err = sHsh.SaveToFile( szHshFile );
 				//+ Done
 			}
+			m_bDone = (err == ERROR_SUCCESS);
+
+		} else {
+			err = ERROR_WRITE_FAULT;
 		}
 
-	} catch (const rapidxml::parse_error &e) {
-		UNREFERENCED_PARAMETER( e );
-		///e.what();
-		err = ERROR_INVALID_DATA;
-	} catch (...) {
-		err = ERROR_INVALID_DATA;
+		return err;
+	}
+
+	ULONG Record( _Inout_ SmsCheckpoint &Checkpoint )
+	{
+		if (!m_bDone || !m_bRootOpen)		/// End() failed, or empty document
+			return ERROR_NOT_SUPPORTED;
+		Checkpoint.SetOutput( 1, m_iContent, m_iResume );
+		return ERROR_SUCCESS;
+	}
+
+private:
+	SmsOutputFile m_Output;
+	CmbkOutputBuf m_Buf;
+	std::ostream m_fout;				/// Prints to m_Buf
+	rapidxml::xml_document<> m_Doc;		/// Scratch document, reused for every message
+	CmbkMessageReader m_Existing;		/// Messages of the output being continued
+	BOOL m_bRootOpen;
+	BOOL m_bDone;						/// End() succeeded
+	ULONG64 m_iContent;					/// Where the root's children start
+	ULONG64 m_iResume;					/// Where the root's closing tag starts
+};
+
+
+//++ Write_CMBK
+ULONG Write_CMBK( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList )
+{
+	if (!pszFile || !*pszFile)
+		return ERROR_INVALID_PARAMETER;
+
+	Writer_CMBK Writer( pszFile );
+	return SmsWriteList( Writer, SmsList );
+}
+
+
+//++ HashFile
+/// Continue hashing a file, from Sha.GetSize() to its end
+static ULONG HashFile( _In_ LPCTSTR pszFile, _Inout_ SmsSha256 &Sha )
+{
+	DWORD err = ERROR_SUCCESS;
+	SmsTraceScope Trace( SMS_STAGE_HASH_CMBK );
+	ULONG64 iStart = Sha.GetSize();
+
+	HANDLE h = CreateFile( pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if (h != INVALID_HANDLE_VALUE) {
+
+		LARGE_INTEGER iPos;
+		iPos.QuadPart = (LONGLONG)Sha.GetSize();
+		if (SetFilePointerEx( h, iPos, NULL, FILE_BEGIN )) {
+
+			std::vector<BYTE> Buf( 1024 * 64 );		/// 64 KiB
+			DWORD iBytesRead;
+			while (err == ERROR_SUCCESS) {
+				if (ReadFile( h, Buf.data(), (DWORD)Buf.size(), &iBytesRead, NULL )) {
+					if (iBytesRead > 0) {
+						Sha.Update( Buf.data(), iBytesRead );
+					} else {
+						break;	/// EOF
+					}
+				} else {
+					err = GetLastError();		/// ReadFile
+				}
+			}
+
+		} else {
+			err = GetLastError();		/// SetFilePointerEx
+		}
+		CloseHandle( h );
+	} else {
+		err = GetLastError();		/// CreateFile
 	}
 
+	SmsTraceCount( SMS_COUNTER_BYTES_HASHED, Sha.GetSize() - iStart );
 	return err;
 }
 
 
 //++ Compute_CMBK_Hash
-//?+ https://github.com/gpailler/Android2Wp_SMSConverter/blob/master/converter.py
 ULONG Compute_CMBK_Hash( _In_ LPCTSTR pszFile, _Out_ utf8string &Hash )
 {
-	DWORD err = ERROR_SUCCESS;
-
-	CHAR base64_sha2[50];
-	base64_sha2[0] = ANSI_NULL;
-
 	Hash.clear();
 
 	//! sha256(file)
-	HANDLE h = CreateFile( pszFile, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL );
-	if (h != INVALID_HANDLE_VALUE) {
-
-		ULONG iBufSize = 1024 * 16;		/// 16 KiB
-		LPBYTE pBuf = (LPBYTE)HeapAlloc( GetProcessHeap(), 0, iBufSize );
-		if (pBuf) {
-
-			HCRYPTPROV hCryptProv = NULL;
-			if (CryptAcquireContext( &hCryptProv, NULL, MS_ENH_RSA_AES_PROV_W, PROV_RSA_AES, CRYPT_VERIFYCONTEXT | CRYPT_SILENT )) {
-
-				HCRYPTHASH hCryptHash = NULL;
-				if (CryptCreateHash( hCryptProv, CALG_SHA_256, NULL, 0, &hCryptHash )) {
-
-					DWORD iBytesRead;
-					while (err == ERROR_SUCCESS) {
-						if (ReadFile( h, pBuf, iBufSize, &iBytesRead, NULL )) {
-							if (iBytesRead > 0) {
-								if (CryptHashData( hCryptHash, pBuf, iBytesRead, 0 )) {
-								} else {
-									err = GetLastError();		/// CryptHashData
-								}
-							} else {
-								break;	/// EOF
-							}
-						} else {
-							err = GetLastError();		/// ReadFile
-						}
-					}
-					if (err == ERROR_SUCCESS) {
+	SmsSha256 Sha;
+	ULONG err = HashFile( pszFile, Sha );
+	if (err == ERROR_SUCCESS) {
+		BYTE Digest[32];
+		Sha.Final( Digest );
+		err = Encode_CMBK_Hash( Digest, Hash );
+	}
+	return err;
+}
 
-						BYTE pHash[32];
-						DWORD iHashSize = sizeof( pHash );
-						if (CryptGetHashParam( hCryptHash, HP_HASHVAL, pHash, &iHashSize, 0 )) {
 
-							//! base64(sha256(file))
-							DWORD n = ARRAYSIZE( base64_sha2 );
-							if (CryptBinaryToStringA( pHash, iHashSize, CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, base64_sha2, &n )) {
-								//+ Success
-							} else {
-								err = GetLastError();		/// CryptBinaryToStringA
-							}
-						} else {
-							err = GetLastError();		/// CryptGetHashParam
-						}
-					}
-					CryptDestroyHash( hCryptHash );
+//++ Encode_CMBK_Hash
+/// sha256(file) -> .hsh content
+//?+ https://github.com/gpailler/Android2Wp_SMSConverter/blob/master/converter.py
+static ULONG Encode_CMBK_Hash( _In_ const BYTE Digest[32], _Out_ utf8string &Hash )
+{
+	DWORD err = ERROR_SUCCESS;
 
-				} else {
-					err = GetLastError();		/// CryptCreateHash
-				}
-				CryptReleaseContext( hCryptProv, 0 );
+	CHAR base64_sha2[50];
+	base64_sha2[0] = ANSI_NULL;
 
-			} else {
-				err = GetLastError();		/// CryptAquireContext
-			}
-			HeapFree( GetProcessHeap(), 0, pBuf );
+	Hash.clear();
 
-		} else {
-			err = GetLastError();		/// HeapAlloc
-		}
-		CloseHandle( h );
+	//! base64(sha256(file))
+	DWORD n = ARRAYSIZE( base64_sha2 );
+	if (CryptBinaryToStringA( Digest, 32, CRYPT_STRING_BASE64 | CRYPT_STRING_NOCRLF, base64_sha2, &n )) {
+		//+ Success
 	} else {
-		err = GetLastError();		/// CreateFile
+		err = GetLastError();		/// CryptBinaryToStringA
 	}
 
 	//! aes128(base64(sha256(file)))
@@ -568,60 +1424,164 @@ ULONG Compute_CMBK_Hash( _In_ LPCTSTR pszFile, _Out_ utf8string &Hash )
 
 //++ Read_SMSBR
 ULONG Read_SMSBR( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
+{
+	SmsListSink Sink( SmsList );
+	return Read_SMSBR( pszFile, Sink );
+}
+
+ULONG Read_SMSBR( _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter )
 {
 	ULONG err = ERROR_SUCCESS;
 
 	if (!pszFile || !*pszFile)
 		return ERROR_INVALID_PARAMETER;
 
+	SmsTraceScope Trace( SMS_STAGE_READ_SMSBR );
+
 	try {
 
 		CHAR szFileA[MAX_PATH];
 		WideCharToMultiByte( CP_ACP, 0, pszFile, -1, szFileA, ARRAYSIZE( szFileA ), NULL, NULL );
 		rapidxml::file<> FileObj( szFileA );
+		SmsTraceCount( SMS_COUNTER_BYTES_READ, FileObj.size() );
+		err = Parse_SMSBR( FileObj.data(), Sink, pFilter, FileObj.size() );
 
-		rapidxml::xml_document<> Doc;
-		Doc.parse<0>( FileObj.data() );
+	} catch (const std::bad_alloc&) {
+		err = ERROR_NOT_ENOUGH_MEMORY;
+	} catch (...) {
+		err = ERROR_INVALID_DATA;
+	}
+
+	return err;
+}
+
+//+ SMSBR_ATTR
+/// <sms> attributes used by the reader
+enum SMSBR_ATTR {
+	SMSBR_ATTR_ADDRESS,
+	SMSBR_ATTR_DATE,
+	SMSBR_ATTR_BODY,
+	SMSBR_ATTR_TYPE,
+	SMSBR_ATTR_READ,
+	SMSBR_ATTR_COUNT
+};
+
+//++ SmsbrAttr
+/// Attribute name -> SMSBR_ATTR, or -1 if not used
+/// The name length and first letter select a single candidate (among protocol, address, date, date_sent, type, subject, body, toa, sc_toa, service_center, read, status, locked, readable_date, contact_name), confirmed by one comparison
+static int SmsbrAttr( _In_ const char *pszName, _In_ size_t iLen )
+{
+	switch (iLen) {
+		case 4:
+			switch (pszName[0]) {
+				case 'd': return memcmp( pszName, "date", 4 ) == 0 ? SMSBR_ATTR_DATE : -1;
+				case 'b': return memcmp( pszName, "body", 4 ) == 0 ? SMSBR_ATTR_BODY : -1;
+				case 't': return memcmp( pszName, "type", 4 ) == 0 ? SMSBR_ATTR_TYPE : -1;
+				case 'r': return memcmp( pszName, "read", 4 ) == 0 ? SMSBR_ATTR_READ : -1;
+			}
+			break;
+		case 7:
+			if (pszName[0] == 'a')
+				return memcmp( pszName, "address", 7 ) == 0 ? SMSBR_ATTR_ADDRESS : -1;
+			break;
+	}
+	return -1;
+}
+
+//++ Parse_SMSBR
+ULONG Parse_SMSBR( _Inout_ char *pszXml, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter, _In_ size_t iLen )
+{
+	ULONG err = ERROR_SUCCESS;
+	ULONG iNodes = 0, iMessages = 0;		/// Trace counters
+
+	if (!pszXml)
+		return ERROR_INVALID_PARAMETER;
+
+	try {
+
+		XmlDocument CachedDoc( XML_POOL_ESTIMATE( iLen ) );
+		rapidxml::xml_document<> &Doc = *CachedDoc;
+		Doc.parse<rapidxml::parse_no_entity_translation>( pszXml );		/// See ExpandEntities
 
 		rapidxml::xml_node<> *Root = Doc.first_node( "smses" );
 		if (Root) {
 
+			SMS pending;		/// The previous message is held back until we know it's not sent to multiple recepients
+			BOOL bPending = FALSE;
+
 			for (auto n = Root->first_node( "sms" ); n; n = n->next_sibling( "sms" )) {
 
-				rapidxml::xml_attribute<> *AttrAddr = n->first_attribute( "address" );
-				rapidxml::xml_attribute<> *AttrDate = n->first_attribute( "date" );
-				rapidxml::xml_attribute<> *AttrBody = n->first_attribute( "body" );
-				rapidxml::xml_attribute<> *AttrType = n->first_attribute( "type" );
-				rapidxml::xml_attribute<> *AttrRead = n->first_attribute( "read" );
+				iNodes++;
+
+				/// Single walk of the attribute list. The first occurrence of each name wins (same as first_attribute)
+				rapidxml::xml_attribute<> *Attrs[SMSBR_ATTR_COUNT] = {NULL};
+				int iFound = 0;
+				for (auto a = n->first_attribute(); a && iFound < SMSBR_ATTR_COUNT; a = a->next_attribute()) {
+					int i = SmsbrAttr( a->name(), a->name_size() );
+					if (i >= 0 && !Attrs[i]) {
+						Attrs[i] = a;
+						iFound++;
+					}
+				}
+				rapidxml::xml_attribute<> *AttrAddr = Attrs[SMSBR_ATTR_ADDRESS];
+				rapidxml::xml_attribute<> *AttrDate = Attrs[SMSBR_ATTR_DATE];
+				rapidxml::xml_attribute<> *AttrBody = Attrs[SMSBR_ATTR_BODY];
+				rapidxml::xml_attribute<> *AttrType = Attrs[SMSBR_ATTR_TYPE];
+				rapidxml::xml_attribute<> *AttrRead = Attrs[SMSBR_ATTR_READ];
 
 				if (AttrAddr && AttrDate && AttrBody && AttrType && AttrRead) {
 
 					SMS sms;
 
-					sms.PhoneNo.push_back( AttrAddr->value() );
-					sms.IsIncoming = EqualStrA( AttrType->value(), "1" );		/// Incoming=1, Outgoing=2
-					sms.IsRead = !EqualStrA( AttrRead->value(), "0" );			/// Unread=0, Read=1
+					sms.IsIncoming = SmsSpanIs( AttrType->value(), AttrType->value_size(), "1" );		/// Incoming=1, Outgoing=2
+					sms.IsRead = !SmsSpanIs( AttrRead->value(), AttrRead->value_size(), "0" );			/// Unread=0, Read=1
+
+					int64_t iMillis;
+					if (!SmsParseInt( AttrDate->value(), AttrDate->value_size(), iMillis ) || !SmsPosixMsInRange( iMillis )) {
+						SmsTraceCount( SMS_COUNTER_RECORDS_SKIPPED, 1 );		/// Out of range. Skip the message, keep converting
+						continue;
+					}
+					sms.Timestamp = SmsTimeFromPosixMs( iMillis );
+
+					if (pFilter && (!pFilter->TestTime( sms.Timestamp ) || !pFilter->TestFlags( sms.IsIncoming, sms.IsRead )))
+						continue;
+
+					SMS_PHONE_ID iPhone = SmsPhones().Intern( AttrAddr->value(), ExpandEntities( AttrAddr->value(), AttrAddr->value_size() ) );
+					if (pFilter && !pFilter->TestPhone( iPhone ))
+						continue;
+
+					size_t iBodyLen = ExpandEntities( AttrBody->value(), AttrBody->value_size() );
+					if (pFilter && !pFilter->TestText( AttrBody->value(), iBodyLen ))
+						continue;
 
-					time_t tm;
-					StrToInt64ExA( AttrDate->value(), STIF_DEFAULT, (PLONGLONG)&tm );
-					sms.Timestamp = POSIXms_to_FILETIME( tm );
+					sms.PhoneId.push_back( iPhone );
 					sms.Text = AttrBody->value();
 					sms.Text.StripLF();
 
 					/// Aggregate outgoing messages sent to multiple recepients
 					if (!sms.IsIncoming &&
-						!SmsList.empty() &&
-						!SmsList.back().IsIncoming &&
-						*(PULONG64)&SmsList.back().Timestamp == *(PULONG64)&sms.Timestamp &&
-						EqualStrA( SmsList.back().Text, sms.Text ))
+						bPending &&
+						!pending.IsIncoming &&
+						pending.Timestamp == sms.Timestamp &&
+						EqualStrA( pending.Text, sms.Text ))
 					{
-						SmsList.back().PhoneNo.push_back( sms.PhoneNo.front() );
+						pending.PhoneId.push_back( sms.PhoneId.front() );
 					} else {
-						SmsList.push_back( sms );
+						if (bPending && !Sink.Put( pending )) {
+							bPending = FALSE;
+							err = ERROR_CANCELLED;
+							break;
+						}
+						pending = std::move( sms );
+						bPending = TRUE;
+						iMessages++;
 					}
 				}
 			}
 
+			if (bPending && !Sink.Put( pending ))
+				err = ERROR_CANCELLED;
+
 		} else {
 			err = ERROR_INVALID_DATA;
 		}
@@ -630,151 +1590,403 @@ ULONG Read_SMSBR( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 		UNREFERENCED_PARAMETER( e );
 		///e.what();
 		err = ERROR_INVALID_DATA;
+	} catch (const std::bad_alloc&) {
+		err = ERROR_NOT_ENOUGH_MEMORY;
 	} catch (...) {
 		err = ERROR_INVALID_DATA;
 	}
 
+	SmsTraceCount( SMS_COUNTER_NODES_PARSED, iNodes );
+	SmsTraceCount( SMS_COUNTER_MESSAGES_READ, iMessages );
 	return err;
 }
 
 
-//++ Write_SMSBR
-ULONG Write_SMSBR( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList )
-{
-	ULONG err = ERROR_SUCCESS;
-
-	if (!pszFile || !*pszFile)
-		return ERROR_INVALID_PARAMETER;
-
-	try {
-
-		rapidxml::xml_document<> Doc;
-		rapidxml::xml_node<> *Root, *Node;
-		CHAR szBuf[128];
+//++ Writer_SMSBR
+/// Streaming "SMS Backup & Restore" writer
+/// Messages are printed one by one, the output is identical to printing the whole document at once
+/// The root node must state the message count. If it's unknown, messages are spooled to a temporary file until End()
+class Writer_SMSBR: public SmsWriter {
+public:
 
-		//? "SMS Backup & Restore" expects a precise .xml layout in order to list it correctly
-		//? If conditions are not met, the converted .xml file might be displayed at the end of the backup list, with a timestamp somewhere in the 70s
-		//? However, even if the timestamp looks bad, messages *can* be restored...
+	Writer_SMSBR( _In_ LPCTSTR pszFile ): m_Output( pszFile ), m_iCount( 0 ), m_iWritten( 0 ), m_bRootOpen( FALSE ), m_pOut( NULL )
+	{
+		m_szSpoolFile[0] = 0;
+	}
 
-		//? Layout:
-		/// <?xml version="1.0" encoding="UTF-8" standalone="yes"?>
-		/// <!--File created by XXX on YYY-->
-		/// <?xml-stylesheet type="text/xsl" href="sms.xsl"?>
-		/// <smses count="xxx" backup_set = "GUID" backup_date = "1493574946759">
-		///    <sms [...] />
-		///    <sms [...] />
-		/// </smses>
+	~Writer_SMSBR()
+	{
+		if (m_Spool.is_open())
+			m_Spool.close();
+		if (*m_szSpoolFile)
+			DeleteFile( m_szSpoolFile );
+		if (m_fout.is_open())
+			m_fout.close();
+		m_Output.Discard();		/// Unless End() succeeded
+	}
 
-		//? Rules:
-		//? * The nodes "xml", comment, "xml-stylesheet", "smses" must appear in this precise order
-		//? * There must *not* be multiple comment nodes
-		//? * The comment node must *not* have additional leading whitespaces (such as "<--   File created [...]   -->"
+	ULONG Begin( _In_ ULONG iCount )
+	{
+		ULONG err = ERROR_SUCCESS;
+		SmsTraceScope Trace( SMS_STAGE_WRITE_SMSBR );
 
-		Node = Doc.allocate_node( rapidxml::node_declaration );
-		Node->append_attribute( Doc.allocate_attribute( "version", "1.0" ) );
-		Node->append_attribute( Doc.allocate_attribute( "encoding", "UTF-8" ) );
-		Node->append_attribute( Doc.allocate_attribute( "standalone", "yes" ) );
-		Doc.append_node( Node );
+		m_iCount = iCount;
+		m_iWritten = 0;
 
+		// Header values
 		SYSTEMTIME st;
 		GetLocalTime( &st );
 		StringCchPrintfA(
-			szBuf, ARRAYSIZE( szBuf ),
+			m_szComment, ARRAYSIZE( m_szComment ),
 			"File created by %s on %hu/%02hu/%02hu %02hu:%02hu:%02hu, %s",
 			g_szAppName,
 			st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
 			SMS_APP_LINK
 		);
-		Doc.append_node( Doc.allocate_node( rapidxml::node_comment, "", Doc.allocate_string( szBuf ) ) );
-
-		Doc.append_node( Doc.allocate_node( rapidxml::node_pi, "xml-stylesheet", "type=\"text/xsl\" href=\"sms.xsl\"" ) );
-
-		// Root node
-		Root = Doc.allocate_node( rapidxml::node_element, "smses" );
-		Doc.append_node( Root );
-
-		StringCchPrintfA( szBuf, ARRAYSIZE( szBuf ), "%u", SmsCount( SmsList ) );	/// SmsCount() is aware of multiple contacts!
-		Root->append_attribute( Doc.allocate_attribute( "count", Doc.allocate_string( szBuf ) ) );
 
 		UUID uuid;
 		RPC_WSTR szuuid = NULL;
 		UuidCreate( &uuid );
 		UuidToString( &uuid, &szuuid );
-		WideCharToMultiByte( CP_UTF8, 0, (LPCWSTR)szuuid, -1, szBuf, ARRAYSIZE( szBuf ), NULL, NULL );
+		WideCharToMultiByte( CP_UTF8, 0, (LPCWSTR)szuuid, -1, m_szBackupSet, ARRAYSIZE( m_szBackupSet ), NULL, NULL );
 		RpcStringFree( &szuuid );
-		Root->append_attribute( Doc.allocate_attribute( "backup_set", Doc.allocate_string( szBuf ) ) );
 
 		FILETIME ft;
 		GetSystemTime( &st );
 		SystemTimeToFileTime( &st, &ft );
-		time_t tm = FILETIME_to_POSIXms( ft );
-		StringCchPrintfA( szBuf, ARRAYSIZE( szBuf ), "%I64u", tm );
-		Root->append_attribute( Doc.allocate_attribute( "backup_date", Doc.allocate_string( szBuf ) ) );
+		StringCchPrintfA( m_szBackupDate, ARRAYSIZE( m_szBackupDate ), "%I64u", SmsTimeToPosixMs( SmsTimeFromFileTime( ft ) ) );
+
+		if (m_iCount != SMS_COUNT_UNKNOWN) {
+
+			/// Write directly to the output file
+			err = OpenOutput();
+			m_pOut = &m_fout;
+
+		} else {
+
+			/// Spool messages to a temporary file
+			TCHAR szTempDir[MAX_PATH];
+			CHAR szSpoolFileA[MAX_PATH];
+			if (GetTempPath( ARRAYSIZE( szTempDir ), szTempDir ) && GetTempFileName( szTempDir, _T( "sms" ), 0, m_szSpoolFile )) {
+				WideCharToMultiByte( CP_ACP, 0, m_szSpoolFile, -1, szSpoolFileA, ARRAYSIZE( szSpoolFileA ), NULL, NULL );
+				m_Spool.open( szSpoolFileA, std::ios::out | std::ios::binary );		/// Binary. Line endings get translated when copied to the output file
+				m_pOut = &m_Spool;
+				if (!m_Spool.is_open())
+					err = ERROR_OPEN_FAILED;
+			} else {
+				err = GetLastError();
+			}
+		}
+
+		return err;
+	}
 
-		// SMS nodes
-		for (auto it = SmsList.begin(); it != SmsList.end(); ++it) {
+	ULONG Write( _In_ const SMS &sms )
+	{
+		ULONG err = ERROR_SUCCESS;
+		SmsTraceScope Trace( SMS_STAGE_WRITE_SMSBR );
+		SmsTraceCount( SMS_COUNTER_MESSAGES_WRITTEN, 1 );
+
+		try {
+
+			rapidxml::xml_node<> *Node;
+
+			// Root node
+			if (m_pOut == &m_fout && !m_bRootOpen) {
+				PrintRoot( m_iCount, FALSE );
+				m_bRootOpen = TRUE;
+			}
 
 			/// Outgoing message may have multiple recepients
 			/// "Clone" the same message for each contact
-			for (auto itPhoneNo = it->PhoneNo.begin(); itPhoneNo != it->PhoneNo.end(); ++itPhoneNo) {
-
-				Root->append_node( (Node = Doc.allocate_node( rapidxml::node_element, "sms" )) );
+			for (auto itPhoneId = sms.PhoneId.begin(); itPhoneId != sms.PhoneId.end(); ++itPhoneId) {
+
+				m_Doc.reset();		/// Recycle the memory pool
+
+				Node = m_Doc.allocate_node( rapidxml::node_element, "sms" );
+
+				Node->append_attribute( m_Doc.allocate_attribute( "protocol", "0" ) );
+				Node->append_attribute( m_Doc.allocate_attribute( "address", SmsPhones().Resolve( *itPhoneId ) ) );
+
+				/// Timestamps are formatted straight into the memory pool
+				char *pszDate = m_Doc.allocate_string( NULL, 21 );
+				size_t iLen = SmsFormatUInt( pszDate, (ULONG64)SmsTimeToPosixMs( sms.Timestamp ) );
+				pszDate[iLen] = '\0';
+				Node->append_attribute( m_Doc.allocate_attribute( "date", pszDate, 0, iLen ) );
+
+				Node->append_attribute( m_Doc.allocate_attribute( "type", sms.IsIncoming ? "1" : "2" ) );
+				Node->append_attribute( m_Doc.allocate_attribute( "subject", "null" ) );
+				Node->append_attribute( m_Doc.allocate_attribute( "body", sms.Text ) );
+				Node->append_attribute( m_Doc.allocate_attribute( "read", sms.IsRead ? "1" : "0" ) );
+				Node->append_attribute( m_Doc.allocate_attribute( "date_sent", "" ) );
+
+				char *pszReadable = m_Doc.allocate_string( NULL, 20 );
+				iLen = SmsFormatDateTime( pszReadable, sms.Timestamp );
+				pszReadable[iLen] = '\0';
+				Node->append_attribute( m_Doc.allocate_attribute( "readable_date", pszReadable, 0, iLen ) );
+
+				rapidxml::internal::print_node(
+					std::ostream_iterator<char>( *m_pOut ),
+					Node,
+					rapidxml::print_no_surrogate_expansion,		/// Don't expand the special emoji characters used by "SMS Backup & Restore"
+					1
+				);
+				m_iWritten++;
+			}
 
-				Node->append_attribute( Doc.allocate_attribute( "protocol", "0" ) );
-				Node->append_attribute( Doc.allocate_attribute( "address", *itPhoneNo ) );
+		} catch (...) {
+			err = ERROR_INVALID_DATA;
+		}
 
-				time_t tm = FILETIME_to_POSIXms( it->Timestamp );
-				StringCchPrintfA( szBuf, ARRAYSIZE( szBuf ), "%I64u", tm );
-				Node->append_attribute( Doc.allocate_attribute( "date", Doc.allocate_string( szBuf ) ) );
+		return err;
+	}
 
-				Node->append_attribute( Doc.allocate_attribute( "type", it->IsIncoming ? "1" : "2" ) );
-				Node->append_attribute( Doc.allocate_attribute( "subject", "null" ) );
-				Node->append_attribute( Doc.allocate_attribute( "body", it->Text ) );
-				Node->append_attribute( Doc.allocate_attribute( "read", it->IsRead ? "1" : "0" ) );
-				Node->append_attribute( Doc.allocate_attribute( "date_sent", "" ) );
+	ULONG End()
+	{
+		ULONG err = ERROR_SUCCESS;
+		SmsTraceScope Trace( SMS_STAGE_WRITE_SMSBR );
+
+		try {
+
+			if (m_pOut == &m_Spool) {
+
+				// Spooled messages -> Output file
+				m_Spool.close();
+				if ((err = OpenOutput()) == ERROR_SUCCESS) {
+					if (m_iWritten > 0) {
+						CHAR szSpoolFileA[MAX_PATH];
+						WideCharToMultiByte( CP_ACP, 0, m_szSpoolFile, -1, szSpoolFileA, ARRAYSIZE( szSpoolFileA ), NULL, NULL );
+						std::ifstream fin( szSpoolFileA, std::ios::in | std::ios::binary );
+						PrintRoot( m_iWritten, FALSE );
+						m_fout << fin.rdbuf();
+						m_bRootOpen = TRUE;
+					}
+				}
+			}
 
-				FileTimeToSystemTime( &it->Timestamp, &st );
-				StringCchPrintfA( szBuf, ARRAYSIZE( szBuf ), "%hu/%02hu/%02hu %02hu:%02hu:%02hu", st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond );
-				Node->append_attribute( Doc.allocate_attribute( "readable_date", Doc.allocate_string( szBuf ) ) );
+			if (err == ERROR_SUCCESS) {
+				if (m_bRootOpen) {
+					m_fout << "</smses>\n";
+				} else {
+					PrintRoot( m_iCount == SMS_COUNT_UNKNOWN ? m_iWritten : m_iCount, TRUE );
+				}
+				m_fout << "\n";		/// Document's trailing line break
+				if (SmsTracing())
+					SmsTraceCount( SMS_COUNTER_BYTES_WRITTEN, (ULONG64)m_fout.tellp() );
+				m_fout.close();
+				if (m_fout.fail())
+					err = ERROR_WRITE_FAULT;
 			}
+			if (err == ERROR_SUCCESS)
+				err = m_Output.Commit();
+
+		} catch (...) {
+			err = ERROR_INVALID_DATA;
 		}
 
-		// xml -> File
+		return err;
+	}
+
+private:
+
+	ULONG OpenOutput()
+	{
+		//? "SMS Backup & Restore" expects a precise .xml layout in order to list it correctly
+		//? If conditions are not met, the converted .xml file might be displayed at the end of the backup list, with a timestamp somewhere in the 70s
+		//? However, even if the timestamp looks bad, messages *can* be restored...
+
+		//? Layout:
+		/// <?xml version="1.0" encoding="UTF-8" standalone="yes"?>
+		/// <!--File created by XXX on YYY-->
+		/// <?xml-stylesheet type="text/xsl" href="sms.xsl"?>
+		/// <smses count="xxx" backup_set = "GUID" backup_date = "1493574946759">
+		///    <sms [...] />
+		///    <sms [...] />
+		/// </smses>
+
+		//? Rules:
+		//? * The nodes "xml", comment, "xml-stylesheet", "smses" must appear in this precise order
+		//? * There must *not* be multiple comment nodes
+		//? * The comment node must *not* have additional leading whitespaces (such as "<--   File created [...]   -->"
+
+		ULONG err = m_Output.Create();
+		if (err != ERROR_SUCCESS)
+			return err;
+
 		CHAR szFileA[MAX_PATH];
-		WideCharToMultiByte( CP_UTF8, 0, pszFile, -1, szFileA, ARRAYSIZE( szFileA ), NULL, NULL );
-		std::ofstream fout( szFileA );
-		if (!fout.bad()) {
-			rapidxml::print(
-				std::ostream_iterator<char>( fout ),
-				Doc,
-				rapidxml::print_no_surrogate_expansion		/// Don't expand the special emoji characters used by "SMS Backup & Restore"
-			);
-			fout.close();
+		WideCharToMultiByte( CP_UTF8, 0, m_Output.GetTempFile(), -1, szFileA, ARRAYSIZE( szFileA ), NULL, NULL );
+		m_fout.open( szFileA );
+		if (m_fout.is_open()) {
+
+			rapidxml::xml_document<> Doc;
+			rapidxml::xml_node<> *Node;
+
+			Node = Doc.allocate_node( rapidxml::node_declaration );
+			Node->append_attribute( Doc.allocate_attribute( "version", "1.0" ) );
+			Node->append_attribute( Doc.allocate_attribute( "encoding", "UTF-8" ) );
+			Node->append_attribute( Doc.allocate_attribute( "standalone", "yes" ) );
+			Doc.append_node( Node );
+
+			Doc.append_node( Doc.allocate_node( rapidxml::node_comment, "", m_szComment ) );
+			Doc.append_node( Doc.allocate_node( rapidxml::node_pi, "xml-stylesheet", "type=\"text/xsl\" href=\"sms.xsl\"" ) );
+
+			/// Print the prolog without the document's trailing line break. It follows the root element (see End)
+			rapidxml::internal::print_children( std::ostream_iterator<char>( m_fout ), &Doc, rapidxml::print_no_surrogate_expansion, 0 );
+
+		} else {
+			err = ERROR_OPEN_FAILED;
 		}
 
-	} catch (const rapidxml::parse_error &e) {
-		UNREFERENCED_PARAMETER( e );
-		///e.what();
-		err = ERROR_INVALID_DATA;
-	} catch (...) {
-		err = ERROR_INVALID_DATA;
+		return err;
+	}
+
+	void PrintRoot( _In_ ULONG iCount, _In_ BOOL bChildless )
+	{
+		rapidxml::xml_document<> Doc;
+		CHAR szCount[20];
+
+		rapidxml::xml_node<> *Root = Doc.allocate_node( rapidxml::node_element, "smses" );
+		StringCchPrintfA( szCount, ARRAYSIZE( szCount ), "%u", iCount );	/// SmsCount() is aware of multiple contacts!
+		Root->append_attribute( Doc.allocate_attribute( "count", szCount ) );
+		Root->append_attribute( Doc.allocate_attribute( "backup_set", m_szBackupSet ) );
+		Root->append_attribute( Doc.allocate_attribute( "backup_date", m_szBackupDate ) );
+
+		if (bChildless) {
+			rapidxml::internal::print_node( std::ostream_iterator<char>( m_fout ), Root, rapidxml::print_no_surrogate_expansion, 0 );
+		} else {
+			m_fout << "<smses";
+			rapidxml::internal::print_attributes( std::ostream_iterator<char>( m_fout ), Root, rapidxml::print_no_surrogate_expansion );
+			m_fout << ">\n";
+		}
+	}
+
+private:
+	SmsOutputFile m_Output;
+	TCHAR m_szSpoolFile[MAX_PATH];
+	CHAR m_szComment[128];
+	CHAR m_szBackupSet[50];
+	CHAR m_szBackupDate[30];
+	ULONG m_iCount;						/// Announced message count (SMS_COUNT_UNKNOWN if spooling)
+	ULONG m_iWritten;					/// <sms> nodes written so far
+	BOOL m_bRootOpen;
+	std::ofstream m_fout;
+	std::ofstream m_Spool;
+	std::ostream *m_pOut;				/// m_fout or m_Spool
+	rapidxml::xml_document<> m_Doc;		/// Scratch document, reused for every message
+};
+
+
+//++ Write_SMSBR
+ULONG Write_SMSBR( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList )
+{
+	if (!pszFile || !*pszFile)
+		return ERROR_INVALID_PARAMETER;
+
+	Writer_SMSBR Writer( pszFile );
+	return SmsWriteList( Writer, SmsList );
+}
+
+
+//!++ Nokia time zone
+
+//++ SystemTimeZone
+/// The system's time zone, with its current rules applied to every year (the same conversions as TzSpecificLocalTimeToSystemTime( NULL, ... ))
+/// The rules are handed to SmsTimeZone as a POSIX TZ string. Windows biases are UTC - local, the same sign as POSIX offsets
+static SmsTimeZone SystemTimeZone()
+{
+	SmsTimeZone Zone;
+	TIME_ZONE_INFORMATION tzi = {0};
+	if (GetTimeZoneInformation( &tzi ) == TIME_ZONE_ID_INVALID)
+		return Zone;		/// UTC
+
+	LONG iStd = tzi.Bias + tzi.StandardBias, iDst = tzi.Bias + tzi.DaylightBias;
+	CHAR szRule[128];
+	StringCchPrintfA( szRule, ARRAYSIZE( szRule ), "STD%s%ld:%02ld", iStd < 0 ? "-" : "", abs( iStd ) / 60, abs( iStd ) % 60 );
+	if (tzi.DaylightDate.wMonth && tzi.StandardDate.wMonth && !tzi.DaylightDate.wYear && !tzi.StandardDate.wYear) {		/// Absolute dates (wYear != 0) aren't yearly rules. Ignored
+		const SYSTEMTIME &s = tzi.DaylightDate, &e = tzi.StandardDate;		/// wDay is the week (5 = last)
+		StringCchPrintfA( szRule + lstrlenA( szRule ), ARRAYSIZE( szRule ) - lstrlenA( szRule ), "DST%s%ld:%02ld,M%hu.%hu.%hu/%hu:%02hu:%02hu,M%hu.%hu.%hu/%hu:%02hu:%02hu",
+			iDst < 0 ? "-" : "", abs( iDst ) / 60, abs( iDst ) % 60,
+			s.wMonth, s.wDay, s.wDayOfWeek, s.wHour, s.wMinute, s.wSecond,
+			e.wMonth, e.wDay, e.wDayOfWeek, e.wHour, e.wMinute, e.wSecond
+		);
+	}
+	if (!Zone.SetRule( szRule ))
+		Zone.SetFixed( -iStd );
+	return Zone;
+}
+
+static SRWLOCK g_NokiaZoneLock = SRWLOCK_INIT;
+static std::shared_ptr<const SmsTimeZone> g_pNokiaZone;		/// Replaced, never modified. NULL until first used or set
+
+//++ SmsNokiaTimeZone
+std::shared_ptr<const SmsTimeZone> SmsNokiaTimeZone()
+{
+	std::shared_ptr<const SmsTimeZone> pZone;
+	AcquireSRWLockShared( &g_NokiaZoneLock );
+	pZone = g_pNokiaZone;
+	ReleaseSRWLockShared( &g_NokiaZoneLock );
+
+	if (!pZone) {
+		/// Default. Another thread may get there first
+		std::shared_ptr<const SmsTimeZone> pSystem = std::make_shared<const SmsTimeZone>( SystemTimeZone() );
+		AcquireSRWLockExclusive( &g_NokiaZoneLock );
+		if (!g_pNokiaZone)
+			g_pNokiaZone = pSystem;
+		pZone = g_pNokiaZone;
+		ReleaseSRWLockExclusive( &g_NokiaZoneLock );
 	}
+	return pZone;
+}
 
+//++ SmsSetNokiaTimeZone
+ULONG SmsSetNokiaTimeZone( _In_opt_ LPCTSTR pszZone )
+{
+	ULONG err = ERROR_SUCCESS;
+	SmsTimeZone Zone;
+	if (!pszZone || !*pszZone) {
+		Zone = SystemTimeZone();
+	} else if (PathFileExists( pszZone )) {
+		utf8string s;
+		if ((err = s.LoadFromFile( pszZone )) == ERROR_SUCCESS && !Zone.LoadTzif( s.data(), s.size() ))
+			err = ERROR_INVALID_DATA;
+	} else {
+		CHAR szRule[128];
+		WideCharToMultiByte( CP_ACP, 0, pszZone, -1, szRule, ARRAYSIZE( szRule ), NULL, NULL );
+		if (!Zone.SetRule( szRule ))
+			err = ERROR_INVALID_PARAMETER;
+	}
+	if (err == ERROR_SUCCESS) {
+		std::shared_ptr<const SmsTimeZone> pZone = std::make_shared<const SmsTimeZone>( std::move( Zone ) );
+		AcquireSRWLockExclusive( &g_NokiaZoneLock );
+		g_pNokiaZone.swap( pZone );
+		ReleaseSRWLockExclusive( &g_NokiaZoneLock );
+		/// The previous zone is released here, or by the last conversion using it
+	}
 	return err;
 }
 
 
 //++ Read_NOKIA
 ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
+{
+	SmsListSink Sink( SmsList );
+	return Read_NOKIA( pszFile, Sink );
+}
+
+ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter )
 {
 	ULONG err = ERROR_SUCCESS;
 
 	if (!pszFile || !*pszFile)
 		return ERROR_INVALID_PARAMETER;
 
+	SmsTraceScope Trace( SMS_STAGE_READ_NOKIA );
+
 	utf8string s;
 	if (s.LoadFromFile( pszFile ) == ERROR_SUCCESS) {
 
+		SmsTraceCount( SMS_COUNTER_BYTES_READ, s.size() );
+
 		//? Layout:
 		/// Type,Action,From,To,?,Timestamp,?,Text
 		/// "sms","RECEIVED","+0000000000","","","YYYY.MM.DD HH:mm","","Text1"
@@ -784,12 +1996,22 @@ ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 		typedef struct {
 			int iCurFields;
 			SMS sms;
-			SMS_LIST *pSmsList;
+			SmsSink *pSink;
+			SmsFilter *pFilter;
+			const SmsTimeZone *pZone;
+			BOOL bStop;				/// The sink doesn't want more messages
+			ULONG iRecords, iMessages;		/// Trace counters
 		} CTX;
 
 		CTX ctx;
 		ctx.iCurFields = 0;
-		ctx.pSmsList = &SmsList;
+		ctx.sms.clear();
+		ctx.pSink = &Sink;
+		ctx.pFilter = pFilter;
+		std::shared_ptr<const SmsTimeZone> pZone = SmsNokiaTimeZone();		/// The same zone for the whole file
+		ctx.pZone = pZone.get();
+		ctx.bStop = FALSE;
+		ctx.iRecords = ctx.iMessages = 0;
 
 		struct csv_parser csv;
 		csv_init( &csv, 0 );
@@ -802,7 +2024,7 @@ ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 			[]( void *s, size_t len, void *pParam )
 			{
 				CTX *pctx = (CTX*)pParam;
-				if (pctx->iCurFields >= 0) {		/// Record is still valid
+				if (pctx->iCurFields >= 0 && !pctx->bStop) {		/// Record is still valid
 					switch (pctx->iCurFields) {
 						case 0:
 							// "sms"
@@ -818,16 +2040,18 @@ ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 							pctx->sms.IsRead = (StrStrA( s2.c_str(), "READ" ) != NULL);
 							pctx->sms.IsIncoming = (StrStrA( s2.c_str(), "RECEIVED" ) != NULL);
 							///pctx->sms.IsIncoming = !(StrStrA( s2.c_str(), "SENT" ) != NULL);
+
+							if (pctx->pFilter && !pctx->pFilter->TestFlags( pctx->sms.IsIncoming, pctx->sms.IsRead ))
+								pctx->iCurFields = -1;		/// Filtered out
 							break;
 						}
 						case 2:
 						{
 							// From
 							if (pctx->sms.IsIncoming) {
-								utf8string s2;
-								s2.assign( (LPCSTR)s, (LPCSTR)s + len );
-
-								pctx->sms.PhoneNo.push_back( s2 );
+								pctx->sms.PhoneId.push_back( SmsPhones().Intern( (LPCSTR)s, len ) );
+								if (pctx->pFilter && !pctx->pFilter->TestPhone( pctx->sms.PhoneId.back() ))
+									pctx->iCurFields = -1;		/// Filtered out
 							}
 							break;
 						}
@@ -835,10 +2059,9 @@ ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 						{
 							// To
 							if (!pctx->sms.IsIncoming) {
-								utf8string s2;
-								s2.assign( (LPCSTR)s, (LPCSTR)s + len );
-
-								pctx->sms.PhoneNo.push_back( s2 );
+								pctx->sms.PhoneId.push_back( SmsPhones().Intern( (LPCSTR)s, len ) );
+								if (pctx->pFilter && !pctx->pFilter->TestPhone( pctx->sms.PhoneId.back() ))
+									pctx->iCurFields = -1;		/// Filtered out
 							}
 							break;
 						}
@@ -846,20 +2069,20 @@ ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 						{
 							// "YYYY.MM.DD HH:MM"
 							LPCSTR psz = (LPCSTR)s;
-							if (len == 16 && psz[4] == '.' && psz[7] == '.' && psz[10] == ' ' && psz[13] == ':') {
-
-								utf8string s2;
-								SYSTEMTIME st = {0};
-								st.wYear   = StrToIntA( s2.assign( psz, psz + 4 ).c_str() );
-								st.wMonth  = StrToIntA( s2.assign( psz + 5, psz + 7 ).c_str() );
-								st.wDay    = StrToIntA( s2.assign( psz + 8, psz + 10 ).c_str() );
-								st.wHour   = StrToIntA( s2.assign( psz + 11, psz + 13 ).c_str() );
-								st.wMinute = StrToIntA( s2.assign( psz + 14, psz + 16 ).c_str() );
-
-								SYSTEMTIME st2;
-								TzSpecificLocalTimeToSystemTime( NULL, &st, &st2 );
-
-								SystemTimeToFileTime( &st2, &pctx->sms.Timestamp );
+							int64_t iYear, iMonth, iDay, iHour, iMinute;
+							if (len == 16 && psz[4] == '.' && psz[7] == '.' && psz[10] == ' ' && psz[13] == ':' &&
+								SmsParseInt( psz, 4, iYear ) &&
+								SmsParseInt( psz + 5, 2, iMonth ) && iMonth >= 1 && iMonth <= 12 &&
+								SmsParseInt( psz + 8, 2, iDay ) && iDay >= 1 && iDay <= 31 &&
+								SmsParseInt( psz + 11, 2, iHour ) && iHour >= 0 && iHour < 24 &&
+								SmsParseInt( psz + 14, 2, iMinute ) && iMinute >= 0 && iMinute < 60)
+							{
+								/// Local time -> UTC: a table lookup, no OS calls
+								LONG64 iLocal = (SmsDaysFromCivil( (LONG)iYear, (ULONG)iMonth, (ULONG)iDay ) + SMS_EPOCH_DIFF_DAYS) * 1440 + iHour * 60 + iMinute;
+								pctx->sms.Timestamp = pctx->pZone->FromLocal( iLocal );
+
+								if (pctx->pFilter && !pctx->pFilter->TestTime( pctx->sms.Timestamp ))
+									pctx->iCurFields = -1;		/// Filtered out
 
 							} else {
 								pctx->iCurFields = -1;		/// Invalidate this record
@@ -868,7 +2091,10 @@ ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 						}
 						case 7:
 							// Message text
-							pctx->sms.Text.assign( (LPCSTR)s, (LPCSTR)s + len );
+							if (pctx->pFilter && !pctx->pFilter->TestText( (LPCSTR)s, len ))
+								pctx->iCurFields = -1;		/// Filtered out
+							else
+								pctx->sms.Text.assign( (LPCSTR)s, (LPCSTR)s + len );
 							break;
 					}
 					pctx->iCurFields++;
@@ -880,8 +2106,12 @@ ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 				CTX *pctx = (CTX*)pParam;
 
 				// Store this SMS
-				if (pctx->iCurFields == 8)
-					pctx->pSmsList->push_back( pctx->sms );
+				pctx->iRecords++;
+				if (pctx->iCurFields == 8 && !pctx->bStop) {
+					pctx->iMessages++;
+					if (!pctx->pSink->Put( pctx->sms ))
+						pctx->bStop = TRUE;
+				}
 
 				// Context cleanup
 				pctx->sms.clear();
@@ -894,6 +2124,12 @@ ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 			csv_strerror( csv_error( &csv ) );
 		}
 		csv_fini( &csv, NULL, NULL, NULL );
+
+		if (ctx.bStop)
+			err = ERROR_CANCELLED;
+
+		SmsTraceCount( SMS_COUNTER_NODES_PARSED, ctx.iRecords );
+		SmsTraceCount( SMS_COUNTER_MESSAGES_READ, ctx.iMessages );
 	}
 
 	return err;
@@ -901,8 +2137,97 @@ ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList )
 
 
 //++ Write_NOKIA
+/// Same layout as Read_NOKIA. Messages sent to multiple contacts are split, one record per contact
+/// Timestamps are printed in local time (see SmsSetNokiaTimeZone), with minute precision
 ULONG Write_NOKIA( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList )
 {
-	//TODO: ?
+	if (!pszFile || !*pszFile)
+		return ERROR_INVALID_PARAMETER;
+
+	SmsTraceScope Trace( SMS_STAGE_WRITE_NOKIA );
+
+	utf8string s;
+	CHAR szTime[32];
+	std::shared_ptr<const SmsTimeZone> pZone = SmsNokiaTimeZone();		/// The same zone for the whole file
+	const SmsTimeZone &Zone = *pZone;
+
+	for (auto it = SmsList.begin(); it != SmsList.end(); ++it) {
+
+		/// "YYYY.MM.DD HH:MM"
+		LONG64 iLocal = __max( Zone.ToLocal( it->Timestamp ), 0 );		/// Not before 1601/01/01
+		int32_t iYear;
+		uint32_t iMonth, iDay;
+		SmsCivilFromDays( iLocal / 1440 - SMS_EPOCH_DIFF_DAYS, iYear, iMonth, iDay );
+		ULONG iTimeOfDay = (ULONG)(iLocal % 1440);
+		char *p = (iYear < 10000) ? SmsFormat2( SmsFormat2( szTime, iYear / 100 ), iYear % 100 ) : szTime + SmsFormatUInt( szTime, iYear );
+		*p++ = '.';
+		p = SmsFormat2( p, iMonth );
+		*p++ = '.';
+		p = SmsFormat2( p, iDay );
+		*p++ = ' ';
+		p = SmsFormat2( p, iTimeOfDay / 60 );
+		*p++ = ':';
+		p = SmsFormat2( p, iTimeOfDay % 60 );
+		*p = 0;
+
+		for (auto id = it->PhoneId.begin(); id != it->PhoneId.end(); ++id) {
+			const utf8string &Phone = SmsPhones().Resolve( *id );
+			s += "\"sms\",";
+			s += it->IsIncoming ? (it->IsRead ? "\"READ,RECEIVED\",\"" : "\"RECEIVED\",\"") : "\"SENT\",\"\",\"";
+			s += Phone;
+			s += it->IsIncoming ? "\",\"\",\"\",\"" : "\",\"\",\"";
+			s += szTime;
+			s += "\",\"\",\"";
+			for (const char *psz = it->Text.c_str(); *psz; psz++) {
+				if (*psz == '"')
+					s += '"';		/// Quotes are doubled
+				s += *psz;
+			}
+			s += "\"\n";
+		}
+	}
+
+	SmsTraceCount( SMS_COUNTER_MESSAGES_WRITTEN, SmsList.size() );
+	SmsTraceCount( SMS_COUNTER_BYTES_WRITTEN, s.size() );
+	return s.SaveToFile( pszFile );
+}
+
+
+//++ SmsRead
+ULONG SmsRead( _In_ ULONG iType, _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter )
+{
+	switch (iType) {
+		case 1: return Read_CMBK( pszFile, Sink, pFilter );
+		case 2: return Read_SMSBR( pszFile, Sink, pFilter );
+		case 3: return Read_NOKIA( pszFile, Sink, pFilter );
+		case 4: return Read_SMSB( pszFile, Sink, pFilter );
+	}
 	return ERROR_NOT_SUPPORTED;
 }
+
+//++ SmsReaderFootprint
+ULONG64 SmsReaderFootprint( _In_ ULONG iType, _In_ ULONG64 iFileSize )
+{
+	switch (iType) {
+		case 1:
+		case 2: return iFileSize + iFileSize * 4;		/// File content + DOM (up to 4 times the file, see XML documents)
+		case 3: return iFileSize;						/// File content
+		case 4: return iFileSize;						/// Mapped view
+	}
+	return 0;
+}
+
+
+//++ SmsCreateWriter
+SmsWriter* SmsCreateWriter( _In_ ULONG iType, _In_ LPCTSTR pszFile )
+{
+	if (!pszFile || !*pszFile)
+		return NULL;
+
+	switch (iType) {
+		case 1: return new Writer_CMBK( pszFile );
+		case 2: return new Writer_SMSBR( pszFile );
+		case 4: return new SmsBinaryWriter( pszFile );
+	}
+	return NULL;
+}
@@ -7,6 +7,10 @@
 #include <list>
 #include <vector>
 #include <string>
+#include <deque>
+#include <unordered_map>
+#include <memory>
+#include "SmsTime.h"
 
 //+ class utf8string
 class utf8string: public std::string
@@ -77,45 +81,154 @@ public:
 };
 
 
+//+ SmsPhoneTable
+/// Phone number interning table. Every distinct number is stored once, messages refer to it by id
+/// Ids are valid for the lifetime of the table. Thread safe
+typedef ULONG SMS_PHONE_ID;
+
+class SmsPhoneTable {
+public:
+	SmsPhoneTable();
+
+	SMS_PHONE_ID Intern( _In_ LPCSTR pszPhone, _In_ size_t iLen );
+	SMS_PHONE_ID Intern( _In_ LPCSTR pszPhone ) { return Intern( pszPhone, strlen( pszPhone ) ); }
+
+	/// The returned reference remains valid (table entries never move)
+	const utf8string& Resolve( _In_ SMS_PHONE_ID iId );
+
+	ULONG GetCount();
+
+private:
+	SRWLOCK m_Lock;
+	std::unordered_map<std::string, SMS_PHONE_ID> m_Ids;
+	std::deque<utf8string> m_Phones;		/// Indexed by id
+};
+
+/// The process-wide table, shared by all readers and writers
+SmsPhoneTable& SmsPhones();
+
+
 //+ SMS
 /// Generic SMS structure
 struct SMS {
 
-	FILETIME Timestamp;
+	SMS_TIME Timestamp;
 	bool IsIncoming;
 	bool IsRead;
 	utf8string Text;
-	std::vector<utf8string> PhoneNo;
+	std::vector<SMS_PHONE_ID> PhoneId;		/// See SmsPhones()
 
 	void clear()
 	{
-		Timestamp.dwHighDateTime = Timestamp.dwLowDateTime = 0;
+		Timestamp = 0;
 		IsIncoming = IsRead = true;
 		Text.clear();
-		PhoneNo.clear();
+		PhoneId.clear();
 	}
 
 	bool operator==( const SMS& second ) const {
 		return
-			Timestamp.dwHighDateTime == second.Timestamp.dwHighDateTime &&
-			Timestamp.dwLowDateTime == second.Timestamp.dwLowDateTime &&
+			Timestamp == second.Timestamp &&
 			IsIncoming == second.IsIncoming &&
 			IsRead == second.IsRead &&
 			Text == second.Text &&
-			PhoneNo == second.PhoneNo
+			PhoneId == second.PhoneId
 			;
 	}
 
 	bool operator<( const SMS& second ) const {
-		return *((PULONG64)&Timestamp) < *((PULONG64)&second.Timestamp);
+		return Timestamp < second.Timestamp;
 	}
 
 	bool operator>(const SMS& second) const {
-		return *((PULONG64)&Timestamp) > *((PULONG64)&second.Timestamp);
+		return Timestamp > second.Timestamp;
 	}
 };
 typedef std::list<SMS> SMS_LIST;
 
+//+ SmsTimeFromFileTime, SmsTimeToFileTime
+/// For the OS calls that take a FILETIME. SMS_TIME has the same unit and epoch
+inline SMS_TIME SmsTimeFromFileTime( _In_ const FILETIME &ft )
+{
+	return ((SMS_TIME)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+}
+
+inline FILETIME SmsTimeToFileTime( _In_ SMS_TIME t )
+{
+	FILETIME ft = { (DWORD)t, (DWORD)(t >> 32) };
+	return ft;
+}
+
+
+class SmsFilter;		/// SmsFilter.h
+class SmsTimeZone;		/// SmsTimeZone.h
+class SmsCheckpoint;	/// SmsCheckpoint.h
+
+
+//+ SmsSink
+/// Receives messages from the readers, one at a time
+class SmsSink {
+public:
+	virtual ~SmsSink() {}
+	/// The sink may move the message content away
+	/// Return FALSE to stop the reader (it'll return ERROR_CANCELLED)
+	virtual BOOL Put( _Inout_ SMS &sms ) = 0;
+};
+
+//+ SmsListSink
+/// Appends messages to a SMS_LIST
+class SmsListSink: public SmsSink {
+public:
+	SmsListSink( _Inout_ SMS_LIST &SmsList ): m_SmsList( SmsList ) {}
+	BOOL Put( _Inout_ SMS &sms ) { m_SmsList.push_back( std::move( sms ) ); return TRUE; }
+private:
+	SMS_LIST &m_SmsList;
+};
+
+
+//+ SmsOutputFile
+/// The writers build their output in a temporary file, in the destination's directory. Commit() moves it over the destination
+/// Until then, an existing destination is left alone: a failed or abandoned conversion doesn't damage it. An uncommitted temporary file is deleted
+class SmsOutputFile {
+public:
+	SmsOutputFile( _In_ LPCTSTR pszFile );
+	~SmsOutputFile() { Discard(); }
+
+	ULONG Create();									/// New, empty temporary file
+	ULONG Commit();									/// Temporary file -> Destination (replaced)
+	void Discard();									/// Delete the temporary file. Close it first
+
+	LPCTSTR GetFile() const { return m_szFile; }			/// Destination
+	LPCTSTR GetTempFile() const { return m_szTempFile; }	/// Where the writer writes. Empty until Create()
+
+private:
+	TCHAR m_szFile[MAX_PATH];
+	TCHAR m_szTempFile[MAX_PATH];
+};
+
+
+//+ SmsWriter
+/// Streaming writer. Messages are written in the order they are received
+/// The output replaces the destination file only when End() succeeds (see SmsOutputFile)
+/// Create it with SmsCreateWriter(), destroy it with delete
+class SmsWriter {
+public:
+	virtual ~SmsWriter() {}
+	virtual ULONG Begin( _In_ ULONG iCount ) = 0;		/// iCount is the SmsCount() of the upcoming messages, or SMS_COUNT_UNKNOWN
+	virtual ULONG Write( _In_ const SMS &sms ) = 0;
+	virtual ULONG End() = 0;
+
+	/// Incremental output (see SmsCheckpoint.h). Not supported by default
+	virtual ULONG Resume( _In_ const SmsCheckpoint &Checkpoint ) { UNREFERENCED_PARAMETER( Checkpoint ); return ERROR_NOT_SUPPORTED; }		/// Instead of Begin(). Continue the output described by the checkpoint
+	virtual ULONG Record( _Inout_ SmsCheckpoint &Checkpoint ) { UNREFERENCED_PARAMETER( Checkpoint ); return ERROR_NOT_SUPPORTED; }		/// After End(). Store the point where the output can be continued
+};
+#define SMS_COUNT_UNKNOWN ((ULONG)-1)
+
+
+//+ SmsWriteList
+/// SMS_LIST -> SmsWriter (Begin, Write..., End)
+ULONG SmsWriteList( _In_ SmsWriter &Writer, _In_ const SMS_LIST &SmsList );
+
 
 //+ SmsSetAppName
 /// Configure the app name, written to .xml comments. Default is "sms_w2a"
@@ -127,21 +240,52 @@ VOID SmsSetAppName( _In_ LPCSTR pszName );
 ULONG SmsCount( const SMS_LIST &SmsList );
 
 
+//+ SmsSniffFileType
+/// Cheap format detection. Only the first few KiB of the file are examined
+ULONG SmsSniffFileType(
+	_In_ LPCTSTR pszFile,
+	_Out_ ULONG &iType					/// 0=Unknown, 1=CMBK, 2=SMSBR, 3=NOKIA, 4=SMSB
+);
+
 //+ SmsGetFileSummary
+/// The operation is abandoned with ERROR_CANCELLED as soon as *pbCancel becomes non-zero
+/// CSV files are recognized from their first records. Their messages are counted only if bCount (a full pass over the file), otherwise iMessageCount is SMS_COUNT_UNKNOWN
 ULONG SmsGetFileSummary(
 	_In_ LPCTSTR pszFile,
-	_Out_ ULONG &iType,					/// 0=Unknown, 1=CMBK, 2=SMSBR, 3=NOKIA
+	_Out_ ULONG &iType,					/// 0=Unknown, 1=CMBK, 2=SMSBR, 3=NOKIA, 4=SMSB
 	_Out_ ULONG &iMessageCount,
-	_Out_ std::string &sComments
+	_Out_ std::string &sComments,
+	_In_opt_ const volatile LONG *pbCancel = NULL,
+	_In_ BOOL bCount = FALSE
 );
 
 //+ SmsFormatStr
 LPCSTR SmsFormatStr( _In_ ULONG iType );
 
+//+ SmsRead
+/// Read messages of any known type (1=CMBK, 2=SMSBR, 3=NOKIA, 4=SMSB)
+/// Messages rejected by the optional filter never reach the sink (see SmsFilter.h)
+ULONG SmsRead( _In_ ULONG iType, _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter = NULL );
+
+//+ SmsReaderFootprint
+/// Memory held by SmsRead() while it runs, in bytes (estimate). The readers don't stream: the whole file is loaded (or mapped), and XML files are parsed to a DOM
+ULONG64 SmsReaderFootprint( _In_ ULONG iType, _In_ ULONG64 iFileSize );
+
+//+ SmsCreateWriter
+/// Create a streaming writer of any known type (1=CMBK, 2=SMSBR, 4=SMSB)
+/// Returns NULL if the type can't be written
+SmsWriter* SmsCreateWriter( _In_ ULONG iType, _In_ LPCTSTR pszFile );
+
+//+ SmsXmlRetain
+/// Batch mode: the XML readers keep their parser documents (and memory pools) between files, instead of freeing them after each one
+/// Calls nest. The cached memory is freed when the last SmsXmlRetain( FALSE ) ends batch mode
+void SmsXmlRetain( _In_ BOOL bRetain );
+
 //+ contacts+message backup (Windows Phone)
 /// https://www.microsoft.com/en-us/store/p/contacts-message-backup/9nblgggz57gm
 
 ULONG Read_CMBK( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList );
+ULONG Read_CMBK( _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter = NULL );
 ULONG Write_CMBK( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList );
 ULONG Compute_CMBK_Hash( _In_ LPCTSTR pszFile, _Out_ utf8string &Hash );
 
@@ -150,10 +294,28 @@ ULONG Compute_CMBK_Hash( _In_ LPCTSTR pszFile, _Out_ utf8string &Hash );
 /// https://play.google.com/store/apps/details?id=com.riteshsahu.SMSBackupRestore
 
 ULONG Read_SMSBR( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList );
+ULONG Read_SMSBR( _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter = NULL );
+ULONG Parse_SMSBR( _Inout_ char *pszXml, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter = NULL, _In_ size_t iLen = 0 );		/// In-memory document. The buffer is parsed in place (modified). iLen pre-sizes the parser memory, 0=unknown
 ULONG Write_SMSBR( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList );
 
 //+ Nokia Suite exported messages (Symbian)
 /// https://en.wikipedia.org/wiki/Nokia_Suite
 
 ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList );
+ULONG Read_NOKIA( _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter = NULL );
 ULONG Write_NOKIA( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList );
+
+//+ SmsSetNokiaTimeZone
+/// Time zone of the local timestamps in Nokia files, used by Read_NOKIA and Write_NOKIA. Process-wide, set it before starting a conversion
+/// pszZone: path of an IANA tz database file (e.g. a copy of /usr/share/zoneinfo/Europe/Berlin), or a POSIX TZ string (e.g. "CET-1CEST,M3.5.0,M10.5.0/3", "UTC0")
+/// NULL or empty: the system's time zone, with its current rules applied to every year (the default)
+/// Thread safe. Zones are immutable: a new zone replaces the current one, conversions in progress keep the zone they started with (see SmsNokiaTimeZone)
+ULONG SmsSetNokiaTimeZone( _In_opt_ LPCTSTR pszZone );
+std::shared_ptr<const SmsTimeZone> SmsNokiaTimeZone();
+
+//+ sms_w2a binary container
+/// Compact cache of parsed messages. See SmsBinary.h for details
+
+ULONG Read_SMSB( _In_ LPCTSTR pszFile, _Out_ SMS_LIST& SmsList );
+ULONG Read_SMSB( _In_ LPCTSTR pszFile, _In_ SmsSink &Sink, _In_opt_ SmsFilter *pFilter = NULL );
+ULONG Write_SMSB( _In_ LPCTSTR pszFile, _In_ const SMS_LIST& SmsList );
@@ -0,0 +1,288 @@
+#include "SmsParse.h"
+#include "SmsFormat.h"
+#include "SmsTimeZone.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+
+//? Benchmark of the portable core: field parsers, formatters and time conversions, against the C library calls they stand for
+//? The Windows benchmark (see SmsBench.h) times the readers and the writers. This one builds on any platform (see the sms_bench target in CMakeLists.txt)
+//? Usage: sms_bench [message count] [repetitions]
+//? The results are written to stdout as JSON lines, one line per operation (the fields of SmsBenchmark that make sense without files):
+//?   {"op":"Parse_Fields","messages":1000000,"bytes":37888890,"runs":5,"best_ms":12.5,"median_ms":12.9,"mb_per_s":2890.7,"msg_per_s":80000000}
+//? Every operation checks its result. The exit code is 1 if one of them is wrong
+//? Standard C++ only
+
+
+//!++ Synthetic fields
+
+//+ Random
+/// xorshift32, same as the Windows generator
+static uint32_t Random( uint32_t &iState )
+{
+	iState ^= iState << 13;
+	iState ^= iState >> 17;
+	iState ^= iState << 5;
+	return iState;
+}
+
+//+ BENCH_MESSAGE
+struct BENCH_MESSAGE {
+	SMS_TIME Timestamp;
+	bool bIncoming;
+};
+
+//+ BENCH_FIELDS
+/// The numeric and boolean fields of every message, as the readers see them: CMBK LocalTimestamp and IsIncoming, SMSBR date and type
+/// Fields are zero-terminated (strtoll needs it), four per message
+struct BENCH_FIELDS {
+	std::string Text;
+	std::vector<size_t> Starts;
+	uint64_t iChecksum;					/// Expected parse result
+};
+
+//++ Generate
+/// Messages in chronological order, one to three minutes apart, starting 2015/01/01
+/// Closer than the Windows generator's: 20 million messages stay within the time zone tables (SMS_TZ_LAST_YEAR)
+static void Generate( size_t iCount, std::vector<BENCH_MESSAGE> &Messages )
+{
+	uint32_t iState = 1;
+	SMS_TIME t = SmsTimeFromCivil( 2015, 1, 1, 0, 0, 0 );
+	Messages.resize( iCount );
+	for (size_t i = 0; i < iCount; i++) {
+		t += (SMS_TIME)(60 + Random( iState ) % 120) * 10000000;
+		Messages[i].Timestamp = t;
+		Messages[i].bIncoming = (Random( iState ) & 1) != 0;
+	}
+}
+
+//++ FormatFields
+static void FormatFields( const std::vector<BENCH_MESSAGE> &Messages, BENCH_FIELDS &Fields )
+{
+	char szTicks[30], szMillis[30];
+	Fields.Text.clear();
+	Fields.Starts.clear();
+	Fields.iChecksum = 0;
+
+	for (auto it = Messages.begin(); it != Messages.end(); ++it) {
+		uint64_t iTicks = it->Timestamp;
+		uint64_t iMillis = (uint64_t)SmsTimeToPosixMs( it->Timestamp );
+		snprintf( szTicks, sizeof( szTicks ), "%llu", (unsigned long long)iTicks );
+		snprintf( szMillis, sizeof( szMillis ), "%llu", (unsigned long long)iMillis );
+		const char *Values[4] = { szTicks, it->bIncoming ? "true" : "false", szMillis, it->bIncoming ? "1" : "2" };
+		for (int i = 0; i < 4; i++) {
+			Fields.Starts.push_back( Fields.Text.size() );
+			Fields.Text += Values[i];
+			Fields.Text += '\0';
+		}
+		Fields.iChecksum += iTicks + iMillis + (it->bIncoming ? 2 : 0);
+	}
+}
+
+
+//!++ Operations
+//? Each returns a checksum of its output, compared with the reference operation's (or with the expected value)
+
+enum { OP_PARSE_FAST, OP_PARSE_STRTOLL, OP_FORMAT_DATE_FAST, OP_FORMAT_DATE_PRINTF, OP_FORMAT_UINT_FAST, OP_FORMAT_UINT_PRINTF, OP_TIME_POSIX, OP_TIME_ZONE, OP_COUNT };
+static const char *g_OpNames[OP_COUNT] = { "Parse_Fields", "Parse_Fields_Strtoll", "Format_DateTime", "Format_DateTime_Printf", "Format_UInt", "Format_UInt_Printf", "Convert_Posix_Ms", "Convert_Local_Time" };
+
+//+ BENCH_DATA
+struct BENCH_DATA {
+	std::vector<BENCH_MESSAGE> Messages;
+	BENCH_FIELDS Fields;
+	SmsTimeZone Zone;
+	std::string Out;					/// Formatter output
+};
+
+//++ ParseFields
+/// Parse the fields with SmsParse.h (bFast) or strtoll and strcmp
+static uint64_t ParseFields( const BENCH_FIELDS &Fields, bool bFast )
+{
+	uint64_t iChecksum = 0;
+	const char *psz = Fields.Text.c_str();
+	for (size_t i = 0; i + 4 <= Fields.Starts.size(); i += 4) {
+		const char *pszTicks = psz + Fields.Starts[i], *pszIn = psz + Fields.Starts[i + 1], *pszMillis = psz + Fields.Starts[i + 2], *pszType = psz + Fields.Starts[i + 3];
+		if (bFast) {
+			int64_t n = 0;
+			SmsParseInt( pszTicks, Fields.Starts[i + 1] - Fields.Starts[i] - 1, n );
+			iChecksum += n;
+			SmsParseInt( pszMillis, Fields.Starts[i + 3] - Fields.Starts[i + 2] - 1, n );
+			iChecksum += n;
+			iChecksum += SmsSpanIs( pszIn, Fields.Starts[i + 2] - Fields.Starts[i + 1] - 1, "true" ) ? 1 : 0;
+			iChecksum += SmsSpanIs( pszType, strlen( pszType ), "1" ) ? 1 : 0;
+		} else {
+			iChecksum += strtoll( pszTicks, NULL, 10 );
+			iChecksum += strtoll( pszMillis, NULL, 10 );
+			iChecksum += strcmp( pszIn, "true" ) == 0 ? 1 : 0;
+			iChecksum += strcmp( pszType, "1" ) == 0 ? 1 : 0;
+		}
+	}
+	return iChecksum;
+}
+
+//++ Hash
+/// FNV-1a of the formatter output
+static uint64_t Hash( const std::string &s )
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (auto it = s.begin(); it != s.end(); ++it)
+		h = (h ^ (uint8_t)*it) * 0x100000001b3ULL;
+	return h;
+}
+
+//++ RunOp
+static uint64_t RunOp( int iOp, BENCH_DATA &Data )
+{
+	char szBuf[32];
+	uint64_t iChecksum = 0;
+	const std::vector<BENCH_MESSAGE> &Messages = Data.Messages;
+
+	switch (iOp) {
+		case OP_PARSE_FAST:
+		case OP_PARSE_STRTOLL:
+			return ParseFields( Data.Fields, iOp == OP_PARSE_FAST );
+
+		case OP_FORMAT_DATE_FAST:
+		case OP_FORMAT_DATE_PRINTF:
+			Data.Out.clear();
+			for (auto it = Messages.begin(); it != Messages.end(); ++it) {
+				if (iOp == OP_FORMAT_DATE_FAST) {
+					Data.Out.append( szBuf, SmsFormatDateTime( szBuf, it->Timestamp ) );
+				} else {
+					int32_t iYear;
+					uint32_t iMonth, iDay;
+					uint64_t iSeconds = it->Timestamp / 10000000;
+					uint32_t iTimeOfDay = (uint32_t)(iSeconds % 86400);
+					SmsCivilFromDays( (int64_t)(iSeconds / 86400) - SMS_EPOCH_DIFF_DAYS, iYear, iMonth, iDay );
+					Data.Out.append( szBuf, snprintf( szBuf, sizeof( szBuf ), "%d/%02u/%02u %02u:%02u:%02u", iYear, iMonth, iDay, iTimeOfDay / 3600, iTimeOfDay / 60 % 60, iTimeOfDay % 60 ) );
+				}
+			}
+			return Hash( Data.Out );
+
+		case OP_FORMAT_UINT_FAST:
+		case OP_FORMAT_UINT_PRINTF:
+			Data.Out.clear();
+			for (auto it = Messages.begin(); it != Messages.end(); ++it) {
+				if (iOp == OP_FORMAT_UINT_FAST) {
+					Data.Out.append( szBuf, SmsFormatUInt( szBuf, it->Timestamp ) );
+				} else {
+					Data.Out.append( szBuf, snprintf( szBuf, sizeof( szBuf ), "%llu", (unsigned long long)it->Timestamp ) );
+				}
+			}
+			return Hash( Data.Out );
+
+		case OP_TIME_POSIX:
+			/// The SMSBR reader and writer: UTC milliseconds since 1970 <-> SMS_TIME
+			for (auto it = Messages.begin(); it != Messages.end(); ++it)
+				iChecksum += SmsTimeFromPosixMs( SmsTimeToPosixMs( it->Timestamp ) );
+			return iChecksum;
+
+		case OP_TIME_ZONE:
+			/// The CMBK writer and reader: SMS_TIME -> local minutes -> SMS_TIME, in a time zone with daylight saving time
+			for (auto it = Messages.begin(); it != Messages.end(); ++it) {
+				int64_t iLocal = Data.Zone.ToLocal( it->Timestamp );
+				iChecksum += iLocal + Data.Zone.FromLocal( iLocal ) / SMS_TICKS_PER_MINUTE;
+			}
+			return iChecksum;
+	}
+	return 0;
+}
+
+//++ CetBias, CetFromLocal
+/// Central European time, the slow way: +120 from the last Sunday of March 01:00 UTC to the last Sunday of October 01:00 UTC, +60 otherwise
+static int64_t LastSunday( int32_t iYear, uint32_t iMonth )
+{
+	int64_t iDays = SmsDaysFromCivil( iYear, iMonth, 31 );
+	return iDays - (iDays + 4) % 7;			/// 1970/01/01 was a Thursday
+}
+static int32_t CetBias( int64_t iUtcMinutes )
+{
+	int32_t iYear;
+	uint32_t iMonth, iDay;
+	SmsCivilFromDays( iUtcMinutes / 1440 - SMS_EPOCH_DIFF_DAYS, iYear, iMonth, iDay );
+	int64_t iStart = (LastSunday( iYear, 3 ) + SMS_EPOCH_DIFF_DAYS) * 1440 + 60;
+	int64_t iEnd = (LastSunday( iYear, 10 ) + SMS_EPOCH_DIFF_DAYS) * 1440 + 60;
+	return (iUtcMinutes >= iStart && iUtcMinutes < iEnd) ? 120 : 60;
+}
+/// Repeated local times take the offset after the transition (+60), skipped ones the offset before it (+60 too)
+static int64_t CetFromLocal( int64_t iLocalMinutes )
+{
+	bool bSummer = CetBias( iLocalMinutes - 120 ) == 120, bWinter = CetBias( iLocalMinutes - 60 ) == 60;
+	return (bSummer && !bWinter) ? iLocalMinutes - 120 : iLocalMinutes - 60;
+}
+
+//++ Expected
+/// The checksum each operation must produce. Fast and reference operations agree with each other
+static uint64_t Expected( int iOp, BENCH_DATA &Data )
+{
+	switch (iOp) {
+		case OP_PARSE_FAST:
+		case OP_PARSE_STRTOLL:		return Data.Fields.iChecksum;
+		case OP_FORMAT_DATE_FAST:	return RunOp( OP_FORMAT_DATE_PRINTF, Data );
+		case OP_FORMAT_UINT_FAST:	return RunOp( OP_FORMAT_UINT_PRINTF, Data );
+		case OP_TIME_POSIX:
+		case OP_TIME_ZONE: {
+			uint64_t iChecksum = 0;
+			for (auto it = Data.Messages.begin(); it != Data.Messages.end(); ++it) {
+				if (iOp == OP_TIME_POSIX) {
+					iChecksum += it->Timestamp;		/// Whole seconds, no loss
+				} else {
+					int64_t iUtc = (int64_t)(it->Timestamp / SMS_TICKS_PER_MINUTE), iLocal = iUtc + CetBias( iUtc );
+					iChecksum += iLocal + CetFromLocal( iLocal );
+				}
+			}
+			return iChecksum;
+		}
+	}
+	return RunOp( iOp, Data );		/// The references themselves
+}
+
+
+//++ main
+int main( int argc, char *argv[] )
+{
+	size_t iCount = argc > 1 ? (size_t)strtoul( argv[1], NULL, 10 ) : 1000000;
+	unsigned iRepeat = argc > 2 ? (unsigned)strtoul( argv[2], NULL, 10 ) : 5;
+	if (iCount == 0 || iRepeat == 0) {
+		fprintf( stderr, "Usage: sms_bench [message count] [repetitions]\n" );
+		return 2;
+	}
+
+	BENCH_DATA Data;
+	Generate( iCount, Data.Messages );
+	FormatFields( Data.Messages, Data.Fields );
+	Data.Zone.SetRule( "CET-1CEST,M3.5.0,M10.5.0/3" );
+
+	int iFailures = 0;
+	for (int iOp = 0; iOp < OP_COUNT; iOp++) {
+
+		uint64_t iExpected = Expected( iOp, Data ), iResult = 0;
+		std::vector<double> Times;
+		for (unsigned iRun = 0; iRun < iRepeat; iRun++) {
+			auto t0 = std::chrono::steady_clock::now();
+			iResult = RunOp( iOp, Data );
+			auto t1 = std::chrono::steady_clock::now();
+			Times.push_back( std::chrono::duration<double, std::milli>( t1 - t0 ).count() );
+		}
+		if (iResult != iExpected) {
+			fprintf( stderr, "%s: wrong result\n", g_OpNames[iOp] );
+			iFailures++;
+			continue;
+		}
+
+		std::sort( Times.begin(), Times.end() );
+		double fBest = Times.front(), fMedian = Times[Times.size() / 2];
+		double fSeconds = std::max( fBest, 0.001 ) / 1000.0;
+		uint64_t iBytes = (iOp == OP_PARSE_FAST || iOp == OP_PARSE_STRTOLL) ? Data.Fields.Text.size() : (iOp == OP_TIME_POSIX || iOp == OP_TIME_ZONE) ? 0 : Data.Out.size();
+		printf( "{\"op\":\"%s\",\"messages\":%llu,\"bytes\":%llu,\"runs\":%u,\"best_ms\":%.3f,\"median_ms\":%.3f,\"mb_per_s\":%.2f,\"msg_per_s\":%.0f}\n",
+			g_OpNames[iOp], (unsigned long long)iCount, (unsigned long long)iBytes, iRepeat, fBest, fMedian,
+			(double)iBytes / (1024.0 * 1024.0) / fSeconds, (double)iCount / fSeconds
+		);
+	}
+
+	return iFailures ? 1 : 0;
+}
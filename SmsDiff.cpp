@@ -0,0 +1,349 @@
+#include "StdAfx.h"
+#include "SmsDiff.h"
+#include "SmsPhone.h"
+#include "SmsBinary.h"
+#include <algorithm>
+
+
+//!++ Fingerprints
+
+//+ FINGERPRINT
+struct FINGERPRINT {
+	ULONG64 iKey;				/// Timestamp, direction, recipients. Modified messages keep their key
+	ULONG64 iHash;				/// Key, text, read state. Equal messages have equal hashes
+};
+
+static inline ULONG64 HashBytes( _In_ const char *p, _In_ size_t n )		/// FNV-1a
+{
+	ULONG64 h = 0xcbf29ce484222325ULL;
+	for (const char *pEnd = p + n; p < pEnd; p++)
+		h = (h ^ (BYTE)*p) * 0x100000001b3ULL;
+	return h;
+}
+
+static inline ULONG64 Combine( _In_ ULONG64 h, _In_ ULONG64 v )
+{
+	return h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2));
+}
+
+//+ CanonicalPhones
+/// Canonical recipients, in any order (sorted)
+static void CanonicalPhones( _Inout_ SmsPhoneNormalizer &Normalizer, _In_ const SMS &sms, _Out_ std::vector<SMS_PHONE_ID> &Phones )
+{
+	Phones.clear();
+	for (auto it = sms.PhoneId.begin(); it != sms.PhoneId.end(); ++it)
+		Phones.push_back( Normalizer.Canonical( *it ) );
+	std::sort( Phones.begin(), Phones.end() );
+}
+
+//+ MessageStore
+/// Compact copies of a backup's messages (see SmsEncodeRecord), in reading order
+class MessageStore {
+public:
+	void Add( _In_ const SMS &sms )
+	{
+		ULONG64 iPrevTimestamp = 0;		/// Records are decoded one at a time
+		m_Offsets.push_back( m_Records.size() );
+		SmsEncodeRecord( m_Records, sms, iPrevTimestamp );
+	}
+
+	BOOL Get( _In_ ULONG i, _Out_ SMS &sms ) const
+	{
+		ULONG64 iPrevTimestamp = 0;
+		const BYTE *p = (const BYTE*)m_Records.data() + m_Offsets[i], *pEnd = (const BYTE*)m_Records.data() + m_Records.size();
+		return SmsDecodeRecord( p, pEnd, sms, iPrevTimestamp );
+	}
+
+	size_t size() const { return m_Offsets.size(); }
+
+private:
+	std::string m_Records;
+	std::vector<size_t> m_Offsets;
+};
+
+//+ FingerprintSink
+/// Reader -> Fingerprints and messages. Each reader thread has its own (the normalizer isn't thread safe)
+class FingerprintSink: public SmsSink {
+public:
+	FingerprintSink( _In_ ULONG iCountryCode, _Inout_ std::vector<FINGERPRINT> &Prints, _Inout_ MessageStore &Messages ): m_Normalizer( iCountryCode ), m_Prints( Prints ), m_Messages( Messages ) {}
+
+	BOOL Put( _Inout_ SMS &sms )
+	{
+		CanonicalPhones( m_Normalizer, sms, m_Phones );
+
+		FINGERPRINT fp;
+		fp.iKey = Combine( sms.Timestamp, sms.IsIncoming ? 1 : 2 );
+		for (auto it = m_Phones.begin(); it != m_Phones.end(); ++it)
+			fp.iKey = Combine( fp.iKey, *it );
+		fp.iHash = Combine( Combine( fp.iKey, HashBytes( sms.Text.data(), sms.Text.size() ) ), sms.IsRead ? 1 : 2 );
+		m_Prints.push_back( fp );
+		m_Messages.Add( sms );
+		return TRUE;
+	}
+
+private:
+	SmsPhoneNormalizer m_Normalizer;
+	std::vector<FINGERPRINT> &m_Prints;
+	MessageStore &m_Messages;
+	std::vector<SMS_PHONE_ID> m_Phones;
+};
+
+//+ READ_TASK
+struct READ_TASK {
+	ULONG iType;
+	LPCTSTR pszFile;
+	ULONG iCountryCode;
+	std::vector<FINGERPRINT> Prints;
+	MessageStore Messages;
+	ULONG err;
+};
+
+static DWORD WINAPI ReadThread( _In_ LPVOID pParam )
+{
+	READ_TASK *pTask = (READ_TASK*)pParam;
+	FingerprintSink Sink( pTask->iCountryCode, pTask->Prints, pTask->Messages );
+	pTask->err = SmsRead( pTask->iType, pTask->pszFile, Sink );
+	return pTask->err;
+}
+
+
+//!++ Matching
+
+#define NO_MESSAGE		((ULONG)-1)
+
+enum { STATE_UNCHANGED, STATE_REMOVED, STATE_ADDED, STATE_MODIFIED };
+
+//+ MessageChains
+/// Old messages grouped by a 64-bit value (hash or key), in reading order. Take() unlinks the first one that matches
+class MessageChains {
+public:
+	MessageChains( _In_ size_t iCount ): m_Next( iCount, NO_MESSAGE ) {}
+
+	/// Add messages in reverse order, the first added is the last taken
+	void Add( _In_ ULONG64 v, _In_ ULONG i )
+	{
+		auto ins = m_Heads.insert( std::make_pair( v, i ) );
+		if (!ins.second) {
+			m_Next[i] = ins.first->second;
+			ins.first->second = i;
+		}
+	}
+
+	/// IsMatch( i ) confirms the candidates. Messages that only share the 64-bit value stay in the chain
+	template <class MATCH>
+	ULONG Take( _In_ ULONG64 v, _In_ MATCH IsMatch )
+	{
+		auto it = m_Heads.find( v );
+		if (it == m_Heads.end())
+			return NO_MESSAGE;
+		for (ULONG iPrev = NO_MESSAGE, i = it->second; i != NO_MESSAGE; iPrev = i, i = m_Next[i]) {
+			if (IsMatch( i )) {
+				if (iPrev == NO_MESSAGE) {
+					it->second = m_Next[i];
+				} else {
+					m_Next[iPrev] = m_Next[i];
+				}
+				return i;
+			}
+		}
+		return NO_MESSAGE;
+	}
+
+	void Clear()
+	{
+		m_Heads.clear();
+		std::fill( m_Next.begin(), m_Next.end(), NO_MESSAGE );
+	}
+
+private:
+	std::unordered_map<ULONG64, ULONG> m_Heads;
+	std::vector<ULONG> m_Next;
+};
+
+//+ FieldMatcher
+/// Compares the fields of an old and a new message. Recipients are compared in canonical form, in any order
+class FieldMatcher {
+public:
+	FieldMatcher( _In_ ULONG iCountryCode, _In_ const MessageStore &Old, _In_ const MessageStore &New ): m_Normalizer( iCountryCode ), m_Old( Old ), m_New( New ) {}
+
+	/// Equal messages
+	BOOL IsEqual( _In_ ULONG i, _In_ ULONG j )
+	{
+		return Load( i, j ) && m_OldSms.IsRead == m_NewSms.IsRead && m_OldSms.Text == m_NewSms.Text && IsSameKey();
+	}
+
+	/// Same timestamp, direction and recipients
+	BOOL IsSameKey( _In_ ULONG i, _In_ ULONG j )
+	{
+		return Load( i, j ) && IsSameKey();
+	}
+
+private:
+	BOOL Load( _In_ ULONG i, _In_ ULONG j )
+	{
+		return m_Old.Get( i, m_OldSms ) && m_New.Get( j, m_NewSms );
+	}
+
+	BOOL IsSameKey()
+	{
+		if (m_OldSms.Timestamp != m_NewSms.Timestamp || m_OldSms.IsIncoming != m_NewSms.IsIncoming || m_OldSms.PhoneId.size() != m_NewSms.PhoneId.size())
+			return FALSE;
+		CanonicalPhones( m_Normalizer, m_OldSms, m_OldPhones );
+		CanonicalPhones( m_Normalizer, m_NewSms, m_NewPhones );
+		return m_OldPhones == m_NewPhones;
+	}
+
+private:
+	SmsPhoneNormalizer m_Normalizer;
+	const MessageStore &m_Old, &m_New;
+	SMS m_OldSms, m_NewSms;
+	std::vector<SMS_PHONE_ID> m_OldPhones, m_NewPhones;
+};
+
+
+//++ SmsDiff
+ULONG SmsDiff( _In_ ULONG iOldType, _In_ LPCTSTR pszOld, _In_ ULONG iNewType, _In_ LPCTSTR pszNew, _In_ SmsDiffSink &Sink, _Out_opt_ SMS_DIFF_STATS *pStats, _In_ ULONG iCountryCode )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	if (pStats)
+		ZeroMemory( pStats, sizeof( *pStats ) );
+	if (!pszOld || !*pszOld || !pszNew || !*pszNew)
+		return ERROR_INVALID_PARAMETER;
+
+	// Read. The new backup is read on a worker thread, the old one on this thread
+	READ_TASK Old = { iOldType, pszOld, iCountryCode }, New = { iNewType, pszNew, iCountryCode };
+	HANDLE hThread = CreateThread( NULL, 0, ReadThread, &New, 0, NULL );
+	ReadThread( &Old );
+	if (hThread) {
+		WaitForSingleObject( hThread, INFINITE );
+		CloseHandle( hThread );
+	} else {
+		ReadThread( &New );
+	}
+	if ((err = Old.err) != ERROR_SUCCESS || (err = New.err) != ERROR_SUCCESS)
+		return err;
+	if (Old.Prints.size() >= NO_MESSAGE || New.Prints.size() >= NO_MESSAGE)
+		return ERROR_FILE_TOO_LARGE;
+
+	// Match
+	SMS_DIFF_STATS Stats = {0};
+	Stats.iOldCount = (ULONG)Old.Prints.size();
+	Stats.iNewCount = (ULONG)New.Prints.size();
+	std::vector<BYTE> OldStates( Old.Prints.size(), STATE_REMOVED );
+	std::vector<BYTE> NewStates( New.Prints.size(), STATE_ADDED );
+	std::unordered_map<ULONG, ULONG> Pairs;		/// Modified. New index -> Old index
+
+	{
+		MessageChains Chains( Old.Prints.size() );
+		FieldMatcher Matcher( iCountryCode, Old.Messages, New.Messages );
+
+		/// Equal messages
+		for (ULONG i = Stats.iOldCount; i-- > 0;)
+			Chains.Add( Old.Prints[i].iHash, i );
+		for (ULONG j = 0; j < Stats.iNewCount; j++) {
+			ULONG i = Chains.Take( New.Prints[j].iHash, [&]( ULONG iOld ) { return Matcher.IsEqual( iOld, j ); } );
+			if (i != NO_MESSAGE) {
+				OldStates[i] = NewStates[j] = STATE_UNCHANGED;
+				Stats.iUnchanged++;
+			}
+		}
+
+		/// Leftovers with the same key
+		Chains.Clear();
+		for (ULONG i = Stats.iOldCount; i-- > 0;)
+			if (OldStates[i] == STATE_REMOVED)
+				Chains.Add( Old.Prints[i].iKey, i );
+		for (ULONG j = 0; j < Stats.iNewCount; j++) {
+			if (NewStates[j] == STATE_ADDED) {
+				ULONG i = Chains.Take( New.Prints[j].iKey, [&]( ULONG iOld ) { return Matcher.IsSameKey( iOld, j ); } );
+				if (i != NO_MESSAGE) {
+					OldStates[i] = NewStates[j] = STATE_MODIFIED;
+					Pairs[j] = i;
+				}
+			}
+		}
+	}
+	Stats.iModified = (ULONG)Pairs.size();
+	Stats.iRemoved = Stats.iOldCount - Stats.iUnchanged - Stats.iModified;
+	Stats.iAdded = Stats.iNewCount - Stats.iUnchanged - Stats.iModified;
+	std::vector<FINGERPRINT>().swap( Old.Prints );
+	std::vector<FINGERPRINT>().swap( New.Prints );
+
+	// Report, from the stored messages. Modified pairs refer to their old half by index
+	SMS OldSms, NewSms;
+	for (ULONG i = 0; i < Stats.iOldCount && err == ERROR_SUCCESS; i++) {
+		if (OldStates[i] == STATE_REMOVED) {
+			if (!Old.Messages.Get( i, OldSms ))
+				err = ERROR_INVALID_DATA;
+			else if (!Sink.Removed( OldSms ))
+				err = ERROR_CANCELLED;
+		}
+	}
+	for (ULONG j = 0; j < Stats.iNewCount && err == ERROR_SUCCESS; j++) {
+		if (NewStates[j] == STATE_ADDED) {
+			if (!New.Messages.Get( j, NewSms ))
+				err = ERROR_INVALID_DATA;
+			else if (!Sink.Added( NewSms ))
+				err = ERROR_CANCELLED;
+		} else if (NewStates[j] == STATE_MODIFIED) {
+			if (!Old.Messages.Get( Pairs.at( j ), OldSms ) || !New.Messages.Get( j, NewSms ))
+				err = ERROR_INVALID_DATA;
+			else if (!Sink.Modified( OldSms, NewSms ))
+				err = ERROR_CANCELLED;
+		}
+	}
+
+	if (pStats)
+		*pStats = Stats;
+	return err;
+}
+
+
+//++ SmsDiffTextSink
+ULONG SmsDiffTextSink::Open( _In_ LPCTSTR pszFile )
+{
+	if (!pszFile || !*pszFile)
+		return ERROR_INVALID_PARAMETER;
+
+	CHAR szFileA[MAX_PATH];
+	WideCharToMultiByte( CP_UTF8, 0, pszFile, -1, szFileA, ARRAYSIZE( szFileA ), NULL, NULL );
+	m_fout.open( szFileA, std::ios::out | std::ios::binary );
+	return m_fout.is_open() ? ERROR_SUCCESS : ERROR_OPEN_FAILED;
+}
+
+ULONG SmsDiffTextSink::Close()
+{
+	m_fout.close();
+	return m_fout.fail() ? ERROR_WRITE_FAULT : ERROR_SUCCESS;
+}
+
+BOOL SmsDiffTextSink::Print( _In_ CHAR cTag, _In_ const SMS &sms )
+{
+	CHAR szBuf[64];
+	SYSTEMTIME st;
+	FILETIME ft = SmsTimeToFileTime( sms.Timestamp );
+	FileTimeToSystemTime( &ft, &st );
+	StringCchPrintfA( szBuf, ARRAYSIZE( szBuf ), "%c\t%hu/%02hu/%02hu %02hu:%02hu:%02hu\t%s\t", cTag, st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond, sms.IsIncoming ? "In" : "Out" );
+
+	m_Line = szBuf;
+	for (auto it = sms.PhoneId.begin(); it != sms.PhoneId.end(); ++it) {
+		if (it != sms.PhoneId.begin())
+			m_Line += ',';
+		m_Line += SmsPhones().Resolve( *it );
+	}
+	m_Line += '\t';
+	for (auto it = sms.Text.begin(); it != sms.Text.end(); ++it) {
+		switch (*it) {
+			case '\t':	m_Line += "\\t"; break;		/// Column separator
+			case '\r':	m_Line += "\\r"; break;
+			case '\n':	m_Line += "\\n"; break;		/// Line separator
+			case '\\':	m_Line += "\\\\"; break;
+			default:	m_Line += *it;
+		}
+	}
+	m_Line += "\r\n";
+
+	m_fout.write( m_Line.data(), m_Line.size() );
+	return !m_fout.fail();
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "SmsConvert.h"
+#include <fstream>
+
+//? Message-level diff between two backups of the same phone, in any readable format
+//? Messages match if they are equal (see SMS::operator==). Unmatched messages with the same timestamp, direction and recipients are paired as modified (text or read state changed). The rest are added or removed
+//? Both backups are read concurrently, keeping a fingerprint per message (two 64-bit hashes) and a compact copy of the message (see SmsEncodeRecord)
+//? Matching is done with hash tables, in linear time. Hash matches are confirmed by comparing the messages' fields
+//? The differences are reported from the copies. Each backup is read once
+//? Memory is O(old + new): both backups are held (fingerprints and copies) until the report is done, nothing is spilled to disk. Peak, while reading: two SmsReaderFootprint()s on top of that
+//? The report isn't streamed either: the sink hears of the first difference only after both backups are read and matched
+//? Duplicates are counted: two equal messages in the old backup and one in the new backup make one removal
+
+
+//+ SmsDiffSink
+/// Receives the differences. Return FALSE to stop (SmsDiff returns ERROR_CANCELLED)
+class SmsDiffSink {
+public:
+	virtual ~SmsDiffSink() {}
+	virtual BOOL Removed( _In_ const SMS &Old ) = 0;
+	virtual BOOL Added( _In_ const SMS &New ) = 0;
+	virtual BOOL Modified( _In_ const SMS &Old, _In_ const SMS &New ) = 0;
+};
+
+
+//+ SMS_DIFF_STATS
+/// Message counts (SMS records, not SmsCount())
+struct SMS_DIFF_STATS {
+	ULONG iOldCount;
+	ULONG iNewCount;
+	ULONG iUnchanged;
+	ULONG iRemoved;
+	ULONG iAdded;
+	ULONG iModified;
+};
+
+
+//+ SmsDiff
+/// Removed messages are reported first, in old backup order. Added and modified messages follow, in new backup order
+/// Phone numbers are compared in canonical form (see SmsCanonicalPhone). iCountryCode expands national numbers, 0=leave them alone
+ULONG SmsDiff(
+	_In_ ULONG iOldType, _In_ LPCTSTR pszOld,
+	_In_ ULONG iNewType, _In_ LPCTSTR pszNew,
+	_In_ SmsDiffSink &Sink,
+	_Out_opt_ SMS_DIFF_STATS *pStats = NULL,
+	_In_ ULONG iCountryCode = 0
+);
+
+
+//+ SmsDiffTextSink
+/// Plain text report (UTF-8), one line per message:
+///   "-<tab>date<tab>In|Out<tab>phones<tab>text"		Removed
+///   "+<tab>..."										Added
+///   "<<tab>..." followed by ">" + "<tab>..."			Modified (old, new)
+/// Tabs and line breaks in the text are escaped as "\t", "\r" and "\n", backslashes as "\\"
+class SmsDiffTextSink: public SmsDiffSink {
+public:
+	ULONG Open( _In_ LPCTSTR pszFile );
+	ULONG Close();
+
+	BOOL Removed( _In_ const SMS &Old )						{ return Print( '-', Old ); }
+	BOOL Added( _In_ const SMS &New )						{ return Print( '+', New ); }
+	BOOL Modified( _In_ const SMS &Old, _In_ const SMS &New )	{ return Print( '<', Old ) && Print( '>', New ); }
+
+private:
+	BOOL Print( _In_ CHAR cTag, _In_ const SMS &sms );
+private:
+	std::ofstream m_fout;
+	std::string m_Line;
+};
@@ -0,0 +1,72 @@
+#include "StdAfx.h"
+#include "SmsFilter.h"
+#include <algorithm>
+
+
+//++ SmsFilter
+SmsFilter::SmsFilter( _In_ ULONG iCountryCode ):
+	m_iFrom( SMS_TIME_MIN ),
+	m_iTo( SMS_TIME_MAX ),
+	m_iIncoming( -1 ),
+	m_iRead( -1 ),
+	m_Normalizer( iCountryCode )
+{
+}
+
+void SmsFilter::SetTimeRange( _In_ SMS_TIME iFrom, _In_ SMS_TIME iTo )
+{
+	m_iFrom = iFrom;
+	m_iTo = iTo;
+}
+
+void SmsFilter::NarrowTimeRange( _In_ SMS_TIME iFrom, _In_ SMS_TIME iTo )
+{
+	m_iFrom = __max( m_iFrom, iFrom );
+	m_iTo = __min( m_iTo, iTo );
+}
+
+void SmsFilter::SetDirection( _In_ BOOL bIncoming )
+{
+	m_iIncoming = bIncoming ? 1 : 0;
+}
+
+void SmsFilter::SetReadState( _In_ BOOL bRead )
+{
+	m_iRead = bRead ? 1 : 0;
+}
+
+void SmsFilter::AddContact( _In_ LPCSTR pszPhone )
+{
+	m_Contacts.insert( m_Normalizer.Canonical( SmsPhones().Intern( pszPhone ) ) );
+}
+
+void SmsFilter::SetText( _In_ LPCSTR pszText )
+{
+	m_sText = pszText ? pszText : "";
+}
+
+BOOL SmsFilter::TestPhone( _In_ SMS_PHONE_ID iPhone )
+{
+	return m_Contacts.empty() || m_Contacts.find( m_Normalizer.Canonical( iPhone ) ) != m_Contacts.end();
+}
+
+BOOL SmsFilter::TestText( _In_ LPCSTR pszText, _In_ size_t iLen ) const
+{
+	if (m_sText.empty())
+		return TRUE;
+	return std::search( pszText, pszText + iLen, m_sText.begin(), m_sText.end() ) != pszText + iLen;
+}
+
+BOOL SmsFilter::Test( _Inout_ SMS &sms )
+{
+	if (!TestTime( sms.Timestamp ) || !TestFlags( sms.IsIncoming, sms.IsRead ))
+		return FALSE;
+
+	if (HasContacts()) {
+		sms.PhoneId.erase( std::remove_if( sms.PhoneId.begin(), sms.PhoneId.end(), [this]( SMS_PHONE_ID iPhone ) { return !TestPhone( iPhone ); } ), sms.PhoneId.end() );
+		if (sms.PhoneId.empty())
+			return FALSE;
+	}
+
+	return TestText( sms.Text.c_str(), sms.Text.size() );
+}
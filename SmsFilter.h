@@ -0,0 +1,49 @@
+#pragma once
+
+#include "SmsConvert.h"
+#include "SmsPhone.h"
+#include <unordered_set>
+
+//? Message filter, pushed down into the readers
+//? Readers test the cheap fields (timestamp, direction, read state, phone number) first. The text is decoded and copied only if everything else matched
+//? All criteria must match. Criteria that aren't set match everything
+
+
+//+ SmsFilter
+class SmsFilter {
+public:
+	SmsFilter( _In_ ULONG iCountryCode = 0 );		/// Contacts are compared in canonical form (see SmsCanonicalPhone)
+
+	void SetTimeRange( _In_ SMS_TIME iFrom, _In_ SMS_TIME iTo );		/// [iFrom, iTo). See SMS_TIME_MIN, SMS_TIME_MAX
+	void NarrowTimeRange( _In_ SMS_TIME iFrom, _In_ SMS_TIME iTo );	/// Intersect the current range with [iFrom, iTo)
+	void SetDirection( _In_ BOOL bIncoming );
+	void SetReadState( _In_ BOOL bRead );
+	void AddContact( _In_ LPCSTR pszPhone );
+	void SetText( _In_ LPCSTR pszText );							/// UTF-8 substring, case sensitive
+
+	BOOL HasContacts() const { return !m_Contacts.empty(); }
+
+	//+ Individual tests, cheapest first
+	BOOL TestTime( _In_ SMS_TIME Timestamp ) const
+	{
+		return Timestamp >= m_iFrom && Timestamp < m_iTo;
+	}
+	BOOL TestFlags( _In_ bool IsIncoming, _In_ bool IsRead ) const
+	{
+		return (m_iIncoming < 0 || m_iIncoming == (int)IsIncoming) && (m_iRead < 0 || m_iRead == (int)IsRead);
+	}
+	BOOL TestPhone( _In_ SMS_PHONE_ID iPhone );		/// Is the number in the contact set?
+	BOOL TestText( _In_ LPCSTR pszText, _In_ size_t iLen ) const;
+
+	/// All tests, on a parsed message. Drops the recipients that don't match the contact set
+	/// Returns FALSE if the message is rejected
+	BOOL Test( _Inout_ SMS &sms );
+
+private:
+	SMS_TIME m_iFrom, m_iTo;
+	int m_iIncoming;					/// -1=Any, 0=Outgoing, 1=Incoming
+	int m_iRead;						/// -1=Any, 0=Unread, 1=Read
+	std::unordered_set<SMS_PHONE_ID> m_Contacts;		/// Canonical ids
+	SmsPhoneNormalizer m_Normalizer;
+	std::string m_sText;
+};
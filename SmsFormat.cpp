@@ -0,0 +1,9 @@
+#include "SmsFormat.h"
+
+//? Standard C++ only, compiled without the precompiled header (see sms_w2a.vcxproj)
+
+
+//+ g_szDigitPairs
+const char g_szDigitPairs[201] =
+	"00010203040506070809" "10111213141516171819" "20212223242526272829" "30313233343536373839" "40414243444546474849"
+	"50515253545556575859" "60616263646566676869" "70717273747576777879" "80818283848586878889" "90919293949596979899";
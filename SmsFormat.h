@@ -0,0 +1,70 @@
+#pragma once
+
+//? Fast formatters for the writers. They write straight into the caller's buffer, without a terminator, and return the number of characters
+//? Output is identical to the StringCchPrintfA formats they replace
+//? Standard C++ only, no Windows headers
+
+#include "SmsTime.h"
+#include <string.h>
+
+
+//+ g_szDigitPairs
+/// "00" .. "99" (SmsFormat.cpp)
+extern const char g_szDigitPairs[201];
+
+//+ SmsFormatUInt
+/// Same as "%I64u". Up to 20 characters. Digits are produced two at a time, from a table
+inline size_t SmsFormatUInt( char *pszOut, uint64_t n )
+{
+	char szBuf[20];
+	char *p = szBuf + sizeof( szBuf );
+	while (n >= 100) {
+		uint32_t i = (uint32_t)(n % 100) * 2;
+		n /= 100;
+		*--p = g_szDigitPairs[i + 1];
+		*--p = g_szDigitPairs[i];
+	}
+	if (n >= 10) {
+		*--p = g_szDigitPairs[n * 2 + 1];
+		*--p = g_szDigitPairs[n * 2];
+	} else {
+		*--p = (char)('0' + n);
+	}
+	size_t iLen = szBuf + sizeof( szBuf ) - p;
+	memcpy( pszOut, p, iLen );
+	return iLen;
+}
+
+//+ SmsFormat2
+/// Same as "%02hu" for 0..99
+inline char* SmsFormat2( char *pszOut, uint32_t n )
+{
+	pszOut[0] = g_szDigitPairs[n * 2];
+	pszOut[1] = g_szDigitPairs[n * 2 + 1];
+	return pszOut + 2;
+}
+
+//+ SmsFormatDateTime
+/// UTC -> "Y/MM/DD hh:mm:ss", with the year not padded
+/// Same as FileTimeToSystemTime + "%hu/%02hu/%02hu %02hu:%02hu:%02hu". Up to 19 characters
+inline size_t SmsFormatDateTime( char *pszOut, SMS_TIME t )
+{
+	uint64_t iSeconds = t / 10000000;
+	uint32_t iTimeOfDay = (uint32_t)(iSeconds % 86400);
+	int32_t iYear;
+	uint32_t iMonth, iDay;
+	SmsCivilFromDays( (int64_t)(iSeconds / 86400) - SMS_EPOCH_DIFF_DAYS, iYear, iMonth, iDay );		/// 1601/01/01 -> 1970/01/01
+
+	char *p = pszOut + SmsFormatUInt( pszOut, (uint64_t)iYear );
+	*p++ = '/';
+	p = SmsFormat2( p, iMonth );
+	*p++ = '/';
+	p = SmsFormat2( p, iDay );
+	*p++ = ' ';
+	p = SmsFormat2( p, iTimeOfDay / 3600 );
+	*p++ = ':';
+	p = SmsFormat2( p, iTimeOfDay / 60 % 60 );
+	*p++ = ':';
+	p = SmsFormat2( p, iTimeOfDay % 60 );
+	return p - pszOut;
+}
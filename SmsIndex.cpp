@@ -0,0 +1,137 @@
+#include "StdAfx.h"
+#include "SmsIndex.h"
+#include <algorithm>
+#include <numeric>
+
+
+//++ SmsIndex
+SmsIndex::SmsIndex( _In_ ULONG iCountryCode ):
+	m_Normalizer( iCountryCode ),
+	m_bSorted( TRUE ),
+	m_bSealed( FALSE )
+{
+}
+
+ULONG SmsIndex::Load( _In_ ULONG iType, _In_ LPCTSTR pszFile )
+{
+	ULONG err = SmsRead( iType, pszFile, *this );
+	if (err == ERROR_SUCCESS)
+		Seal();
+	return err;
+}
+
+BOOL SmsIndex::Put( _Inout_ SMS &sms )
+{
+	ULONG iId = (ULONG)m_Messages.size();
+	if (iId > 0 && TimeOf( iId - 1 ) > sms.Timestamp)
+		m_bSorted = FALSE;
+	m_bSealed = FALSE;
+
+	m_Messages.push_back( std::move( sms ) );
+	Post( iId );
+	return TRUE;
+}
+
+void SmsIndex::Post( _In_ ULONG iId )
+{
+	const SMS &sms = m_Messages[iId];
+	for (auto it = sms.PhoneId.begin(); it != sms.PhoneId.end(); ++it) {
+		SMS_POSTINGS &Postings = m_Postings[m_Normalizer.Canonical( *it )];
+		if (Postings.empty() || Postings.back() != iId)		/// Recipients may share the canonical form
+			Postings.push_back( iId );
+	}
+}
+
+void SmsIndex::Seal()
+{
+	if (!m_bSorted) {
+
+		/// Chronological order -> new ids
+		std::vector<ULONG> Order( m_Messages.size() );
+		std::iota( Order.begin(), Order.end(), 0 );
+		std::stable_sort( Order.begin(), Order.end(), [this]( ULONG a, ULONG b ) { return TimeOf( a ) < TimeOf( b ); } );
+
+		std::vector<SMS> Messages;
+		Messages.reserve( m_Messages.size() );
+		for (auto it = Order.begin(); it != Order.end(); ++it)
+			Messages.push_back( std::move( m_Messages[*it] ) );
+		m_Messages.swap( Messages );
+
+		/// Rebuild the posting lists. Their capacity is reused
+		for (auto it = m_Postings.begin(); it != m_Postings.end(); ++it)
+			it->second.clear();
+		for (ULONG iId = 0; iId < (ULONG)m_Messages.size(); iId++)
+			Post( iId );
+
+		m_bSorted = TRUE;
+	}
+	m_bSealed = TRUE;
+}
+
+void SmsIndex::GetContacts( _Out_ std::vector<SMS_PHONE_ID> &Contacts ) const
+{
+	Contacts.clear();
+	Contacts.reserve( m_Postings.size() );
+	for (auto it = m_Postings.begin(); it != m_Postings.end(); ++it)
+		Contacts.push_back( it->first );
+}
+
+const SMS_POSTINGS* SmsIndex::Find( _In_ SMS_PHONE_ID iPhone )
+{
+	assert( m_bSealed );
+	auto it = m_Postings.find( m_Normalizer.Canonical( iPhone ) );
+	return (it != m_Postings.end() && !it->second.empty()) ? &it->second : NULL;
+}
+
+const SMS_POSTINGS* SmsIndex::Find( _In_ LPCSTR pszPhone )
+{
+	return Find( SmsPhones().Intern( pszPhone ) );
+}
+
+void SmsIndex::Query( _In_ SMS_PHONE_ID iPhone, _In_ SMS_TIME iFrom, _In_ SMS_TIME iTo, _Out_ SMS_POSTINGS::const_iterator &itBegin, _Out_ SMS_POSTINGS::const_iterator &itEnd )
+{
+	static const SMS_POSTINGS Empty;
+	const SMS_POSTINGS *pPostings = Find( iPhone );
+	if (!pPostings)
+		pPostings = &Empty;
+
+	itBegin = std::lower_bound( pPostings->begin(), pPostings->end(), iFrom, [this]( ULONG iId, ULONG64 t ) { return TimeOf( iId ) < t; } );
+	itEnd = std::lower_bound( itBegin, pPostings->end(), iTo, [this]( ULONG iId, ULONG64 t ) { return TimeOf( iId ) < t; } );
+}
+
+ULONG SmsIndex::Export( _In_ SMS_PHONE_ID iPhone, _In_ SmsWriter &Writer, _In_ BOOL bNewestFirst, _In_opt_ SMS_TIME iFrom, _In_opt_ SMS_TIME iTo )
+{
+	SMS_POSTINGS::const_iterator itBegin, itEnd;
+	Query( iPhone, iFrom, iTo, itBegin, itEnd );
+
+	/// One record per message, addressed to the contact alone. The other recipients of a group message are not exported
+	SMS_PHONE_ID iContact = m_Normalizer.Canonical( iPhone );
+	SMS sms;
+	auto WriteOne = [&]( ULONG iId ) -> ULONG {
+		const SMS &Source = m_Messages[iId];
+		sms.Timestamp = Source.Timestamp;
+		sms.IsIncoming = Source.IsIncoming;
+		sms.IsRead = Source.IsRead;
+		sms.Text = Source.Text;
+		sms.PhoneId.clear();
+		for (auto it = Source.PhoneId.begin(); it != Source.PhoneId.end(); ++it) {
+			if (m_Normalizer.Canonical( *it ) == iContact) {
+				sms.PhoneId.push_back( *it );		/// The number as the message spells it
+				break;
+			}
+		}
+		return Writer.Write( sms );
+	};
+
+	ULONG err = Writer.Begin( (ULONG)(itEnd - itBegin) );
+	if (bNewestFirst) {
+		for (auto it = itEnd; it != itBegin && err == ERROR_SUCCESS; )
+			err = WriteOne( *--it );
+	} else {
+		for (auto it = itBegin; it != itEnd && err == ERROR_SUCCESS; ++it)
+			err = WriteOne( *it );
+	}
+	if (err == ERROR_SUCCESS)
+		err = Writer.End();
+	return err;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "SmsConvert.h"
+#include "SmsPhone.h"
+
+//? Per-contact conversation index
+//? Messages are stored in a vector, their position is the message id. Every contact (canonical phone number) owns a posting list of the ids of its messages
+//? After Seal(), ids are in chronological order. Posting lists are sorted as well, which turns time-range queries into two binary searches
+
+
+//+ SMS_POSTINGS
+typedef std::vector<ULONG> SMS_POSTINGS;		/// Message ids, ascending
+
+
+//+ SmsIndex
+/// Pass it to SmsRead() as a sink, then call Seal() before querying. See also Load()
+class SmsIndex: public SmsSink {
+public:
+	SmsIndex( _In_ ULONG iCountryCode = 0 );		/// Default country code of national numbers (see SmsCanonicalPhone)
+
+	/// Read and index a file
+	ULONG Load( _In_ ULONG iType, _In_ LPCTSTR pszFile );
+
+	/// SmsSink. The message is indexed as it arrives
+	BOOL Put( _Inout_ SMS &sms );
+
+	/// Done adding messages. Put them in chronological order (stable), if they aren't already
+	void Seal();
+
+	ULONG GetMessageCount() const { return (ULONG)m_Messages.size(); }
+	const SMS& GetMessage( _In_ ULONG iId ) const { return m_Messages[iId]; }
+
+	/// Canonical ids of all contacts
+	void GetContacts( _Out_ std::vector<SMS_PHONE_ID> &Contacts ) const;
+
+	/// Messages exchanged with a contact. Returns NULL if there are none
+	const SMS_POSTINGS* Find( _In_ SMS_PHONE_ID iPhone );
+	const SMS_POSTINGS* Find( _In_ LPCSTR pszPhone );
+
+	ULONG GetCount( _In_ SMS_PHONE_ID iPhone )		{ auto p = Find( iPhone ); return p ? (ULONG)p->size() : 0; }
+
+	/// Messages exchanged with a contact in [iFrom, iTo)
+	/// The result is a range of the posting list, valid until the index changes
+	void Query( _In_ SMS_PHONE_ID iPhone, _In_ SMS_TIME iFrom, _In_ SMS_TIME iTo, _Out_ SMS_POSTINGS::const_iterator &itBegin, _Out_ SMS_POSTINGS::const_iterator &itEnd );
+
+	/// Write a conversation (Begin, Write..., End), optionally limited to [iFrom, iTo)
+	/// Group messages are written with the contact as their only recipient
+	ULONG Export( _In_ SMS_PHONE_ID iPhone, _In_ SmsWriter &Writer, _In_ BOOL bNewestFirst, _In_opt_ SMS_TIME iFrom = SMS_TIME_MIN, _In_opt_ SMS_TIME iTo = SMS_TIME_MAX );
+
+private:
+	void Post( _In_ ULONG iId );
+	SMS_TIME TimeOf( _In_ ULONG iId ) const { return m_Messages[iId].Timestamp; }
+
+private:
+	std::vector<SMS> m_Messages;
+	std::unordered_map<SMS_PHONE_ID, SMS_POSTINGS> m_Postings;		/// Canonical phone id -> Message ids
+	SmsPhoneNormalizer m_Normalizer;
+	BOOL m_bSorted;					/// Messages arrived in chronological order, so far
+	BOOL m_bSealed;
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+//? Fast parsers for the readers. They work on (pointer, length) spans, no terminator required
+//? Decimal integers are converted eight digits at a time, with SWAR arithmetic (SIMD within a 64-bit register)
+//? Byte order is little endian (x86, x64, ARM)
+//? Standard C++ only, no Windows headers
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+//+ SwarAllDigits
+/// true if all eight characters are '0'..'9'
+inline bool SwarAllDigits( uint64_t v )
+{
+	return ((v & 0xF0F0F0F0F0F0F0F0ULL) | (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4)) == 0x3333333333333333ULL;
+}
+
+//+ SwarParse8
+/// Eight digits -> 0..99999999. The first character is in the low byte
+inline uint32_t SwarParse8( uint64_t v )
+{
+	v = ((v & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;				/// 10 * 256 + 1: pairs of digits, in 16-bit lanes
+	v = ((v & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;			/// 100 * 65536 + 1: groups of four, in 32-bit lanes
+	return (uint32_t)(((v & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32);		/// 10000 * 2^32 + 1
+}
+
+//+ SmsParseUInt
+/// Unsigned decimal integer. Parsing stops at the first non-digit
+/// piDigits receives the number of digits consumed (0 = none, the result is 0)
+/// Returns false if the value is above 2^64-1 (more than 20 significant digits, or 20 digits above 18446744073709551615). n is then undefined
+inline bool SmsParseUInt( const char *p, size_t iLen, uint64_t &n, size_t *piDigits = NULL )
+{
+	const char *q = p, *pEnd = p + iLen;
+	bool bOk = true;
+	n = 0;
+	while (pEnd - q >= 8) {
+		uint64_t v;
+		memcpy( &v, q, sizeof( v ) );
+		if (!SwarAllDigits( v ))
+			break;
+		uint32_t x = SwarParse8( v );
+		bOk &= (n < 184467440737ULL || (n == 184467440737ULL && x <= 9551615));		/// 2^64-1 = 184467440737 * 10^8 + 9551615
+		n = n * 100000000 + x;
+		q += 8;
+	}
+	for (; q < pEnd && (uint8_t)(*q - '0') < 10; q++) {
+		uint8_t d = (uint8_t)(*q - '0');
+		bOk &= (n < 1844674407370955161ULL || (n == 1844674407370955161ULL && d <= 5));
+		n = n * 10 + d;
+	}
+	if (piDigits)
+		*piDigits = q - p;
+	return bOk;
+}
+
+//+ SmsParseInt
+/// Same as StrToInt64ExA( STIF_DEFAULT ): optional leading blanks and sign, then decimal digits up to the first non-digit. 0 if there are no digits
+/// Returns false if the value is outside the int64_t range. n is then undefined
+inline bool SmsParseInt( const char *p, size_t iLen, int64_t &n )
+{
+	const char *pEnd = p + iLen;
+	while (p < pEnd && (*p == ' ' || *p == '\t'))
+		p++;
+	bool bNegative = false;
+	if (p < pEnd && (*p == '-' || *p == '+'))
+		bNegative = (*p++ == '-');
+	uint64_t u;
+	if (!SmsParseUInt( p, pEnd - p, u ) || u > (uint64_t)INT64_MAX + (bNegative ? 1 : 0))
+		return false;
+	n = bNegative ? (int64_t)(0 - u) : (int64_t)u;
+	return true;
+}
+
+
+//+ SmsSpanIs
+/// Case insensitive comparison of a span with a lower case ASCII literal ("true", "1", etc.). Same result as EqualStrA for such tokens
+/// The literal's length is known at compile time, the loop is unrolled
+template<size_t N>
+inline bool SmsSpanIs( const char *p, size_t iLen, const char (&szLiteral)[N] )
+{
+	if (iLen != N - 1)
+		return false;
+	for (size_t i = 0; i < N - 1; i++) {
+		char c = p[i];
+		if (szLiteral[i] >= 'a' && szLiteral[i] <= 'z')
+			c |= 0x20;				/// Only 'X' and 'x' fold to 'x'
+		if (c != szLiteral[i])
+			return false;
+	}
+	return true;
+}
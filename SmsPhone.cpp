@@ -0,0 +1,126 @@
+#include "StdAfx.h"
+#include "SmsPhone.h"
+#include <algorithm>
+
+
+#define SMS_PHONE_MIN_DIGITS		7			/// Shorter numbers are service/short codes
+#define SMS_PHONE_MAX_DIGITS		15			/// E.164
+
+//+ Character classes
+#define PO		0		/// Other. The input is not a phone number
+#define PD		1		/// Digit
+#define PP		2		/// Plus
+#define PS		3		/// Separator
+
+static const BYTE g_PhoneCharClass[256] = {
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PS, PO, PO, PO, PO, PO, PO,		/// 00
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// 10
+	PS, PO, PO, PO, PO, PO, PO, PO, PS, PS, PO, PP, PO, PS, PS, PS,		/// 20
+	PD, PD, PD, PD, PD, PD, PD, PD, PD, PD, PO, PO, PO, PO, PO, PO,		/// 30
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// 40
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// 50
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// 60
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// 70
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// 80
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// 90
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// A0
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// B0
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// C0
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// D0
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// E0
+	PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO, PO,		/// F0
+};
+
+
+//++ SmsCanonicalPhone
+BOOL SmsCanonicalPhone( _In_ LPCSTR pszPhone, _In_ size_t iLen, _In_ ULONG iCountryCode, _Out_ std::string &Out )
+{
+	BOOL bPlus = FALSE;
+
+	Out.clear();
+
+	/// Keep the digits, drop the separators
+	for (size_t i = 0; i < iLen; i++) {
+		CHAR ch = pszPhone[i];
+		switch (g_PhoneCharClass[(BYTE)ch]) {
+			case PD:
+				Out.push_back( ch );
+				break;
+			case PP:
+				if (bPlus || !Out.empty())
+					return FALSE;
+				bPlus = TRUE;
+				break;
+			case PS:
+				/// "+44 (0)20..." The national trunk prefix doesn't belong to the international number
+				if (ch == '(' && bPlus && i + 2 < iLen && pszPhone[i + 1] == '0' && pszPhone[i + 2] == ')')
+					i += 2;
+				break;
+			default:
+				return FALSE;
+		}
+	}
+
+	if (Out.size() < SMS_PHONE_MIN_DIGITS)
+		return FALSE;
+
+	if (bPlus) {
+		Out.insert( 0, 1, '+' );					/// +CC...
+	} else if (Out[0] == '0' && Out[1] == '0') {
+		Out.replace( 0, 2, 1, '+' );				/// 00CC...
+	} else if (Out[0] == '0' && iCountryCode) {
+		CHAR szCC[16];
+		StringCchPrintfA( szCC, ARRAYSIZE( szCC ), "+%u", iCountryCode );
+		Out.replace( 0, 1, szCC );					/// 0... (national)
+	} else {
+		return FALSE;								/// No prefix. Can't tell
+	}
+
+	return (Out.size() - 1 <= SMS_PHONE_MAX_DIGITS);
+}
+
+
+//++ SmsPhoneNormalizer
+/// Country code -> Canonical id of every phone id looked up so far (SMS_PHONE_ID_NONE for the others)
+static SRWLOCK g_CanonicalLock = SRWLOCK_INIT;
+static std::unordered_map<ULONG, std::vector<SMS_PHONE_ID>> g_CanonicalIds;
+
+SMS_PHONE_ID SmsPhoneNormalizer::Lookup( _In_ SMS_PHONE_ID iId )
+{
+	SMS_PHONE_ID iCanonical;
+
+	AcquireSRWLockExclusive( &g_CanonicalLock );
+	std::vector<SMS_PHONE_ID> &Map = g_CanonicalIds[m_iCountryCode];
+	if (iId >= Map.size())
+		Map.resize( iId + 1, SMS_PHONE_ID_NONE );
+	if ((iCanonical = Map[iId]) == SMS_PHONE_ID_NONE) {
+		std::string Buf;
+		const utf8string &sPhone = SmsPhones().Resolve( iId );
+		iCanonical = iId;
+		if (SmsCanonicalPhone( sPhone.c_str(), sPhone.size(), m_iCountryCode, Buf ) && Buf != sPhone)
+			iCanonical = SmsPhones().Intern( Buf.c_str(), Buf.size() );		/// Canonical forms are interned as well
+		Map[iId] = iCanonical;
+	}
+	ReleaseSRWLockExclusive( &g_CanonicalLock );
+
+	if (iId >= m_Map.size())
+		m_Map.resize( __max( (size_t)iId + 1, m_Map.size() * 2 ), SMS_PHONE_ID_NONE );
+	m_Map[iId] = iCanonical;
+	return iCanonical;
+}
+
+
+//++ SmsNormalizeStage
+ULONG SmsNormalizeStage::Process( _Inout_ SMS_BATCH &Batch )
+{
+	for (auto it = Batch.begin(); it != Batch.end(); ++it) {
+		auto itOut = it->PhoneId.begin();
+		for (auto itId = it->PhoneId.begin(); itId != it->PhoneId.end(); ++itId) {
+			SMS_PHONE_ID iId = m_Normalizer.Canonical( *itId );
+			if (std::find( it->PhoneId.begin(), itOut, iId ) == itOut)
+				*itOut++ = iId;
+		}
+		it->PhoneId.erase( itOut, it->PhoneId.end() );
+	}
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "SmsConvert.h"
+#include "SmsPipeline.h"
+
+//? Phone number normalization
+//? The same contact may be written as "+40 000 000 001", "0040000000001", "0000000001" or "+40000000001"
+//? Numbers are reduced to their E.164 form ("+" country code, subscriber number). Anything that doesn't look like a phone number (alphanumeric senders, short codes) is left alone
+
+
+//++ SmsCanonicalPhone
+/// Canonical form of a phone number. Returns FALSE if the input is not a phone number (Out is undefined)
+/// iCountryCode is the default country code, used to expand national numbers (trunk prefix "0"). 0=leave national numbers alone
+BOOL SmsCanonicalPhone( _In_ LPCSTR pszPhone, _In_ size_t iLen, _In_ ULONG iCountryCode, _Out_ std::string &Out );
+
+
+#define SMS_PHONE_ID_NONE ((SMS_PHONE_ID)-1)		/// Not a phone id
+
+//+ SmsPhoneNormalizer
+/// Maps interned phone ids (see SmsPhones()) to the ids of their canonical forms
+/// A number is canonicalized the first time it's looked up, once per process and country code. All normalizers share the results
+/// Each normalizer keeps a copy of the ids it has looked up, repeated lookups don't lock
+class SmsPhoneNormalizer {
+public:
+	SmsPhoneNormalizer( _In_ ULONG iCountryCode ): m_iCountryCode( iCountryCode ) {}
+
+	/// Canonical id
+	SMS_PHONE_ID Canonical( _In_ SMS_PHONE_ID iId )
+	{
+		if (iId < m_Map.size() && m_Map[iId] != SMS_PHONE_ID_NONE)
+			return m_Map[iId];
+		return Lookup( iId );
+	}
+
+private:
+	SMS_PHONE_ID Lookup( _In_ SMS_PHONE_ID iId );
+
+private:
+	ULONG m_iCountryCode;
+	std::vector<SMS_PHONE_ID> m_Map;		/// Indexed by id. SMS_PHONE_ID_NONE if not looked up yet
+};
+
+
+//+ SmsNormalizeStage
+/// Replace phone numbers with their canonical form. Recipients that become identical are merged
+/// Optional. Conversions keep the numbers as they are, unless the stage is added (see OnButtonConvert)
+class SmsNormalizeStage: public SmsStage {
+public:
+	SmsNormalizeStage( _In_ ULONG iCountryCode ): m_Normalizer( iCountryCode ) {}
+	ULONG Process( _Inout_ SMS_BATCH &Batch );
+private:
+	SmsPhoneNormalizer m_Normalizer;
+};
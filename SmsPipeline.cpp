@@ -0,0 +1,560 @@
+#include "StdAfx.h"
+#include "SmsPipeline.h"
+#include "SmsCheckpoint.h"
+#include "SmsBinary.h"
+#include "SmsTrace.h"
+#include <algorithm>
+
+
+//++ SmsBatchQueue
+SmsBatchQueue::SmsBatchQueue( _In_ ULONG iMaxBatches ):
+	m_iMaxBatches( iMaxBatches > 0 ? iMaxBatches : 1 ),
+	m_iCountHint( SMS_COUNT_UNKNOWN ),
+	m_bClosed( FALSE ),
+	m_bAborted( FALSE )
+{
+	InitializeCriticalSection( &m_cs );
+	InitializeConditionVariable( &m_cvNotFull );
+	InitializeConditionVariable( &m_cvNotEmpty );
+}
+
+SmsBatchQueue::~SmsBatchQueue()
+{
+	DeleteCriticalSection( &m_cs );
+}
+
+BOOL SmsBatchQueue::Push( _Inout_ SMS_BATCH &Batch )
+{
+	BOOL bOK = FALSE;
+	EnterCriticalSection( &m_cs );
+	while (!m_bAborted && m_Batches.size() >= m_iMaxBatches)
+		SleepConditionVariableCS( &m_cvNotFull, &m_cs, INFINITE );
+	if (!m_bAborted) {
+		assert( !m_bClosed );
+		m_Batches.push_back( std::move( Batch ) );
+		bOK = TRUE;
+	}
+	LeaveCriticalSection( &m_cs );
+	Batch.clear();
+	if (bOK)
+		WakeConditionVariable( &m_cvNotEmpty );
+	return bOK;
+}
+
+BOOL SmsBatchQueue::Pop( _Out_ SMS_BATCH &Batch )
+{
+	BOOL bOK = FALSE;
+	Batch.clear();
+	EnterCriticalSection( &m_cs );
+	while (!m_bAborted && !m_bClosed && m_Batches.empty())
+		SleepConditionVariableCS( &m_cvNotEmpty, &m_cs, INFINITE );
+	if (!m_bAborted && !m_Batches.empty()) {
+		Batch = std::move( m_Batches.front() );
+		m_Batches.pop_front();
+		bOK = TRUE;
+	}
+	LeaveCriticalSection( &m_cs );
+	if (bOK)
+		WakeConditionVariable( &m_cvNotFull );
+	return bOK;
+}
+
+void SmsBatchQueue::Close()
+{
+	EnterCriticalSection( &m_cs );
+	m_bClosed = TRUE;
+	LeaveCriticalSection( &m_cs );
+	WakeAllConditionVariable( &m_cvNotEmpty );
+}
+
+void SmsBatchQueue::Abort()
+{
+	EnterCriticalSection( &m_cs );
+	m_bAborted = TRUE;
+	m_Batches.clear();
+	LeaveCriticalSection( &m_cs );
+	WakeAllConditionVariable( &m_cvNotEmpty );
+	WakeAllConditionVariable( &m_cvNotFull );
+}
+
+void SmsBatchQueue::SetCountHint( _In_ ULONG iCount )
+{
+	EnterCriticalSection( &m_cs );
+	m_iCountHint = iCount;
+	LeaveCriticalSection( &m_cs );
+}
+
+ULONG SmsBatchQueue::GetCountHint()
+{
+	EnterCriticalSection( &m_cs );
+	ULONG iCount = m_iCountHint;
+	LeaveCriticalSection( &m_cs );
+	return iCount;
+}
+
+
+//++ SmsQueueSink
+BOOL SmsQueueSink::Put( _Inout_ SMS &sms )
+{
+	m_Batch.push_back( std::move( sms ) );
+	if (m_Batch.size() >= SMS_BATCH_SIZE)
+		return Flush();
+	return TRUE;
+}
+
+BOOL SmsQueueSink::Flush()
+{
+	BOOL bOK = TRUE;
+	if (!m_Batch.empty()) {
+		bOK = m_Queue.Push( m_Batch );
+		m_Batch.reserve( SMS_BATCH_SIZE );
+	}
+	return bOK;
+}
+
+
+//++ SmsRunReader
+/// Sequential reader of a sorted run, written by SmsSortStage::SpillRun
+/// Run file: {[record length][record]}...
+#define SMS_RUN_IO_SIZE		(256 * 1024)
+
+class SmsRunReader {
+public:
+	SmsRunReader( _In_ HANDLE hFile ): m_hFile( hFile ), m_iPos( 0 ), m_bEof( FALSE ), m_iPrevTimestamp( 0 ) {}
+
+	/// Returns ERROR_HANDLE_EOF at the end of the run
+	ULONG Next( _Out_ SMS &sms )
+	{
+		ULONG err = Fill( 10 );		/// Longest varint
+		if (err != ERROR_SUCCESS)
+			return err;
+		if (m_iPos == m_Buf.size())
+			return ERROR_HANDLE_EOF;
+
+		const BYTE *p = m_Buf.data() + m_iPos, *pEnd = m_Buf.data() + m_Buf.size();
+		ULONG64 iLen;
+		if (!SmsGetVarint( p, pEnd, iLen ) || iLen > 0x7fffffff)
+			return ERROR_INVALID_DATA;
+		size_t iHeader = p - (m_Buf.data() + m_iPos);
+
+		if ((err = Fill( iHeader + (size_t)iLen )) != ERROR_SUCCESS)
+			return err;
+		p = m_Buf.data() + m_iPos + iHeader;
+		pEnd = p + (size_t)iLen;
+		if (pEnd > m_Buf.data() + m_Buf.size() || !SmsDecodeRecord( p, pEnd, sms, m_iPrevTimestamp ) || p != pEnd)
+			return ERROR_INVALID_DATA;
+		m_iPos = pEnd - m_Buf.data();
+		return ERROR_SUCCESS;
+	}
+
+private:
+	/// Make sure at least iBytes are available past m_iPos (fewer at the end of the file)
+	ULONG Fill( _In_ size_t iBytes )
+	{
+		if (m_Buf.size() - m_iPos >= iBytes || m_bEof)
+			return ERROR_SUCCESS;
+		m_Buf.erase( m_Buf.begin(), m_Buf.begin() + m_iPos );
+		m_iPos = 0;
+		while (m_Buf.size() < iBytes && !m_bEof) {
+			size_t iOffset = m_Buf.size();
+			m_Buf.resize( iOffset + (iBytes - iOffset > SMS_RUN_IO_SIZE ? iBytes - iOffset : SMS_RUN_IO_SIZE) );
+			DWORD iRead = 0;
+			if (!ReadFile( m_hFile, m_Buf.data() + iOffset, (DWORD)(m_Buf.size() - iOffset), &iRead, NULL )) {
+				m_Buf.resize( iOffset );
+				return GetLastError();
+			}
+			m_Buf.resize( iOffset + iRead );
+			m_bEof = (iRead == 0);
+		}
+		return ERROR_SUCCESS;
+	}
+
+private:
+	HANDLE m_hFile;
+	std::vector<BYTE> m_Buf;
+	size_t m_iPos;
+	BOOL m_bEof;
+	ULONG64 m_iPrevTimestamp;
+};
+
+
+//++ SmsFootprint
+/// Estimated memory used by a message stored in a SMS_LIST
+static ULONG64 SmsFootprint( _In_ const SMS &sms )
+{
+	return sizeof( SMS ) + 2 * sizeof( void* ) + sms.Text.capacity() + sms.PhoneId.capacity() * sizeof( SMS_PHONE_ID );
+}
+
+
+//++ SmsSortStage
+SmsSortStage::SmsSortStage( _In_ BOOL bNewestFirst, _In_opt_ ULONG64 iMemoryBudget ):
+	m_bNewestFirst( bNewestFirst ),
+	m_iCount( 0 ),
+	m_iMemoryBudget( iMemoryBudget ),
+	m_iMemoryUsed( 0 )
+{
+}
+
+SmsSortStage::~SmsSortStage()
+{
+	for (auto it = m_Runs.begin(); it != m_Runs.end(); ++it)
+		CloseHandle( *it );
+}
+
+ULONG SmsSortStage::Process( _Inout_ SMS_BATCH &Batch )
+{
+	ULONG err = ERROR_SUCCESS;
+	for (auto it = Batch.begin(); it != Batch.end() && err == ERROR_SUCCESS; ++it) {
+		m_iCount += (ULONG)it->PhoneId.size();
+		if (m_iMemoryBudget)
+			m_iMemoryUsed += SmsFootprint( *it );
+		m_SmsList.push_back( std::move( *it ) );
+		if (m_iMemoryBudget && m_iMemoryUsed >= m_iMemoryBudget)
+			err = SpillRun();
+	}
+	Batch.clear();
+	return err;
+}
+
+void SmsSortStage::Sort()
+{
+	SmsTraceScope Trace( SMS_STAGE_SORT );
+
+	/// std::list::sort is stable
+	if (m_bNewestFirst) {
+		m_SmsList.sort( std::greater<SMS>() );
+	} else {
+		m_SmsList.sort( std::less<SMS>() );
+	}
+}
+
+ULONG SmsSortStage::SpillRun()
+{
+	ULONG err = ERROR_SUCCESS;
+
+	if (m_SmsList.empty())
+		return ERROR_SUCCESS;
+
+	Sort();
+
+	TCHAR szTempDir[MAX_PATH], szRunFile[MAX_PATH];
+	if (!GetTempPath( ARRAYSIZE( szTempDir ), szTempDir ) || !GetTempFileName( szTempDir, _T( "sms" ), 0, szRunFile ))
+		return GetLastError();
+
+	HANDLE hFile = CreateFile( szRunFile, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL );
+	if (hFile == INVALID_HANDLE_VALUE) {
+		err = GetLastError();
+		DeleteFile( szRunFile );
+		return err;
+	}
+	m_Runs.push_back( hFile );
+
+	std::string Buf, Record;
+	ULONG64 iPrevTimestamp = 0;
+	while (!m_SmsList.empty() && err == ERROR_SUCCESS) {
+
+		Record.clear();
+		SmsEncodeRecord( Record, m_SmsList.front(), iPrevTimestamp );
+		SmsPutVarint( Buf, Record.size() );
+		Buf.append( Record );
+		m_SmsList.pop_front();		/// Release memory as we go
+
+		if (Buf.size() >= SMS_RUN_IO_SIZE || m_SmsList.empty()) {
+			DWORD iWritten;
+			if (!WriteFile( hFile, Buf.data(), (DWORD)Buf.size(), &iWritten, NULL ) || iWritten != Buf.size())
+				err = ERROR_WRITE_FAULT;
+			Buf.clear();
+		}
+	}
+	m_SmsList.clear();
+	m_iMemoryUsed = 0;
+
+	if (err == ERROR_SUCCESS) {
+		LARGE_INTEGER iZero = {0};
+		if (!SetFilePointerEx( hFile, iZero, NULL, FILE_BEGIN ))
+			err = GetLastError();
+	}
+	return err;
+}
+
+ULONG SmsSortStage::MergeRuns( _In_ SmsBatchQueue &Out )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	/// k-way merge. Ties are broken by run index, to keep the sort stable
+	struct HEAD {
+		SMS sms;
+		size_t iRun;
+	};
+	BOOL bNewestFirst = m_bNewestFirst;
+	auto fnAfter = [bNewestFirst]( const HEAD &a, const HEAD &b ) -> bool {
+		if (bNewestFirst ? (a.sms < b.sms) : (a.sms > b.sms))
+			return true;
+		if (bNewestFirst ? (b.sms < a.sms) : (b.sms > a.sms))
+			return false;
+		return a.iRun > b.iRun;
+	};
+
+	std::vector<SmsRunReader> Readers;
+	std::vector<HEAD> Heap;
+	Readers.reserve( m_Runs.size() );
+	Heap.reserve( m_Runs.size() );
+
+	for (size_t i = 0; i < m_Runs.size() && err == ERROR_SUCCESS; i++) {
+		Readers.push_back( SmsRunReader( m_Runs[i] ) );
+		HEAD h;
+		h.iRun = i;
+		err = Readers[i].Next( h.sms );
+		if (err == ERROR_SUCCESS) {
+			Heap.push_back( std::move( h ) );
+			std::push_heap( Heap.begin(), Heap.end(), fnAfter );
+		} else if (err == ERROR_HANDLE_EOF) {
+			err = ERROR_SUCCESS;
+		}
+	}
+
+	SMS_BATCH Batch;
+	Batch.reserve( SMS_BATCH_SIZE );
+	while (!Heap.empty() && err == ERROR_SUCCESS) {
+
+		std::pop_heap( Heap.begin(), Heap.end(), fnAfter );
+		HEAD &h = Heap.back();
+		Batch.push_back( std::move( h.sms ) );
+
+		err = Readers[h.iRun].Next( h.sms );
+		if (err == ERROR_SUCCESS) {
+			std::push_heap( Heap.begin(), Heap.end(), fnAfter );
+		} else if (err == ERROR_HANDLE_EOF) {
+			Heap.pop_back();
+			err = ERROR_SUCCESS;
+		}
+
+		if (err == ERROR_SUCCESS && (Batch.size() >= SMS_BATCH_SIZE || Heap.empty())) {
+			if (!Out.Push( Batch ))
+				err = ERROR_CANCELLED;
+			Batch.reserve( SMS_BATCH_SIZE );
+		}
+	}
+	return err;
+}
+
+ULONG SmsSortStage::Flush( _In_ SmsBatchQueue &Out )
+{
+	Out.SetCountHint( m_iCount );
+
+	if (!m_Runs.empty()) {
+		/// External sort. Spill the remaining messages, then merge all runs
+		ULONG err = SpillRun();
+		if (err == ERROR_SUCCESS)
+			err = MergeRuns( Out );
+		return err;
+	}
+
+	Sort();
+
+	SMS_BATCH Batch;
+	Batch.reserve( SMS_BATCH_SIZE );
+	while (!m_SmsList.empty()) {
+		Batch.push_back( std::move( m_SmsList.front() ) );
+		m_SmsList.pop_front();		/// Release memory as we go
+		if (Batch.size() >= SMS_BATCH_SIZE || m_SmsList.empty()) {
+			if (!Out.Push( Batch ))
+				return ERROR_CANCELLED;
+			Batch.reserve( SMS_BATCH_SIZE );
+		}
+	}
+	return ERROR_SUCCESS;
+}
+
+
+//++ SmsDedupStage
+ULONG SmsDedupStage::Process( _Inout_ SMS_BATCH &Batch )
+{
+	auto itOut = Batch.begin();
+	for (auto it = Batch.begin(); it != Batch.end(); ++it) {
+		if (m_bPrev && *it == m_Prev)
+			continue;
+		m_Prev = *it;
+		m_bPrev = TRUE;
+		if (itOut != it)
+			*itOut = std::move( *it );
+		++itOut;
+	}
+	Batch.erase( itOut, Batch.end() );
+	return ERROR_SUCCESS;
+}
+
+
+//++ SmsFilterStage
+ULONG SmsFilterStage::Process( _Inout_ SMS_BATCH &Batch )
+{
+	Batch.erase( std::remove_if( Batch.begin(), Batch.end(), [this]( const SMS &sms ) { return !m_fnKeep( sms ); } ), Batch.end() );
+	return ERROR_SUCCESS;
+}
+
+
+//++ SmsPipeline
+SmsPipeline::SmsPipeline(): m_iReaderType( 0 ), m_pReaderFilter( NULL ), m_pCheckpoint( NULL ), m_pWriter( NULL ), m_err( ERROR_SUCCESS ), m_iWritten( 0 )
+{
+	m_szReaderFile[0] = 0;
+}
+
+SmsPipeline::~SmsPipeline()
+{
+	for (auto it = m_Queues.begin(); it != m_Queues.end(); ++it)
+		delete *it;
+}
+
+void SmsPipeline::SetReader( _In_ ULONG iType, _In_ LPCTSTR pszFile, _In_opt_ SmsFilter *pFilter )
+{
+	m_iReaderType = iType;
+	StringCchCopy( m_szReaderFile, ARRAYSIZE( m_szReaderFile ), pszFile ? pszFile : _T( "" ) );
+	m_pReaderFilter = pFilter;
+}
+
+void SmsPipeline::AddStage( _In_ SmsStage *pStage )
+{
+	assert( pStage );
+	m_Stages.push_back( pStage );
+}
+
+void SmsPipeline::SetWriter( _In_ SmsWriter *pWriter )
+{
+	m_pWriter = pWriter;
+}
+
+void SmsPipeline::SetCheckpoint( _In_opt_ SmsCheckpoint *pCheckpoint )
+{
+	m_pCheckpoint = pCheckpoint;
+}
+
+void SmsPipeline::Fail( _In_ ULONG err )
+{
+	/// Keep the first error, abort everybody
+	if (err != ERROR_SUCCESS && err != ERROR_CANCELLED) {
+		InterlockedCompareExchange( &m_err, (LONG)err, ERROR_SUCCESS );
+		for (auto it = m_Queues.begin(); it != m_Queues.end(); ++it)
+			(*it)->Abort();
+	}
+}
+
+DWORD WINAPI SmsPipeline::ReaderThread( _In_ LPVOID pParam )
+{
+	STAGE_CTX *pCtx = (STAGE_CTX*)pParam;
+
+	SmsPipeline *pPipeline = pCtx->pPipeline;
+	SmsQueueSink Sink( *pCtx->pOut );
+	ULONG err = pPipeline->m_pCheckpoint ?
+		pPipeline->m_pCheckpoint->Read( pPipeline->m_iReaderType, pPipeline->m_szReaderFile, Sink, pPipeline->m_pReaderFilter ) :
+		SmsRead( pPipeline->m_iReaderType, pPipeline->m_szReaderFile, Sink, pPipeline->m_pReaderFilter );
+	if (err == ERROR_SUCCESS && !Sink.Flush())
+		err = ERROR_CANCELLED;
+
+	/// Fail before Close. Downstream threads must never see a closed queue without the error that ended it
+	pCtx->pPipeline->Fail( err );
+	pCtx->pOut->Close();
+	return err;
+}
+
+DWORD WINAPI SmsPipeline::StageThread( _In_ LPVOID pParam )
+{
+	STAGE_CTX *pCtx = (STAGE_CTX*)pParam;
+	ULONG err = ERROR_SUCCESS;
+
+	SMS_BATCH Batch;
+	while (err == ERROR_SUCCESS && pCtx->pIn->Pop( Batch )) {
+		if (pCtx->pStage->PreservesCount())
+			pCtx->pOut->SetCountHint( pCtx->pIn->GetCountHint() );
+		err = pCtx->pStage->Process( Batch );
+		if (err == ERROR_SUCCESS && !Batch.empty() && !pCtx->pOut->Push( Batch ))
+			err = ERROR_CANCELLED;
+	}
+	if (err == ERROR_SUCCESS)
+		err = pCtx->pStage->Flush( *pCtx->pOut );
+
+	pCtx->pPipeline->Fail( err );		/// Before Close (see ReaderThread)
+	pCtx->pOut->Close();
+	return err;
+}
+
+DWORD WINAPI SmsPipeline::WriterThread( _In_ LPVOID pParam )
+{
+	STAGE_CTX *pCtx = (STAGE_CTX*)pParam;
+	SmsWriter *pWriter = pCtx->pPipeline->m_pWriter;
+	ULONG err = ERROR_SUCCESS;
+
+	/// Wait for the first batch before calling Begin(). By then, the message count may be known
+	/// Nothing is written if the conversion failed upstream. The writer's output would replace the destination
+	SMS_BATCH Batch;
+	BOOL bBatch = pCtx->pIn->Pop( Batch );
+	if (pCtx->pPipeline->m_err != ERROR_SUCCESS)
+		return ERROR_CANCELLED;
+
+	SmsCheckpoint *pCheckpoint = pCtx->pPipeline->m_pCheckpoint;
+	if (pCheckpoint && pCheckpoint->HasOutput()) {
+		err = pWriter->Resume( *pCheckpoint );		/// Append
+	} else {
+		err = pWriter->Begin( pCtx->pIn->GetCountHint() );
+	}
+	while (err == ERROR_SUCCESS && bBatch) {
+		for (auto it = Batch.begin(); it != Batch.end() && err == ERROR_SUCCESS; ++it) {
+			err = pWriter->Write( *it );
+			pCtx->pPipeline->m_iWritten += (ULONG)it->PhoneId.size();
+		}
+		bBatch = (err == ERROR_SUCCESS) && pCtx->pIn->Pop( Batch );
+	}
+	if (err == ERROR_SUCCESS && pCtx->pPipeline->m_err == ERROR_SUCCESS)
+		err = pWriter->End();
+	if (err == ERROR_SUCCESS && pCheckpoint)
+		pWriter->Record( *pCheckpoint );		/// Not fatal. If the writer can't be resumed, the checkpoint won't be saved
+
+	pCtx->pPipeline->Fail( err );
+	return err;
+}
+
+ULONG SmsPipeline::Run()
+{
+	if (!m_pWriter || !*m_szReaderFile)
+		return ERROR_INVALID_PARAMETER;
+
+	m_err = ERROR_SUCCESS;
+	m_iWritten = 0;
+
+	// Queues
+	for (auto it = m_Queues.begin(); it != m_Queues.end(); ++it)
+		delete *it;
+	m_Queues.clear();
+	for (size_t i = 0; i <= m_Stages.size(); i++)
+		m_Queues.push_back( new SmsBatchQueue() );
+
+	// Threads
+	std::vector<STAGE_CTX> Ctx( m_Stages.size() + 2 );
+	std::vector<HANDLE> Threads;
+
+	for (size_t i = 0; i < Ctx.size(); i++) {
+
+		STAGE_CTX &ctx = Ctx[i];
+		ctx.pPipeline = this;
+		ctx.pStage = (i > 0 && i <= m_Stages.size()) ? m_Stages[i - 1] : NULL;
+		ctx.pIn = (i > 0) ? m_Queues[i - 1] : NULL;
+		ctx.pOut = (i < m_Queues.size()) ? m_Queues[i] : NULL;
+
+		LPTHREAD_START_ROUTINE fnThread = (i == 0) ? ReaderThread : (ctx.pOut ? StageThread : WriterThread);
+		HANDLE hThread = CreateThread( NULL, 0, fnThread, &ctx, 0, NULL );
+		if (hThread) {
+			Threads.push_back( hThread );
+		} else {
+			Fail( GetLastError() );
+			break;
+		}
+	}
+
+	// Wait
+	if (!Threads.empty()) {
+		WaitForMultipleObjects( (DWORD)Threads.size(), Threads.data(), TRUE, INFINITE );
+		for (auto it = Threads.begin(); it != Threads.end(); ++it)
+			CloseHandle( *it );
+	}
+
+	return (ULONG)m_err;
+}
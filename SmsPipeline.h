@@ -0,0 +1,176 @@
+#pragma once
+
+#include "SmsConvert.h"
+#include <deque>
+#include <functional>
+
+class SmsCheckpoint;	/// SmsCheckpoint.h
+
+//? Conversion pipeline:
+//?   Reader thread --> [queue] --> Stage thread --> [queue] --> ... --> Writer thread
+//? Messages travel in batches. Queues are bounded, so a fast producer waits for a slow consumer and memory stays flat
+//? The first failure aborts all threads. The destination file is replaced only if the whole conversion succeeds (see SmsOutputFile)
+
+
+//+ SMS_BATCH
+typedef std::vector<SMS> SMS_BATCH;
+
+#define SMS_BATCH_SIZE		1024		/// Messages per batch
+#define SMS_QUEUE_DEPTH		4			/// Batches per queue
+
+
+//+ SmsBatchQueue
+/// Bounded, thread safe queue of batches
+class SmsBatchQueue {
+public:
+	SmsBatchQueue( _In_ ULONG iMaxBatches = SMS_QUEUE_DEPTH );
+	~SmsBatchQueue();
+
+	BOOL Push( _Inout_ SMS_BATCH &Batch );		/// Blocks while the queue is full. Returns FALSE if the queue was aborted
+	BOOL Pop( _Out_ SMS_BATCH &Batch );			/// Blocks while the queue is empty. Returns FALSE if the queue was closed and drained, or aborted
+	void Close();								/// The producer is done
+	void Abort();								/// Wake up everybody, refuse further batches
+
+	/// SmsCount() of all the messages that will pass through this queue, if known in advance. Must be set before pushing the first batch
+	void SetCountHint( _In_ ULONG iCount );
+	ULONG GetCountHint();
+
+private:
+	CRITICAL_SECTION m_cs;
+	CONDITION_VARIABLE m_cvNotFull;
+	CONDITION_VARIABLE m_cvNotEmpty;
+	std::deque<SMS_BATCH> m_Batches;
+	ULONG m_iMaxBatches;
+	ULONG m_iCountHint;
+	BOOL m_bClosed;
+	BOOL m_bAborted;
+};
+
+
+//+ SmsQueueSink
+/// Reader -> Batches -> Queue
+class SmsQueueSink: public SmsSink {
+public:
+	SmsQueueSink( _In_ SmsBatchQueue &Queue ): m_Queue( Queue ) { m_Batch.reserve( SMS_BATCH_SIZE ); }
+	BOOL Put( _Inout_ SMS &sms );
+	BOOL Flush();
+private:
+	SmsBatchQueue &m_Queue;
+	SMS_BATCH m_Batch;
+};
+
+
+//+ SmsStage
+/// Intermediate pipeline stage. Each stage runs on its own thread
+class SmsStage {
+public:
+	virtual ~SmsStage() {}
+
+	/// Transform a batch in place. Messages left in the batch are forwarded downstream
+	/// Messages moved out of the batch can be released later, from Flush()
+	virtual ULONG Process( _Inout_ SMS_BATCH &Batch ) = 0;
+
+	/// End of input. Push any retained messages downstream
+	virtual ULONG Flush( _In_ SmsBatchQueue &Out ) { UNREFERENCED_PARAMETER( Out ); return ERROR_SUCCESS; }
+
+	/// Return TRUE if the stage forwards every message it receives (the message count is preserved)
+	virtual BOOL PreservesCount() const { return FALSE; }
+};
+
+
+//+ SmsSortStage
+/// Sort all messages by timestamp. It's a barrier: nothing is forwarded until the input is exhausted
+/// With a memory budget, sorted runs are spilled to temporary files whenever the budget is exceeded, and merged back in Flush()
+/// The sort is stable, with or without spilling
+/// Only the sorted copy is bounded. The readers load the whole input (see SmsReaderFootprint), so an input larger than memory can't be converted, whatever the budget
+class SmsSortStage: public SmsStage {
+public:
+	SmsSortStage( _In_ BOOL bNewestFirst, _In_opt_ ULONG64 iMemoryBudget = 0 );		/// iMemoryBudget in bytes, 0=unlimited
+	~SmsSortStage();
+	ULONG Process( _Inout_ SMS_BATCH &Batch );
+	ULONG Flush( _In_ SmsBatchQueue &Out );
+	BOOL PreservesCount() const { return TRUE; }
+	ULONG GetRunCount() const { return (ULONG)m_Runs.size(); }
+private:
+	void Sort();
+	ULONG SpillRun();
+	ULONG MergeRuns( _In_ SmsBatchQueue &Out );
+private:
+	BOOL m_bNewestFirst;
+	SMS_LIST m_SmsList;
+	ULONG m_iCount;					/// SmsCount() of all received messages
+	ULONG64 m_iMemoryBudget;
+	ULONG64 m_iMemoryUsed;			/// Estimated footprint of m_SmsList
+	std::vector<HANDLE> m_Runs;		/// Temporary files, deleted on close
+};
+
+
+//+ SmsDedupStage
+/// Drop consecutive duplicates (see std::unique). Place it after a SmsSortStage to remove all duplicates
+class SmsDedupStage: public SmsStage {
+public:
+	SmsDedupStage(): m_bPrev( FALSE ) {}
+	ULONG Process( _Inout_ SMS_BATCH &Batch );
+private:
+	SMS m_Prev;
+	BOOL m_bPrev;
+};
+
+
+//+ SmsFilterStage
+/// Drop messages rejected by a predicate
+class SmsFilterStage: public SmsStage {
+public:
+	typedef std::function<BOOL( const SMS& )> PREDICATE;
+	SmsFilterStage( _In_ const PREDICATE &fnKeep ): m_fnKeep( fnKeep ) {}
+	ULONG Process( _Inout_ SMS_BATCH &Batch );
+private:
+	PREDICATE m_fnKeep;
+};
+
+
+//+ SmsPipeline
+/// Reader (type + file) -> Stages -> Writer
+/// Stages and writer are owned by the caller and must outlive Run()
+class SmsPipeline {
+public:
+	SmsPipeline();
+	~SmsPipeline();
+
+	void SetReader( _In_ ULONG iType, _In_ LPCTSTR pszFile, _In_opt_ SmsFilter *pFilter = NULL );		/// The filter is evaluated by the reader (see SmsRead)
+	void AddStage( _In_ SmsStage *pStage );
+	void SetWriter( _In_ SmsWriter *pWriter );
+
+	/// Incremental conversion. Only the messages that are new since the checkpoint are read, and appended to the output if the checkpoint describes it
+	/// The checkpoint is updated. Save it if Run() succeeds (see SmsCheckpoint.h)
+	void SetCheckpoint( _In_opt_ SmsCheckpoint *pCheckpoint );
+
+	/// Run all threads, wait for completion. Returns the first error
+	ULONG Run();
+
+	/// SmsCount() of the written messages
+	ULONG GetCount() const { return m_iWritten; }
+
+private:
+	static DWORD WINAPI ReaderThread( _In_ LPVOID pParam );
+	static DWORD WINAPI StageThread( _In_ LPVOID pParam );
+	static DWORD WINAPI WriterThread( _In_ LPVOID pParam );
+	void Fail( _In_ ULONG err );
+
+	struct STAGE_CTX {
+		SmsPipeline *pPipeline;
+		SmsStage *pStage;
+		SmsBatchQueue *pIn;
+		SmsBatchQueue *pOut;
+	};
+
+	ULONG m_iReaderType;
+	TCHAR m_szReaderFile[MAX_PATH];
+	SmsFilter *m_pReaderFilter;
+	SmsCheckpoint *m_pCheckpoint;
+	std::vector<SmsStage*> m_Stages;
+	SmsWriter *m_pWriter;
+	std::vector<SmsBatchQueue*> m_Queues;		/// m_Stages.size() + 1
+	volatile LONG m_err;
+	ULONG m_iWritten;
+};
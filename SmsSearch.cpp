@@ -0,0 +1,204 @@
+#include "StdAfx.h"
+#include "SmsSearch.h"
+#include <algorithm>
+#include <intrin.h>
+#include <immintrin.h>
+
+
+#define SMS_SEARCH_MIN_CHUNK		(1024 * 1024)		/// Smaller arenas aren't worth a thread
+
+//++ SmsTextArena
+BOOL SmsTextArena::Put( _Inout_ SMS &sms )
+{
+	m_Text.append( sms.Text );
+	m_Ends.push_back( m_Text.size() );
+	m_Text.push_back( '\0' );
+	return TRUE;
+}
+
+
+//!++ Kernels
+
+//+ PATTERN
+struct PATTERN {
+	std::string sText;			/// Lower case, if bIgnoreCase
+	BOOL bIgnoreCase;
+	BYTE First, Last;			/// Lower case, if letters and bIgnoreCase
+	BYTE FirstMask, LastMask;	/// 0x20 for letters (when ignoring case) otherwise 0. (c | Mask) == First
+};
+
+static inline BYTE ToLowerA( _In_ BYTE c )		{ return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c; }
+static inline BOOL IsAlphaA( _In_ BYTE c )		{ c |= 0x20; return c >= 'a' && c <= 'z'; }
+
+static BOOL Matches( _In_ const char *p, _In_ const PATTERN &Pat )
+{
+	if (!Pat.bIgnoreCase)
+		return memcmp( p, Pat.sText.c_str(), Pat.sText.size() ) == 0;
+	for (size_t i = 0; i < Pat.sText.size(); i++)
+		if (ToLowerA( (BYTE)p[i] ) != (BYTE)Pat.sText[i])
+			return FALSE;
+	return TRUE;
+}
+
+/// Each kernel returns the first match in [p, pEnd), or NULL
+static const char* FindScalar( _In_ const char *p, _In_ const char *pEnd, _In_ const PATTERN &Pat )
+{
+	for (const size_t n = Pat.sText.size(); p + n <= pEnd; p++)
+		if ((BYTE)(p[0] | Pat.FirstMask) == Pat.First && (BYTE)(p[n - 1] | Pat.LastMask) == Pat.Last && Matches( p, Pat ))
+			return p;
+	return NULL;
+}
+
+static const char* FindSse2( _In_ const char *p, _In_ const char *pEnd, _In_ const PATTERN &Pat )
+{
+	const size_t n = Pat.sText.size();
+	const __m128i First = _mm_set1_epi8( (char)Pat.First ), FirstMask = _mm_set1_epi8( (char)Pat.FirstMask );
+	const __m128i Last = _mm_set1_epi8( (char)Pat.Last ), LastMask = _mm_set1_epi8( (char)Pat.LastMask );
+
+	for (; p + n - 1 + 16 <= pEnd; p += 16) {
+		__m128i a = _mm_or_si128( _mm_loadu_si128( (const __m128i*)p ), FirstMask );
+		__m128i b = _mm_or_si128( _mm_loadu_si128( (const __m128i*)(p + n - 1) ), LastMask );
+		ULONG iMask = (ULONG)_mm_movemask_epi8( _mm_and_si128( _mm_cmpeq_epi8( a, First ), _mm_cmpeq_epi8( b, Last ) ) );
+		for (ULONG i; iMask; iMask &= iMask - 1) {
+			_BitScanForward( &i, iMask );
+			if (Matches( p + i, Pat ))
+				return p + i;
+		}
+	}
+	return FindScalar( p, pEnd, Pat );
+}
+
+static const char* FindAvx2( _In_ const char *p, _In_ const char *pEnd, _In_ const PATTERN &Pat )
+{
+	const size_t n = Pat.sText.size();
+	const __m256i First = _mm256_set1_epi8( (char)Pat.First ), FirstMask = _mm256_set1_epi8( (char)Pat.FirstMask );
+	const __m256i Last = _mm256_set1_epi8( (char)Pat.Last ), LastMask = _mm256_set1_epi8( (char)Pat.LastMask );
+
+	for (; p + n - 1 + 32 <= pEnd; p += 32) {
+		__m256i a = _mm256_or_si256( _mm256_loadu_si256( (const __m256i*)p ), FirstMask );
+		__m256i b = _mm256_or_si256( _mm256_loadu_si256( (const __m256i*)(p + n - 1) ), LastMask );
+		ULONG iMask = (ULONG)_mm256_movemask_epi8( _mm256_and_si256( _mm256_cmpeq_epi8( a, First ), _mm256_cmpeq_epi8( b, Last ) ) );
+		for (ULONG i; iMask; iMask &= iMask - 1) {
+			_BitScanForward( &i, iMask );
+			if (Matches( p + i, Pat ))
+				return p + i;
+		}
+	}
+	_mm256_zeroupper();
+	return FindSse2( p, pEnd, Pat );
+}
+
+//+ HasAvx2
+/// CPU and OS support (the OS must save the YMM registers)
+static BOOL HasAvx2()
+{
+	int r[4];
+	__cpuid( r, 0 );
+	if (r[0] < 7)
+		return FALSE;
+	__cpuid( r, 1 );
+	if ((r[2] & (1 << 27)) == 0 || (r[2] & (1 << 28)) == 0)		/// OSXSAVE, AVX
+		return FALSE;
+	if ((_xgetbv( 0 ) & 6) != 6)								/// XMM and YMM state
+		return FALSE;
+	__cpuidex( r, 7, 0 );
+	return (r[1] & (1 << 5)) != 0;								/// AVX2
+}
+
+typedef const char* (*FIND_ROUTINE)( _In_ const char *p, _In_ const char *pEnd, _In_ const PATTERN &Pat );
+
+
+//!++ SmsSearch
+
+//+ SEARCH_TASK
+/// Messages [iFirst, iLast) of the arena
+struct SEARCH_TASK {
+	const char *pText;
+	const std::vector<size_t> *pEnds;
+	const PATTERN *pPattern;
+	FIND_ROUTINE pfnFind;
+	ULONG iFirst, iLast;
+	SMS_POSTINGS Ids;
+	HANDLE hThread;
+};
+
+static DWORD WINAPI SearchThread( _In_ LPVOID pParam )
+{
+	SEARCH_TASK *pTask = (SEARCH_TASK*)pParam;
+	const std::vector<size_t> &Ends = *pTask->pEnds;
+
+	const char *p = pTask->pText + (pTask->iFirst > 0 ? Ends[pTask->iFirst - 1] + 1 : 0);
+	const char *pEnd = pTask->pText + Ends[pTask->iLast - 1];
+	auto itEnd = Ends.begin() + pTask->iFirst;
+
+	while (p < pEnd && (p = pTask->pfnFind( p, pEnd, *pTask->pPattern )) != NULL) {
+		/// Containing message. Skip the rest of it
+		itEnd = std::lower_bound( itEnd, Ends.begin() + pTask->iLast, (size_t)(p - pTask->pText) );
+		pTask->Ids.push_back( (ULONG)(itEnd - Ends.begin()) );
+		p = pTask->pText + *itEnd + 1;
+	}
+	return ERROR_SUCCESS;
+}
+
+ULONG SmsSearch( _In_ const SmsTextArena &Arena, _In_ LPCSTR pszPattern, _In_ BOOL bIgnoreCase, _Out_ SMS_POSTINGS &Ids )
+{
+	static const FIND_ROUTINE pfnFind = HasAvx2() ? FindAvx2 : FindSse2;
+
+	Ids.clear();
+	if (!pszPattern || !*pszPattern)
+		return ERROR_INVALID_PARAMETER;
+	if (Arena.m_Ends.empty())
+		return ERROR_SUCCESS;
+
+	PATTERN Pat;
+	Pat.sText = pszPattern;
+	Pat.bIgnoreCase = bIgnoreCase;
+	if (bIgnoreCase)
+		std::transform( Pat.sText.begin(), Pat.sText.end(), Pat.sText.begin(), []( char c ) { return (char)ToLowerA( (BYTE)c ); } );
+	Pat.First = (BYTE)Pat.sText.front();
+	Pat.Last = (BYTE)Pat.sText.back();
+	Pat.FirstMask = (bIgnoreCase && IsAlphaA( Pat.First )) ? 0x20 : 0;
+	Pat.LastMask = (bIgnoreCase && IsAlphaA( Pat.Last )) ? 0x20 : 0;
+
+	/// Split the arena at message boundaries
+	SYSTEM_INFO si;
+	GetSystemInfo( &si );
+	ULONG iCount = (ULONG)Arena.m_Ends.size();
+	ULONG iTasks = (ULONG)__min( (size_t)__max( si.dwNumberOfProcessors, 1 ), Arena.m_Text.size() / SMS_SEARCH_MIN_CHUNK + 1 );
+	iTasks = __min( iTasks, iCount );
+
+	std::vector<SEARCH_TASK> Tasks( iTasks );
+	ULONG iFirst = 0;
+	for (ULONG i = 0; i < iTasks; i++) {
+		SEARCH_TASK &Task = Tasks[i];
+		Task.pText = Arena.m_Text.data();
+		Task.pEnds = &Arena.m_Ends;
+		Task.pPattern = &Pat;
+		Task.pfnFind = pfnFind;
+		Task.iFirst = iFirst;
+		if (i + 1 < iTasks) {
+			size_t iSplit = Arena.m_Text.size() / iTasks * (i + 1);
+			Task.iLast = (ULONG)(std::lower_bound( Arena.m_Ends.begin() + iFirst, Arena.m_Ends.end(), iSplit ) - Arena.m_Ends.begin()) + 1;
+			Task.iLast = __min( Task.iLast, iCount );
+		} else {
+			Task.iLast = iCount;
+		}
+		iFirst = Task.iLast;
+		Task.hThread = NULL;
+		if (Task.iFirst < Task.iLast && i > 0)		/// The first task runs on this thread
+			Task.hThread = CreateThread( NULL, 0, SearchThread, &Task, 0, NULL );
+	}
+
+	for (ULONG i = 0; i < iTasks; i++) {
+		SEARCH_TASK &Task = Tasks[i];
+		if (Task.hThread) {
+			WaitForSingleObject( Task.hThread, INFINITE );
+			CloseHandle( Task.hThread );
+		} else if (Task.iFirst < Task.iLast) {
+			SearchThread( &Task );
+		}
+		Ids.insert( Ids.end(), Task.Ids.begin(), Task.Ids.end() );
+	}
+
+	return ERROR_SUCCESS;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "SmsConvert.h"
+#include "SmsIndex.h"
+
+//? Bulk substring search ("grep") over message texts
+//? Texts are kept back to back in one contiguous arena. The arena is split among worker threads (one per CPU), each scanning its part with a SIMD kernel:
+//?   candidates are positions where both the first and the last byte of the pattern match, 32 (AVX2) or 16 (SSE2) positions at a time. Only candidates are compared in full
+//? Message ids are the positions of the messages in reading order (see SmsRead)
+
+
+//+ SmsTextArena
+/// Pass it to SmsRead() as a sink
+class SmsTextArena: public SmsSink {
+public:
+	BOOL Put( _Inout_ SMS &sms );
+
+	ULONG GetMessageCount() const { return (ULONG)m_Ends.size(); }
+	void Clear() { m_Text.clear(); m_Ends.clear(); }
+
+private:
+	friend ULONG SmsSearch( _In_ const SmsTextArena&, _In_ LPCSTR, _In_ BOOL, _Out_ SMS_POSTINGS& );
+	std::string m_Text;						/// Texts, each followed by '\0' (a match can't span two messages)
+	std::vector<size_t> m_Ends;				/// Position of each terminator
+};
+
+
+//+ SmsSearch
+/// Messages containing pszPattern. Ids are ascending
+/// bIgnoreCase folds ASCII letters only, anything else (UTF-8) must match exactly
+ULONG SmsSearch(
+	_In_ const SmsTextArena &Arena,
+	_In_ LPCSTR pszPattern,
+	_In_ BOOL bIgnoreCase,
+	_Out_ SMS_POSTINGS &Ids
+);
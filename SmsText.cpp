@@ -0,0 +1,495 @@
+#include "StdAfx.h"
+#include "SmsText.h"
+#include "SmsBinary.h"
+#include <algorithm>
+#include <iterator>
+
+
+//!++ Tokenizer
+
+//+ g_LatinFold
+/// U+00C0 .. U+024F -> Base letter (lower case)
+/// '_' Letter without an ASCII base, kept verbatim
+/// '.' Not a letter (separator)
+#define LATIN_FOLD_FIRST	0xC0
+static const char g_LatinFold[] =
+	"aaaaaa_ceeeeiiii_nooooo.ouuuuy__"		/// U+00C0
+	"aaaaaa_ceeeeiiii_nooooo.ouuuuy_y"		/// U+00E0
+	"aaaaaaccccccccddddeeeeeeeeeegggg"		/// U+0100
+	"gggghhhhiiiiiiiii___jjkk_lllllll"		/// U+0120
+	"lllnnnnnn___oooooo__rrrrrrssssss"		/// U+0140
+	"ssttttttuuuuuuuuuuuuwwyyyzzzzzz_"		/// U+0160
+	"bbbb___cc_ddd____ffg___ikkl__nno"		/// U+0180
+	"oo__pp_____ttttuu_vyyzz_________"		/// U+01A0
+	"_____d__l__n_aaiioouuuuuuuuuu_aa"		/// U+01C0
+	"aa__ggggkkoooo__j_d_gg__nnaa__oo"		/// U+01E0
+	"aaaaeeeeiiiioooorrrruuuusstt__hh"		/// U+0200	Romanian S/T with comma below (U+0218..U+021B)
+	"nd__zzaaeeooooooooyylnt___acclts"		/// U+0220
+	"z__b__eejj_qrryy";						/// U+0240
+#define LATIN_FOLD_LAST		(LATIN_FOLD_FIRST + ARRAYSIZE( g_LatinFold ) - 2)
+
+/// Punctuation, symbols, emoji, private use... Everything else is part of a word
+static BOOL IsSeparator( _In_ ULONG cp )
+{
+	return
+		cp < 0xC0 ||							/// ASCII (non alphanumeric) and Latin-1 punctuation
+		(cp >= 0x2000 && cp < 0x2C00) ||		/// General punctuation, symbols, arrows, dingbats...
+		(cp >= 0x3000 && cp < 0x3040) ||		/// CJK punctuation
+		(cp >= 0xD800 && cp < 0xF900) ||		/// Surrogates (CESU-8 emoji), private use
+		(cp >= 0xFE00 && cp < 0xFE10) ||		/// Variation selectors
+		(cp >= 0x1F000);						/// Emoji
+}
+
+//+ Tokenize
+/// Calls fnTerm( const std::string& ) for each folded term
+template <class FN>
+static void Tokenize( _In_ LPCSTR pszText, _In_ size_t iLen, _Inout_ std::string &Term, _In_ FN fnTerm )
+{
+	const BYTE *p = (const BYTE*)pszText, *pEnd = p + iLen;
+
+	Term.clear();
+	while (p < pEnd) {
+
+		BYTE c = *p;
+
+		/// ASCII
+		if (c < 0x80) {
+			if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) {
+				Term.push_back( (char)c );
+			} else if (c >= 'A' && c <= 'Z') {
+				Term.push_back( (char)(c + 'a' - 'A') );
+			} else if (!Term.empty()) {
+				if (Term.size() <= SMSX_MAX_TERM)
+					fnTerm( Term );
+				Term.clear();
+			}
+			p++;
+			continue;
+		}
+
+		/// UTF-8 sequence
+		ULONG cp, n;
+		if ((c & 0xE0) == 0xC0)			cp = c & 0x1F, n = 2;
+		else if ((c & 0xF0) == 0xE0)	cp = c & 0x0F, n = 3;
+		else if ((c & 0xF8) == 0xF0)	cp = c & 0x07, n = 4;
+		else							cp = 0, n = 1;		/// Malformed
+		if (p + n > pEnd)
+			n = 1, cp = 0;
+		for (ULONG i = 1; i < n; i++) {
+			if ((p[i] & 0xC0) != 0x80) {
+				n = 1, cp = 0;
+				break;
+			}
+			cp = (cp << 6) | (p[i] & 0x3F);
+		}
+
+		char chFold = (cp >= LATIN_FOLD_FIRST && cp <= LATIN_FOLD_LAST) ? g_LatinFold[cp - LATIN_FOLD_FIRST] : '_';
+		if (chFold == '.' || (chFold == '_' && IsSeparator( cp ))) {
+			if (!Term.empty()) {
+				if (Term.size() <= SMSX_MAX_TERM)
+					fnTerm( Term );
+				Term.clear();
+			}
+		} else if (chFold == '_') {
+			Term.append( (const char*)p, n );
+		} else {
+			Term.push_back( chFold );
+		}
+		p += n;
+	}
+
+	if (!Term.empty() && Term.size() <= SMSX_MAX_TERM)
+		fnTerm( Term );
+}
+
+
+//++ SmsTokenize
+ULONG SmsTokenize( _In_ LPCSTR pszText, _In_ size_t iLen, _Out_ std::vector<std::string> &Terms )
+{
+	std::string Term;
+	Terms.clear();
+	Tokenize( pszText, iLen, Term, [&Terms]( const std::string &s ) { Terms.push_back( s ); } );
+	return (ULONG)Terms.size();
+}
+
+
+//++ SmsTextIndexFile
+void SmsTextIndexFile( _In_ LPCTSTR pszBackup, _Out_ LPTSTR pszIndex, _In_ ULONG iLen )
+{
+	StringCchPrintf( pszIndex, iLen, _T( "%s%s" ), pszBackup, SMSX_EXTENSION );
+}
+
+
+//!++ SMSX writer
+
+#define SMSX_BATCH_SIZE		65536		/// Messages per worker thread
+#define SMSX_IO_SIZE		(1024 * 1024)
+
+//++ SmsTextIndexWriter
+SmsTextIndexWriter::SmsTextIndexWriter(): m_pBatch( NULL ), m_iCount( 0 )
+{
+	SYSTEM_INFO si;
+	GetSystemInfo( &si );
+	m_iMaxThreads = __max( si.dwNumberOfProcessors, 1 );
+}
+
+SmsTextIndexWriter::~SmsTextIndexWriter()
+{
+	WaitBatches( 0 );
+	for (auto it = m_Batches.begin(); it != m_Batches.end(); ++it)
+		delete *it;
+	delete m_pBatch;
+}
+
+DWORD WINAPI SmsTextIndexWriter::BatchThread( _In_ LPVOID pParam )
+{
+	BATCH *pBatch = (BATCH*)pParam;
+	std::string Term;
+	ULONG iStart = 0;
+
+	for (ULONG i = 0; i < (ULONG)pBatch->Ends.size(); i++) {
+		ULONG iId = pBatch->iFirstId + i;
+		Tokenize( pBatch->Text.c_str() + iStart, pBatch->Ends[i] - iStart, Term, [pBatch, iId]( const std::string &s ) {
+			SMS_POSTINGS &Postings = pBatch->Terms[s];
+			if (Postings.empty() || Postings.back() != iId)		/// Once per message
+				Postings.push_back( iId );
+		} );
+		iStart = pBatch->Ends[i];
+	}
+
+	/// Release the input
+	std::string().swap( pBatch->Text );
+	std::vector<ULONG>().swap( pBatch->Ends );
+	return ERROR_SUCCESS;
+}
+
+void SmsTextIndexWriter::StartBatch()
+{
+	if (m_pBatch) {
+		WaitBatches( m_iMaxThreads - 1 );		/// Limit concurrency
+		m_pBatch->hThread = CreateThread( NULL, 0, BatchThread, m_pBatch, 0, NULL );
+		if (!m_pBatch->hThread)
+			BatchThread( m_pBatch );			/// Do it ourselves
+		m_Batches.push_back( m_pBatch );
+		m_pBatch = NULL;
+	}
+}
+
+void SmsTextIndexWriter::WaitBatches( _In_ ULONG iMaxRunning )
+{
+	ULONG iRunning = 0;
+	for (auto it = m_Batches.begin(); it != m_Batches.end(); ++it)
+		if ((*it)->hThread)
+			iRunning++;
+
+	/// Oldest first
+	for (auto it = m_Batches.begin(); it != m_Batches.end() && iRunning > iMaxRunning; ++it) {
+		if ((*it)->hThread) {
+			WaitForSingleObject( (*it)->hThread, INFINITE );
+			CloseHandle( (*it)->hThread );
+			(*it)->hThread = NULL;
+			iRunning--;
+		}
+	}
+}
+
+BOOL SmsTextIndexWriter::Put( _Inout_ SMS &sms )
+{
+	if (!m_pBatch) {
+		m_pBatch = new BATCH;
+		m_pBatch->iFirstId = m_iCount;
+		m_pBatch->hThread = NULL;
+		m_pBatch->Ends.reserve( SMSX_BATCH_SIZE );
+	}
+
+	m_pBatch->Text.append( sms.Text );
+	m_pBatch->Ends.push_back( (ULONG)m_pBatch->Text.size() );
+	m_iCount++;
+
+	if (m_pBatch->Ends.size() >= SMSX_BATCH_SIZE)
+		StartBatch();
+	return TRUE;
+}
+
+ULONG SmsTextIndexWriter::Save( _In_ LPCTSTR pszBackup )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	StartBatch();
+	WaitBatches( 0 );
+
+	/// Merge. Batches are in message order, so are their posting lists
+	std::unordered_map<std::string, SMS_POSTINGS> Terms;
+	for (auto it = m_Batches.begin(); it != m_Batches.end(); ++it) {
+		for (auto itTerm = (*it)->Terms.begin(); itTerm != (*it)->Terms.end(); ++itTerm) {
+			SMS_POSTINGS &Postings = Terms[itTerm->first];
+			Postings.insert( Postings.end(), itTerm->second.begin(), itTerm->second.end() );
+		}
+		delete *it;
+	}
+	m_Batches.clear();
+
+	std::vector<const std::pair<const std::string, SMS_POSTINGS>*> Sorted;
+	Sorted.reserve( Terms.size() );
+	for (auto it = Terms.begin(); it != Terms.end(); ++it)
+		Sorted.push_back( &*it );
+	std::sort( Sorted.begin(), Sorted.end(), []( const std::pair<const std::string, SMS_POSTINGS> *a, const std::pair<const std::string, SMS_POSTINGS> *b ) { return a->first < b->first; } );
+
+	// Header
+	SMSX_HEADER Header = {0};
+	memcpy( Header.Magic, SMSX_MAGIC, SMSX_MAGIC_SIZE );
+	Header.iVersion = SMSX_VERSION;
+	Header.iMessageCount = m_iCount;
+	Header.iTermCount = (ULONG)Sorted.size();
+
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if (!GetFileAttributesEx( pszBackup, GetFileExInfoStandard, &fad ))
+		return GetLastError();
+	Header.iSourceSize = ((ULONG64)fad.nFileSizeHigh << 32) | fad.nFileSizeLow;
+	Header.SourceTime = fad.ftLastWriteTime;
+
+	TCHAR szIndex[MAX_PATH];
+	SmsTextIndexFile( pszBackup, szIndex, ARRAYSIZE( szIndex ) );
+	HANDLE hFile = CreateFile( szIndex, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (hFile == INVALID_HANDLE_VALUE)
+		return GetLastError();
+
+	std::string Buf;
+	ULONG64 iOffset = sizeof( Header );
+	DWORD dwBytes;
+	auto fnFlush = [&]() -> ULONG {
+		if (!Buf.empty() && !WriteFile( hFile, Buf.data(), (DWORD)Buf.size(), &dwBytes, NULL ))
+			return GetLastError();
+		iOffset += Buf.size();
+		Buf.clear();
+		return ERROR_SUCCESS;
+	};
+
+	if (!WriteFile( hFile, &Header, sizeof( Header ), &dwBytes, NULL ))
+		err = GetLastError();
+
+	// Postings
+	std::vector<ULONG64> Offsets( Sorted.size() );
+	for (size_t i = 0; i < Sorted.size() && err == ERROR_SUCCESS; i++) {
+		const SMS_POSTINGS &Postings = Sorted[i]->second;
+		Offsets[i] = iOffset + Buf.size();
+		SmsPutVarint( Buf, Postings.size() );
+		ULONG iPrev = 0;
+		for (auto it = Postings.begin(); it != Postings.end(); ++it) {
+			SmsPutVarint( Buf, *it - iPrev );
+			iPrev = *it;
+		}
+		if (Buf.size() >= SMSX_IO_SIZE)
+			err = fnFlush();
+	}
+	if (err == ERROR_SUCCESS)
+		err = fnFlush();
+
+	// Dictionary
+	Header.iDictionaryOffset = iOffset;
+	if (err == ERROR_SUCCESS) {
+		ULONG64 iPrev = 0;
+		SmsPutVarint( Buf, Sorted.size() );
+		for (size_t i = 0; i < Sorted.size() && err == ERROR_SUCCESS; i++) {
+			SmsPutVarint( Buf, Sorted[i]->first.size() );
+			Buf.append( Sorted[i]->first );
+			SmsPutVarint( Buf, Offsets[i] - iPrev );
+			iPrev = Offsets[i];
+			if (Buf.size() >= SMSX_IO_SIZE)
+				err = fnFlush();
+		}
+		if (err == ERROR_SUCCESS)
+			err = fnFlush();
+	}
+
+	// Patch the header
+	if (err == ERROR_SUCCESS) {
+		LARGE_INTEGER iZero = {0};
+		if (!SetFilePointerEx( hFile, iZero, NULL, FILE_BEGIN ) || !WriteFile( hFile, &Header, sizeof( Header ), &dwBytes, NULL ))
+			err = GetLastError();
+	}
+
+	CloseHandle( hFile );
+	if (err != ERROR_SUCCESS)
+		DeleteFile( szIndex );
+	return err;
+}
+
+
+//++ SmsBuildTextIndex
+ULONG SmsBuildTextIndex( _In_ ULONG iType, _In_ LPCTSTR pszBackup )
+{
+	SmsTextIndexWriter Writer;
+	ULONG err = SmsRead( iType, pszBackup, Writer );
+	if (err == ERROR_SUCCESS)
+		err = Writer.Save( pszBackup );
+	return err;
+}
+
+
+//!++ SMSX reader
+
+//++ SmsTextIndex
+SmsTextIndex::SmsTextIndex():
+	m_hFile( INVALID_HANDLE_VALUE ),
+	m_hMap( NULL ),
+	m_pView( NULL ),
+	m_pEnd( NULL ),
+	m_pHeader( NULL )
+{
+}
+
+SmsTextIndex::~SmsTextIndex()
+{
+	Close();
+}
+
+ULONG SmsTextIndex::Open( _In_ LPCTSTR pszBackup )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	Close();
+	if (!pszBackup || !*pszBackup)
+		return ERROR_INVALID_PARAMETER;
+
+	WIN32_FILE_ATTRIBUTE_DATA fad;
+	if (!GetFileAttributesEx( pszBackup, GetFileExInfoStandard, &fad ))
+		return GetLastError();
+
+	TCHAR szIndex[MAX_PATH];
+	SmsTextIndexFile( pszBackup, szIndex, ARRAYSIZE( szIndex ) );
+	m_hFile = CreateFile( szIndex, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL );
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		return GetLastError();
+
+	LARGE_INTEGER iFileSize;
+	if (!GetFileSizeEx( m_hFile, &iFileSize )) {
+		err = GetLastError();
+	} else if ((ULONG64)iFileSize.QuadPart < sizeof( SMSX_HEADER ) || (ULONG64)iFileSize.QuadPart > (SIZE_T)-1) {
+		err = ERROR_INVALID_DATA;
+	} else {
+		if ((m_hMap = CreateFileMapping( m_hFile, NULL, PAGE_READONLY, 0, 0, NULL )) == NULL) {
+			err = GetLastError();
+		} else if ((m_pView = (const BYTE*)MapViewOfFile( m_hMap, FILE_MAP_READ, 0, 0, 0 )) == NULL) {
+			err = GetLastError();
+		}
+	}
+
+	if (err == ERROR_SUCCESS) {
+
+		m_pEnd = m_pView + iFileSize.QuadPart;
+		m_pHeader = (const SMSX_HEADER*)m_pView;
+		if (memcmp( m_pHeader->Magic, SMSX_MAGIC, SMSX_MAGIC_SIZE ) != 0 ||
+			m_pHeader->iVersion != SMSX_VERSION ||
+			m_pHeader->iDictionaryOffset < sizeof( SMSX_HEADER ) ||
+			m_pHeader->iDictionaryOffset > (ULONG64)iFileSize.QuadPart ||
+			m_pHeader->iSourceSize != (((ULONG64)fad.nFileSizeHigh << 32) | fad.nFileSizeLow) ||
+			CompareFileTime( &m_pHeader->SourceTime, &fad.ftLastWriteTime ) != 0)		/// Stale
+		{
+			err = ERROR_INVALID_DATA;
+		}
+
+		// Dictionary
+		if (err == ERROR_SUCCESS) {
+			const BYTE *p = m_pView + m_pHeader->iDictionaryOffset;
+			ULONG64 iCount, iLen, iDelta, iOffset = 0;
+			if (SmsGetVarint( p, m_pEnd, iCount ) && iCount <= (ULONG64)(m_pEnd - p)) {
+				m_Terms.reserve( (size_t)iCount );
+				for (ULONG64 i = 0; i < iCount && err == ERROR_SUCCESS; i++) {
+					TERM Term;
+					if (SmsGetVarint( p, m_pEnd, iLen ) && iLen <= (ULONG64)(m_pEnd - p)) {
+						Term.pTerm = (const char*)p;
+						Term.iLen = (ULONG)iLen;
+						p += iLen;
+						if (SmsGetVarint( p, m_pEnd, iDelta ) && (iOffset += iDelta) < m_pHeader->iDictionaryOffset) {
+							Term.iPostings = iOffset;
+							m_Terms.push_back( Term );
+							continue;
+						}
+					}
+					err = ERROR_INVALID_DATA;
+				}
+			} else {
+				err = ERROR_INVALID_DATA;
+			}
+		}
+	}
+
+	if (err != ERROR_SUCCESS)
+		Close();
+	return err;
+}
+
+void SmsTextIndex::Close()
+{
+	if (m_pView)
+		UnmapViewOfFile( m_pView );
+	if (m_hMap)
+		CloseHandle( m_hMap );
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		CloseHandle( m_hFile );
+	m_hFile = INVALID_HANDLE_VALUE;
+	m_hMap = NULL;
+	m_pView = m_pEnd = NULL;
+	m_pHeader = NULL;
+	m_Terms.clear();
+}
+
+ULONG SmsTextIndex::GetPostings( _In_ const std::string &sTerm, _Out_ SMS_POSTINGS &Ids )
+{
+	Ids.clear();
+
+	auto it = std::lower_bound( m_Terms.begin(), m_Terms.end(), sTerm, []( const TERM &t, const std::string &s ) {
+		int i = memcmp( t.pTerm, s.c_str(), __min( t.iLen, (ULONG)s.size() ) );
+		return i < 0 || (i == 0 && t.iLen < s.size());
+	} );
+	if (it == m_Terms.end() || it->iLen != sTerm.size() || memcmp( it->pTerm, sTerm.c_str(), it->iLen ) != 0)
+		return ERROR_SUCCESS;		/// Not found
+
+	const BYTE *p = m_pView + it->iPostings, *pEnd = m_pView + m_pHeader->iDictionaryOffset;
+	ULONG64 iCount, iDelta, iId = 0;
+	if (!SmsGetVarint( p, pEnd, iCount ) || iCount > (ULONG64)(pEnd - p))
+		return ERROR_INVALID_DATA;
+	Ids.reserve( (size_t)iCount );
+	for (ULONG64 i = 0; i < iCount; i++) {
+		if (!SmsGetVarint( p, pEnd, iDelta ))
+			return ERROR_INVALID_DATA;
+		Ids.push_back( (ULONG)(iId += iDelta) );
+	}
+	return ERROR_SUCCESS;
+}
+
+ULONG SmsTextIndex::Query( _In_ LPCSTR pszQuery, _Out_ SMS_POSTINGS &Ids )
+{
+	ULONG err = ERROR_SUCCESS;
+
+	Ids.clear();
+	if (!m_pView)
+		return ERROR_INVALID_HANDLE;
+	if (!pszQuery)
+		return ERROR_INVALID_PARAMETER;
+
+	std::vector<std::string> Terms;
+	if (SmsTokenize( pszQuery, strlen( pszQuery ), Terms ) == 0)
+		return ERROR_SUCCESS;
+
+	/// Intersect the posting lists
+	SMS_POSTINGS Postings, Both;
+	for (size_t i = 0; i < Terms.size() && err == ERROR_SUCCESS; i++) {
+		if ((err = GetPostings( Terms[i], Postings )) == ERROR_SUCCESS) {
+			if (i == 0) {
+				Ids.swap( Postings );
+			} else {
+				Both.clear();
+				std::set_intersection( Ids.begin(), Ids.end(), Postings.begin(), Postings.end(), std::back_inserter( Both ) );
+				Ids.swap( Both );
+			}
+			if (Ids.empty())
+				break;
+		}
+	}
+
+	if (err != ERROR_SUCCESS)
+		Ids.clear();
+	return err;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "SmsConvert.h"
+#include "SmsIndex.h"
+
+//? Full-text index of message bodies
+//? Text is split into words (runs of letters and digits). Words are case folded and stripped of diacritics, "Stiinte" matches "STIINTE" and "\u0218tiin\u021Be"
+//? Folding covers ASCII, Latin-1 and Latin Extended-A/B letters (all Romanian letters, comma and cedilla variants alike). Other scripts are indexed verbatim
+//? Letters without an ASCII base ("\u00C6"/"\u00E6", "\u00DF", ...) and other scripts (Greek, Cyrillic, ...) are indexed verbatim, therefore case sensitive
+//? Message ids are the positions of the messages in reading order (see SmsRead)
+
+
+//+ SmsTokenize
+/// Split UTF-8 text into folded terms. Returns the number of terms
+ULONG SmsTokenize( _In_ LPCSTR pszText, _In_ size_t iLen, _Out_ std::vector<std::string> &Terms );
+
+
+//!++ SMSX index file
+//? Stored next to the backup, as "<backup>.smsx"
+//? Layout:
+//?   SMSX_HEADER
+//?   Postings   {[count]{[message id delta]}...}...
+//?   Dictionary [term count]{[length][term][postings offset delta]}...		Sorted by term
+//? The index remembers the size and time of the backup it was built from. A stale index refuses to open
+
+#define SMSX_MAGIC			"SMSX"
+#define SMSX_MAGIC_SIZE		4
+#define SMSX_VERSION		1
+#define SMSX_EXTENSION		_T( ".smsx" )
+#define SMSX_MAX_TERM		64			/// Longer words (bytes) aren't indexed
+
+//+ SMSX_HEADER
+struct SMSX_HEADER {
+	CHAR Magic[SMSX_MAGIC_SIZE];		/// SMSX_MAGIC
+	ULONG iVersion;						/// SMSX_VERSION
+	ULONG iMessageCount;
+	ULONG iTermCount;
+	ULONG64 iDictionaryOffset;
+	ULONG64 iSourceSize;				/// Size of the backup
+	FILETIME SourceTime;				/// Last write time of the backup
+};
+
+//+ SmsTextIndexFile
+/// Backup file -> Index file
+void SmsTextIndexFile( _In_ LPCTSTR pszBackup, _Out_ LPTSTR pszIndex, _In_ ULONG iLen );
+
+
+//+ SmsTextIndexWriter
+/// Pass it to SmsRead() as a sink, then Save()
+/// Messages are tokenized in batches, on worker threads (one per CPU), while reading continues
+class SmsTextIndexWriter: public SmsSink {
+public:
+	SmsTextIndexWriter();
+	~SmsTextIndexWriter();
+
+	BOOL Put( _Inout_ SMS &sms );
+
+	/// Wait for the workers, merge their terms and write the index next to the backup
+	ULONG Save( _In_ LPCTSTR pszBackup );
+
+private:
+	struct BATCH {
+		ULONG iFirstId;
+		std::string Text;								/// Message texts, back to back
+		std::vector<ULONG> Ends;						/// End of each text in Text
+		std::unordered_map<std::string, SMS_POSTINGS> Terms;
+		HANDLE hThread;
+	};
+	static DWORD WINAPI BatchThread( _In_ LPVOID pParam );
+	void StartBatch();
+	void WaitBatches( _In_ ULONG iMaxRunning );
+
+private:
+	std::vector<BATCH*> m_Batches;
+	BATCH *m_pBatch;					/// The batch being filled
+	ULONG m_iCount;						/// Messages received
+	ULONG m_iMaxThreads;
+};
+
+//+ SmsBuildTextIndex
+/// Read a backup of any known type and index it
+ULONG SmsBuildTextIndex( _In_ ULONG iType, _In_ LPCTSTR pszBackup );
+
+
+//+ SmsTextIndex
+class SmsTextIndex {
+public:
+	SmsTextIndex();
+	~SmsTextIndex();
+
+	/// Open the index of a backup. Returns ERROR_INVALID_DATA if the index is stale or damaged
+	ULONG Open( _In_ LPCTSTR pszBackup );
+	void Close();
+
+	ULONG GetMessageCount() const	{ return m_pHeader ? m_pHeader->iMessageCount : 0; }
+	ULONG GetTermCount() const		{ return (ULONG)m_Terms.size(); }
+
+	/// Messages containing all the words of pszQuery (UTF-8). Ids are ascending
+	ULONG Query( _In_ LPCSTR pszQuery, _Out_ SMS_POSTINGS &Ids );
+
+private:
+	struct TERM {
+		const char *pTerm;				/// Not null terminated!
+		ULONG iLen;
+		ULONG64 iPostings;				/// File offset
+	};
+	ULONG GetPostings( _In_ const std::string &sTerm, _Out_ SMS_POSTINGS &Ids );
+
+private:
+	HANDLE m_hFile;
+	HANDLE m_hMap;
+	const BYTE *m_pView;
+	const BYTE *m_pEnd;
+	const SMSX_HEADER *m_pHeader;
+	std::vector<TERM> m_Terms;			/// Sorted
+};
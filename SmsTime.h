@@ -0,0 +1,101 @@
+#pragma once
+
+//? Message timestamps, and conversions between the units used by the backup formats
+//? * SMS_TIME:      100ns ticks since 1601/01/01 UTC (the FILETIME unit and epoch). CMBK stores them as they are
+//? * POSIX ms:      milliseconds since 1970/01/01 UTC. Android (SMSBR) timestamps
+//? * Local minutes: minutes since 1601/01/01, local time. Nokia timestamps ("YYYY.MM.DD HH:MM")
+//? Timestamps are plain 64-bit integers: sorting and comparisons are integer operations, and nothing is type-punned through FILETIME
+//? Standard C++ only, no Windows headers. The core builds and runs on any platform
+
+//? LINKS:
+//? * https://en.wikipedia.org/wiki/Unix_time
+//? * http://stackoverflow.com/questions/6161776/convert-windows-filetime-to-second-in-unix-linux
+//? * http://stackoverflow.com/questions/3585583/convert-unix-linux-time-to-windows-filetime
+//? * http://howardhinnant.github.io/date_algorithms.html
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+//+ SMS_TIME
+typedef uint64_t SMS_TIME;
+
+#define SMS_TIME_MIN			((SMS_TIME)0)
+#define SMS_TIME_MAX			((SMS_TIME)-1)
+
+#define SMS_TICKS_PER_MS		10000LL
+#define SMS_TICKS_PER_MINUTE	600000000LL
+#define SMS_EPOCH_DIFF_MS		(11644473600LL * 1000LL)		/// Milliseconds(1/1/1970 - 1/1/1601)
+#define SMS_EPOCH_DIFF_DAYS		134774LL						/// Days(1/1/1970 - 1/1/1601)
+
+
+//+ SmsTimeToPosixMs, SmsTimeFromPosixMs
+/// Signed arithmetic: timestamps before 1970 are negative milliseconds
+/// SmsTimeFromPosixMs requires SmsPosixMsInRange( iMs ) (1601 to year 30828). Check values read from files first
+inline int64_t SmsTimeToPosixMs( SMS_TIME t )
+{
+	return (int64_t)t / SMS_TICKS_PER_MS - SMS_EPOCH_DIFF_MS;
+}
+
+inline SMS_TIME SmsTimeFromPosixMs( int64_t iMs )
+{
+	return (SMS_TIME)((iMs + SMS_EPOCH_DIFF_MS) * SMS_TICKS_PER_MS);
+}
+
+#define SMS_POSIX_MS_MIN		(-SMS_EPOCH_DIFF_MS)									/// 1601/01/01
+#define SMS_POSIX_MS_MAX		(INT64_MAX / SMS_TICKS_PER_MS - SMS_EPOCH_DIFF_MS)		/// The last millisecond whose tick count fits in int64_t
+
+inline bool SmsPosixMsInRange( int64_t iMs )
+{
+	return iMs >= SMS_POSIX_MS_MIN && iMs <= SMS_POSIX_MS_MAX;
+}
+
+//+ SmsTimeToLocalMinutes, SmsTimeFromLocalMinutes
+/// iBias is the offset of the local time from UTC, in minutes (e.g. +120 for UTC+2). Seconds are truncated
+inline int64_t SmsTimeToLocalMinutes( SMS_TIME t, int32_t iBias )
+{
+	return (int64_t)(t / SMS_TICKS_PER_MINUTE) + iBias;
+}
+
+inline SMS_TIME SmsTimeFromLocalMinutes( int64_t iMinutes, int32_t iBias )
+{
+	return (SMS_TIME)((iMinutes - iBias) * SMS_TICKS_PER_MINUTE);
+}
+
+
+//+ SmsDaysFromCivil
+/// Year, month (1..12), day (1..31) -> days since 1970/01/01, proleptic Gregorian calendar
+/// Howard Hinnant's days_from_civil. Plain integer arithmetic, no OS calls
+inline int64_t SmsDaysFromCivil( int32_t iYear, uint32_t iMonth, uint32_t iDay )
+{
+	iYear -= (iMonth <= 2);
+	int64_t iEra = (iYear >= 0 ? iYear : iYear - 399) / 400;
+	uint32_t iYearOfEra = (uint32_t)(iYear - iEra * 400);								/// [0, 399]
+	uint32_t iDayOfYear = (153 * (iMonth > 2 ? iMonth - 3 : iMonth + 9) + 2) / 5 + iDay - 1;		/// [0, 365], from March 1st
+	uint32_t iDayOfEra = iYearOfEra * 365 + iYearOfEra / 4 - iYearOfEra / 100 + iDayOfYear;		/// [0, 146096]
+	return iEra * 146097 + iDayOfEra - 719468;
+}
+
+//+ SmsCivilFromDays
+/// Days since 1970/01/01 -> year, month (1..12), day (1..31). Inverse of SmsDaysFromCivil
+inline void SmsCivilFromDays( int64_t iDays, int32_t &iYear, uint32_t &iMonth, uint32_t &iDay )
+{
+	iDays += 719468;														/// Shift the epoch to 0000/03/01
+	int64_t iEra = (iDays >= 0 ? iDays : iDays - 146096) / 146097;			/// 400-year eras
+	uint32_t iDayOfEra = (uint32_t)(iDays - iEra * 146097);					/// [0, 146096]
+	uint32_t iYearOfEra = (iDayOfEra - iDayOfEra / 1460 + iDayOfEra / 36524 - iDayOfEra / 146096) / 365;		/// [0, 399]
+	uint32_t iDayOfYear = iDayOfEra - (365 * iYearOfEra + iYearOfEra / 4 - iYearOfEra / 100);				/// [0, 365], from March 1st
+	uint32_t iMonthIndex = (5 * iDayOfYear + 2) / 153;						/// [0, 11], from March
+	iDay = iDayOfYear - (153 * iMonthIndex + 2) / 5 + 1;
+	iMonth = iMonthIndex < 10 ? iMonthIndex + 3 : iMonthIndex - 9;
+	iYear = (int32_t)(iYearOfEra + iEra * 400) + (iMonth <= 2);
+}
+
+//+ SmsTimeFromCivil
+/// UTC date and time -> SMS_TIME. Fields are not validated
+inline SMS_TIME SmsTimeFromCivil( int32_t iYear, uint32_t iMonth, uint32_t iDay, uint32_t iHour, uint32_t iMinute, uint32_t iSecond )
+{
+	int64_t iSeconds = (SmsDaysFromCivil( iYear, iMonth, iDay ) + SMS_EPOCH_DIFF_DAYS) * 86400 + iHour * 3600 + iMinute * 60 + iSecond;
+	return (SMS_TIME)(iSeconds * 10000000);
+}
+
@@ -0,0 +1,293 @@
+#include "SmsTimeZone.h"
+#include <string.h>
+#include <string>
+
+//? Standard C++ only, compiled without the precompiled header (see sms_w2a.vcxproj)
+
+
+//+ SMS_TZ_RULE
+/// Parsed POSIX TZ string: std offset [dst [offset] [,start[/time],end[/time]]]
+struct SMS_TZ_RULE {
+	struct DATE {
+		char cKind;				/// 'M' = Mm.w.d, 'J' = Jn (1..365, February 29th is never counted), 'N' = n (0..365)
+		int32_t iMonth, iWeek, iDay;
+		int32_t iTime;			/// Seconds, local time. May be negative or exceed 24h (RFC 8536)
+	};
+	int32_t iStdBias, iDstBias;	/// Minutes, local - UTC
+	bool bDst;
+	DATE Start, End;
+};
+
+
+//++ FloorDiv
+static inline int64_t FloorDiv( int64_t a, int64_t b )
+{
+	return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+//++ ParseNumber
+static const char* ParseNumber( const char *p, int32_t iMax, int32_t &iValue )
+{
+	if (*p < '0' || *p > '9')
+		return NULL;
+	for (iValue = 0; *p >= '0' && *p <= '9'; p++) {
+		iValue = iValue * 10 + (*p - '0');
+		if (iValue > iMax)
+			return NULL;
+	}
+	return p;
+}
+
+//++ ParseName
+/// Alphabetic ("CET") or quoted ("<+0530>")
+static const char* ParseName( const char *p )
+{
+	const char *pStart = p;
+	if (*p == '<') {
+		while (*++p && *p != '>') {}
+		return (*p == '>' && p - pStart > 1) ? p + 1 : NULL;
+	}
+	while ((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z'))
+		p++;
+	return p - pStart >= 3 ? p : NULL;
+}
+
+//++ ParseTime
+/// [+|-]hh[:mm[:ss]] -> seconds
+static const char* ParseTime( const char *p, int32_t &iSeconds )
+{
+	int32_t iSign = 1, iHours, iMinutes = 0, i = 0;
+	if (*p == '+' || *p == '-')
+		iSign = (*p++ == '-') ? -1 : 1;
+	if ((p = ParseNumber( p, 167, iHours )) == NULL)
+		return NULL;
+	if (*p == ':') {
+		if ((p = ParseNumber( p + 1, 59, iMinutes )) == NULL)
+			return NULL;
+		if (*p == ':' && (p = ParseNumber( p + 1, 59, i )) == NULL)
+			return NULL;
+	}
+	iSeconds = iSign * (iHours * 3600 + iMinutes * 60 + i);
+	return p;
+}
+
+//++ ParseDate
+/// Mm.w.d | Jn | n, then an optional /time (default 02:00)
+static const char* ParseDate( const char *p, SMS_TZ_RULE::DATE &Date )
+{
+	Date.iMonth = Date.iWeek = Date.iDay = 0;
+	if (*p == 'M') {
+		Date.cKind = 'M';
+		if ((p = ParseNumber( p + 1, 12, Date.iMonth )) == NULL || Date.iMonth < 1 || *p != '.')
+			return NULL;
+		if ((p = ParseNumber( p + 1, 5, Date.iWeek )) == NULL || Date.iWeek < 1 || *p != '.')
+			return NULL;
+		if ((p = ParseNumber( p + 1, 6, Date.iDay )) == NULL)
+			return NULL;
+	} else if (*p == 'J') {
+		Date.cKind = 'J';
+		if ((p = ParseNumber( p + 1, 365, Date.iDay )) == NULL || Date.iDay < 1)
+			return NULL;
+	} else {
+		Date.cKind = 'N';
+		if ((p = ParseNumber( p, 365, Date.iDay )) == NULL)
+			return NULL;
+	}
+	Date.iTime = 7200;
+	if (*p == '/')
+		p = ParseTime( p + 1, Date.iTime );
+	return p;
+}
+
+//++ DateInYear
+/// Local time of a rule date, in minutes since 1601/01/01
+static int64_t DateInYear( const SMS_TZ_RULE::DATE &Date, int32_t iYear )
+{
+	int64_t iDays = SmsDaysFromCivil( iYear, 1, 1 );
+	if (Date.cKind == 'M') {
+		int64_t iFirst = SmsDaysFromCivil( iYear, Date.iMonth, 1 );
+		int64_t iNext = (Date.iMonth == 12) ? SmsDaysFromCivil( iYear + 1, 1, 1 ) : SmsDaysFromCivil( iYear, Date.iMonth + 1, 1 );
+		int32_t iFirstDay = (int32_t)((iFirst % 7 + 11) % 7);		/// 1970/01/01 was a Thursday (4)
+		iDays = iFirst + (Date.iDay - iFirstDay + 7) % 7 + (Date.iWeek - 1) * 7;
+		while (iDays >= iNext)
+			iDays -= 7;		/// Week 5 = the last one
+	} else if (Date.cKind == 'J') {
+		bool bLeap = (iYear % 4 == 0 && iYear % 100 != 0) || iYear % 400 == 0;
+		iDays += Date.iDay - 1 + (bLeap && Date.iDay >= 60 ? 1 : 0);
+	} else {
+		iDays += Date.iDay;
+	}
+	return (iDays + SMS_EPOCH_DIFF_DAYS) * 1440 + FloorDiv( Date.iTime, 60 );
+}
+
+
+//++ SmsTimeZone::SetFixed
+void SmsTimeZone::SetFixed( int32_t iBias )
+{
+	m_Utc.clear();
+	m_Local.clear();
+	m_Bias.assign( 1, iBias );
+}
+
+//++ SmsTimeZone::Add
+/// Transitions are added in chronological order. A transition at or before the last one replaces it
+void SmsTimeZone::Add( int64_t iUtc, int32_t iBias )
+{
+	while (!m_Utc.empty() && iUtc <= m_Utc.back()) {
+		m_Utc.pop_back();
+		m_Local.pop_back();
+		m_Bias.pop_back();
+	}
+	if (iBias == m_Bias.back())
+		return;				/// Not a change (e.g. only the abbreviation changed)
+	m_Utc.push_back( iUtc );
+	m_Local.push_back( iUtc + iBias );
+	m_Bias.push_back( iBias );
+}
+
+//++ SmsTimeZone::ParseRule
+bool SmsTimeZone::ParseRule( const char *pszRule, SMS_TZ_RULE &Rule )
+{
+	int32_t iOffset;
+	const char *p = pszRule;
+	if (!p || (p = ParseName( p )) == NULL || (p = ParseTime( p, iOffset )) == NULL)
+		return false;
+	Rule.iStdBias = -FloorDiv( iOffset, 60 );		/// POSIX offsets are positive west of Greenwich
+	Rule.bDst = (*p != 0);
+	if (!Rule.bDst)
+		return true;
+
+	if ((p = ParseName( p )) == NULL)
+		return false;
+	Rule.iDstBias = Rule.iStdBias + 60;
+	if (*p && *p != ',') {
+		if ((p = ParseTime( p, iOffset )) == NULL)
+			return false;
+		Rule.iDstBias = -FloorDiv( iOffset, 60 );
+	}
+	if (*p == ',') {
+		if ((p = ParseDate( p + 1, Rule.Start )) == NULL || *p != ',')
+			return false;
+		if ((p = ParseDate( p + 1, Rule.End )) == NULL)
+			return false;
+	} else {
+		ParseDate( "M3.2.0", Rule.Start );				/// US rules, the POSIX default
+		ParseDate( "M11.1.0", Rule.End );
+	}
+	return *p == 0;
+}
+
+//++ SmsTimeZone::ExpandRule
+/// Adds the transitions of the years [iFirstYear, SMS_TZ_LAST_YEAR] that come after iAfter (UTC)
+void SmsTimeZone::ExpandRule( const SMS_TZ_RULE &Rule, int32_t iFirstYear, int64_t iAfter )
+{
+	if (!Rule.bDst) {
+		if (m_Utc.empty())
+			m_Bias[0] = Rule.iStdBias;
+		return;
+	}
+	for (int32_t iYear = iFirstYear; iYear <= SMS_TZ_LAST_YEAR; iYear++) {
+		int64_t iStart = DateInYear( Rule.Start, iYear ) - Rule.iStdBias;		/// The start time is in standard time
+		int64_t iEnd = DateInYear( Rule.End, iYear ) - Rule.iDstBias;			/// The end time is in daylight time
+		if (iStart < iEnd) {
+			if (iStart > iAfter)
+				Add( iStart, Rule.iDstBias );
+			if (iEnd > iAfter)
+				Add( iEnd, Rule.iStdBias );
+		} else {
+			if (iEnd > iAfter)
+				Add( iEnd, Rule.iStdBias );			/// Southern hemisphere
+			if (iStart > iAfter)
+				Add( iStart, Rule.iDstBias );
+		}
+	}
+}
+
+//++ SmsTimeZone::SetRule
+bool SmsTimeZone::SetRule( const char *pszRule )
+{
+	SMS_TZ_RULE Rule;
+	if (!ParseRule( pszRule, Rule ))
+		return false;
+	SetFixed( Rule.iStdBias );
+	ExpandRule( Rule, SMS_TZ_FIRST_YEAR, INT64_MIN );
+	return true;
+}
+
+
+//++ ReadBE
+static inline int64_t ReadBE( const unsigned char *p, size_t iBytes )
+{
+	uint64_t v = 0;
+	for (size_t i = 0; i < iBytes; i++)
+		v = (v << 8) | p[i];
+	return iBytes == 4 ? (int64_t)(int32_t)(uint32_t)v : (int64_t)v;
+}
+
+//++ SmsTimeZone::LoadTzif
+bool SmsTimeZone::LoadTzif( const void *pData, size_t iSize )
+{
+	//? Layout (RFC 8536):
+	/// Header:  "TZif", version, 15 reserved bytes, six 32-bit big endian counts: isutcnt, isstdcnt, leapcnt, timecnt, typecnt, charcnt
+	/// Data:    transition times (timecnt), transition types (timecnt), local time types (typecnt * 6), abbreviations (charcnt), leap seconds, indicators
+	/// Version 1 data has 32-bit times. Version 2+ repeats the header and data with 64-bit times, then adds a footer: "\n<POSIX TZ string>\n"
+	const unsigned char *p = (const unsigned char*)pData, *pEnd = p + iSize;
+	size_t iTimeSize = 4;
+
+	for (int iPass = 0; iPass < 2; iPass++) {
+		if (pEnd - p < 44 || memcmp( p, "TZif", 4 ) != 0)
+			return false;
+		char cVersion = (char)p[4];
+		size_t iUtCnt = (size_t)ReadBE( p + 20, 4 ), iStdCnt = (size_t)ReadBE( p + 24, 4 ), iLeapCnt = (size_t)ReadBE( p + 28, 4 );
+		size_t iTimeCnt = (size_t)ReadBE( p + 32, 4 ), iTypeCnt = (size_t)ReadBE( p + 36, 4 ), iCharCnt = (size_t)ReadBE( p + 40, 4 );
+		p += 44;
+		size_t iDataSize = iTimeCnt * iTimeSize + iTimeCnt + iTypeCnt * 6 + iCharCnt + iLeapCnt * (iTimeSize + 4) + iStdCnt + iUtCnt;
+		if (iTypeCnt == 0 || iTimeCnt > (1 << 20) || iTypeCnt > 256 || iLeapCnt > (1 << 20) || iCharCnt > (1 << 20) || (size_t)(pEnd - p) < iDataSize)
+			return false;
+
+		if (iPass == 0 && cVersion >= '2') {
+			p += iDataSize;				/// Skip to the 64-bit data
+			iTimeSize = 8;
+			continue;
+		}
+
+		const unsigned char *pTimes = p, *pIndices = p + iTimeCnt * iTimeSize, *pTypes = pIndices + iTimeCnt;
+		for (size_t i = 0; i < iTimeCnt; i++)
+			if (pIndices[i] >= iTypeCnt)
+				return false;
+
+		/// Local time type 0 applies before the first transition
+		SmsTimeZone Zone;
+		Zone.SetFixed( (int32_t)FloorDiv( ReadBE( pTypes, 4 ), 60 ) );
+		for (size_t i = 0; i < iTimeCnt; i++) {
+			int64_t iUtc = FloorDiv( ReadBE( pTimes + i * iTimeSize, iTimeSize ), 60 ) + SMS_EPOCH_DIFF_DAYS * 1440;
+			Zone.Add( iUtc, (int32_t)FloorDiv( ReadBE( pTypes + pIndices[i] * 6, 4 ), 60 ) );
+		}
+
+		/// Footer: the rule for the times after the last transition
+		p += iDataSize;
+		if (iTimeSize == 8 && p < pEnd && *p == '\n') {
+			const unsigned char *pRule = p + 1, *pRuleEnd = (const unsigned char*)memchr( pRule, '\n', pEnd - pRule );
+			if (pRuleEnd && pRuleEnd > pRule) {
+				SMS_TZ_RULE Rule;
+				std::string sRule( (const char*)pRule, pRuleEnd - pRule );
+				if (!ParseRule( sRule.c_str(), Rule ))
+					return false;
+				if (Zone.m_Utc.empty()) {
+					Zone.SetFixed( Rule.iStdBias );
+					Zone.ExpandRule( Rule, SMS_TZ_FIRST_YEAR, INT64_MIN );
+				} else {
+					int64_t iLast = Zone.m_Utc.back();
+					int32_t iYear;
+					uint32_t iMonth, iDay;
+					SmsCivilFromDays( FloorDiv( iLast, 1440 ) - SMS_EPOCH_DIFF_DAYS, iYear, iMonth, iDay );
+					Zone.ExpandRule( Rule, iYear, iLast );
+				}
+			}
+		}
+
+		*this = Zone;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "SmsTime.h"
+#include <vector>
+#include <algorithm>
+
+//? Time zones, as precomputed tables of UTC offset transitions
+//? A conversion is a binary search in the table, then an add. No OS calls per timestamp, and the result doesn't depend on the machine's time zone
+//? Sources:
+//? * IANA tz database files (TZif, RFC 8536), e.g. /usr/share/zoneinfo/Europe/Berlin on Linux. The footer rule extends the table up to SMS_TZ_LAST_YEAR
+//? * POSIX TZ strings, e.g. "CET-1CEST,M3.5.0,M10.5.0/3" or "UTC0". Yearly rules are expanded from SMS_TZ_FIRST_YEAR to SMS_TZ_LAST_YEAR
+//? Outside the table, the first (or last) offset applies
+//? Times are minutes since 1601/01/01 (see SmsTimeToLocalMinutes). Offsets are whole minutes
+//? Standard C++ only, no Windows headers
+
+#define SMS_TZ_FIRST_YEAR		1970
+#define SMS_TZ_LAST_YEAR		2100
+
+struct SMS_TZ_RULE;			/// SmsTimeZone.cpp
+
+
+//+ SmsTimeZone
+class SmsTimeZone {
+public:
+	SmsTimeZone() { SetFixed( 0 ); }			/// UTC
+
+	void SetFixed( int32_t iBias );								/// Local = UTC + iBias minutes
+	bool SetRule( const char *pszRule );						/// POSIX TZ string. false if malformed (the zone is unchanged)
+	bool LoadTzif( const void *pData, size_t iSize );			/// TZif file, versions 1 to 4. false if malformed (the zone is unchanged)
+
+	//+ Lookups
+	/// Offsets from UTC, in minutes. Local times skipped by a transition use the offset before it, repeated local times use the offset after it
+	int32_t BiasAtUtc( int64_t iUtcMinutes ) const
+	{
+		return m_Bias[std::upper_bound( m_Utc.begin(), m_Utc.end(), iUtcMinutes ) - m_Utc.begin()];
+	}
+	int32_t BiasAtLocal( int64_t iLocalMinutes ) const
+	{
+		return m_Bias[std::upper_bound( m_Local.begin(), m_Local.end(), iLocalMinutes ) - m_Local.begin()];
+	}
+
+	SMS_TIME FromLocal( int64_t iLocalMinutes ) const { return SmsTimeFromLocalMinutes( iLocalMinutes, BiasAtLocal( iLocalMinutes ) ); }
+	int64_t ToLocal( SMS_TIME t ) const { return SmsTimeToLocalMinutes( t, BiasAtUtc( (int64_t)(t / SMS_TICKS_PER_MINUTE) ) ); }
+
+	size_t GetTransitionCount() const { return m_Utc.size(); }
+
+private:
+	static bool ParseRule( const char *pszRule, SMS_TZ_RULE &Rule );
+	void ExpandRule( const SMS_TZ_RULE &Rule, int32_t iFirstYear, int64_t iAfter );
+	void Add( int64_t iUtc, int32_t iBias );
+
+private:
+	std::vector<int64_t> m_Utc;				/// Transitions, UTC
+	std::vector<int64_t> m_Local;			/// The same transitions, local time after the change
+	std::vector<int32_t> m_Bias;			/// m_Bias[0] applies before the first transition, m_Bias[i + 1] from transition i on
+};
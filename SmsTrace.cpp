@@ -0,0 +1,106 @@
+#include "StdAfx.h"
+#include "SmsConvert.h"
+#include "SmsTrace.h"
+
+volatile LONG g_bSmsTrace = FALSE;
+
+static volatile LONG64 g_StageCalls[SMS_STAGE_COUNT] = {0};
+static volatile LONG64 g_StageTicks[SMS_STAGE_COUNT] = {0};
+static volatile LONG64 g_Counters[SMS_COUNTER_COUNT] = {0};
+
+static LPCSTR g_StageNames[SMS_STAGE_COUNT] = {
+	"SmsGetFileSummary",
+	"Read_CMBK", "Read_SMSBR", "Read_NOKIA", "Read_SMSB",
+	"Write_CMBK", "Write_SMSBR", "Write_NOKIA", "Write_SMSB",
+	"Hash_CMBK",
+	"Sort"
+};
+
+static LPCSTR g_CounterNames[SMS_COUNTER_COUNT] = {
+	"bytes_read", "bytes_written", "bytes_hashed",
+	"nodes_parsed", "messages_read", "messages_written",
+	"pool_blocks", "pool_bytes",
+	"records_skipped"
+};
+
+
+//++ SmsTraceEnable
+void SmsTraceEnable( _In_ BOOL bEnable )
+{
+	if (bEnable) {
+		for (int i = 0; i < SMS_STAGE_COUNT; i++)
+			g_StageCalls[i] = g_StageTicks[i] = 0;
+		for (int i = 0; i < SMS_COUNTER_COUNT; i++)
+			g_Counters[i] = 0;
+	}
+	InterlockedExchange( &g_bSmsTrace, bEnable ? TRUE : FALSE );
+}
+
+
+//++ SmsTraceAdd
+void SmsTraceAdd( _In_ SMS_COUNTER iCounter, _In_ ULONG64 iValue )
+{
+	assert( iCounter < SMS_COUNTER_COUNT );
+	InterlockedExchangeAdd64( &g_Counters[iCounter], (LONG64)iValue );
+}
+
+
+//++ SmsTraceScope
+LONG64 SmsTraceScope::Start()
+{
+	LARGE_INTEGER t;
+	QueryPerformanceCounter( &t );
+	return t.QuadPart ? t.QuadPart : 1;		/// 0 means "not timed"
+}
+
+void SmsTraceScope::Stop( _In_ SMS_STAGE iStage, _In_ LONG64 iStart )
+{
+	assert( iStage < SMS_STAGE_COUNT );
+	LARGE_INTEGER t;
+	QueryPerformanceCounter( &t );
+	InterlockedIncrement64( &g_StageCalls[iStage] );
+	InterlockedExchangeAdd64( &g_StageTicks[iStage], t.QuadPart - iStart );
+}
+
+
+//++ SmsTracePoolAlloc
+void* SmsTracePoolAlloc( _In_ size_t iSize )
+{
+	SmsTraceCount( SMS_COUNTER_POOL_BLOCKS, 1 );
+	SmsTraceCount( SMS_COUNTER_POOL_BYTES, iSize );
+	return new char[iSize];		/// Same as rapidxml's default allocator
+}
+
+//++ SmsTracePoolFree
+void SmsTracePoolFree( _In_ void *p )
+{
+	delete[] (char*)p;
+}
+
+
+//++ SmsTraceSave
+ULONG SmsTraceSave( _In_ LPCTSTR pszFile )
+{
+	LARGE_INTEGER iFreq;
+	QueryPerformanceFrequency( &iFreq );
+
+	CHAR szItem[128];
+	utf8string Json;
+
+	Json += "{\"stages\":{";
+	for (int i = 0, n = 0; i < SMS_STAGE_COUNT; i++) {
+		if (g_StageCalls[i]) {
+			StringCchPrintfA( szItem, ARRAYSIZE( szItem ), "%s\n\t\"%s\":{\"calls\":%I64d,\"ms\":%.3f}",
+				n++ ? "," : "", g_StageNames[i], g_StageCalls[i], (double)g_StageTicks[i] * 1000.0 / (double)iFreq.QuadPart );
+			Json += szItem;
+		}
+	}
+	Json += "\n},\"counters\":{";
+	for (int i = 0; i < SMS_COUNTER_COUNT; i++) {
+		StringCchPrintfA( szItem, ARRAYSIZE( szItem ), "%s\n\t\"%s\":%I64d", i ? "," : "", g_CounterNames[i], g_Counters[i] );
+		Json += szItem;
+	}
+	Json += "\n}}\n";
+
+	return Json.SaveToFile( pszFile );
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+//? Lightweight instrumentation: per-stage timers and global counters
+//? Disabled by default. While disabled, every probe costs one test of a global flag
+//? Enabled, counters are updated with interlocked operations. Probes in loops accumulate locally and report once
+//? Run with "sms_w2a.exe /trace <file.json>" to get a JSON summary when the app exits
+
+
+//+ SMS_STAGE
+enum SMS_STAGE {
+	SMS_STAGE_SUMMARY,			/// SmsGetFileSummary
+	SMS_STAGE_READ_CMBK,
+	SMS_STAGE_READ_SMSBR,
+	SMS_STAGE_READ_NOKIA,
+	SMS_STAGE_READ_SMSB,
+	SMS_STAGE_WRITE_CMBK,		/// Writers: Begin, Write and End calls
+	SMS_STAGE_WRITE_SMSBR,
+	SMS_STAGE_WRITE_NOKIA,
+	SMS_STAGE_WRITE_SMSB,
+	SMS_STAGE_HASH_CMBK,		/// Compute_CMBK_Hash. Writer_CMBK hashes its output as it writes it (SMS_STAGE_WRITE_CMBK)
+	SMS_STAGE_SORT,				/// In-memory sorting in SmsSortStage, one call per run
+	SMS_STAGE_COUNT
+};
+
+//+ SMS_COUNTER
+enum SMS_COUNTER {
+	SMS_COUNTER_BYTES_READ,			/// Input files loaded by the XML and CSV readers (SMSB files are mapped, not counted)
+	SMS_COUNTER_BYTES_WRITTEN,		/// Output files
+	SMS_COUNTER_BYTES_HASHED,
+	SMS_COUNTER_NODES_PARSED,		/// Message nodes (XML) or records (CSV, SMSB) visited
+	SMS_COUNTER_MESSAGES_READ,		/// Messages passed to the sinks
+	SMS_COUNTER_MESSAGES_WRITTEN,
+	SMS_COUNTER_POOL_BLOCKS,		/// Dynamic blocks allocated by rapidxml memory pools
+	SMS_COUNTER_POOL_BYTES,
+	SMS_COUNTER_RECORDS_SKIPPED,	/// Message nodes dropped by the readers because a field is out of range (e.g. a timestamp that doesn't fit)
+	SMS_COUNTER_COUNT
+};
+
+
+extern volatile LONG g_bSmsTrace;
+
+//+ SmsTraceEnable
+/// Counters are cleared when tracing is enabled
+void SmsTraceEnable( _In_ BOOL bEnable );
+#define SmsTracing() (g_bSmsTrace != 0)
+
+//+ SmsTraceCount
+void SmsTraceAdd( _In_ SMS_COUNTER iCounter, _In_ ULONG64 iValue );
+inline void SmsTraceCount( _In_ SMS_COUNTER iCounter, _In_ ULONG64 iValue )
+{
+	if (g_bSmsTrace)
+		SmsTraceAdd( iCounter, iValue );
+}
+
+//+ SmsTraceScope
+/// Adds the lifetime of the object to a stage. Different stages may overlap (e.g. Writer_CMBK hashes its output in End)
+class SmsTraceScope {
+public:
+	SmsTraceScope( _In_ SMS_STAGE iStage ): m_iStage( iStage ) { m_iStart = g_bSmsTrace ? Start() : 0; }
+	~SmsTraceScope() { if (m_iStart) Stop( m_iStage, m_iStart ); }
+private:
+	static LONG64 Start();
+	static void Stop( _In_ SMS_STAGE iStage, _In_ LONG64 iStart );
+private:
+	SMS_STAGE m_iStage;
+	LONG64 m_iStart;		/// 0 if not timed
+};
+
+//+ SmsTracePoolAlloc, SmsTracePoolFree
+/// rapidxml memory pool allocator that counts pool growth. Usage: if (SmsTracing()) Doc.set_allocator( SmsTracePoolAlloc, SmsTracePoolFree )
+void* SmsTracePoolAlloc( _In_ size_t iSize );
+void SmsTracePoolFree( _In_ void *p );
+
+//+ SmsTraceSave
+/// JSON summary:
+///   {"stages":{"Read_SMSBR":{"calls":1,"ms":412.5},...},"counters":{"bytes_read":52428800,...}}
+/// Stages that never ran are omitted
+ULONG SmsTraceSave( _In_ LPCTSTR pszFile );
@@ -0,0 +1,207 @@
+#include "SmsTest.h"
+#include "rapidxml/rapidxml.hpp"
+#include "rapidxml/rapidxml_print.hpp"
+#include <string>
+#include <vector>
+#include <iterator>
+
+//? rapidxml printer: the bulk copy of unescaped runs (find_special_chars) against the original character by character expansion
+//? Sample CMBK and SMSBR documents, built like the writers build them, with every character the printer escapes
+
+
+//++ BaselineExpand
+/// copy_and_expand_chars as it was before find_special_chars
+static std::string BaselineExpand( const char *begin, const char *end, char noexpand, int flags )
+{
+	std::string out;
+	for (; begin != end; ++begin) {
+		if (*begin == noexpand) {
+			out += *begin;
+			continue;
+		}
+		switch (*begin) {
+			case '<':	out += "&lt;"; break;
+			case '>':	out += "&gt;"; break;
+			case '\'':	out += "&apos;"; break;
+			case '"':	out += "&quot;"; break;
+			case '&':	out += "&amp;"; break;
+			default:
+				if ((flags & rapidxml::print_no_surrogate_expansion) && ((*begin & 0xf0) == 0xe0)) {
+					unsigned long code = ((*begin & 0x0f) << 12) | ((*(begin + 1) & 0x3f) << 6) | ((*(begin + 2) & 0x3f));
+					if (code >= 0xd800 && code < 0xe000) {
+						char temp[10];
+						snprintf( temp, 10, "&#%lu;", code );
+						out += temp;
+						begin += 2;
+					} else {
+						out += *begin;
+					}
+				} else {
+					out += *begin;
+				}
+		}
+	}
+	return out;
+}
+
+//++ Expand
+static std::string Expand( const char *begin, const char *end, char noexpand, int flags )
+{
+	std::string out;
+	rapidxml::internal::copy_and_expand_chars( begin, end, noexpand, flags, std::back_inserter( out ) );
+	return out;
+}
+
+//++ CheckValue
+/// Both expansions of a value, with the noexpand characters the printer uses for text (0) and for attribute values (either quote)
+static void CheckValue( const char *pValue, size_t iLen )
+{
+	static const char Noexpand[] = { 0, '"', '\'' };
+	static const int Flags[] = { 0, rapidxml::print_no_surrogate_expansion };
+	for (size_t f = 0; f < sizeof( Flags ) / sizeof( Flags[0] ); f++) {
+		for (size_t n = 0; n < sizeof( Noexpand ); n++) {
+			std::string sExpected = BaselineExpand( pValue, pValue + iLen, Noexpand[n], Flags[f] );
+			std::string sActual = Expand( pValue, pValue + iLen, Noexpand[n], Flags[f] );
+			SMS_CHECK( sActual == sExpected );
+			if (sActual != sExpected)
+				fprintf( stderr, "  value: \"%.*s\"\n  expected: %s\n  actual:   %s\n", (int)iLen, pValue, sExpected.c_str(), sActual.c_str() );
+		}
+	}
+}
+
+//++ CheckNode
+/// Every value and attribute value of the subtree
+static void CheckNode( const rapidxml::xml_node<> *pNode )
+{
+	CheckValue( pNode->value(), pNode->value_size() );
+	for (const rapidxml::xml_attribute<> *pAttr = pNode->first_attribute(); pAttr; pAttr = pAttr->next_attribute())
+		CheckValue( pAttr->value(), pAttr->value_size() );
+	for (const rapidxml::xml_node<> *pChild = pNode->first_node(); pChild; pChild = pChild->next_sibling())
+		CheckNode( pChild );
+}
+
+
+/// Message texts. Escaped characters alone, in runs, at 16 and 32 byte block boundaries, next to multibyte UTF-8 and encoded surrogates
+static const char *g_Texts[] = {
+	"",
+	"<",
+	">&'\"",
+	"Plain text, no special characters at all, longer than one 32 byte block",
+	"Tom & Jerry <3 \"quotes\" and 'apostrophes' > everything",
+	"0123456789abcde<0123456789abcde>0123456789abcdef&0123456789abcdef'0123456789abcdef\"",
+	"0123456789abcdefghijklmnopqrstu<0123456789abcdefghijklmnopqrstuv&",
+	"<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>",
+	"Line one\r\nLine two & three\r\n",
+	"\xC4\x83\xC3\xAE\xC8\x99\xC8\x9B \xE2\x82\xAC 100 & \xE2\x80\x9Cquoted\xE2\x80\x9D",
+	"Emoji \xF0\x9F\x98\x80 & surrogates \xED\xA0\xBD\xED\xB8\x80 <ok>",
+	"\xED\xA0\xBD\xED\xB8\x80\xED\xA0\xBD\xED\xB8\x81\xED\xA0\xBD\xED\xB8\x82\xED\xA0\xBD\xED\xB8\x83\xED\xA0\xBD\xED\xB8\x84\xED\xA0\xBD\xED\xB8\x85",
+	"0123456789abcdefghijklmnopqrstu\xED\xA0\xBD\xED\xB8\x80 \xE2\x82\xAC'",
+	"0123456789abcd\xED\xA0\xBD\xED\xB8\x80",
+};
+#define TEXT_COUNT		(sizeof( g_Texts ) / sizeof( g_Texts[0] ))
+
+//++ BuildCmbk
+/// <ArrayOfMessage><Message><Recepients><string/></Recepients><Body/>...</Message></ArrayOfMessage>
+static void BuildCmbk( rapidxml::xml_document<> &Doc )
+{
+	rapidxml::xml_node<> *Root = Doc.allocate_node( rapidxml::node_element, "ArrayOfMessage" );
+	Doc.append_node( Root );
+	for (size_t i = 0; i < TEXT_COUNT; i++) {
+		rapidxml::xml_node<> *Node = Doc.allocate_node( rapidxml::node_element, "Message" ), *SubNode;
+		Node->append_node( (SubNode = Doc.allocate_node( rapidxml::node_element, "Recepients" )) );
+		SubNode->append_node( Doc.allocate_node( rapidxml::node_element, "string", "+40722111111" ) );
+		SubNode->append_node( Doc.allocate_node( rapidxml::node_element, "string", "Mom & Dad <home>" ) );
+		Node->append_node( Doc.allocate_node( rapidxml::node_element, "Body", g_Texts[i] ) );
+		Node->append_node( Doc.allocate_node( rapidxml::node_element, "IsIncoming", "true" ) );
+		Node->append_node( Doc.allocate_node( rapidxml::node_element, "IsRead", "false" ) );
+		Node->append_node( Doc.allocate_node( rapidxml::node_element, "Attachments" ) );
+		Node->append_node( Doc.allocate_node( rapidxml::node_element, "LocalTimestamp", "130000000000000000" ) );
+		Node->append_node( Doc.allocate_node( rapidxml::node_element, "Sender", "+40722111111" ) );
+		Root->append_node( Node );
+	}
+}
+
+//++ BuildSmsbr
+/// <smses count=""><sms address="" body="" .../></smses>
+static void BuildSmsbr( rapidxml::xml_document<> &Doc )
+{
+	rapidxml::xml_node<> *Root = Doc.allocate_node( rapidxml::node_element, "smses" );
+	Root->append_attribute( Doc.allocate_attribute( "count", "14" ) );
+	Doc.append_node( Root );
+	for (size_t i = 0; i < TEXT_COUNT; i++) {
+		rapidxml::xml_node<> *Node = Doc.allocate_node( rapidxml::node_element, "sms" );
+		Node->append_attribute( Doc.allocate_attribute( "protocol", "0" ) );
+		Node->append_attribute( Doc.allocate_attribute( "address", "+40 (722) 111-111 'home'" ) );
+		Node->append_attribute( Doc.allocate_attribute( "date", "1489149296000" ) );
+		Node->append_attribute( Doc.allocate_attribute( "type", "1" ) );
+		Node->append_attribute( Doc.allocate_attribute( "subject", "null" ) );
+		Node->append_attribute( Doc.allocate_attribute( "body", g_Texts[i] ) );
+		Node->append_attribute( Doc.allocate_attribute( "read", "1" ) );
+		Node->append_attribute( Doc.allocate_attribute( "readable_date", "Mar 10, 2017 12:34:56 PM" ) );
+		Root->append_node( Node );
+	}
+}
+
+
+//++ TestDocuments
+/// Every value of the sample documents. The printed documents parse back to the same values
+static void TestDocuments()
+{
+	void (*Builders[])( rapidxml::xml_document<>& ) = { BuildCmbk, BuildSmsbr };
+	for (size_t b = 0; b < sizeof( Builders ) / sizeof( Builders[0] ); b++) {
+
+		rapidxml::xml_document<> Doc;
+		Builders[b]( Doc );
+		CheckNode( &Doc );
+
+		std::string sXml;
+		rapidxml::internal::print_children( std::back_inserter( sXml ), &Doc, 0, 0 );
+
+		std::vector<char> Copy( sXml.begin(), sXml.end() );
+		Copy.push_back( '\0' );
+		rapidxml::xml_document<> Parsed;
+		try {
+			Parsed.parse<0>( Copy.data() );
+		} catch (const rapidxml::parse_error &e) {
+			fprintf( stderr, "  parse error: %s\n", e.what() );
+			SMS_CHECK( !"printed document parses" );
+			continue;
+		}
+
+		const rapidxml::xml_node<> *pRoot = Parsed.first_node();
+		SMS_CHECK( pRoot != NULL );
+		size_t i = 0;
+		for (const rapidxml::xml_node<> *pMsg = pRoot ? pRoot->first_node() : NULL; pMsg; pMsg = pMsg->next_sibling(), i++) {
+			const char *pszBody = b == 0 ? pMsg->first_node( "Body" )->value() : pMsg->first_attribute( "body" )->value();
+			SMS_CHECK( i < TEXT_COUNT && std::string( pszBody ) == g_Texts[i] );
+		}
+		SMS_CHECK_EQ( i, TEXT_COUNT );
+	}
+}
+
+
+//++ TestRandom
+/// Random strings of escaped characters, ASCII, multibyte UTF-8 and encoded surrogates, of every length up to a few blocks
+static void TestRandom()
+{
+	static const char *Pieces[] = { "<", ">", "&", "'", "\"", "a", "b", " ", "\r\n", "\xC4\x83", "\xE2\x82\xAC", "\xF0\x9F\x98\x80", "\xED\xA0\xBD", "\xED\xB8\x80", "\xEF\xBF\xBD" };
+	SmsTestRandom Rand( 42 );
+	for (int iRound = 0; iRound < 20000; iRound++) {
+		std::string s;
+		size_t iLen = (size_t)Rand.Range( 0, 100 );
+		uint64_t iSpecialOdds = Rand.Range( 1, 40 );
+		while (s.size() < iLen) {
+			size_t iPiece = Rand.Range( 1, iSpecialOdds ) == 1 ? (size_t)Rand.Range( 0, 4 ) : (size_t)Rand.Range( 5, sizeof( Pieces ) / sizeof( Pieces[0] ) - 1 );
+			s += Pieces[iPiece];
+		}
+		CheckValue( s.data(), s.size() );
+	}
+}
+
+
+int main()
+{
+	TestDocuments();
+	TestRandom();
+	return SmsTestResult();
+}
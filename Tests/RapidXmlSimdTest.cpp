@@ -0,0 +1,138 @@
+#include "SmsTest.h"
+#include "rapidxml/rapidxml.hpp"
+#include <string.h>
+
+//? rapidxml find_any: the SSE2 and AVX2 scans against the scalar one
+//? Every start offset within a 64 byte block, every string length up to a few blocks, stop characters at and around block boundaries, random buffers
+
+#ifdef RAPIDXML_SIMD
+
+#define BUF_ALIGN		64
+#define BUF_SIZE		(BUF_ALIGN * 8)
+#define MAX_LEN			(BUF_ALIGN * 3)
+
+/// The stop character pairs of the parser's vectorized predicates
+static const char g_Stops[][2] = { { '<', 0 }, { '<', '&' }, { '"', 0 }, { '"', '&' }, { '\'', 0 }, { '\'', '&' } };
+#define STOP_COUNT		(sizeof( g_Stops ) / sizeof( g_Stops[0] ))
+
+//+ SCAN_BUFFER
+/// Aligned buffer. The scans read whole aligned blocks, including the bytes past the terminating zero
+struct SCAN_BUFFER {
+	alignas( BUF_ALIGN ) char Data[BUF_SIZE];
+};
+
+//++ Fill
+/// Random bytes, without zero and the stop characters. Bytes above 0x7f are included (signed char comparisons)
+static void Fill( SCAN_BUFFER &Buf, SmsTestRandom &Rand, char c1, char c2 )
+{
+	for (size_t i = 0; i < BUF_SIZE; i++) {
+		char c;
+		do {
+			c = (char)Rand.Range( 1, 255 );
+		} while (c == c1 || c == c2);
+		Buf.Data[i] = c;
+	}
+}
+
+//++ Check
+/// All the routines the CPU supports return the same character as the scalar scan
+static void Check( char *p, char c1, char c2 )
+{
+	char *pExpected = rapidxml::internal::find_any_scalar( p, c1, c2 );
+	int iLevel = rapidxml::internal::simd_level();
+	if (iLevel >= 1)
+		SMS_CHECK_EQ( rapidxml::internal::find_any_sse2( p, c1, c2 ) - p, pExpected - p );
+	if (iLevel >= 2)
+		SMS_CHECK_EQ( rapidxml::internal::find_any_avx2( p, c1, c2 ) - p, pExpected - p );
+	SMS_CHECK_EQ( rapidxml::internal::find_any( p, c1, c2 ) - p, pExpected - p );
+}
+
+
+//++ TestTails
+/// No stop character: the scans end at the terminating zero. Covers strings shorter than a block, at every alignment
+static void TestTails()
+{
+	SmsTestRandom Rand( 41 );
+	SCAN_BUFFER Buf;
+	for (size_t s = 0; s < STOP_COUNT; s++) {
+		char c1 = g_Stops[s][0], c2 = g_Stops[s][1];
+		Fill( Buf, Rand, c1, c2 );
+		for (size_t iOffset = 0; iOffset < BUF_ALIGN; iOffset++) {
+			for (size_t iLen = 0; iLen <= MAX_LEN; iLen++) {
+				char *p = Buf.Data + iOffset;
+				char cSaved = p[iLen];
+				p[iLen] = '\0';
+				Check( p, c1, c2 );
+				p[iLen] = cSaved;
+			}
+		}
+	}
+}
+
+
+//++ TestBoundaries
+/// One stop character at every position of a string, in particular the first and last bytes of 16 and 32 byte blocks
+/// Stop characters before the start of the string (in the same block) must be ignored
+static void TestBoundaries()
+{
+	SmsTestRandom Rand( 4116 );
+	SCAN_BUFFER Buf;
+	for (size_t s = 0; s < STOP_COUNT; s++) {
+		char c1 = g_Stops[s][0], c2 = g_Stops[s][1];
+		for (size_t iOffset = 0; iOffset < BUF_ALIGN; iOffset++) {
+			Fill( Buf, Rand, c1, c2 );
+			char *p = Buf.Data + iOffset;
+			for (size_t i = 0; i < iOffset; i++)
+				Buf.Data[i] = (i & 1) && c2 ? c2 : c1;		/// Before the start
+			size_t iLen = MAX_LEN - iOffset % 7;
+			p[iLen] = '\0';
+			for (size_t iStop = 0; iStop < iLen; iStop++) {
+				char cSaved = p[iStop];
+				p[iStop] = (iStop & 1) && c2 ? c2 : c1;
+				Check( p, c1, c2 );
+				p[iStop] = cSaved;
+			}
+		}
+	}
+}
+
+
+//++ TestRandom
+/// Random strings with random stop character density, at random offsets
+static void TestRandom()
+{
+	SmsTestRandom Rand( 0x41F022 );
+	SCAN_BUFFER Buf;
+	for (int iRound = 0; iRound < 200000; iRound++) {
+		const char *Stops = g_Stops[Rand.Range( 0, STOP_COUNT - 1 )];
+		char c1 = Stops[0], c2 = Stops[1];
+		uint64_t iDensity = Rand.Range( 1, 200 );
+		size_t iOffset = (size_t)Rand.Range( 0, BUF_ALIGN - 1 );
+		size_t iLen = (size_t)Rand.Range( 0, MAX_LEN );
+		char *p = Buf.Data + iOffset;
+		for (size_t i = 0; i < BUF_SIZE; i++) {
+			char c = (char)Rand.Range( 1, 255 );
+			if (Rand.Range( 1, iDensity ) == 1)
+				c = (Rand.Next() & 1) && c2 ? c2 : c1;
+			Buf.Data[i] = c;
+		}
+		p[iLen] = '\0';
+		Check( p, c1, c2 );
+	}
+}
+
+#endif		/// RAPIDXML_SIMD
+
+
+int main()
+{
+#ifdef RAPIDXML_SIMD
+	printf( "SIMD level: %d\n", rapidxml::internal::simd_level() );
+	TestTails();
+	TestBoundaries();
+	TestRandom();
+#else
+	printf( "No SIMD scan on this platform\n" );
+#endif
+	return SmsTestResult();
+}
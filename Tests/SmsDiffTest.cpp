@@ -0,0 +1,239 @@
+#include "StdAfx.h"
+#include "SmsTest.h"
+#include "SmsDiff.h"
+#include <string>
+
+//? SmsDiff: matching rules (duplicates, modified pairs, canonical phones) and report order
+
+
+//+ SmsDiffCapture
+/// One line per difference: "-text", "+text", "text>text"
+class SmsDiffCapture: public SmsDiffSink {
+public:
+	BOOL Removed( _In_ const SMS &Old )						{ m_Lines.push_back( std::string( "-" ) + Old.Text.c_str() ); return Continue(); }
+	BOOL Added( _In_ const SMS &New )						{ m_Lines.push_back( std::string( "+" ) + New.Text.c_str() ); return Continue(); }
+	BOOL Modified( _In_ const SMS &Old, _In_ const SMS &New )	{ m_Lines.push_back( std::string( Old.Text.c_str() ) + ">" + New.Text.c_str() ); return Continue(); }
+
+	std::vector<std::string> m_Lines;
+	size_t m_iStopAfter = (size_t)-1;
+
+private:
+	BOOL Continue() { return m_Lines.size() < m_iStopAfter; }
+};
+
+
+//+ MESSAGE
+struct MESSAGE {
+	ULONG iSecond;				/// Timestamp
+	bool bIncoming;
+	bool bRead;
+	LPCSTR pszText;
+	std::initializer_list<LPCSTR> Phones;
+};
+
+//++ WriteBackup
+/// Messages -> backup file of iType (see SmsCreateWriter)
+static ULONG WriteBackup( _In_ ULONG iType, _In_ LPCTSTR pszFile, _In_ std::initializer_list<MESSAGE> Messages )
+{
+	ULONG err;
+	SmsWriter *pWriter = SmsCreateWriter( iType, pszFile );
+	if (!pWriter)
+		return ERROR_NOT_SUPPORTED;
+	if ((err = pWriter->Begin( SMS_COUNT_UNKNOWN )) == ERROR_SUCCESS) {
+		for (auto it = Messages.begin(); it != Messages.end() && err == ERROR_SUCCESS; ++it) {
+			SMS sms;
+			sms.clear();
+			sms.Timestamp = SmsTimeFromPosixMs( 1500000000000LL + it->iSecond * 1000LL );
+			sms.IsIncoming = it->bIncoming;
+			sms.IsRead = it->bRead;
+			sms.Text = it->pszText;
+			for (auto itPhone = it->Phones.begin(); itPhone != it->Phones.end(); ++itPhone)
+				sms.PhoneId.push_back( SmsPhones().Intern( *itPhone ) );
+			err = pWriter->Write( sms );
+		}
+		ULONG err2 = pWriter->End();
+		if (err == ERROR_SUCCESS)
+			err = err2;
+	}
+	delete pWriter;
+	return err;
+}
+
+//+ SmsDiffFiles
+/// Two temporary backups
+class SmsDiffFiles {
+public:
+	SmsDiffFiles()
+	{
+		TCHAR szDir[MAX_PATH];
+		GetTempPath( ARRAYSIZE( szDir ), szDir );
+		GetTempFileName( szDir, _T( "dif" ), 0, m_szOld );
+		GetTempFileName( szDir, _T( "dif" ), 0, m_szNew );
+	}
+	~SmsDiffFiles()
+	{
+		DeleteFile( m_szOld );
+		DeleteFile( m_szNew );
+	}
+
+	/// Write both (SMSB), diff them
+	ULONG Diff( _In_ std::initializer_list<MESSAGE> Old, _In_ std::initializer_list<MESSAGE> New, _In_ ULONG iCountryCode = 0 )
+	{
+		ULONG err;
+		m_Capture.m_Lines.clear();
+		ZeroMemory( &m_Stats, sizeof( m_Stats ) );
+		if ((err = WriteBackup( 4, m_szOld, Old )) != ERROR_SUCCESS || (err = WriteBackup( 4, m_szNew, New )) != ERROR_SUCCESS)
+			return err;
+		return SmsDiff( 4, m_szOld, 4, m_szNew, m_Capture, &m_Stats, iCountryCode );
+	}
+
+	BOOL Report( _In_ std::initializer_list<LPCSTR> Lines ) const
+	{
+		return m_Capture.m_Lines == std::vector<std::string>( Lines.begin(), Lines.end() );
+	}
+
+	TCHAR m_szOld[MAX_PATH], m_szNew[MAX_PATH];
+	SmsDiffCapture m_Capture;
+	SMS_DIFF_STATS m_Stats;
+};
+
+
+//++ TestDuplicates
+/// Equal messages are matched one to one
+static void TestDuplicates()
+{
+	SmsDiffFiles Files;
+
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, true, true, "hi", { "+40722111111" } }, { 10, true, true, "hi", { "+40722111111" } } },
+		{ { 10, true, true, "hi", { "+40722111111" } } } ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "-hi" } ) );
+	SMS_CHECK_EQ( Files.m_Stats.iUnchanged, 1 );
+	SMS_CHECK_EQ( Files.m_Stats.iRemoved, 1 );
+
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, true, true, "hi", { "+40722111111" } } },
+		{ { 10, true, true, "hi", { "+40722111111" } }, { 10, true, true, "hi", { "+40722111111" } }, { 10, true, true, "hi", { "+40722111111" } } } ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "+hi", "+hi" } ) );
+	SMS_CHECK_EQ( Files.m_Stats.iOldCount, 1 );
+	SMS_CHECK_EQ( Files.m_Stats.iNewCount, 3 );
+	SMS_CHECK_EQ( Files.m_Stats.iUnchanged, 1 );
+	SMS_CHECK_EQ( Files.m_Stats.iAdded, 2 );
+
+	/// Same text, another time: not a duplicate
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, true, true, "hi", { "+40722111111" } } },
+		{ { 10, true, true, "hi", { "+40722111111" } }, { 11, true, true, "hi", { "+40722111111" } } } ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "+hi" } ) );
+}
+
+//++ TestModified
+/// Leftovers with the same timestamp, direction and recipients are paired, in reading order. Equal messages are matched first
+static void TestModified()
+{
+	SmsDiffFiles Files;
+
+	/// Text and read state
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, true, true, "a", { "+40722111111" } }, { 20, true, false, "b", { "+40722111111" } } },
+		{ { 10, true, true, "A", { "+40722111111" } }, { 20, true, true, "b", { "+40722111111" } } } ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "a>A", "b>b" } ) );
+	SMS_CHECK_EQ( Files.m_Stats.iModified, 2 );
+	SMS_CHECK_EQ( Files.m_Stats.iUnchanged, 0 );
+
+	/// Same key three times: the unchanged one is matched first, the others pair up in order
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, true, true, "x1", { "+40722111111" } }, { 10, true, true, "same", { "+40722111111" } }, { 10, true, true, "x2", { "+40722111111" } } },
+		{ { 10, true, true, "same", { "+40722111111" } }, { 10, true, true, "y1", { "+40722111111" } }, { 10, true, true, "y2", { "+40722111111" } } } ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "x1>y1", "x2>y2" } ) );
+	SMS_CHECK_EQ( Files.m_Stats.iUnchanged, 1 );
+
+	/// Another time, direction or recipient isn't a modification
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, true, true, "t", { "+40722111111" } }, { 20, true, true, "d", { "+40722111111" } }, { 30, true, true, "p", { "+40722111111" } } },
+		{ { 11, true, true, "t", { "+40722111111" } }, { 20, false, true, "d", { "+40722111111" } }, { 30, true, true, "p", { "+40722222222" } } } ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "-t", "-d", "-p", "+t", "+d", "+p" } ) );
+	SMS_CHECK_EQ( Files.m_Stats.iRemoved, 3 );
+	SMS_CHECK_EQ( Files.m_Stats.iAdded, 3 );
+	SMS_CHECK_EQ( Files.m_Stats.iModified, 0 );
+
+	/// Report order: removed (old order), then added and modified (new order)
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 30, true, true, "r2", { "+40722111111" } }, { 10, true, true, "m", { "+40722111111" } }, { 20, true, true, "r1", { "+40722111111" } } },
+		{ { 40, true, true, "a1", { "+40722111111" } }, { 10, true, true, "M", { "+40722111111" } }, { 5, true, true, "a2", { "+40722111111" } } } ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "-r2", "-r1", "+a1", "m>M", "+a2" } ) );
+
+	/// The sink stops the report
+	Files.m_Capture.m_iStopAfter = 2;
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 30, true, true, "r2", { "+40722111111" } }, { 10, true, true, "m", { "+40722111111" } }, { 20, true, true, "r1", { "+40722111111" } } },
+		{ { 40, true, true, "a1", { "+40722111111" } }, { 10, true, true, "M", { "+40722111111" } }, { 5, true, true, "a2", { "+40722111111" } } } ), ERROR_CANCELLED );
+	SMS_CHECK( Files.Report( { "-r2", "-r1" } ) );
+}
+
+//++ TestPhones
+/// Recipients are compared in canonical form, in any order
+static void TestPhones()
+{
+	SmsDiffFiles Files;
+
+	/// National and international forms of the same number
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, true, true, "hi", { "0722 111 111" } }, { 20, true, true, "yo", { "(0722) 111-111" } } },
+		{ { 10, true, true, "hi", { "+40722111111" } }, { 20, true, true, "YO", { "0040722111111" } } }, 40 ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "yo>YO" } ) );
+	SMS_CHECK_EQ( Files.m_Stats.iUnchanged, 1 );
+
+	/// Without a country code, national numbers stay national
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, true, true, "hi", { "0722 111 111" } } },
+		{ { 10, true, true, "hi", { "+40722111111" } } }, 0 ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "-hi", "+hi" } ) );
+
+	/// Formatting alone doesn't matter
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, true, true, "hi", { "+40 722 111 111" } } },
+		{ { 10, true, true, "hi", { "+40722111111" } } }, 0 ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( {} ) );
+
+	/// Group messages: recipients in another order, another form
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, false, true, "group", { "+40722111111", "+40733333333" } } },
+		{ { 10, false, true, "group", { "+40733333333", "0722111111" } } }, 40 ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( {} ) );
+	SMS_CHECK_EQ( Files.m_Stats.iUnchanged, 1 );
+
+	/// One recipient less
+	SMS_CHECK_EQ( Files.Diff(
+		{ { 10, false, true, "group", { "+40722111111", "+40733333333" } } },
+		{ { 10, false, true, "group", { "+40733333333" } } }, 40 ), ERROR_SUCCESS );
+	SMS_CHECK( Files.Report( { "-group", "+group" } ) );
+}
+
+//++ TestFormats
+/// The same messages in two formats are unchanged
+static void TestFormats()
+{
+	SmsDiffFiles Files;
+	SMS_DIFF_STATS Stats;
+	SmsDiffCapture Capture;
+
+	SMS_CHECK_EQ( WriteBackup( 4, Files.m_szOld, { { 10, true, true, "one", { "+40722111111" } }, { 20, false, false, "two", { "+40722222222" } } } ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( WriteBackup( 2, Files.m_szNew, { { 10, true, true, "one", { "+40722111111" } }, { 20, false, false, "two", { "+40722222222" } } } ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( SmsDiff( 4, Files.m_szOld, 2, Files.m_szNew, Capture, &Stats ), ERROR_SUCCESS );
+	SMS_CHECK( Capture.m_Lines.empty() );
+	SMS_CHECK_EQ( Stats.iUnchanged, 2 );
+
+	/// Missing file
+	SMS_CHECK( SmsDiff( 4, Files.m_szOld, 4, _T( "does-not-exist.smsb" ), Capture ) != ERROR_SUCCESS );
+}
+
+
+int main()
+{
+	TestDuplicates();
+	TestModified();
+	TestPhones();
+	TestFormats();
+	return SmsTestResult();
+}
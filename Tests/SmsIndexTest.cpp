@@ -0,0 +1,95 @@
+#include "StdAfx.h"
+#include "SmsTest.h"
+#include "SmsIndex.h"
+
+//? SmsIndex: per-contact queries and exports, group messages
+
+
+//+ SmsCaptureWriter
+/// Keeps what it's given
+class SmsCaptureWriter: public SmsWriter {
+public:
+	ULONG Begin( _In_ ULONG iCount )		{ m_iCount = iCount; m_Messages.clear(); return ERROR_SUCCESS; }
+	ULONG Write( _In_ const SMS &sms )		{ m_Messages.push_back( sms ); return ERROR_SUCCESS; }
+	ULONG End()								{ return ERROR_SUCCESS; }
+
+	ULONG m_iCount = 0;
+	std::vector<SMS> m_Messages;
+};
+
+
+//++ Add
+static void Add( _Inout_ SmsIndex &Index, _In_ SMS_TIME t, _In_ LPCSTR pszText, _In_ std::initializer_list<LPCSTR> Phones )
+{
+	SMS sms;
+	sms.clear();
+	sms.Timestamp = t;
+	sms.Text = pszText;
+	for (auto it = Phones.begin(); it != Phones.end(); ++it)
+		sms.PhoneId.push_back( SmsPhones().Intern( *it ) );
+	Index.Put( sms );
+}
+
+
+//++ TestGroupExport
+/// A group message exported for one of its recipients lists that recipient alone
+static void TestGroupExport()
+{
+	SmsIndex Index( 40 );
+	Add( Index, 300, "group", { "0722 111 111", "+40722222222", "+40733333333" } );
+	Add( Index, 100, "one", { "+40722111111" } );
+	Add( Index, 200, "other", { "+40722222222" } );
+	Add( Index, 400, "group, twice", { "+40722111111", "0040722111111", "+40733333333" } );
+	Index.Seal();
+
+	SMS_PHONE_ID iContact = SmsPhones().Intern( "+40722111111" );
+	SMS_CHECK_EQ( Index.GetCount( iContact ), 3 );
+
+	SmsCaptureWriter Writer;
+	SMS_CHECK_EQ( Index.Export( iContact, Writer, FALSE ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( Writer.m_iCount, 3 );
+	SMS_CHECK_EQ( Writer.m_Messages.size(), 3 );
+	for (auto it = Writer.m_Messages.begin(); it != Writer.m_Messages.end(); ++it) {
+		SMS_CHECK_EQ( it->PhoneId.size(), 1 );
+		SMS_CHECK( Index.Find( it->PhoneId[0] ) == Index.Find( iContact ) );
+	}
+	if (Writer.m_Messages.size() == 3) {
+		SMS_CHECK( Writer.m_Messages[0].Text == utf8string( "one" ) );
+		SMS_CHECK( Writer.m_Messages[1].Text == utf8string( "group" ) );
+		SMS_CHECK( SmsPhones().Resolve( Writer.m_Messages[1].PhoneId[0] ) == utf8string( "0722 111 111" ) );		/// As the message spells it
+		SMS_CHECK( Writer.m_Messages[2].Text == utf8string( "group, twice" ) );
+	}
+
+	/// The indexed messages are unchanged
+	SMS_CHECK_EQ( Index.GetMessage( 2 ).PhoneId.size(), 3 );
+
+	/// Newest first, in a time range
+	SMS_CHECK_EQ( Index.Export( iContact, Writer, TRUE, 200, 500 ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( Writer.m_iCount, 2 );
+	SMS_CHECK_EQ( Writer.m_Messages.size(), 2 );
+	if (Writer.m_Messages.size() == 2) {
+		SMS_CHECK_EQ( Writer.m_Messages[0].Timestamp, 400 );
+		SMS_CHECK_EQ( Writer.m_Messages[1].Timestamp, 300 );
+	}
+
+	/// Another recipient of the same group message
+	SMS_CHECK_EQ( Index.Export( SmsPhones().Intern( "+40722222222" ), Writer, FALSE ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( Writer.m_Messages.size(), 2 );
+	for (auto it = Writer.m_Messages.begin(); it != Writer.m_Messages.end(); ++it) {
+		SMS_CHECK_EQ( it->PhoneId.size(), 1 );
+		if (!it->PhoneId.empty())
+			SMS_CHECK( SmsPhones().Resolve( it->PhoneId[0] ) == utf8string( "+40722222222" ) );
+	}
+
+	/// Unknown contact
+	SMS_CHECK_EQ( Index.Export( SmsPhones().Intern( "+40744444444" ), Writer, FALSE ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( Writer.m_iCount, 0 );
+	SMS_CHECK_EQ( Writer.m_Messages.size(), 0 );
+}
+
+
+int main()
+{
+	TestGroupExport();
+	return SmsTestResult();
+}
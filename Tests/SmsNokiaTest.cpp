@@ -0,0 +1,143 @@
+#include "StdAfx.h"
+#include "SmsTest.h"
+#include "SmsConvert.h"
+#include <string>
+
+//? Write_NOKIA: file layout, quoting, time zones, round trip through Read_NOKIA
+
+
+//++ Message
+static SMS Message( _In_ SMS_TIME t, _In_ bool bIncoming, _In_ bool bRead, _In_ LPCSTR pszText, _In_ std::initializer_list<LPCSTR> Phones )
+{
+	SMS sms;
+	sms.clear();
+	sms.Timestamp = t;
+	sms.IsIncoming = bIncoming;
+	sms.IsRead = bRead;
+	sms.Text = pszText;
+	for (auto it = Phones.begin(); it != Phones.end(); ++it)
+		sms.PhoneId.push_back( SmsPhones().Intern( *it ) );
+	return sms;
+}
+
+//++ TempFile
+static void TempFile( _Out_ LPTSTR pszFile )		/// MAX_PATH
+{
+	TCHAR szDir[MAX_PATH];
+	GetTempPath( ARRAYSIZE( szDir ), szDir );
+	GetTempFileName( szDir, _T( "nok" ), 0, pszFile );
+}
+
+
+//++ TestLayout
+/// One record per contact, quotes doubled, local time with minute precision
+static void TestLayout()
+{
+	TCHAR szFile[MAX_PATH];
+	TempFile( szFile );
+	SMS_CHECK_EQ( SmsSetNokiaTimeZone( _T( "UTC0" ) ), ERROR_SUCCESS );
+
+	SMS_LIST List;
+	List.push_back( Message( SmsTimeFromCivil( 2020, 7, 15, 9, 5, 59 ), true, true, "Say \"hi\", then go", { "+40722111111" } ) );
+	List.push_back( Message( SmsTimeFromCivil( 2020, 7, 15, 10, 0, 0 ), true, false, "unread", { "+40722111111" } ) );
+	List.push_back( Message( SmsTimeFromCivil( 2021, 1, 2, 23, 59, 0 ), false, true, "group", { "+40722111111", "+40733333333" } ) );
+	SMS_CHECK_EQ( Write_NOKIA( szFile, List ), ERROR_SUCCESS );
+
+	utf8string s;
+	SMS_CHECK_EQ( s.LoadFromFile( szFile ), ERROR_SUCCESS );
+	SMS_CHECK( std::string( s.c_str() ) ==
+		"\"sms\",\"READ,RECEIVED\",\"+40722111111\",\"\",\"\",\"2020.07.15 09:05\",\"\",\"Say \"\"hi\"\", then go\"\n"
+		"\"sms\",\"RECEIVED\",\"+40722111111\",\"\",\"\",\"2020.07.15 10:00\",\"\",\"unread\"\n"
+		"\"sms\",\"SENT\",\"\",\"+40722111111\",\"\",\"2021.01.02 23:59\",\"\",\"group\"\n"
+		"\"sms\",\"SENT\",\"\",\"+40733333333\",\"\",\"2021.01.02 23:59\",\"\",\"group\"\n"
+	);
+
+	/// Nothing to write
+	SMS_LIST Empty;
+	SMS_CHECK_EQ( Write_NOKIA( szFile, Empty ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( s.LoadFromFile( szFile ), ERROR_SUCCESS );
+	SMS_CHECK( s.empty() );
+	SMS_CHECK_EQ( Write_NOKIA( _T( "" ), List ), ERROR_INVALID_PARAMETER );
+
+	DeleteFile( szFile );
+}
+
+//++ TestTimeZone
+/// Local time in the configured zone, daylight saving time included. The earliest time is 1601/01/01
+static void TestTimeZone()
+{
+	TCHAR szFile[MAX_PATH];
+	TempFile( szFile );
+	SMS_CHECK_EQ( SmsSetNokiaTimeZone( _T( "CET-1CEST,M3.5.0,M10.5.0/3" ) ), ERROR_SUCCESS );
+
+	SMS_LIST List;
+	List.push_back( Message( SmsTimeFromCivil( 2020, 1, 15, 12, 0, 0 ), true, true, "winter", { "+40722111111" } ) );
+	List.push_back( Message( SmsTimeFromCivil( 2020, 7, 15, 12, 0, 0 ), true, true, "summer", { "+40722111111" } ) );
+	List.push_back( Message( SmsTimeFromCivil( 2020, 12, 31, 23, 30, 0 ), true, true, "new year", { "+40722111111" } ) );
+	SMS_CHECK_EQ( Write_NOKIA( szFile, List ), ERROR_SUCCESS );
+
+	utf8string s;
+	SMS_CHECK_EQ( s.LoadFromFile( szFile ), ERROR_SUCCESS );
+	SMS_CHECK( strstr( s.c_str(), "\"2020.01.15 13:00\",\"\",\"winter\"" ) != NULL );
+	SMS_CHECK( strstr( s.c_str(), "\"2020.07.15 14:00\",\"\",\"summer\"" ) != NULL );
+	SMS_CHECK( strstr( s.c_str(), "\"2021.01.01 00:30\",\"\",\"new year\"" ) != NULL );
+
+	SMS_LIST Read;
+	SMS_CHECK_EQ( Read_NOKIA( szFile, Read ), ERROR_SUCCESS );
+	SMS_CHECK( Read == List );
+
+	/// West of UTC, the first minutes of 1601 would be before the epoch
+	SMS_CHECK_EQ( SmsSetNokiaTimeZone( _T( "EST5" ) ), ERROR_SUCCESS );
+	List.clear();
+	List.push_back( Message( 0, true, true, "epoch", { "+40722111111" } ) );
+	SMS_CHECK_EQ( Write_NOKIA( szFile, List ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( s.LoadFromFile( szFile ), ERROR_SUCCESS );
+	SMS_CHECK( strstr( s.c_str(), "\"1601.01.01 00:00\"" ) != NULL );
+
+	SMS_CHECK_EQ( SmsSetNokiaTimeZone( _T( "UTC0" ) ), ERROR_SUCCESS );
+	DeleteFile( szFile );
+}
+
+//++ TestRoundTrip
+/// Write_NOKIA -> Read_NOKIA keeps everything the format can hold
+static void TestRoundTrip()
+{
+	TCHAR szFile[MAX_PATH];
+	TempFile( szFile );
+	SMS_CHECK_EQ( SmsSetNokiaTimeZone( _T( "UTC0" ) ), ERROR_SUCCESS );
+
+	SMS_LIST List;
+	List.push_back( Message( SmsTimeFromCivil( 2019, 3, 1, 8, 0, 0 ), true, true, "\"Quoted\" \"\"twice\"\"", { "+40722111111" } ) );
+	List.push_back( Message( SmsTimeFromCivil( 2019, 3, 1, 8, 1, 0 ), true, false, "Line one\r\nLine two, with a comma", { "0722 111 111" } ) );
+	List.push_back( Message( SmsTimeFromCivil( 2019, 3, 1, 8, 2, 0 ), true, true, "\xC8\x98tiin\xC8\x9B" "e \xF0\x9F\x98\x80", { "+40722111111" } ) );		/// Științe, emoji
+	List.push_back( Message( SmsTimeFromCivil( 2019, 3, 1, 8, 3, 0 ), true, true, "", { "+40722111111" } ) );
+	List.push_back( Message( SmsTimeFromCivil( 2019, 3, 1, 8, 4, 0 ), false, false, "sent", { "+40733333333" } ) );
+	SMS_CHECK_EQ( Write_NOKIA( szFile, List ), ERROR_SUCCESS );
+
+	SMS_LIST Read;
+	SMS_CHECK_EQ( Read_NOKIA( szFile, Read ), ERROR_SUCCESS );
+	SMS_CHECK( Read == List );
+
+	/// Not kept: seconds, the read state of sent messages (always unread), and messages sent to multiple contacts (one message per contact)
+	List.clear();
+	List.push_back( Message( SmsTimeFromCivil( 2019, 3, 1, 8, 0, 42 ), false, true, "group", { "+40722111111", "+40733333333" } ) );
+	SMS_CHECK_EQ( Write_NOKIA( szFile, List ), ERROR_SUCCESS );
+	Read.clear();
+	SMS_CHECK_EQ( Read_NOKIA( szFile, Read ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( Read.size(), 2 );
+	SMS_LIST Expected;
+	Expected.push_back( Message( SmsTimeFromCivil( 2019, 3, 1, 8, 0, 0 ), false, false, "group", { "+40722111111" } ) );
+	Expected.push_back( Message( SmsTimeFromCivil( 2019, 3, 1, 8, 0, 0 ), false, false, "group", { "+40733333333" } ) );
+	SMS_CHECK( Read == Expected );
+
+	DeleteFile( szFile );
+}
+
+
+int main()
+{
+	TestLayout();
+	TestTimeZone();
+	TestRoundTrip();
+	return SmsTestResult();
+}
@@ -0,0 +1,190 @@
+#include "StdAfx.h"
+#include "SmsTest.h"
+#include "SmsSearch.h"
+#include <algorithm>
+#include <string>
+
+//? SmsSearch: the SIMD kernels and the multi-threaded split against std::search
+
+
+//++ Lower
+static char Lower( _In_ char c )
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+//++ Reference
+/// Messages containing sPattern, one at a time with std::search
+static SMS_POSTINGS Reference( _In_ const std::vector<std::string> &Texts, _In_ const std::string &sPattern, _In_ BOOL bIgnoreCase )
+{
+	SMS_POSTINGS Ids;
+	for (size_t i = 0; i < Texts.size(); i++) {
+		const std::string &s = Texts[i];
+		auto it = bIgnoreCase ?
+			std::search( s.begin(), s.end(), sPattern.begin(), sPattern.end(), []( char a, char b ) { return Lower( a ) == Lower( b ); } ) :
+			std::search( s.begin(), s.end(), sPattern.begin(), sPattern.end() );
+		if (it != s.end())
+			Ids.push_back( (ULONG)i );
+	}
+	return Ids;
+}
+
+//++ RandomText
+/// Few distinct bytes, so that candidates and matches are frequent. '@' and '`', '[' and '{' differ by 0x20 only, like letters
+static std::string RandomText( _In_ SmsTestRandom &Rnd, _In_ size_t iLen )
+{
+	static const char Alphabet[] = "abAB@`[{ -\xC3\xA2\xC8\x9B";
+	std::string s;
+	for (size_t i = 0; i < iLen; i++)
+		s.push_back( Alphabet[Rnd.Range( 0, ARRAYSIZE( Alphabet ) - 2 )] );
+	return s;
+}
+
+//++ RandomLength
+/// Around the kernel widths (16, 32), where the vector loops hand over to their tails
+static size_t RandomLength( _In_ SmsTestRandom &Rnd )
+{
+	static const size_t Lengths[] = { 1, 1, 2, 3, 5, 15, 16, 17, 31, 32, 33, 47, 48, 63, 64, 65 };
+	return Lengths[Rnd.Range( 0, ARRAYSIZE( Lengths ) - 1 )];
+}
+
+//++ Compare
+static void Compare( _In_ const SmsTextArena &Arena, _In_ const std::vector<std::string> &Texts, _In_ const std::string &sPattern, _In_ BOOL bIgnoreCase )
+{
+	SMS_POSTINGS Ids;
+	SMS_CHECK_EQ( SmsSearch( Arena, sPattern.c_str(), bIgnoreCase, Ids ), ERROR_SUCCESS );
+	SMS_POSTINGS Expected = Reference( Texts, sPattern, bIgnoreCase );
+	SMS_CHECK( Ids == Expected );
+	if (Ids != Expected)
+		fprintf( stderr, "  \"%s\" (%u bytes, ignore case %d): %u ids, expected %u\n", sPattern.c_str(), (ULONG)sPattern.size(), bIgnoreCase, (ULONG)Ids.size(), (ULONG)Expected.size() );
+}
+
+//++ Build
+static void Build( _Out_ SmsTextArena &Arena, _In_ const std::vector<std::string> &Texts )
+{
+	Arena.Clear();
+	for (auto it = Texts.begin(); it != Texts.end(); ++it) {
+		SMS sms;
+		sms.clear();
+		sms.Text = it->c_str();
+		Arena.Put( sms );
+	}
+}
+
+
+//++ TestDifferential
+/// Random arenas and patterns. Patterns are taken from the texts (hits) or made up (mostly misses)
+static void TestDifferential( _In_ ULONG iMessages, _In_ size_t iMaxLen, _In_ ULONG iPatterns, _In_ uint64_t iSeed )
+{
+	SmsTestRandom Rnd( iSeed );
+	std::vector<std::string> Texts;
+	for (ULONG i = 0; i < iMessages; i++) {
+		ULONG iKind = (ULONG)Rnd.Range( 0, 9 );
+		size_t iLen = iKind == 0 ? 0 : iKind < 7 ? Rnd.Range( 1, 80 ) : Rnd.Range( 1, iMaxLen );		/// Some empty messages
+		Texts.push_back( RandomText( Rnd, iLen ) );
+	}
+	SmsTextArena Arena;
+	Build( Arena, Texts );
+
+	for (ULONG i = 0; i < iPatterns; i++) {
+		size_t iLen = RandomLength( Rnd );
+		std::string sPattern;
+		const std::string &s = Texts[Rnd.Range( 0, Texts.size() - 1 )];
+		if (Rnd.Range( 0, 1 ) && s.size() >= iLen) {
+			sPattern = s.substr( Rnd.Range( 0, s.size() - iLen ), iLen );
+		} else {
+			sPattern = RandomText( Rnd, iLen );
+		}
+		if (Rnd.Range( 0, 1 )) {
+			/// Letters at both ends, so that the case masks are exercised
+			sPattern.front() = "aAbB"[Rnd.Range( 0, 3 )];
+			sPattern.back() = "aAbB"[Rnd.Range( 0, 3 )];
+		}
+		Compare( Arena, Texts, sPattern, FALSE );
+		Compare( Arena, Texts, sPattern, TRUE );
+	}
+}
+
+//++ TestSplit
+/// Every non-empty message holds the pattern once: at its start, its end or in between. The arena is large enough to be split among threads,
+/// so whatever the CPU count, the messages at the task boundaries must be found like all the others
+static void TestSplit()
+{
+	SmsTestRandom Rnd( 7 );
+	const std::string sPattern = "Needle";
+	std::vector<std::string> Texts;
+	for (size_t iSize = 0; iSize < 8 * 1024 * 1024; ) {
+		std::string s;
+		if (Rnd.Range( 0, 19 ) > 0) {
+			s = RandomText( Rnd, Rnd.Range( 0, 200 ) );
+			ULONG iWhere = (ULONG)Rnd.Range( 0, 2 );
+			s.insert( iWhere == 0 ? 0 : iWhere == 1 ? s.size() : s.size() / 2, sPattern );
+		}
+		iSize += s.size() + 1;
+		Texts.push_back( s );
+	}
+	SmsTextArena Arena;
+	Build( Arena, Texts );
+
+	SMS_POSTINGS Ids, Expected;
+	for (ULONG i = 0; i < Texts.size(); i++)
+		if (!Texts[i].empty())
+			Expected.push_back( i );
+	SMS_CHECK_EQ( SmsSearch( Arena, sPattern.c_str(), FALSE, Ids ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( Ids.size(), Expected.size() );
+	SMS_CHECK( Ids == Expected );
+	SMS_CHECK_EQ( SmsSearch( Arena, "nEEDLE", TRUE, Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids == Expected );
+	SMS_CHECK_EQ( SmsSearch( Arena, "nEEDLE", FALSE, Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids.empty() );
+}
+
+//++ TestEdges
+static void TestEdges()
+{
+	SmsTextArena Arena;
+	SMS_POSTINGS Ids;
+
+	/// Empty arena
+	SMS_CHECK_EQ( SmsSearch( Arena, "a", FALSE, Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids.empty() );
+
+	/// Empty pattern
+	Build( Arena, { "a", "b" } );
+	SMS_CHECK_EQ( SmsSearch( Arena, "", FALSE, Ids ), ERROR_INVALID_PARAMETER );
+
+	/// Empty messages only
+	Build( Arena, { "", "", "" } );
+	SMS_CHECK_EQ( SmsSearch( Arena, "a", TRUE, Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids.empty() );
+
+	/// A match can't span two messages
+	Build( Arena, { "ab", "cd", "", "abcd" } );
+	SMS_CHECK_EQ( SmsSearch( Arena, "bc", FALSE, Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids == SMS_POSTINGS( { 3 } ) );
+
+	/// Case folding is ASCII only
+	Build( Arena, { "\xC3\x82ine", "\xC3\xA2ine", "AINE" } );		/// Âine, âine
+	SMS_CHECK_EQ( SmsSearch( Arena, "\xC3\xA2ine", TRUE, Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids == SMS_POSTINGS( { 1 } ) );
+	SMS_CHECK_EQ( SmsSearch( Arena, "aine", TRUE, Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids == SMS_POSTINGS( { 2 } ) );
+
+	/// '@' and '`' differ by the case bit, but aren't letters
+	Build( Arena, { "@home", "`home" } );
+	SMS_CHECK_EQ( SmsSearch( Arena, "`HOME", TRUE, Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids == SMS_POSTINGS( { 1 } ) );
+}
+
+
+int main()
+{
+	TestEdges();
+	for (ULONG i = 0; i < 500; i++)
+		TestDifferential( 3, 80, 10, 100 + i );			/// Tiny arenas, searched by the SSE2 and scalar tails
+	TestDifferential( 2000, 300, 400, 1 );				/// Short texts, one thread
+	TestDifferential( 200, 5000, 200, 2 );				/// Long texts
+	TestDifferential( 40000, 300, 30, 3 );				/// Several threads (SMS_SEARCH_MIN_CHUNK)
+	TestSplit();
+	return SmsTestResult();
+}
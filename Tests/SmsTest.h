@@ -0,0 +1,55 @@
+#pragma once
+
+//? Minimal test harness, standard C++ only
+//? A test is a console program: SMS_CHECK the expectations, then return SmsTestResult() from main()
+
+#include <stdio.h>
+#include <stdint.h>
+
+static int g_iSmsTestFailures = 0;
+
+//+ SMS_CHECK
+/// Report a failed expectation and keep going
+#define SMS_CHECK( x ) \
+	do { \
+		if (!(x)) { \
+			fprintf( stderr, "%s(%d): check failed: %s\n", __FILE__, __LINE__, #x ); \
+			g_iSmsTestFailures++; \
+		} \
+	} while (0)
+
+//+ SMS_CHECK_EQ
+/// Integer expectations, both values are reported
+#define SMS_CHECK_EQ( a, b ) \
+	do { \
+		long long _a = (long long)(a), _b = (long long)(b); \
+		if (_a != _b) { \
+			fprintf( stderr, "%s(%d): check failed: %s == %s (%lld != %lld)\n", __FILE__, __LINE__, #a, #b, _a, _b ); \
+			g_iSmsTestFailures++; \
+		} \
+	} while (0)
+
+//+ SmsTestResult
+inline int SmsTestResult()
+{
+	if (g_iSmsTestFailures)
+		fprintf( stderr, "%d check(s) failed\n", g_iSmsTestFailures );
+	return g_iSmsTestFailures ? 1 : 0;
+}
+
+//+ SmsTestRandom
+/// Deterministic pseudo random numbers (xorshift64*). Failures are reproducible
+class SmsTestRandom {
+public:
+	SmsTestRandom( uint64_t iSeed = 0x9E3779B97F4A7C15ULL ): m_iState( iSeed ? iSeed : 1 ) {}
+	uint64_t Next()
+	{
+		m_iState ^= m_iState >> 12;
+		m_iState ^= m_iState << 25;
+		m_iState ^= m_iState >> 27;
+		return m_iState * 0x2545F4914F6CDD1DULL;
+	}
+	uint64_t Range( uint64_t iMin, uint64_t iMax ) { return iMin + Next() % (iMax - iMin + 1); }		/// [iMin, iMax]
+private:
+	uint64_t m_iState;
+};
@@ -0,0 +1,196 @@
+#include "StdAfx.h"
+#include "SmsTest.h"
+#include "SmsText.h"
+#include <string>
+
+//? SmsText: diacritic and case folding, SMSX index round trip, stale index refusal
+
+
+//++ Utf8
+/// Code point -> UTF-8
+static std::string Utf8( _In_ ULONG cp )
+{
+	std::string s;
+	if (cp < 0x80) {
+		s.push_back( (char)cp );
+	} else if (cp < 0x800) {
+		s.push_back( (char)(0xC0 | (cp >> 6)) );
+		s.push_back( (char)(0x80 | (cp & 0x3F)) );
+	} else if (cp < 0x10000) {
+		s.push_back( (char)(0xE0 | (cp >> 12)) );
+		s.push_back( (char)(0x80 | ((cp >> 6) & 0x3F)) );
+		s.push_back( (char)(0x80 | (cp & 0x3F)) );
+	} else {
+		s.push_back( (char)(0xF0 | (cp >> 18)) );
+		s.push_back( (char)(0x80 | ((cp >> 12) & 0x3F)) );
+		s.push_back( (char)(0x80 | ((cp >> 6) & 0x3F)) );
+		s.push_back( (char)(0x80 | (cp & 0x3F)) );
+	}
+	return s;
+}
+
+//++ Terms
+/// Folded terms, separated by spaces
+static std::string Terms( _In_ const std::string &sText )
+{
+	std::vector<std::string> Terms;
+	SmsTokenize( sText.c_str(), sText.size(), Terms );
+	std::string s;
+	for (auto it = Terms.begin(); it != Terms.end(); ++it)
+		s += (s.empty() ? "" : " ") + *it;
+	return s;
+}
+
+
+//++ TestFolding
+static void TestFolding()
+{
+	/// Romanian: comma below (U+0218..U+021B), cedilla (U+015E, U+015F, U+0162, U+0163), upper and lower case
+	SMS_CHECK( Terms( "stiinte" ) == "stiinte" );
+	SMS_CHECK( Terms( "\xC8\x98tiin\xC8\x9B" "e" ) == "stiinte" );				/// Științe
+	SMS_CHECK( Terms( "\xC5\x9ETIIN\xC5\xA2" "E" ) == "stiinte" );				/// ŞTIINŢE
+	SMS_CHECK( Terms( "\xC8\x99" "\xC8\x9A" "\xC5\x9F" "\xC5\xA3" ) == "stst" );	/// șȚşţ
+	SMS_CHECK( Terms( "\xC3\x8E" "nv\xC4\x83\xC8\x9B\xC4\x83m \xC3\xA2ine" ) == "invatam aine" );		/// Învățăm âine
+
+	/// Letters at both ends of a run of each row of the table (U+00C0 .. U+024F). A row shifted by one fails here
+	static const struct { ULONG cp; char ch; } Letters[] = {
+		{ 0x00C5, 'a' }, { 0x00C7, 'c' }, { 0x00DD, 'y' },		/// U+00C0
+		{ 0x00E0, 'a' }, { 0x00E5, 'a' }, { 0x00FF, 'y' },		/// U+00E0
+		{ 0x0100, 'a' }, { 0x0105, 'a' }, { 0x011B, 'e' }, { 0x011C, 'g' },		/// U+0100
+		{ 0x0123, 'g' }, { 0x0124, 'h' }, { 0x0137, 'k' }, { 0x0139, 'l' },		/// U+0120
+		{ 0x0142, 'l' }, { 0x0143, 'n' }, { 0x0159, 'r' }, { 0x015A, 's' },		/// U+0140
+		{ 0x0161, 's' }, { 0x0162, 't' }, { 0x0179, 'z' }, { 0x017E, 'z' },		/// U+0160
+		{ 0x0180, 'b' }, { 0x0183, 'b' }, { 0x019E, 'n' }, { 0x019F, 'o' },		/// U+0180
+		{ 0x01A1, 'o' }, { 0x01A4, 'p' }, { 0x01B5, 'z' }, { 0x01B6, 'z' },		/// U+01A0
+		{ 0x01C5, 'd' }, { 0x01DC, 'u' }, { 0x01DE, 'a' },		/// U+01C0
+		{ 0x01E1, 'a' }, { 0x01E4, 'g' }, { 0x01FE, 'o' }, { 0x01FF, 'o' },		/// U+01E0
+		{ 0x0200, 'a' }, { 0x0203, 'a' }, { 0x021E, 'h' }, { 0x021F, 'h' },		/// U+0200
+		{ 0x0220, 'n' }, { 0x023F, 's' },		/// U+0220
+		{ 0x0240, 'z' }, { 0x024D, 'r' }, { 0x024E, 'y' },		/// U+0240
+	};
+	for (size_t i = 0; i < ARRAYSIZE( Letters ); i++) {
+		std::string sExpected = std::string( "x" ) + Letters[i].ch + "x";
+		std::string sActual = Terms( "x" + Utf8( Letters[i].cp ) + "x" );
+		SMS_CHECK( sActual == sExpected );
+		if (sActual != sExpected)
+			fprintf( stderr, "  U+%04X: \"%s\", expected \"%s\"\n", Letters[i].cp, sActual.c_str(), sExpected.c_str() );
+	}
+
+	/// Separators
+	SMS_CHECK( Terms( "a" + Utf8( 0xD7 ) + "b" + Utf8( 0xF7 ) + "c" ) == "a b c" );			/// × ÷
+	SMS_CHECK( Terms( "Hello, world! 123" ) == "hello world 123" );
+	SMS_CHECK( Terms( "emoji" + Utf8( 0x1F600 ) + "here" ) == "emoji here" );
+	SMS_CHECK( Terms( "" ) == "" );
+
+	/// Not folded: letters without an ASCII base and other scripts are kept verbatim, case included (see SmsText.h)
+	SMS_CHECK( Terms( Utf8( 0xC6 ) ) == Utf8( 0xC6 ) );				/// Æ
+	SMS_CHECK( Terms( Utf8( 0xE6 ) ) == Utf8( 0xE6 ) );				/// æ
+	SMS_CHECK( Terms( Utf8( 0xDF ) ) == Utf8( 0xDF ) );				/// ß
+	SMS_CHECK( Terms( Utf8( 0x0414 ) + Utf8( 0x0430 ) ) == Utf8( 0x0414 ) + Utf8( 0x0430 ) );		/// Да
+
+	/// Words longer than SMSX_MAX_TERM aren't indexed
+	SMS_CHECK( Terms( std::string( SMSX_MAX_TERM, 'a' ) ) == std::string( SMSX_MAX_TERM, 'a' ) );
+	SMS_CHECK( Terms( std::string( SMSX_MAX_TERM + 1, 'a' ) + " b" ) == "b" );
+}
+
+
+//++ WriteFile
+static BOOL WriteBackup( _In_ LPCTSTR pszFile, _In_ LPCSTR pszContent )
+{
+	HANDLE h = CreateFile( pszFile, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL );
+	if (h == INVALID_HANDLE_VALUE)
+		return FALSE;
+	DWORD iWritten = 0;
+	BOOL bOk = WriteFile( h, pszContent, (DWORD)strlen( pszContent ), &iWritten, NULL );
+	CloseHandle( h );
+	return bOk;
+}
+
+//++ TestIndex
+/// Save -> Open -> Query, with more messages than one worker batch (ids must stay ascending across batches)
+static void TestIndex()
+{
+	TCHAR szDir[MAX_PATH], szBackup[MAX_PATH], szIndex[MAX_PATH];
+	GetTempPath( ARRAYSIZE( szDir ), szDir );
+	GetTempFileName( szDir, _T( "smsx" ), 0, szBackup );
+	SmsTextIndexFile( szBackup, szIndex, ARRAYSIZE( szIndex ) );
+	SMS_CHECK( WriteBackup( szBackup, "backup" ) );
+
+	const ULONG iCount = 150000;		/// Three batches (SMSX_BATCH_SIZE)
+	SMS_POSTINGS Expected, ExpectedBoth;
+	{
+		SmsTextIndexWriter Writer;
+		for (ULONG i = 0; i < iCount; i++) {
+			SMS sms;
+			sms.clear();
+			sms.Timestamp = i;
+			if (i % 1000 == 7) {
+				sms.Text = (i % 2000 == 7) ? "\xC8\x98tiin\xC8\x9B" "e exacte" : "\xC5\x9ETIIN\xC5\xA2" "E";		/// Științe exacte, ŞTIINŢE
+				Expected.push_back( i );
+				if (i % 2000 == 7)
+					ExpectedBoth.push_back( i );
+			} else {
+				sms.Text = (i & 1) ? "Ne vedem m\xC3\xA2ine" : "OK, mul\xC8\x9Bumesc!";
+			}
+			Writer.Put( sms );
+		}
+		SMS_CHECK_EQ( Writer.Save( szBackup ), ERROR_SUCCESS );
+	}
+
+	SmsTextIndex Index;
+	SMS_CHECK_EQ( Index.Open( szBackup ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( Index.GetMessageCount(), iCount );
+
+	SMS_POSTINGS Ids;
+	SMS_CHECK_EQ( Index.Query( "stiinte", Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids == Expected );
+	SMS_CHECK_EQ( Index.Query( "\xC8\x98TIIN\xC8\x9A" "E", Ids ), ERROR_SUCCESS );		/// ȘTIINȚE
+	SMS_CHECK( Ids == Expected );
+	SMS_CHECK_EQ( Index.Query( "EXACTE \xC5\x9Ftiin\xC5\xA3" "e", Ids ), ERROR_SUCCESS );		/// Both words
+	SMS_CHECK( Ids == ExpectedBoth );
+	SMS_CHECK_EQ( Index.Query( "maine", Ids ), ERROR_SUCCESS );
+	SMS_CHECK_EQ( Ids.size(), iCount / 2 - Expected.size() );
+	for (size_t i = 1; i < Ids.size(); i++)
+		SMS_CHECK( Ids[i - 1] < Ids[i] );
+	SMS_CHECK_EQ( Index.Query( "nothing", Ids ), ERROR_SUCCESS );
+	SMS_CHECK( Ids.empty() );
+	Index.Close();
+
+	/// The backup changed since it was indexed: the index refuses to open
+	SMS_CHECK( WriteBackup( szBackup, "backup, a newer one" ) );
+	SMS_CHECK_EQ( Index.Open( szBackup ), ERROR_INVALID_DATA );
+
+	/// Same size, another time
+	SMS_CHECK( WriteBackup( szBackup, "backup" ) );
+	{
+		SmsTextIndexWriter Writer;
+		SMS sms;
+		sms.clear();
+		sms.Text = "one";
+		Writer.Put( sms );
+		SMS_CHECK_EQ( Writer.Save( szBackup ), ERROR_SUCCESS );
+	}
+	SMS_CHECK_EQ( Index.Open( szBackup ), ERROR_SUCCESS );
+	Index.Close();
+	HANDLE h = CreateFile( szBackup, FILE_WRITE_ATTRIBUTES, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	SMS_CHECK( h != INVALID_HANDLE_VALUE );
+	if (h != INVALID_HANDLE_VALUE) {
+		FILETIME ft;
+		GetSystemTimeAsFileTime( &ft );
+		ft.dwHighDateTime += 1;			/// About 7 minutes later
+		SetFileTime( h, NULL, NULL, &ft );
+		CloseHandle( h );
+	}
+	SMS_CHECK_EQ( Index.Open( szBackup ), ERROR_INVALID_DATA );
+
+	DeleteFile( szIndex );
+	DeleteFile( szBackup );
+}
+
+
+int main()
+{
+	TestFolding();
+	TestIndex();
+	return SmsTestResult();
+}
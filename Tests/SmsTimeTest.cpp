@@ -0,0 +1,172 @@
+#include "SmsTest.h"
+#include "SmsTime.h"
+#include "SmsFormat.h"
+#include "SmsParse.h"
+
+//? SMS_TIME conversions: known epochs, round trips. Field parsers and formatters
+
+
+//++ TestEpochs
+static void TestEpochs()
+{
+	/// 1970/01/01 00:00:00 UTC is 116444736000000000 FILETIME ticks
+	SMS_TIME tPosixEpoch = 116444736000000000ULL;
+	SMS_CHECK_EQ( SmsTimeFromPosixMs( 0 ), tPosixEpoch );
+	SMS_CHECK_EQ( SmsTimeToPosixMs( tPosixEpoch ), 0 );
+	SMS_CHECK_EQ( SmsTimeFromCivil( 1970, 1, 1, 0, 0, 0 ), tPosixEpoch );
+	SMS_CHECK_EQ( SmsTimeFromCivil( 1601, 1, 1, 0, 0, 0 ), 0 );
+	SMS_CHECK_EQ( SmsDaysFromCivil( 1601, 1, 1 ), -SMS_EPOCH_DIFF_DAYS );
+
+	/// 2017/03/10 12:34:56 UTC = 1489149296 POSIX seconds
+	SMS_CHECK_EQ( SmsTimeToPosixMs( SmsTimeFromCivil( 2017, 3, 10, 12, 34, 56 ) ), 1489149296000LL );
+
+	/// Leap days
+	SMS_CHECK_EQ( SmsDaysFromCivil( 2000, 3, 1 ) - SmsDaysFromCivil( 2000, 2, 28 ), 2 );
+	SMS_CHECK_EQ( SmsDaysFromCivil( 1900, 3, 1 ) - SmsDaysFromCivil( 1900, 2, 28 ), 1 );
+	SMS_CHECK_EQ( SmsDaysFromCivil( 2100, 3, 1 ) - SmsDaysFromCivil( 2100, 2, 28 ), 1 );
+
+	/// The range of POSIX milliseconds that converts without overflow
+	SMS_CHECK_EQ( SmsTimeFromPosixMs( SMS_POSIX_MS_MIN ), 0 );
+	SMS_CHECK_EQ( SmsTimeToPosixMs( SmsTimeFromPosixMs( SMS_POSIX_MS_MAX ) ), SMS_POSIX_MS_MAX );
+	SMS_CHECK( SmsTimeFromPosixMs( SMS_POSIX_MS_MAX ) <= (SMS_TIME)INT64_MAX );
+	SMS_CHECK( SmsPosixMsInRange( 0 ) && SmsPosixMsInRange( SMS_POSIX_MS_MIN ) && SmsPosixMsInRange( SMS_POSIX_MS_MAX ) );
+	SMS_CHECK( !SmsPosixMsInRange( SMS_POSIX_MS_MIN - 1 ) && !SmsPosixMsInRange( SMS_POSIX_MS_MAX + 1 ) );
+	SMS_CHECK( !SmsPosixMsInRange( INT64_MAX ) && !SmsPosixMsInRange( INT64_MIN ) );
+
+	/// Local minutes
+	SMS_CHECK_EQ( SmsTimeToLocalMinutes( tPosixEpoch, 120 ), SMS_EPOCH_DIFF_DAYS * 1440 + 120 );
+	SMS_CHECK_EQ( SmsTimeFromLocalMinutes( SMS_EPOCH_DIFF_DAYS * 1440 + 120, 120 ), tPosixEpoch );
+}
+
+//++ TestCivilRoundTrip
+/// Every day from 1601 to 2400
+static void TestCivilRoundTrip()
+{
+	int64_t iFirst = SmsDaysFromCivil( 1601, 1, 1 ), iLast = SmsDaysFromCivil( 2400, 12, 31 );
+	int32_t iPrevYear = 1600;
+	uint32_t iPrevMonth = 12, iPrevDay = 31;
+	for (int64_t i = iFirst; i <= iLast; i++) {
+		int32_t iYear;
+		uint32_t iMonth, iDay;
+		SmsCivilFromDays( i, iYear, iMonth, iDay );
+		SMS_CHECK_EQ( SmsDaysFromCivil( iYear, iMonth, iDay ), i );
+
+		/// Consecutive dates
+		bool bNext =
+			(iYear == iPrevYear && iMonth == iPrevMonth && iDay == iPrevDay + 1) ||
+			(iYear == iPrevYear && iMonth == iPrevMonth + 1 && iDay == 1) ||
+			(iYear == iPrevYear + 1 && iMonth == 1 && iDay == 1 && iPrevMonth == 12 && iPrevDay == 31);
+		SMS_CHECK( bNext );
+		if (!bNext)
+			break;
+		iPrevYear = iYear, iPrevMonth = iMonth, iPrevDay = iDay;
+	}
+}
+
+//++ TestRoundTrips
+/// Random timestamps through every unit and back
+static void TestRoundTrips()
+{
+	SmsTestRandom Rand;
+	const SMS_TIME tMax = SmsTimeFromCivil( 9999, 12, 31, 23, 59, 59 );
+	for (int i = 0; i < 100000; i++) {
+
+		SMS_TIME t = Rand.Range( 0, tMax );
+		SMS_TIME tMs = t - t % SMS_TICKS_PER_MS;
+		SMS_TIME tMinute = t - t % SMS_TICKS_PER_MINUTE;
+		int32_t iBias = (int32_t)Rand.Range( 0, 26 * 60 ) - 12 * 60;
+
+		SMS_CHECK_EQ( SmsTimeFromPosixMs( SmsTimeToPosixMs( t ) ), tMs );
+		SMS_CHECK_EQ( SmsTimeFromLocalMinutes( SmsTimeToLocalMinutes( t, iBias ), iBias ), tMinute );
+
+		/// Civil date and time
+		uint64_t iSeconds = t / 10000000;
+		int32_t iYear;
+		uint32_t iMonth, iDay;
+		SmsCivilFromDays( (int64_t)(iSeconds / 86400) - SMS_EPOCH_DIFF_DAYS, iYear, iMonth, iDay );
+		uint32_t iTime = (uint32_t)(iSeconds % 86400);
+		SMS_CHECK_EQ( SmsTimeFromCivil( iYear, iMonth, iDay, iTime / 3600, iTime / 60 % 60, iTime % 60 ), t - t % 10000000 );
+
+		/// Text and back
+		char szBuf[32];
+		size_t iLen = SmsFormatUInt( szBuf, t ), iDigits;
+		uint64_t n;
+		SMS_CHECK( SmsParseUInt( szBuf, iLen, n, &iDigits ) );
+		SMS_CHECK_EQ( n, t );
+		SMS_CHECK_EQ( iDigits, iLen );
+	}
+}
+
+//++ TestParse
+/// Limits of the integer parsers. Values out of range are rejected, not wrapped
+static void TestParse()
+{
+	uint64_t u;
+	int64_t n;
+	size_t iDigits;
+	static const char szMax[] = "18446744073709551615";
+	SMS_CHECK( SmsParseUInt( szMax, 20, u, &iDigits ) && u == UINT64_MAX && iDigits == 20 );
+	SMS_CHECK( SmsParseUInt( "0000000018446744073709551615", 28, u ) && u == UINT64_MAX );		/// Leading zeros
+	SMS_CHECK( !SmsParseUInt( "18446744073709551616", 20, u ) );
+	SMS_CHECK( !SmsParseUInt( "18446744073709551620", 20, u ) );			/// Above the limit in the last digit only
+	SMS_CHECK( !SmsParseUInt( "18446744083709551615", 20, u ) );			/// Above the limit in the second 8-digit block
+	SMS_CHECK( SmsParseUInt( "000018446744073709551615", 24, u ) && u == UINT64_MAX );		/// The last digits in an 8-digit block
+	SMS_CHECK( !SmsParseUInt( "000018446744073709551616", 24, u ) );
+	SMS_CHECK( !SmsParseUInt( "99999999999999999999", 20, u ) );
+	SMS_CHECK( !SmsParseUInt( "100000000000000000000", 21, u, &iDigits ) && iDigits == 21 );
+	SMS_CHECK( !SmsParseUInt( "123456789012345678901234567890", 30, u ) );
+	SMS_CHECK( SmsParseUInt( "", 0, u, &iDigits ) && u == 0 && iDigits == 0 );
+	SMS_CHECK( SmsParseUInt( "12x45", 5, u, &iDigits ) && u == 12 && iDigits == 2 );
+
+	SMS_CHECK( SmsParseInt( "9223372036854775807", 19, n ) && n == INT64_MAX );
+	SMS_CHECK( SmsParseInt( "-9223372036854775808", 20, n ) && n == INT64_MIN );
+	SMS_CHECK( !SmsParseInt( "9223372036854775808", 19, n ) );
+	SMS_CHECK( !SmsParseInt( "-9223372036854775809", 20, n ) );
+	SMS_CHECK( !SmsParseInt( "  +18446744073709551616", 23, n ) );
+	SMS_CHECK( SmsParseInt( "  -42<", 6, n ) && n == -42 );
+	SMS_CHECK( SmsParseInt( "x", 1, n ) && n == 0 );
+
+	/// Random lengths and leading zeros, values around 2^64-1: same result as the digit by digit conversion, with the same overflow
+	SmsTestRandom Rand( 46 );
+	for (int i = 0; i < 100000; i++) {
+		char szBuf[32];
+		size_t iLen = (size_t)Rand.Range( 1, 28 ), iZeros = (size_t)Rand.Range( 0, iLen - 1 );
+		for (size_t j = 0; j < iLen; j++)
+			szBuf[j] = (char)('0' + (j < iZeros ? 0 : j == iZeros ? Rand.Range( 1, 2 ) : Rand.Range( 0, 9 )));		/// Leading zeros, then 1 or 2 (close to 2^64-1)
+		uint64_t iExpected = 0;
+		bool bExpected = true;
+		for (size_t j = 0; j < iLen; j++) {
+			uint64_t d = (uint64_t)(szBuf[j] - '0');
+			bExpected &= iExpected <= (UINT64_MAX - d) / 10;
+			iExpected = iExpected * 10 + d;
+		}
+		bool bOk = SmsParseUInt( szBuf, iLen, u );
+		SMS_CHECK_EQ( bOk, bExpected );
+		if (bOk)
+			SMS_CHECK_EQ( u, iExpected );
+	}
+}
+
+//++ TestFormat
+static void TestFormat()
+{
+	char szBuf[32];
+	size_t iLen = SmsFormatDateTime( szBuf, SmsTimeFromCivil( 2017, 3, 10, 1, 2, 3 ) + 9999999 );
+	szBuf[iLen] = 0;
+	SMS_CHECK( strcmp( szBuf, "2017/03/10 01:02:03" ) == 0 );
+
+	iLen = SmsFormatDateTime( szBuf, 0 );
+	szBuf[iLen] = 0;
+	SMS_CHECK( strcmp( szBuf, "1601/01/01 00:00:00" ) == 0 );
+}
+
+
+int main()
+{
+	TestEpochs();
+	TestCivilRoundTrip();
+	TestRoundTrips();
+	TestParse();
+	TestFormat();
+	return SmsTestResult();
+}
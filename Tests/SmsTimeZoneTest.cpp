@@ -0,0 +1,231 @@
+#include "SmsTest.h"
+#include "SmsTimeZone.h"
+#include <string>
+
+//? SmsTimeZone: POSIX TZ rules, TZif files built in memory, DST transitions, local times skipped or repeated by a transition
+
+
+//++ Minutes
+/// Civil date and time -> minutes since 1601/01/01. UTC or local, depending on the caller
+static int64_t Minutes( int32_t iYear, uint32_t iMonth, uint32_t iDay, uint32_t iHour, uint32_t iMinute )
+{
+	return (int64_t)(SmsTimeFromCivil( iYear, iMonth, iDay, iHour, iMinute, 0 ) / SMS_TICKS_PER_MINUTE);
+}
+
+//++ CheckCet
+/// Central European rules: +60, +120 from the last Sunday of March 01:00 UTC to the last Sunday of October 01:00 UTC
+static void CheckCet( const SmsTimeZone &Zone, int32_t iYear, uint32_t iMarchDay, uint32_t iOctoberDay )
+{
+	int64_t iStart = Minutes( iYear, 3, iMarchDay, 1, 0 ), iEnd = Minutes( iYear, 10, iOctoberDay, 1, 0 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( iYear, 1, 15, 12, 0 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( iStart - 1 ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( iStart ), 120 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( iYear, 7, 15, 12, 0 ) ), 120 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( iEnd - 1 ), 120 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( iEnd ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( iYear, 12, 15, 12, 0 ) ), 60 );
+
+	/// Local -> UTC -> local, away from the transitions
+	int64_t iSummer = Minutes( iYear, 7, 15, 14, 0 ), iWinter = Minutes( iYear, 12, 15, 13, 0 );
+	SMS_CHECK_EQ( Zone.FromLocal( iSummer ), SmsTimeFromCivil( iYear, 7, 15, 12, 0, 0 ) );
+	SMS_CHECK_EQ( Zone.FromLocal( iWinter ), SmsTimeFromCivil( iYear, 12, 15, 12, 0, 0 ) );
+	SMS_CHECK_EQ( Zone.ToLocal( Zone.FromLocal( iSummer ) ), iSummer );
+	SMS_CHECK_EQ( Zone.ToLocal( Zone.FromLocal( iWinter ) ), iWinter );
+}
+
+
+//++ TestRules
+static void TestRules()
+{
+	SmsTimeZone Zone;
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 7, 1, 0, 0 ) ), 0 );		/// UTC by default
+	SMS_CHECK_EQ( Zone.GetTransitionCount(), 0 );
+
+	SMS_CHECK( Zone.SetRule( "CET-1CEST,M3.5.0,M10.5.0/3" ) );
+	SMS_CHECK_EQ( Zone.GetTransitionCount(), (size_t)(SMS_TZ_LAST_YEAR - SMS_TZ_FIRST_YEAR + 1) * 2 );
+	CheckCet( Zone, 2017, 26, 29 );
+	CheckCet( Zone, 2030, 31, 27 );
+
+	/// Outside the table the first (or last) offset applies
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 1900, 7, 1, 0, 0 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2200, 7, 1, 0, 0 ) ), 60 );
+
+	/// US default rules (second Sunday of March, first Sunday of November, 02:00 local)
+	SMS_CHECK( Zone.SetRule( "EST5EDT" ) );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 3, 12, 6, 59 ) ), -300 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 3, 12, 7, 0 ) ), -240 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 11, 5, 5, 59 ) ), -240 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 11, 5, 6, 0 ) ), -300 );
+
+	/// Southern hemisphere: daylight time across the new year
+	SMS_CHECK( Zone.SetRule( "AEST-10AEDT,M10.1.0,M4.1.0/3" ) );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 1, 15, 0, 0 ) ), 660 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 4, 1, 15, 59 ) ), 660 );		/// 2017/04/02 03:00 AEDT
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 4, 1, 16, 0 ) ), 600 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 7, 15, 0, 0 ) ), 600 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 9, 30, 15, 59 ) ), 600 );		/// 2017/10/01 02:00 AEST
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 9, 30, 16, 0 ) ), 660 );
+
+	/// Fixed offsets, quoted names, minutes
+	SMS_CHECK( Zone.SetRule( "UTC0" ) );
+	SMS_CHECK_EQ( Zone.GetTransitionCount(), 0 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 7, 1, 0, 0 ) ), 0 );
+	SMS_CHECK( Zone.SetRule( "<+0530>-5:30" ) );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 7, 1, 0, 0 ) ), 330 );
+	SMS_CHECK( Zone.SetRule( "<-03>3" ) );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 7, 1, 0, 0 ) ), -180 );
+
+	/// Malformed rules leave the zone unchanged
+	static const char *Malformed[] = { "", "C-1", "CET", "CET-1CEST,M3.5.0", "CET-1CEST,M13.5.0,M10.5.0", "CET-1CEST,M3.0.0,M10.5.0", "CET-1CEST,M3.5.7,M10.5.0", "CET-1CEST,J0,M10.5.0", "CET-1 ", "<+0530-5:30" };
+	for (size_t i = 0; i < sizeof( Malformed ) / sizeof( Malformed[0] ); i++) {
+		SMS_CHECK( !Zone.SetRule( Malformed[i] ) );
+		SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 7, 1, 0, 0 ) ), -180 );
+	}
+	SMS_CHECK( !Zone.SetRule( NULL ) );
+}
+
+
+//++ TestAmbiguity
+/// Local -> UTC around the CET transitions
+/// Skipped local times (02:00..02:59 on the last Sunday of March) use the offset before the transition (+60)
+/// Repeated local times (02:00..02:59 on the last Sunday of October) use the offset after the transition (+60, standard time)
+static void TestAmbiguity()
+{
+	SmsTimeZone Zone;
+	SMS_CHECK( Zone.SetRule( "CET-1CEST,M3.5.0,M10.5.0/3" ) );
+
+	/// Spring forward
+	SMS_CHECK_EQ( Zone.BiasAtLocal( Minutes( 2017, 3, 26, 1, 59 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtLocal( Minutes( 2017, 3, 26, 2, 0 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtLocal( Minutes( 2017, 3, 26, 2, 30 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtLocal( Minutes( 2017, 3, 26, 2, 59 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtLocal( Minutes( 2017, 3, 26, 3, 0 ) ), 120 );
+	SMS_CHECK_EQ( Zone.FromLocal( Minutes( 2017, 3, 26, 2, 30 ) ), SmsTimeFromCivil( 2017, 3, 26, 1, 30, 0 ) );
+	SMS_CHECK_EQ( Zone.FromLocal( Minutes( 2017, 3, 26, 3, 0 ) ), SmsTimeFromCivil( 2017, 3, 26, 1, 0, 0 ) );
+	SMS_CHECK_EQ( Zone.ToLocal( SmsTimeFromCivil( 2017, 3, 26, 0, 59, 0 ) ), Minutes( 2017, 3, 26, 1, 59 ) );
+	SMS_CHECK_EQ( Zone.ToLocal( SmsTimeFromCivil( 2017, 3, 26, 1, 0, 0 ) ), Minutes( 2017, 3, 26, 3, 0 ) );
+
+	/// Fall back
+	SMS_CHECK_EQ( Zone.BiasAtLocal( Minutes( 2017, 10, 29, 1, 59 ) ), 120 );
+	SMS_CHECK_EQ( Zone.BiasAtLocal( Minutes( 2017, 10, 29, 2, 0 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtLocal( Minutes( 2017, 10, 29, 2, 30 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtLocal( Minutes( 2017, 10, 29, 3, 0 ) ), 60 );
+	SMS_CHECK_EQ( Zone.FromLocal( Minutes( 2017, 10, 29, 2, 30 ) ), SmsTimeFromCivil( 2017, 10, 29, 1, 30, 0 ) );
+	SMS_CHECK_EQ( Zone.FromLocal( Minutes( 2017, 10, 29, 1, 59 ) ), SmsTimeFromCivil( 2017, 10, 28, 23, 59, 0 ) );
+
+	/// Both UTC times of a repeated local time show the same local time
+	SMS_CHECK_EQ( Zone.ToLocal( SmsTimeFromCivil( 2017, 10, 29, 0, 30, 0 ) ), Minutes( 2017, 10, 29, 2, 30 ) );
+	SMS_CHECK_EQ( Zone.ToLocal( SmsTimeFromCivil( 2017, 10, 29, 1, 30, 0 ) ), Minutes( 2017, 10, 29, 2, 30 ) );
+}
+
+
+//+ TZIF_TYPE
+struct TZIF_TYPE {
+	int32_t iOffset;			/// Seconds
+	bool bDst;
+	unsigned char iName;		/// Index in the abbreviations
+};
+
+//++ PutBE
+static void PutBE( std::string &Buf, int64_t v, size_t iBytes )
+{
+	for (size_t i = iBytes; i-- > 0; )
+		Buf.push_back( (char)(unsigned char)((uint64_t)v >> (i * 8)) );
+}
+
+//++ PutTzifBlock
+/// Header and data of one version block. iTimeSize = 4 (version 1 data) or 8
+static void PutTzifBlock( std::string &Buf, char cVersion, size_t iTimeSize, const int64_t *pTimes, const unsigned char *pIndices, size_t iTimeCnt, const TZIF_TYPE *pTypes, size_t iTypeCnt, const char *pNames, size_t iCharCnt )
+{
+	Buf += "TZif";
+	Buf.push_back( cVersion );
+	Buf.append( 15, '\0' );
+	PutBE( Buf, 0, 4 );				/// isutcnt
+	PutBE( Buf, 0, 4 );				/// isstdcnt
+	PutBE( Buf, 0, 4 );				/// leapcnt
+	PutBE( Buf, (int64_t)iTimeCnt, 4 );
+	PutBE( Buf, (int64_t)iTypeCnt, 4 );
+	PutBE( Buf, (int64_t)iCharCnt, 4 );
+	for (size_t i = 0; i < iTimeCnt; i++)
+		PutBE( Buf, pTimes[i], iTimeSize );
+	Buf.append( (const char*)pIndices, iTimeCnt );
+	for (size_t i = 0; i < iTypeCnt; i++) {
+		PutBE( Buf, pTypes[i].iOffset, 4 );
+		Buf.push_back( pTypes[i].bDst ? 1 : 0 );
+		Buf.push_back( (char)pTypes[i].iName );
+	}
+	Buf.append( pNames, iCharCnt );
+}
+
+
+/// Europe/Berlin, shortened: local mean time until 1901 (the first 32-bit time), CET, then the 2017 transitions. POSIX seconds
+static const int64_t g_Times[] = { -2147483648LL, 1490490000LL, 1509238800LL };
+static const unsigned char g_Indices[] = { 1, 2, 1 };
+static const TZIF_TYPE g_Types[] = { { 3208, false, 0 }, { 3600, false, 4 }, { 7200, true, 8 } };
+static const char g_Names[] = "LMT\0CET\0CEST";
+#define TZIF_TIMES		(sizeof( g_Times ) / sizeof( g_Times[0] ))
+#define TZIF_TYPES		(sizeof( g_Types ) / sizeof( g_Types[0] ))
+
+//++ TestTzif
+static void TestTzif()
+{
+	/// Version 1: 32-bit times, no footer. The last offset applies after the last transition
+	std::string sV1;
+	PutTzifBlock( sV1, '\0', 4, g_Times, g_Indices, TZIF_TIMES, g_Types, TZIF_TYPES, g_Names, sizeof( g_Names ) );
+	SmsTimeZone Zone;
+	SMS_CHECK( Zone.LoadTzif( sV1.data(), sV1.size() ) );
+	SMS_CHECK_EQ( Zone.GetTransitionCount(), TZIF_TIMES );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 1890, 1, 1, 0, 0 ) ), 53 );		/// +00:53:28, rounded down to whole minutes
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2000, 1, 1, 0, 0 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 3, 26, 0, 59 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 3, 26, 1, 0 ) ), 120 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 10, 29, 1, 0 ) ), 60 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2030, 7, 1, 0, 0 ) ), 60 );
+
+	/// Version 2: a version 1 block (ignored), the 64-bit block, then the footer rule. The rule extends the table after 2017
+	std::string sV2;
+	static const TZIF_TYPE Utc = { 0, false, 0 };
+	PutTzifBlock( sV2, '2', 4, NULL, NULL, 0, &Utc, 1, "UTC", 4 );
+	PutTzifBlock( sV2, '2', 8, g_Times, g_Indices, TZIF_TIMES, g_Types, TZIF_TYPES, g_Names, sizeof( g_Names ) );
+	sV2 += "\nCET-1CEST,M3.5.0,M10.5.0/3\n";
+	SMS_CHECK( Zone.LoadTzif( sV2.data(), sV2.size() ) );
+	SMS_CHECK_EQ( Zone.GetTransitionCount(), TZIF_TIMES + (size_t)(SMS_TZ_LAST_YEAR - 2017) * 2 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 1890, 1, 1, 0, 0 ) ), 53 );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2000, 7, 1, 0, 0 ) ), 60 );
+	CheckCet( Zone, 2017, 26, 29 );
+	CheckCet( Zone, 2030, 31, 27 );
+	SMS_CHECK_EQ( Zone.FromLocal( Minutes( 2030, 3, 31, 2, 30 ) ), SmsTimeFromCivil( 2030, 3, 31, 1, 30, 0 ) );
+	SMS_CHECK_EQ( Zone.FromLocal( Minutes( 2030, 10, 27, 2, 30 ) ), SmsTimeFromCivil( 2030, 10, 27, 1, 30, 0 ) );
+
+	/// Version 2 without transitions: the footer rule alone
+	std::string sRuleOnly;
+	PutTzifBlock( sRuleOnly, '2', 4, NULL, NULL, 0, &Utc, 1, "UTC", 4 );
+	PutTzifBlock( sRuleOnly, '2', 8, NULL, NULL, 0, &g_Types[1], 1, "CET", 4 );
+	sRuleOnly += "\nCET-1CEST,M3.5.0,M10.5.0/3\n";
+	SMS_CHECK( Zone.LoadTzif( sRuleOnly.data(), sRuleOnly.size() ) );
+	CheckCet( Zone, 2017, 26, 29 );
+
+	/// Malformed files leave the zone unchanged
+	SMS_CHECK( Zone.SetRule( "<-03>3" ) );
+	std::string sBad = sV2;
+	sBad[0] = 'X';
+	SMS_CHECK( !Zone.LoadTzif( sBad.data(), sBad.size() ) );
+	for (size_t iSize = 0; iSize < sV1.size(); iSize += 7)
+		SMS_CHECK( !Zone.LoadTzif( sV1.data(), iSize ) );		/// Truncated
+	sBad = sV1;
+	sBad[44 + TZIF_TIMES * 4] = (char)TZIF_TYPES;				/// Transition to a type that doesn't exist
+	SMS_CHECK( !Zone.LoadTzif( sBad.data(), sBad.size() ) );
+	sBad = sV2;
+	sBad.replace( sBad.size() - 10, 1, "X" );					/// "M10.5.0/3" -> "X10.5.0/3"
+	SMS_CHECK( !Zone.LoadTzif( sBad.data(), sBad.size() ) );
+	SMS_CHECK_EQ( Zone.BiasAtUtc( Minutes( 2017, 7, 1, 0, 0 ) ), -180 );
+}
+
+
+int main()
+{
+	TestRules();
+	TestAmbiguity();
+	TestTzif();
+	return SmsTestResult();
+}
@@ -120,9 +120,17 @@ namespace rapidxml
     // Size of dynamic memory block of memory_pool.
     // Define RAPIDXML_DYNAMIC_POOL_SIZE before including rapidxml.hpp if you want to override the default value.
     // After the static block is exhausted, dynamic blocks with approximately this size are allocated by memory_pool.
+    // Each following block is twice as big as the previous one, up to RAPIDXML_MAX_DYNAMIC_POOL_SIZE.
     #define RAPIDXML_DYNAMIC_POOL_SIZE (64 * 1024)
 #endif
 
+#ifndef RAPIDXML_MAX_DYNAMIC_POOL_SIZE
+    // Maximum size of dynamic memory block of memory_pool.
+    // Define RAPIDXML_MAX_DYNAMIC_POOL_SIZE before including rapidxml.hpp if you want to override the default value.
+    // Define it equal to RAPIDXML_DYNAMIC_POOL_SIZE to allocate blocks of constant size.
+    #define RAPIDXML_MAX_DYNAMIC_POOL_SIZE (16 * 1024 * 1024)
+#endif
+
 #ifndef RAPIDXML_ALIGNMENT
     // Memory allocation alignment.
     // Define RAPIDXML_ALIGNMENT before including rapidxml.hpp if you want to override the default value, which is the size of pointer.
@@ -131,6 +139,24 @@ namespace rapidxml
     #define RAPIDXML_ALIGNMENT sizeof(void *)
 #endif
 
+///////////////////////////////////////////////////////////////////////////
+// SIMD
+
+#if !defined(RAPIDXML_NO_SIMD) && (defined(_M_IX86) || defined(_M_X64))
+    // Text and attribute values are scanned 16 (SSE2) or 32 (AVX2) bytes at a time, depending on the CPU.
+    // Define RAPIDXML_NO_SIMD before including rapidxml.hpp if you want to use the table-driven scan only.
+    #define RAPIDXML_SIMD
+    #define RAPIDXML_AVX2_TARGET
+    #include <intrin.h>
+    #include <immintrin.h>
+#elif !defined(RAPIDXML_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__i386__) || defined(__x86_64__))
+    // Same scan with GCC and Clang. The AVX2 routines are compiled for AVX2 alone, the CPU is checked at run time.
+    #define RAPIDXML_SIMD
+    #define RAPIDXML_AVX2_TARGET __attribute__((target("avx2")))
+    #include <cpuid.h>
+    #include <immintrin.h>
+#endif
+
 namespace rapidxml
 {
     // Forward declarations
@@ -335,6 +361,137 @@ namespace rapidxml
             }
             return true;
         }
+
+#ifdef RAPIDXML_SIMD
+#if defined(_MSC_VER)
+        inline void cpuid(int r[4], int leaf)
+        {
+            __cpuidex(r, leaf, 0);
+        }
+
+        inline unsigned long long xgetbv0()
+        {
+            return _xgetbv(0);
+        }
+
+        inline unsigned long bit_scan_forward(unsigned long mask)
+        {
+            unsigned long index;
+            _BitScanForward(&index, mask);
+            return index;
+        }
+#else
+        inline void cpuid(int r[4], int leaf)
+        {
+            unsigned int a, b, c, d;
+            __cpuid_count(leaf, 0, a, b, c, d);
+            r[0] = static_cast<int>(a); r[1] = static_cast<int>(b); r[2] = static_cast<int>(c); r[3] = static_cast<int>(d);
+        }
+
+        inline unsigned long long xgetbv0()
+        {
+            unsigned int lo, hi;
+            __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+            return (static_cast<unsigned long long>(hi) << 32) | lo;
+        }
+
+        inline unsigned long bit_scan_forward(unsigned long mask)
+        {
+            return static_cast<unsigned long>(__builtin_ctzl(mask));
+        }
+#endif
+
+        // Detect vectorized scan support: 0 - none, 1 - SSE2, 2 - AVX2 (the OS must also save YMM registers)
+        inline int detect_simd_level()
+        {
+            int r[4];
+            cpuid(r, 0);
+            int max_leaf = r[0];
+            cpuid(r, 1);
+            if (!(r[3] & (1 << 26)))                                    // SSE2
+                return 0;
+            if (max_leaf < 7 || !(r[2] & (1 << 27)) || !(r[2] & (1 << 28)) || (xgetbv0() & 6) != 6)    // OSXSAVE, AVX, XMM and YMM state
+                return 1;
+            cpuid(r, 7);
+            return (r[1] & (1 << 5)) ? 2 : 1;                           // AVX2
+        }
+
+        inline int simd_level()
+        {
+            static const int level = detect_simd_level();
+            return level;
+        }
+
+        // Bit mask of zero, c1 or c2 characters in an aligned 16 byte block
+        inline unsigned long find_mask_sse2(const char *block, __m128i v1, __m128i v2)
+        {
+            __m128i x = _mm_load_si128(reinterpret_cast<const __m128i *>(block));
+            __m128i m = _mm_or_si128(_mm_cmpeq_epi8(x, _mm_setzero_si128()), _mm_or_si128(_mm_cmpeq_epi8(x, v1), _mm_cmpeq_epi8(x, v2)));
+            return static_cast<unsigned long>(_mm_movemask_epi8(m));
+        }
+
+        // Bit mask of zero, c1 or c2 characters in an aligned 32 byte block
+        RAPIDXML_AVX2_TARGET inline unsigned long find_mask_avx2(const char *block, __m256i v1, __m256i v2)
+        {
+            __m256i x = _mm256_load_si256(reinterpret_cast<const __m256i *>(block));
+            __m256i m = _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_setzero_si256()), _mm256_or_si256(_mm256_cmpeq_epi8(x, v1), _mm256_cmpeq_epi8(x, v2)));
+            return static_cast<unsigned long>(static_cast<unsigned int>(_mm256_movemask_epi8(m)));
+        }
+
+        // Find first zero, c1 or c2 character.
+        // Blocks are loaded from aligned addresses, so no load crosses a page boundary, even past the terminating zero.
+        // Bytes before p in the first block are masked out.
+        inline char *find_any_sse2(char *p, char c1, char c2)
+        {
+            __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2);
+            std::size_t offset = reinterpret_cast<std::size_t>(p) & 15;
+            char *block = p - offset;
+            unsigned long mask = find_mask_sse2(block, v1, v2) >> offset << offset;
+            while (!mask)
+            {
+                block += 16;
+                mask = find_mask_sse2(block, v1, v2);
+            }
+            return block + bit_scan_forward(mask);
+        }
+
+        RAPIDXML_AVX2_TARGET inline char *find_any_avx2(char *p, char c1, char c2)
+        {
+            __m256i v1 = _mm256_set1_epi8(c1), v2 = _mm256_set1_epi8(c2);
+            std::size_t offset = reinterpret_cast<std::size_t>(p) & 31;
+            char *block = p - offset;
+            unsigned long mask = find_mask_avx2(block, v1, v2) >> offset << offset;
+            while (!mask)
+            {
+                block += 32;
+                mask = find_mask_avx2(block, v1, v2);
+            }
+            _mm256_zeroupper();
+            return block + bit_scan_forward(mask);
+        }
+
+        // Find first zero, c1 or c2 character, one character at a time
+        inline char *find_any_scalar(char *p, char c1, char c2)
+        {
+            while (*p && *p != c1 && *p != c2)
+                ++p;
+            return p;
+        }
+
+        // Find first zero, c1 or c2 character, using the best routine supported by the CPU
+        inline char *find_any(char *p, char c1, char c2)
+        {
+            switch (simd_level())
+            {
+            case 2:
+                return find_any_avx2(p, c1, c2);
+            case 1:
+                return find_any_sse2(p, c1, c2);
+            default:
+                return find_any_scalar(p, c1, c2);
+            }
+        }
+#endif
     }
     //! \endcond
 
@@ -354,13 +511,16 @@ namespace rapidxml
     //! Such strings can then be used as names or values of nodes without worrying about their lifetime.
     //! Note that there is no <code>free()</code> function -- all allocations are freed at once when clear() function is called, 
     //! or when the pool is destroyed.
+    //! reset() function also discards all allocations, but keeps the memory for the next ones. 
+    //! Use it to parse many documents with the same pool, without allocating and freeing the blocks every time.
     //! <br><br>
     //! It is also possible to create a standalone memory_pool, and use it 
     //! to allocate nodes, whose lifetime will not be tied to any document.
     //! <br><br>
     //! Pool maintains <code>RAPIDXML_STATIC_POOL_SIZE</code> bytes of statically allocated memory. 
     //! Until static memory is exhausted, no dynamic memory allocations are done.
-    //! When static memory is exhausted, pool allocates additional blocks of memory of size <code>RAPIDXML_DYNAMIC_POOL_SIZE</code> each,
+    //! When static memory is exhausted, pool allocates additional blocks of memory, starting with <code>RAPIDXML_DYNAMIC_POOL_SIZE</code> bytes
+    //! and doubling the size of each new block up to <code>RAPIDXML_MAX_DYNAMIC_POOL_SIZE</code>,
     //! by using global <code>new[]</code> and <code>delete[]</code> operators. 
     //! This behaviour can be changed by setting custom allocation routines. 
     //! Use set_allocator() function to set them.
@@ -371,6 +531,7 @@ namespace rapidxml
     //! To obtain absolutely top performance from the parser,
     //! it is important that all nodes are allocated from a single, contiguous block of memory.
     //! Otherwise, cache misses when jumping between two (or more) disjoint blocks of memory can slow down parsing quite considerably.
+    //! If the size of the document is known in advance, reserve() can allocate a single block for it.
     //! If required, you can tweak <code>RAPIDXML_STATIC_POOL_SIZE</code>, <code>RAPIDXML_DYNAMIC_POOL_SIZE</code> and <code>RAPIDXML_ALIGNMENT</code> 
     //! to obtain best wasted memory to performance compromise.
     //! To do it, define their values before rapidxml.hpp file is included.
@@ -524,18 +685,46 @@ namespace rapidxml
         //! Any nodes or strings allocated from the pool will no longer be valid.
         void clear()
         {
-            while (m_begin != m_static_memory)
+            reset();
+            while (m_spare)
             {
-                char *previous_begin = reinterpret_cast<header *>(align(m_begin))->previous_begin;
+                char *next_spare = reinterpret_cast<header *>(align(m_spare))->previous_begin;
                 if (m_free_func)
-                    m_free_func(m_begin);
+                    m_free_func(m_spare);
                 else
-                    delete[] m_begin;
-                m_begin = previous_begin;
+                    delete[] m_spare;
+                m_spare = next_spare;
             }
             init();
         }
 
+        //! Resets the pool, keeping its memory.
+        //! Any nodes or strings allocated from the pool will no longer be valid.
+        //! Dynamic blocks are not freed: they are reused, in allocation order, by the following allocations,
+        //! until clear() is called or the pool is destroyed.
+        void reset()
+        {
+            // Move current blocks to the front of the spare list, oldest first
+            while (m_begin != m_static_memory)
+            {
+                header *block = reinterpret_cast<header *>(align(m_begin));
+                char *previous_begin = block->previous_begin;
+                block->previous_begin = m_spare;
+                m_spare = m_begin;
+                m_begin = previous_begin;
+            }
+            rewind();
+        }
+
+        //! Makes room for allocations of given total size in a single block.
+        //! Use it to pre-size the pool before parsing a document of known size, instead of growing it block by block.
+        //! \param size Number of bytes to make room for.
+        void reserve(std::size_t size)
+        {
+            if (align(m_ptr) + size > m_end)
+                add_block(size);
+        }
+
         //! Sets or resets the user-defined memory allocation functions for the pool.
         //! This can only be called when no memory is allocated from the pool yet, otherwise results are undefined.
         //! Allocation function must not return invalid pointer on failure. It should either throw,
@@ -551,7 +740,7 @@ namespace rapidxml
         //! \param ff Free function, or 0 to restore default function
         void set_allocator(alloc_func *af, free_func *ff)
         {
-            assert(m_begin == m_static_memory && m_ptr == align(m_begin));    // Verify that no memory is allocated yet
+            assert(m_begin == m_static_memory && m_ptr == align(m_begin) && !m_spare);    // Verify that no memory is allocated yet
             m_alloc_func = af;
             m_free_func = ff;
         }
@@ -560,10 +749,18 @@ namespace rapidxml
 
         struct header
         {
-            char *previous_begin;
+            char *previous_begin;       // Previous block, or next spare block
+            std::size_t size;           // Size of the block, including header and alignment
         };
 
         void init()
+        {
+            m_spare = 0;
+            m_block_size = RAPIDXML_DYNAMIC_POOL_SIZE;
+            rewind();
+        }
+
+        void rewind()
         {
             m_begin = m_static_memory;
             m_ptr = align(m_begin);
@@ -601,25 +798,10 @@ namespace rapidxml
             // Calculate aligned pointer
             char *result = align(m_ptr);
 
-            // If not enough memory left in current pool, allocate a new pool
+            // If not enough memory left in current pool, start a new pool
             if (result + size > m_end)
             {
-                // Calculate required pool size (may be bigger than RAPIDXML_DYNAMIC_POOL_SIZE)
-                std::size_t pool_size = RAPIDXML_DYNAMIC_POOL_SIZE;
-                if (pool_size < size)
-                    pool_size = size;
-                
-                // Allocate
-                std::size_t alloc_size = sizeof(header) + (2 * RAPIDXML_ALIGNMENT - 2) + pool_size;     // 2 alignments required in worst case: one for header, one for actual allocation
-                char *raw_memory = allocate_raw(alloc_size);
-                    
-                // Setup new pool in allocated memory
-                char *pool = align(raw_memory);
-                header *new_header = reinterpret_cast<header *>(pool);
-                new_header->previous_begin = m_begin;
-                m_begin = raw_memory;
-                m_ptr = pool + sizeof(header);
-                m_end = raw_memory + alloc_size;
+                add_block(size);
 
                 // Calculate aligned pointer again using new pool
                 result = align(m_ptr);
@@ -630,10 +812,48 @@ namespace rapidxml
             return result;
         }
 
+        void add_block(std::size_t size)
+        {
+            std::size_t min_size = sizeof(header) + (2 * RAPIDXML_ALIGNMENT - 2) + size;     // 2 alignments required in worst case: one for header, one for actual allocation
+            char *raw_memory;
+            std::size_t alloc_size;
+            if (m_spare && reinterpret_cast<header *>(align(m_spare))->size >= min_size)
+            {
+                // Reuse the next spare block
+                raw_memory = m_spare;
+                alloc_size = reinterpret_cast<header *>(align(m_spare))->size;
+                m_spare = reinterpret_cast<header *>(align(m_spare))->previous_begin;
+            }
+            else
+            {
+                // Calculate required pool size (may be bigger than the current block size)
+                std::size_t pool_size = m_block_size;
+                if (pool_size < size)
+                    pool_size = size;
+                if (m_block_size < RAPIDXML_MAX_DYNAMIC_POOL_SIZE)
+                    m_block_size = (m_block_size * 2 < RAPIDXML_MAX_DYNAMIC_POOL_SIZE) ? m_block_size * 2 : RAPIDXML_MAX_DYNAMIC_POOL_SIZE;
+
+                // Allocate
+                alloc_size = sizeof(header) + (2 * RAPIDXML_ALIGNMENT - 2) + pool_size;
+                raw_memory = allocate_raw(alloc_size);
+            }
+
+            // Setup new pool in the block
+            char *pool = align(raw_memory);
+            header *new_header = reinterpret_cast<header *>(pool);
+            new_header->previous_begin = m_begin;
+            new_header->size = alloc_size;
+            m_begin = raw_memory;
+            m_ptr = pool + sizeof(header);
+            m_end = raw_memory + alloc_size;
+        }
+
         char *m_begin;                                      // Start of raw memory making up current pool
         char *m_ptr;                                        // First free byte in current pool
         char *m_end;                                        // One past last available byte in current pool
         char m_static_memory[RAPIDXML_STATIC_POOL_SIZE];    // Static raw memory
+        char *m_spare;                                      // First block kept by reset() for reuse, or 0
+        std::size_t m_block_size;                           // Size of next dynamic block
         alloc_func *m_alloc_func;                           // Allocator function, or 0 if default is to be used
         free_func *m_free_func;                             // Free function, or 0 if default is to be used
     };
@@ -1418,6 +1638,15 @@ namespace rapidxml
             this->remove_all_attributes();
             memory_pool<Ch>::clear();
         }
+
+        //! Clears the document by deleting all nodes and resetting the memory pool.
+        //! All nodes owned by document pool are destroyed, but the pool keeps its memory for the next document.
+        void reset()
+        {
+            this->remove_all_nodes();
+            this->remove_all_attributes();
+            memory_pool<Ch>::reset();
+        }
         
     private:
 
@@ -1427,6 +1656,7 @@ namespace rapidxml
         // Detect whitespace character
         struct whitespace_pred
         {
+            enum { stop_1 = 0, stop_2 = 0 };  // Characters the predicate stops at, besides zero (0 - not vectorized)
             static unsigned char test(Ch ch)
             {
                 return internal::lookup_tables<0>::lookup_whitespace[static_cast<unsigned char>(ch)];
@@ -1436,6 +1666,7 @@ namespace rapidxml
         // Detect node name character
         struct node_name_pred
         {
+            enum { stop_1 = 0, stop_2 = 0 };
             static unsigned char test(Ch ch)
             {
                 return internal::lookup_tables<0>::lookup_node_name[static_cast<unsigned char>(ch)];
@@ -1445,6 +1676,7 @@ namespace rapidxml
         // Detect attribute name character
         struct attribute_name_pred
         {
+            enum { stop_1 = 0, stop_2 = 0 };
             static unsigned char test(Ch ch)
             {
                 return internal::lookup_tables<0>::lookup_attribute_name[static_cast<unsigned char>(ch)];
@@ -1454,6 +1686,7 @@ namespace rapidxml
         // Detect text character (PCDATA)
         struct text_pred
         {
+            enum { stop_1 = '<', stop_2 = 0 };
             static unsigned char test(Ch ch)
             {
                 return internal::lookup_tables<0>::lookup_text[static_cast<unsigned char>(ch)];
@@ -1463,6 +1696,7 @@ namespace rapidxml
         // Detect text character (PCDATA) that does not require processing
         struct text_pure_no_ws_pred
         {
+            enum { stop_1 = '<', stop_2 = '&' };
             static unsigned char test(Ch ch)
             {
                 return internal::lookup_tables<0>::lookup_text_pure_no_ws[static_cast<unsigned char>(ch)];
@@ -1472,6 +1706,7 @@ namespace rapidxml
         // Detect text character (PCDATA) that does not require processing
         struct text_pure_with_ws_pred
         {
+            enum { stop_1 = 0, stop_2 = 0 };
             static unsigned char test(Ch ch)
             {
                 return internal::lookup_tables<0>::lookup_text_pure_with_ws[static_cast<unsigned char>(ch)];
@@ -1482,6 +1717,7 @@ namespace rapidxml
         template<Ch Quote>
         struct attribute_value_pred
         {
+            enum { stop_1 = Quote, stop_2 = 0 };
             static unsigned char test(Ch ch)
             {
                 if (Quote == Ch('\''))
@@ -1496,6 +1732,7 @@ namespace rapidxml
         template<Ch Quote>
         struct attribute_value_pure_pred
         {
+            enum { stop_1 = Quote, stop_2 = '&' };
             static unsigned char test(Ch ch)
             {
                 if (Quote == Ch('\''))
@@ -1557,6 +1794,14 @@ namespace rapidxml
         template<class StopPred, int Flags>
         static void skip(Ch *&text)
         {
+#ifdef RAPIDXML_SIMD
+            // Predicates that stop only at zero and one or two other characters are vectorized
+            if (sizeof(Ch) == 1 && StopPred::stop_1 != 0)
+            {
+                text = reinterpret_cast<Ch *>(internal::find_any(reinterpret_cast<char *>(text), static_cast<char>(StopPred::stop_1), static_cast<char>(StopPred::stop_2)));
+                return;
+            }
+#endif
             Ch *tmp = text;
             while (StopPred::test(*tmp))
                 ++tmp;
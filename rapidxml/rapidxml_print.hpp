@@ -7,6 +7,7 @@
 //! \file rapidxml_print.hpp This file contains rapidxml printer implementation
 
 #include "rapidxml.hpp"
+#include <cstdio>       // For snprintf
 
 // Only include streams if not disabled
 #ifndef RAPIDXML_NO_STREAMS
@@ -42,6 +43,72 @@ namespace rapidxml
             return out;
         }
         
+#ifdef RAPIDXML_SIMD
+        // Detect character that copy_and_expand_chars must inspect: < > & ' " and, if surrogates are not expanded,
+        // 0xED (lead byte of the three byte UTF-8 sequences of U+D000 through U+DFFF)
+        inline bool is_special_char(char ch, char surrogate)
+        {
+            return ch == '<' || ch == '>' || ch == '&' || ch == '\'' || ch == '"' || ch == surrogate;
+        }
+
+        // Find first special character in the range, 16 bytes at a time
+        inline const char *find_special_chars_sse2(const char *begin, const char *end, char surrogate)
+        {
+            const __m128i lt = _mm_set1_epi8('<'), gt = _mm_set1_epi8('>'), amp = _mm_set1_epi8('&');
+            const __m128i apos = _mm_set1_epi8('\''), quot = _mm_set1_epi8('"'), sur = _mm_set1_epi8(surrogate);
+            for (; end - begin >= 16; begin += 16)
+            {
+                __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+                __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, lt), _mm_cmpeq_epi8(x, gt)), _mm_or_si128(_mm_cmpeq_epi8(x, amp), _mm_cmpeq_epi8(x, apos)));
+                m = _mm_or_si128(m, _mm_or_si128(_mm_cmpeq_epi8(x, quot), _mm_cmpeq_epi8(x, sur)));
+                unsigned long mask = static_cast<unsigned long>(_mm_movemask_epi8(m));
+                if (mask)
+                    return begin + bit_scan_forward(mask);
+            }
+            while (begin != end && !is_special_char(*begin, surrogate))
+                ++begin;
+            return begin;
+        }
+
+        // Find first special character in the range, 32 bytes at a time
+        RAPIDXML_AVX2_TARGET inline const char *find_special_chars_avx2(const char *begin, const char *end, char surrogate)
+        {
+            const __m256i lt = _mm256_set1_epi8('<'), gt = _mm256_set1_epi8('>'), amp = _mm256_set1_epi8('&');
+            const __m256i apos = _mm256_set1_epi8('\''), quot = _mm256_set1_epi8('"'), sur = _mm256_set1_epi8(surrogate);
+            for (; end - begin >= 32; begin += 32)
+            {
+                __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(begin));
+                __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, lt), _mm256_cmpeq_epi8(x, gt)), _mm256_or_si256(_mm256_cmpeq_epi8(x, amp), _mm256_cmpeq_epi8(x, apos)));
+                m = _mm256_or_si256(m, _mm256_or_si256(_mm256_cmpeq_epi8(x, quot), _mm256_cmpeq_epi8(x, sur)));
+                unsigned long mask = static_cast<unsigned long>(static_cast<unsigned int>(_mm256_movemask_epi8(m)));
+                if (mask)
+                {
+                    _mm256_zeroupper();
+                    return begin + bit_scan_forward(mask);
+                }
+            }
+            _mm256_zeroupper();
+            return find_special_chars_sse2(begin, end, surrogate);
+        }
+
+        // Find first special character in the range, using the best routine supported by the CPU
+        inline const char *find_special_chars(const char *begin, const char *end, int flags)
+        {
+            char surrogate = (flags & print_no_surrogate_expansion) ? '\xED' : '<';     // '<' is a stand-in for "none"
+            switch (simd_level())
+            {
+            case 2:
+                return find_special_chars_avx2(begin, end, surrogate);
+            case 1:
+                return find_special_chars_sse2(begin, end, surrogate);
+            default:
+                while (begin != end && !is_special_char(*begin, surrogate))
+                    ++begin;
+                return begin;
+            }
+        }
+#endif
+
         // Copy characters from given range to given output iterator and expand
         // characters into references (&lt; &gt; &apos; &quot; &amp;)
         template<class OutIt, class Ch>
@@ -49,6 +116,17 @@ namespace rapidxml
         {
             while (begin != end)
             {
+#ifdef RAPIDXML_SIMD
+                // Copy the run of characters that need no expansion in bulk; only special characters take the switch below
+                if (sizeof(Ch) == 1)
+                {
+                    const Ch *run = reinterpret_cast<const Ch *>(find_special_chars(reinterpret_cast<const char *>(begin), reinterpret_cast<const char *>(end), flags));
+                    out = copy_chars(begin, run, out);
+                    begin = run;
+                    if (begin == end)
+                        break;
+                }
+#endif
                 if (*begin == noexpand)
                 {
                     *out++ = *begin;    // No expansion, copy character
@@ -79,11 +157,11 @@ namespace rapidxml
 							assert( (*(begin + 1) & 0xc0) == 0x80 );
 							assert( (*(begin + 2) & 0xc0) == 0x80 );
 
-							ULONG code = ((*begin & 0x0f) << 12) | ((*(begin + 1) & 0x3f) << 6) | ((*(begin + 2) & 0x3f));
+							unsigned long code = ((*begin & 0x0f) << 12) | ((*(begin + 1) & 0x3f) << 6) | ((*(begin + 2) & 0x3f));
 							if (code >= 0xd800 && code < 0xe000) {
 								// High surrogates D800DBFF, Low surrogates DC00DFFF
 								Ch temp[10];
-								sprintf_s( temp, 10, "&#%u;", code );
+								snprintf( temp, 10, "&#%lu;", code );
 								for (auto psz = temp; *psz; psz++)
 									*out++ = *psz;
 								begin += 2;			// An additional ++begin will follow...
@@ -121,6 +199,26 @@ namespace rapidxml
 
         ///////////////////////////////////////////////////////////////////////////
         // Internal printing operations
+
+        // Forward declarations. print_node calls them before their definitions (GCC and Clang look the names up at the point of definition)
+        template<class OutIt, class Ch>
+        inline OutIt print_children(OutIt out, const xml_node<Ch> *node, int flags, int indent);
+        template<class OutIt, class Ch>
+        inline OutIt print_attributes(OutIt out, const xml_node<Ch> *node, int flags);
+        template<class OutIt, class Ch>
+        inline OutIt print_data_node(OutIt out, const xml_node<Ch> *node, int flags, int indent);
+        template<class OutIt, class Ch>
+        inline OutIt print_cdata_node(OutIt out, const xml_node<Ch> *node, int flags, int indent);
+        template<class OutIt, class Ch>
+        inline OutIt print_element_node(OutIt out, const xml_node<Ch> *node, int flags, int indent);
+        template<class OutIt, class Ch>
+        inline OutIt print_declaration_node(OutIt out, const xml_node<Ch> *node, int flags, int indent);
+        template<class OutIt, class Ch>
+        inline OutIt print_comment_node(OutIt out, const xml_node<Ch> *node, int flags, int indent);
+        template<class OutIt, class Ch>
+        inline OutIt print_doctype_node(OutIt out, const xml_node<Ch> *node, int flags, int indent);
+        template<class OutIt, class Ch>
+        inline OutIt print_pi_node(OutIt out, const xml_node<Ch> *node, int flags, int indent);
     
         // Print node
         template<class OutIt, class Ch>